@@ -53,6 +53,171 @@ int compare_connected_used(Beacon_t *a, Beacon_t *b)
                 ((b)->ap.property.used && !(a)->ap.property.used) ? -1 : 0);
 }
 
+#if !SKY_EXCLUDE_WIFI_SUPPORT
+/*! \brief hash a MAC address
+ *
+ *  @param mac pointer to MAC address
+ *
+ *  @return hash of MAC
+ */
+static uint32_t hash_mac(const uint8_t mac[])
+{
+    uint32_t hash = 2166136261u; /* FNV-1a */
+
+    for (int n = 0; n < MAC_SIZE; n++)
+        hash = (hash ^ mac[n]) * 16777619u;
+    return hash;
+}
+#endif // !SKY_EXCLUDE_WIFI_SUPPORT
+
+#if !SKY_EXCLUDE_CELL_SUPPORT
+/*! \brief hash the fields of a cell which make up its search key
+ *
+ *  @param type cell type
+ *  @param id2 cell id2
+ *  @param id4 cell id4
+ *
+ *  @return key of cell
+ */
+static uint32_t hash_cell_key(uint16_t type, uint16_t id2, uint64_t id4)
+{
+    uint32_t key = 2166136261u; /* FNV-1a */
+
+    key = (key ^ type) * 16777619u;
+    key = (key ^ id2) * 16777619u;
+    key = (key ^ (uint32_t)id4) * 16777619u;
+    key = (key ^ (uint32_t)(id4 >> 32)) * 16777619u;
+    return key;
+}
+
+/*! \brief compute the search key of a cell
+ *
+ *   Every cell type compares id2 and id4 when testing for equivalence, so
+ *   cells which are equal always have the same key.
+ *
+ *  @param b pointer to cell
+ *
+ *  @return key of cell
+ */
+uint32_t cell_key(Beacon_t *b)
+{
+    return hash_cell_key(b->h.type, b->cell.id2, (uint64_t)b->cell.id4);
+}
+#endif // !SKY_EXCLUDE_CELL_SUPPORT
+
+/*! \brief compute the duplicate key of a beacon
+ *
+ *   Beacons which are equal always have the same key
+ *
+ *  @param b pointer to beacon
+ *
+ *  @return key of beacon
+ */
+static uint32_t beacon_key(Beacon_t *b)
+{
+#if !SKY_EXCLUDE_WIFI_SUPPORT
+    if (is_ap_type(b))
+        return hash_mac(b->ap.mac);
+#endif // !SKY_EXCLUDE_WIFI_SUPPORT
+#if !SKY_EXCLUDE_CELL_SUPPORT
+    if (is_cell_type(b))
+        return cell_key(b);
+#endif // !SKY_EXCLUDE_CELL_SUPPORT
+    return 0;
+}
+
+/*! \brief add the beacon in a slot of the request context to the duplicate hash
+ *
+ *   The hash is rebuilt if it has filled with entries of beacons no longer in the
+ *   request context, so the beacon in the slot must already be counted in it
+ *
+ *  @param rctx Skyhook request context
+ *  @param slot slot of beacon in rctx->beacon
+ */
+static void beacon_hash_add(Sky_rctx_t *rctx, uint8_t slot)
+{
+    uint32_t p = beacon_key(&rctx->beacon[slot]) % BEACON_HASH_SIZE;
+
+    for (int n = 0; n < BEACON_HASH_SIZE; n++, p = (p + 1) % BEACON_HASH_SIZE) {
+        if (!rctx->beacon_hash[p]) {
+            rctx->beacon_hash[p] = (uint8_t)(slot + 1);
+            return;
+        }
+    }
+    beacon_hash_rebuild(rctx);
+}
+
+/*! \brief remove the beacon in a slot of the request context from the duplicate hash
+ *
+ *   Linear probing from the home position of the beacon. Entries after it in the
+ *   same run are shifted back so that no search stops early at the hole.
+ *
+ *  @param rctx Skyhook request context
+ *  @param slot slot of beacon in rctx->beacon
+ *
+ *  @return true if beacon was found and removed, false otherwise
+ */
+static bool beacon_hash_remove(Sky_rctx_t *rctx, uint8_t slot)
+{
+    uint32_t i = beacon_key(&rctx->beacon[slot]) % BEACON_HASH_SIZE, j, home;
+    int n;
+
+    for (n = 0; rctx->beacon_hash[i] != slot + 1; n++, i = (i + 1) % BEACON_HASH_SIZE) {
+        if (!rctx->beacon_hash[i] || n == BEACON_HASH_SIZE)
+            return false;
+    }
+    for (j = (i + 1) % BEACON_HASH_SIZE; rctx->beacon_hash[j] && j != i;
+         j = (j + 1) % BEACON_HASH_SIZE) {
+        home = beacon_key(&rctx->beacon[rctx->beacon_hash[j] - 1]) % BEACON_HASH_SIZE;
+        /* move entry back unless its home position lies cyclically in (i, j] */
+        if (i < j ? (home <= i || home > j) : (home <= i && home > j)) {
+            rctx->beacon_hash[i] = rctx->beacon_hash[j];
+            i = j;
+        }
+    }
+    rctx->beacon_hash[i] = 0;
+    return true;
+}
+
+/*! \brief rebuild the duplicate hash from the beacons of the request context
+ *
+ *  @param rctx Skyhook request context
+ */
+void beacon_hash_rebuild(Sky_rctx_t *rctx)
+{
+    memset(rctx->beacon_hash, 0, sizeof(rctx->beacon_hash));
+    for (int j = 0; j < NUM_BEACONS(rctx); j++)
+        beacon_hash_add(rctx, rctx->order[j]);
+}
+
+/*! \brief find a beacon in the request context equal to a given beacon
+ *
+ *   Only beacons with the same duplicate key are compared by the plugins. Entries
+ *   of slots no longer in use are skipped.
+ *
+ *  @param rctx Skyhook request context
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param b pointer to beacon
+ *
+ *  @return 0 based index of equal beacon, -1 if none
+ */
+static int find_duplicate(Sky_rctx_t *rctx, Sky_errno_t *sky_errno, Beacon_t *b)
+{
+    uint32_t key = beacon_key(b), p = key % BEACON_HASH_SIZE;
+    int n, j;
+
+    for (n = 0; n < BEACON_HASH_SIZE && rctx->beacon_hash[p]; n++, p = (p + 1) % BEACON_HASH_SIZE) {
+        Beacon_t *d = &rctx->beacon[rctx->beacon_hash[p] - 1];
+        bool equal = false;
+
+        if (beacon_key(d) == key &&
+            sky_plugin_equal(rctx, sky_errno, b, d, &equal) == SKY_SUCCESS && equal &&
+            (j = beacon_index(rctx, d)) >= 0)
+            return j;
+    }
+    return -1;
+}
+
 /*! \brief shuffle list to remove the beacon at index
  *
  *  @param rctx Skyhook request context
@@ -62,21 +227,49 @@ int compare_connected_used(Beacon_t *a, Beacon_t *b)
  */
 Sky_status_t remove_beacon(Sky_rctx_t *rctx, int index)
 {
+    uint8_t slot;
+
     if (index >= NUM_BEACONS(rctx))
         return SKY_ERROR;
 
-    LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "type:%s idx:%d", sky_pbeacon(&rctx->beacon[index]), index);
-    if (is_ap_type(&rctx->beacon[index]))
+    LOGFMT(
+        rctx, SKY_LOG_LEVEL_DEBUG, "type:%s idx:%d", sky_pbeacon(&RCTX_BEACON(rctx, index)), index);
+#if CACHE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
+    update_cache_count(rctx, &RCTX_BEACON(rctx, index), -1);
+#endif // CACHE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
+    if (is_ap_type(&RCTX_BEACON(rctx, index)))
         NUM_APS(rctx) -= 1;
-    memmove(&rctx->beacon[index], &rctx->beacon[index + 1],
-        sizeof(Beacon_t) * (NUM_BEACONS(rctx) - index - 1));
+    /* close the gap in the order and move the freed slot after the remaining beacons */
+    slot = rctx->order[index];
+    memmove(&rctx->order[index], &rctx->order[index + 1], (size_t)(NUM_BEACONS(rctx) - index - 1));
     NUM_BEACONS(rctx) -= 1;
+    rctx->order[NUM_BEACONS(rctx)] = slot;
+    if (!beacon_hash_remove(rctx, slot))
+        beacon_hash_rebuild(rctx); /* beacon changed since it was added */
 #if VERBOSE_DEBUG
     DUMP_REQUEST_CTX(rctx);
 #endif // VERBOSE_DEBUG
     return SKY_SUCCESS;
 }
 
+/*! \brief find the index of a beacon in the request context
+ *
+ *  @param rctx Skyhook request context
+ *  @param b pointer to beacon
+ *
+ *  @return 0 based index of beacon in priority order, -1 if b is not a beacon of the request
+ */
+int beacon_index(Sky_rctx_t *rctx, Beacon_t *b)
+{
+    int j;
+
+    for (j = 0; j < NUM_BEACONS(rctx); j++) {
+        if (b == &RCTX_BEACON(rctx, j))
+            return j;
+    }
+    return -1;
+}
+
 /*! \brief compare beacons for ordering when inserting in request context
  *
  * better beacons are inserted before worse.
@@ -140,34 +333,26 @@ static int is_beacon_first(Sky_rctx_t *rctx, Beacon_t *a, Beacon_t *b)
 static Sky_status_t insert_beacon(Sky_rctx_t *rctx, Sky_errno_t *sky_errno, Beacon_t *b)
 {
     int j;
+    uint8_t slot;
 
     /* check for duplicate */
     if (is_ap_type(b) || is_cell_type(b)) {
-        for (j = 0; j < NUM_BEACONS(rctx); j++) {
-            bool equal = false;
+        if ((j = find_duplicate(rctx, sky_errno, b)) >= 0) {
+            Beacon_t *d = &RCTX_BEACON(rctx, j);
 
-            if (sky_plugin_equal(rctx, sky_errno, b, &rctx->beacon[j], &equal) == SKY_SUCCESS &&
-                equal) {
-                /* Found duplicate - keep new beacon if it is better */
-                if (b->h.age < rctx->beacon[j].h.age || /* Younger */
-                    (b->h.age == rctx->beacon[j].h.age &&
-                        b->h.connected) || /* same age, but connected */
-                    (b->h.age ==
-                            rctx->beacon[j].h.age && /* same age and connectedness, but stronger */
-                        b->h.connected == rctx->beacon[j].h.connected &&
-                        b->h.rssi > rctx->beacon[j].h.rssi)) {
-                    LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Keep new duplicate");
-                    break; /* break for loop and remove existing duplicate */
-                } else {
-                    LOGFMT(rctx, SKY_LOG_LEVEL_WARNING, "Reject duplicate");
-                    return set_error_status(sky_errno, SKY_ERROR_NONE);
-                }
+            /* Found duplicate - keep new beacon if it is better */
+            if (b->h.age < d->h.age || /* Younger */
+                (b->h.age == d->h.age && b->h.connected) || /* same age, but connected */
+                (b->h.age == d->h.age && /* same age and connectedness, but stronger */
+                    b->h.connected == d->h.connected && b->h.rssi > d->h.rssi)) {
+                LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Keep new duplicate");
+                /* a better duplicate was found, remove existing beacon */
+                remove_beacon(rctx, j);
+            } else {
+                LOGFMT(rctx, SKY_LOG_LEVEL_WARNING, "Reject duplicate");
+                return set_error_status(sky_errno, SKY_ERROR_NONE);
             }
         }
-        if (j < NUM_BEACONS(rctx)) {
-            /* a better duplicate was found, remove existing beacon */
-            remove_beacon(rctx, j);
-        }
     } else {
         LOGFMT(rctx, SKY_LOG_LEVEL_WARNING, "Unsupported beacon type");
         return set_error_status(sky_errno, SKY_ERROR_INTERNAL);
@@ -175,33 +360,28 @@ static Sky_status_t insert_beacon(Sky_rctx_t *rctx, Sky_errno_t *sky_errno, Beac
 
     /* find position to insert based on plugin compare operation */
     for (j = 0; j < NUM_BEACONS(rctx); j++) {
-        if (is_beacon_first(rctx, b, &rctx->beacon[j]) > 0)
+        if (is_beacon_first(rctx, b, &RCTX_BEACON(rctx, j)) > 0)
             break;
     }
 
-    /* add beacon at the end */
-    if (j == NUM_BEACONS(rctx)) {
-        rctx->beacon[j] = *b;
-        NUM_BEACONS(rctx)++;
-    } else {
-        /* shift beacons to make room for the new one */
-        memmove(&rctx->beacon[j + 1], &rctx->beacon[j], sizeof(Beacon_t) * (NUM_BEACONS(rctx) - j));
-        rctx->beacon[j] = *b;
-        NUM_BEACONS(rctx)++;
-    }
+    /* save beacon in the first unused slot, and shift the order to make room for it */
+    slot = rctx->order[NUM_BEACONS(rctx)];
+    rctx->beacon[slot] = *b;
+    memmove(&rctx->order[j + 1], &rctx->order[j], (size_t)(NUM_BEACONS(rctx) - j));
+    rctx->order[j] = slot;
+    NUM_BEACONS(rctx)++;
+    beacon_hash_add(rctx, slot);
 
     if (is_ap_type(b)) {
         NUM_APS(rctx)++;
     }
+#if CACHE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
+    update_cache_count(rctx, b, 1);
+#endif // CACHE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
 
-#ifdef SKY_LOGGING
-    /* Verify that the beacon we just added now appears in our beacon set. */
-    for (j = 0; j < NUM_BEACONS(rctx); j++) {
-        bool equal;
-        if (sky_plugin_equal(rctx, sky_errno, b, &rctx->beacon[j], &equal) == SKY_SUCCESS && equal)
-            break;
-    }
-    if (j < NUM_BEACONS(rctx))
+#if SKY_LOGGING
+    /* Verify that the beacon we just added is now found by the duplicate hash. */
+    if ((j = find_duplicate(rctx, sky_errno, b)) >= 0)
         LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Beacon type %s inserted at idx %d", sky_pbeacon(b), j);
     else
         LOGFMT(rctx, SKY_LOG_LEVEL_ERROR, "Beacon NOT found after insert");
@@ -236,8 +416,6 @@ static Sky_status_t insert_beacon(Sky_rctx_t *rctx, Sky_errno_t *sky_errno, Beac
  */
 Sky_status_t add_beacon(Sky_rctx_t *rctx, Sky_errno_t *sky_errno, Beacon_t *b, time_t timestamp)
 {
-    int n;
-
 #if !SKY_EXCLUDE_SANITY_CHECKS
     if (!validate_request_ctx(rctx))
         return set_error_status(sky_errno, SKY_ERROR_BAD_REQUEST_CTX);
@@ -246,6 +424,26 @@ Sky_status_t add_beacon(Sky_rctx_t *rctx, Sky_errno_t *sky_errno, Beacon_t *b, t
     if (!rctx->session->open_flag)
         return set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
 
+    return add_valid_beacon(rctx, sky_errno, b, timestamp);
+}
+
+/*! \brief add beacon to list in request rctx already validated
+ *
+ *   As add_beacon(), less the checks of the request rctx, so that a batch of
+ *   beacons may be added after checking the request rctx once.
+ *
+ *  @param rctx Skyhook request context
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param b beacon to be added
+ *  @param timestamp time that the beacon was scanned
+ *
+ *  @return SKY_SUCCESS if beacon successfully added or SKY_ERROR
+ */
+Sky_status_t add_valid_beacon(
+    Sky_rctx_t *rctx, Sky_errno_t *sky_errno, Beacon_t *b, time_t timestamp)
+{
+    int n;
+
     if (!validate_beacon(b, rctx))
         return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
 
@@ -291,162 +489,1242 @@ Sky_status_t add_beacon(Sky_rctx_t *rctx, Sky_errno_t *sky_errno, Beacon_t *b, t
 }
 
 #if CACHE_SIZE
-/*! \brief check if a beacon is in cache
+#if !SKY_EXCLUDE_WIFI_SUPPORT
+/*! \brief hash a MAC address to its home slot in the cache index
  *
- *   Scan all cachelines in the cache.
- *   If the given beacon is found in the cache true is returned otherwise
- *   false. A beacon may appear in multiple cachelines.
- *   If beacon is found and the cached beacon is marked 'used', the given
- *   beacon is marked as 'used' also.
- *   Algorithm stops searching if beacon is found and that beacon is marked used.
- *   Otherwise the entire cache is scanned.
+ *  @param sctx Skyhook session context
+ *  @param mac pointer to MAC address
  *
- *  @param rctx Skyhook request context
- *  @param b pointer to new beacon
- *  @param cl pointer to cacheline
- *  @param prop pointer to where the properties of matching beacon is saved
+ *  @return slot index in the range 0 to CACHE_INDEX_SLOTS(sctx) - 1
+ */
+static uint32_t cache_index_slot(Sky_sctx_t *sctx, const uint8_t mac[])
+{
+    return hash_mac(mac) % CACHE_INDEX_SLOTS(sctx);
+}
+
+/*! \brief find the index slot which holds a MAC address
  *
- *  @return true if beacon successfully found or false
+ *   Linear probing from the home slot of the MAC address. Search stops at the
+ *   slot holding the MAC or at the first empty slot, where it would be added.
+ *
+ *  @param sctx Skyhook session context
+ *  @param mac pointer to MAC address
+ *
+ *  @return pointer to slot, or NULL if MAC is not present and index is full
  */
-bool beacon_in_cache(Sky_rctx_t *rctx, Beacon_t *b)
+static Sky_cache_index_t *cache_index_find(Sky_sctx_t *sctx, const uint8_t mac[])
 {
-    bool result = false;
+    Sky_cache_index_t *index = CACHE_INDEX(sctx);
+    uint32_t slots = CACHE_INDEX_SLOTS(sctx);
+    uint32_t slot;
 
-    for (int i = 0; i < rctx->session->num_cachelines; i++) {
-        if (beacon_in_cacheline(rctx, b, &rctx->session->cacheline[i])) {
-            result = true; /* beacon is in cache */
-            if (is_ap_type(b) && b->ap.property.used)
-                break; /* beacon is in cached and used, can stop search */
-        }
+    if (slots == 0)
+        return NULL;
+    slot = cache_index_slot(sctx, mac);
+    for (uint32_t n = 0; n < slots; n++) {
+        Sky_cache_index_t *e = &index[slot];
+
+        if (e->lines == 0 || memcmp(e->mac, mac, MAC_SIZE) == 0)
+            return e;
+        slot = (slot + 1) % slots;
     }
-    return result;
+    return NULL;
 }
 
-/*! \brief check if a beacon is in a cacheline
+/*! \brief drop one reference to an AP from the cache index
  *
- *   Scan all beacons in the cacheline. If the type matches the given beacon, compare
- *   the appropriate attributes. If the given beacon is found in the cacheline
- *   true is returned otherwise false. Also if cached beacon has the Used property,
- *   set it in the beacon we searched for.
+ *   When the last cacheline holding the AP goes away, the slot is emptied and
+ *   later members of its probe sequence are shifted back so that lookups
+ *   never need to step over deleted slots.
  *
- *  @param rctx Skyhook request context
- *  @param b pointer to new beacon
+ *  @param sctx Skyhook session context
+ *  @param mac MAC of cached AP
+ *  @param used whether the cached AP is marked 'used'
+ */
+static void cache_index_remove_ap(Sky_sctx_t *sctx, const uint8_t mac[], bool used)
+{
+    Sky_cache_index_t *index = CACHE_INDEX(sctx);
+    Sky_cache_index_t *e = cache_index_find(sctx, mac);
+    uint32_t i, j, home;
+
+    if (e == NULL || e->lines == 0)
+        return; /* not indexed */
+    if (used && e->used)
+        e->used--;
+    if (--e->lines)
+        return;
+
+    /* slot is now empty, close the gap in the probe sequence */
+    i = j = (uint32_t)(e - index);
+    for (;;) {
+        j = (j + 1) % CACHE_INDEX_SLOTS(sctx);
+        if (index[j].lines == 0)
+            break;
+        home = cache_index_slot(sctx, index[j].mac);
+        /* entry j stays put if its home lies cyclically in (i, j] */
+        if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+        index[i] = index[j];
+        i = j;
+    }
+    index[i].lines = 0;
+    index[i].used = 0;
+}
+
+/*! \brief find an AP in a cacheline by MAC, using the MAC order of its APs
+ *
+ *  @param sctx Skyhook session context
  *  @param cl pointer to cacheline
+ *  @param mac MAC of AP
  *
- *  @return true if beacon successfully found or false
+ *  @return index of AP in cacheline with the same MAC, or -1 if none
  */
-bool beacon_in_cacheline(Sky_rctx_t *rctx, Beacon_t *b, Sky_cacheline_t *cl)
+static int cacheline_ap_index(Sky_sctx_t *sctx, Sky_cacheline_t *cl, const uint8_t mac[])
 {
-    int j;
+    int lo = 0, hi = NUM_APS(cl) - 1;
 
-    if (cl->time == CACHE_EMPTY) {
-        return false;
+#if CACHE_SOA_LAYOUT
+    (void)sctx; /* suppress warning unused parameter */
+#endif // CACHE_SOA_LAYOUT
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int diff = memcmp(CL_AP_MAC(sctx, cl, cl->ap_order[mid]), mac, MAC_SIZE);
+
+        if (diff == 0)
+            return cl->ap_order[mid];
+        else if (diff < 0)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
     }
+    return -1;
+}
 
-    for (j = 0; j < NUM_BEACONS(cl); j++) {
-        bool equal = false;
+/*! \brief check whether a cacheline holds an AP
+ *
+ *   Binary search of the cacheline APs in MAC order
+ *
+ *  @param sctx Skyhook session context
+ *  @param cl pointer to cacheline
+ *  @param mac MAC of AP
+ *
+ *  @return true if an AP in the cacheline has the same MAC
+ */
+static bool ap_in_cacheline(Sky_sctx_t *sctx, Sky_cacheline_t *cl, const uint8_t mac[])
+{
+    return cacheline_ap_index(sctx, cl, mac) >= 0;
+}
 
-        if (sky_plugin_equal(rctx, NULL, b, &cl->beacon[j], &equal) == SKY_SUCCESS && equal) {
-            if (is_ap_type(&cl->beacon[j]) && cl->beacon[j].ap.property.used)
-                b->ap.property.used = true;
-            return true;
-        }
+/*! \brief update the running counts of request APs held in each cacheline
+ *
+ *   Called as an AP is added to or removed from the request context, so that
+ *   matching the request against the cache need not compare the APs again.
+ *   The cache index tells whether any cacheline holds the AP at all. A key
+ *   combining the MACs of the counted APs is kept alongside the counts.
+ *
+ *  @param rctx Skyhook request context
+ *  @param b pointer to beacon being added or removed
+ *  @param delta 1 if beacon is being added, -1 if it is being removed
+ */
+void update_cache_count(Sky_rctx_t *rctx, Beacon_t *b, int delta)
+{
+    Sky_sctx_t *sctx = rctx->session;
+    Sky_cache_index_t *e;
+
+    if (!is_ap_type(b))
+        return;
+    rctx->cache_count_key ^= hash_mac(b->ap.mac);
+    if (rctx->cache_gen != sctx->cache_gen)
+        return;
+    e = cache_index_find(sctx, b->ap.mac);
+    if (e == NULL || e->lines == 0)
+        return; /* AP is not cached */
+    for (int i = 0; i < sctx->num_cachelines; i++) {
+        Sky_cacheline_t *cl = &sctx->cacheline[i];
+
+        if (cl->time != CACHE_EMPTY && ap_in_cacheline(sctx, cl, b->ap.mac))
+            rctx->cache_count[i] = (uint8_t)(rctx->cache_count[i] + delta);
     }
-    return false;
 }
 
-/*! \brief find cache entry with oldest entry
+/*! \brief check that the running counts of request APs held in each cacheline can be used
+ *
+ *   Counts are stale if another request context has since changed the cache,
+ *   or if the APs in the request context were changed other than by adding
+ *   and removing beacons, e.g. replaced by those of a cacheline.
  *
  *  @param rctx Skyhook request context
  *
- *  @return index of oldest cache entry, or empty
+ *  @return true if rctx->cache_count is valid
  */
-int find_oldest(Sky_rctx_t *rctx)
+bool cache_count_valid(Sky_rctx_t *rctx)
 {
-#if CACHE_SIZE == 1
-    /* if there is only one cacheline */
-    (void)rctx;
-    return 0;
-#else
-    int i;
-    int oldestc = 0;
-    time_t oldest = rctx->header.time;
-
-    for (i = 0; i < CACHE_SIZE; i++) {
-        /* if time is unavailable or
-         * cacheline is empty,
-         * then return index of current cacheline */
-        if (oldest == TIME_UNAVAILABLE || rctx->session->cacheline[i].time == CACHE_EMPTY)
-            return i;
-        else if (difftime(rctx->session->cacheline[i].time, oldest) < 0) {
-            oldest = rctx->session->cacheline[i].time;
-            oldestc = i;
-        }
-    }
-    LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "cacheline %d oldest time %d", oldestc, oldest);
-    return oldestc;
-#endif // CACHE_SIZE == 1
+    uint32_t key = 0;
+
+    if (rctx->cache_gen != rctx->session->cache_gen)
+        return false;
+    for (int j = 0; j < NUM_APS(rctx); j++)
+        key ^= hash_mac(RCTX_BEACON(rctx, j).ap.mac);
+    return key == rctx->cache_count_key;
 }
 
-#if !SKY_EXCLUDE_GNSS_SUPPORT
-/*! \brief test whether gnss in new scan is preferable to that in cache
+/*! \brief note that a cacheline has changed
  *
- *  if new scan has better gnss that that in cache, it is better to update cache
- *  by sending new scan to server.
+ *   Any request context with running counts then recomputes them, but the
+ *   counts of the request context changing the cacheline are kept valid.
  *
- *  true only if gnss fix in cache is worse than new scan
- *  false if cached gnss is better
+ *  @param rctx Skyhook request context
+ *  @param cl pointer to cacheline
+ *  @param count number of request APs now held in the cacheline
+ */
+static void cacheline_changed(Sky_rctx_t *rctx, Sky_cacheline_t *cl, int count)
+{
+    Sky_sctx_t *sctx = rctx->session;
+    bool valid = rctx->cache_gen == sctx->cache_gen;
+
+    sctx->cache_gen++;
+    if (valid) {
+        rctx->cache_count[cl - sctx->cacheline] = (uint8_t)count;
+        rctx->cache_gen = sctx->cache_gen;
+    }
+}
+
+/*! \brief find a cacheline into which to merge the request
+ *
+ *   A cacheline qualifies if its location is within hpe of the new location
+ *   and at least cache_consolidate percent of the APs of the request and
+ *   cacheline together are in both. The most overlapping line is chosen, and
+ *   its Used APs which are not in the request are copied out, as many as the
+ *   request has room for, to be saved with the request APs.
  *
  *  @param rctx Skyhook request context
- *  @param cl the cacheline to count in
+ *  @param loc location reported by server
+ *  @param extra where to copy the Used APs kept from the cacheline
+ *  @param num_extra where to save the number of APs kept
  *
- *  @return true or false
+ *  @return index of cacheline or -1 if none qualifies
  */
-int cached_gnss_worse(Sky_rctx_t *rctx, Sky_cacheline_t *cl)
+int find_consolidation(
+    Sky_rctx_t *rctx, Sky_location_t *loc, Sky_cache_ap_t *extra, int *num_extra)
 {
-    if (!has_gnss(rctx))
-        /* new scan doesn't include gnss */
-        return false;
+    Sky_sctx_t *sctx = rctx->session;
+    bool counted = cache_count_valid(rctx);
+    int best = -1, best_score = 0, room;
 
-    if (!has_gnss(cl)) {
-#ifdef VERBOSE_DEBUG
-        /* new scan includes gnss, but cached scan does not */
-        LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "cache miss! Cacheline has no gnss!");
-#endif // VERBOSE_DEBUG
-        return true;
-    }
+    *num_extra = 0;
+    if (sctx->cache_consolidate == 0 || NUM_APS(rctx) == 0)
+        return -1;
+    for (int k = 0; k < sctx->num_expiry; k++) {
+        int i = sctx->expiry[k], common = 0, score;
+        Sky_cacheline_t *cl = &sctx->cacheline[i];
 
-    /* at this point both new and cached scans include GNSS */
-    if (rctx->gnss.hpe < cl->gnss.hpe) {
-#ifdef VERBOSE_DEBUG
-        /* New gnss is more accurate than cached gnss */
-        LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "cache miss! Cacheline has worse gnss hpe!");
-#endif // VERBOSE_DEBUG
-        return true;
+        if (NUM_APS(cl) == 0 || cl->loc.location_status != SKY_LOCATION_STATUS_SUCCESS ||
+            distance_equirect(loc->lat, loc->lon, cl->loc.lat, cl->loc.lon) >
+                (float)(loc->hpe > cl->loc.hpe ? loc->hpe : cl->loc.hpe))
+            continue;
+        if (counted)
+            common = rctx->cache_count[i];
+        else
+            for (int j = 0; j < NUM_APS(rctx); j++)
+                common += ap_in_cacheline(sctx, cl, RCTX_BEACON(rctx, j).ap.mac);
+        score = 100 * common / (NUM_APS(rctx) + NUM_APS(cl) - common);
+        if (score >= sctx->cache_consolidate && score > best_score) {
+            best = i;
+            best_score = score;
+        }
     }
+    if (best < 0)
+        return -1;
 
-    if (distance_A_to_B(rctx->gnss.lat, rctx->gnss.lon, cl->gnss.lat, cl->gnss.lon) >=
-        (float)rctx->gnss.hpe) {
-#ifdef VERBOSE_DEBUG
-        /* Cached gnss location is outside radius of uncertainty at 68% of new gnss */
-        LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG,
-            "cache miss! Distance to cacheline gnss fix (%dm) is larger than HPE of new gnss fix (%dm)",
-            (int)distance_A_to_B(rctx->gnss.lat, rctx->gnss.lon, cl->gnss.lat, cl->gnss.lon),
-            rctx->gnss.hpe);
-#endif // VERBOSE_DEBUG
-        return true;
-    }
+    /* a cacheline over the configured limits would be cleared by the next request */
+    room = (int)CONFIG(sctx, max_ap_beacons) - NUM_APS(rctx);
+    if ((int)CONFIG(sctx, total_beacons) - NUM_BEACONS(rctx) < room)
+        room = (int)CONFIG(sctx, total_beacons) - NUM_BEACONS(rctx);
+    for (int j = 0; j < NUM_APS(&sctx->cacheline[best]) && *num_extra < room; j++) {
+        Sky_cache_ap_t *a = CACHE_AP(sctx, &sctx->cacheline[best], j);
+        int n;
 
-    return false;
+        if (!(a->flags & CL_AP_FLAG_USED))
+            continue;
+        for (n = 0; n < NUM_APS(rctx); n++)
+            if (memcmp(RCTX_BEACON(rctx, n).ap.mac, a->mac, MAC_SIZE) == 0)
+                break;
+        if (n == NUM_APS(rctx))
+            extra[(*num_extra)++] = *a;
+    }
+    LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "merging into cache %d, %d%% APs in common, %d kept", best,
+        best_score, *num_extra);
+    return best;
 }
-#endif // !SKY_EXCLUDE_GNSS_SUPPORT
+#endif // !SKY_EXCLUDE_WIFI_SUPPORT
 
 #if !SKY_EXCLUDE_CELL_SUPPORT
-/*! \brief test serving cell in workspace has changed from that in cache
+/*! \brief compute the search key of a cell held in the cache pool
  *
- *  @return true or false
+ *  @param c pointer to cached cell
  *
- *  false if either request context or cache has no cells
+ *  @return key of cell, the same as cell_key() of the original cell
+ */
+uint32_t cached_cell_key(Sky_cache_cell_t *c)
+{
+    return hash_cell_key(c->type, c->id2, ((uint64_t)c->id4[1] << 32) | c->id4[0]);
+}
+
+/*! \brief key of the serving cell of a request, used to partition the cache
+ *
+ *   The serving cell is the highest priority cell. An NMR never causes a
+ *   cacheline to be rejected by serving_cell_changed(), so it has no key.
+ *
+ *  @param rctx Skyhook request context
+ *
+ *  @return key of serving cell, 0 if there is no serving cell or it is an NMR
+ */
+static uint32_t serving_key(Sky_rctx_t *rctx)
+{
+    Beacon_t *w = &RCTX_BEACON(rctx, NUM_APS(rctx));
+    uint32_t key;
+
+    if (NUM_CELLS(rctx) == 0 || is_cell_nmr(w))
+        return 0;
+    key = cell_key(w);
+    return key ? key : 1; /* 0 is reserved for no serving cell */
+}
+
+/*! \brief bucket of cachelines with a given serving cell key
+ *
+ *  @param key serving cell key
+ *
+ *  @return bucket index, 0 for no serving cell
+ */
+static int serving_bucket(uint32_t key)
+{
+    return key == 0 ? 0 : 1 + (int)(key % (SERVING_CELL_BUCKETS - 1));
+}
+
+/*! \brief add a newly saved cacheline to the bucket of its serving cell
+ *
+ *   Buckets are kept in cacheline order, so that lines are searched in the
+ *   same order whether or not the cache is partitioned.
+ *
+ *  @param rctx Skyhook request context holding the saved beacons
+ *  @param cl pointer to cacheline
+ */
+static void serving_bucket_add(Sky_rctx_t *rctx, Sky_cacheline_t *cl)
+{
+    Sky_sctx_t *sctx = rctx->session;
+    uint16_t *link;
+
+    cl->serving_key = serving_key(rctx);
+    link = &sctx->serving_bucket[serving_bucket(cl->serving_key)];
+    while (*link && &sctx->cacheline[*link - 1] < cl)
+        link = &sctx->cacheline[*link - 1].serving_next;
+    cl->serving_next = *link;
+    *link = (uint16_t)(cl - sctx->cacheline + 1);
+}
+
+/*! \brief remove a cacheline from the bucket of its serving cell
+ *
+ *  @param sctx Skyhook session context
+ *  @param cl pointer to cacheline
+ */
+static void serving_bucket_remove(Sky_sctx_t *sctx, Sky_cacheline_t *cl)
+{
+    uint16_t *link = &sctx->serving_bucket[serving_bucket(cl->serving_key)];
+
+    while (*link && &sctx->cacheline[*link - 1] != cl)
+        link = &sctx->cacheline[*link - 1].serving_next;
+    if (*link)
+        *link = cl->serving_next;
+    cl->serving_key = 0;
+    cl->serving_next = 0;
+}
+#endif // !SKY_EXCLUDE_CELL_SUPPORT
+
+#if !SKY_EXCLUDE_GNSS_SUPPORT
+/*! \brief grid cell holding a coordinate
+ *
+ *  @param deg latitude or longitude in degrees
+ *
+ *  @return grid cell index
+ */
+static int32_t grid_cell(double deg)
+{
+    return (int32_t)floor(deg / GNSS_GRID_DEGREES);
+}
+
+/*! \brief bucket of cachelines with a GNSS fix in a grid cell
+ *
+ *  @param lat grid cell latitude index
+ *  @param lon grid cell longitude index
+ *
+ *  @return bucket index
+ */
+static int grid_bucket(int32_t lat, int32_t lon)
+{
+    return (int)(((uint32_t)lat * 73856093u ^ (uint32_t)lon * 19349663u) % GNSS_GRID_BUCKETS);
+}
+
+/*! \brief add a newly saved cacheline to the bucket of the grid cell of its GNSS fix
+ *
+ *   Lines without a GNSS fix are not added, as they never match a request
+ *   with one, see cached_gnss_worse().
+ *
+ *  @param rctx Skyhook request context holding the saved GNSS fix
+ *  @param cl pointer to cacheline
+ */
+static void gnss_grid_add(Sky_rctx_t *rctx, Sky_cacheline_t *cl)
+{
+    Sky_sctx_t *sctx = rctx->session;
+    uint16_t *link;
+
+    if (!has_gnss(rctx))
+        return;
+    cl->grid_lat = grid_cell(rctx->gnss.lat);
+    cl->grid_lon = grid_cell(rctx->gnss.lon);
+    link = &sctx->gnss_grid[grid_bucket(cl->grid_lat, cl->grid_lon)];
+    cl->grid_next = *link;
+    *link = (uint16_t)(cl - sctx->cacheline + 1);
+}
+
+/*! \brief remove a cacheline from the bucket of the grid cell of its GNSS fix
+ *
+ *  @param sctx Skyhook session context
+ *  @param cl pointer to cacheline
+ */
+static void gnss_grid_remove(Sky_sctx_t *sctx, Sky_cacheline_t *cl)
+{
+    uint16_t *link = &sctx->gnss_grid[grid_bucket(cl->grid_lat, cl->grid_lon)];
+
+    while (*link && &sctx->cacheline[*link - 1] != cl)
+        link = &sctx->cacheline[*link - 1].grid_next;
+    if (*link)
+        *link = cl->grid_next;
+    cl->grid_lat = cl->grid_lon = 0;
+    cl->grid_next = 0;
+}
+
+/*! \brief list the cachelines with a GNSS fix near that of a request
+ *
+ *   Cachelines further from the request GNSS fix than its HPE are never a
+ *   match, see cached_gnss_worse(), so only the grid cells which the HPE
+ *   reaches are looked up. Lines are listed in cacheline order.
+ *
+ *  @param rctx Skyhook request context
+ *  @param lines where to save index of each cacheline, room for num_cachelines
+ *
+ *  @return number of cachelines listed, or -1 if the grid can not be used
+ */
+static int gnss_candidates(Sky_rctx_t *rctx, uint16_t *lines)
+{
+    Sky_sctx_t *sctx = rctx->session;
+    bool visited[GNSS_GRID_BUCKETS] = { false };
+    double dlat, dlon, c;
+    int32_t lat0, lat1, lon0, lon1;
+    int n = 0, skipped = 0;
+#if !SKY_EXCLUDE_CELL_SUPPORT
+    uint32_t key = serving_key(rctx);
+#endif // !SKY_EXCLUDE_CELL_SUPPORT
+
+    if (!has_gnss(rctx))
+        return -1;
+
+    /* degrees spanned by HPE, with a margin for rounding, widest in longitude nearest the pole */
+    dlat = rctx->gnss.hpe * 1.01 / METERS_PER_DEGREE + GNSS_GRID_DEGREES / 1000;
+    c = cos((fabs(rctx->gnss.lat) + dlat) * 3.14159265358979 / 180);
+    if (c < 0.01 || rctx->gnss.lon - dlat / c < -180 || rctx->gnss.lon + dlat / c > 180)
+        return -1; /* near a pole or the antimeridian */
+    dlon = dlat / c;
+    lat0 = grid_cell(rctx->gnss.lat - dlat);
+    lat1 = grid_cell(rctx->gnss.lat + dlat);
+    lon0 = grid_cell(rctx->gnss.lon - dlon);
+    lon1 = grid_cell(rctx->gnss.lon + dlon);
+    if ((lat1 - lat0 + 1) * (lon1 - lon0 + 1) > GNSS_GRID_MAX_CELLS)
+        return -1;
+
+    for (int32_t la = lat0; la <= lat1; la++) {
+        for (int32_t lo = lon0; lo <= lon1; lo++) {
+            int b = grid_bucket(la, lo);
+
+            if (visited[b])
+                continue;
+            visited[b] = true;
+            for (uint16_t l = sctx->gnss_grid[b]; l; l = sctx->cacheline[l - 1].grid_next) {
+                Sky_cacheline_t *cl = &sctx->cacheline[l - 1];
+                int k;
+
+                if (cl->grid_lat < lat0 || cl->grid_lat > lat1 || cl->grid_lon < lon0 ||
+                    cl->grid_lon > lon1)
+                    continue;
+#if !SKY_EXCLUDE_CELL_SUPPORT
+                if (key && cl->serving_key && cl->serving_key != key) {
+                    skipped++;
+                    continue;
+                }
+#endif // !SKY_EXCLUDE_CELL_SUPPORT
+                /* insert in cacheline order */
+                for (k = n++; k > 0 && lines[k - 1] > l - 1; k--)
+                    lines[k] = lines[k - 1];
+                lines[k] = l - 1;
+            }
+        }
+    }
+    /* lines left out are misses for a changed serving cell, or no GNSS fix near enough */
+    if (skipped)
+        CACHE_REJECT(rctx, CACHE_REJECT_CELL);
+    if (n + skipped < sctx->num_expiry)
+        CACHE_REJECT(rctx, CACHE_REJECT_GNSS);
+    LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "%d of %d cachelines near GNSS fix", n, sctx->num_cachelines);
+    return n;
+}
+#endif // !SKY_EXCLUDE_GNSS_SUPPORT
+
+/*! \brief list the cachelines which may match the serving cell of a request
+ *
+ *   Cachelines whose serving cell differs from that of the request are never
+ *   a match, see serving_cell_changed(). If the request has a GNSS fix, only
+ *   lines near it are listed. Otherwise, if the request has a serving cell,
+ *   only the bucket of that serving cell and the bucket of lines without one
+ *   are listed. Otherwise every cacheline is listed. Lines are listed in
+ *   cacheline order.
+ *
+ *  @param rctx Skyhook request context
+ *  @param lines where to save index of each cacheline, room for num_cachelines
+ *
+ *  @return number of cachelines listed
+ */
+int cache_candidates(Sky_rctx_t *rctx, uint16_t *lines)
+{
+    Sky_sctx_t *sctx = rctx->session;
+    int n;
+#if !SKY_EXCLUDE_CELL_SUPPORT
+    uint32_t key = serving_key(rctx);
+#endif // !SKY_EXCLUDE_CELL_SUPPORT
+
+#if !SKY_EXCLUDE_GNSS_SUPPORT
+    if ((n = gnss_candidates(rctx, lines)) >= 0)
+        return n;
+#endif // !SKY_EXCLUDE_GNSS_SUPPORT
+#if !SKY_EXCLUDE_CELL_SUPPORT
+    if (key) {
+        uint16_t a = sctx->serving_bucket[0];
+        uint16_t b = sctx->serving_bucket[serving_bucket(key)];
+
+        /* merge the two buckets, skipping lines of other serving cells sharing bucket b */
+        for (n = 0; a || b;) {
+            if (b == 0 || (a && a < b)) {
+                lines[n++] = a - 1;
+                a = sctx->cacheline[a - 1].serving_next;
+            } else {
+                if (sctx->cacheline[b - 1].serving_key == key)
+                    lines[n++] = b - 1;
+                b = sctx->cacheline[b - 1].serving_next;
+            }
+        }
+        /* every other line in use has a different serving cell */
+        if (n < sctx->num_expiry)
+            CACHE_REJECT(rctx, CACHE_REJECT_CELL);
+        LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "%d of %d cachelines share serving cell", n,
+            sctx->num_cachelines);
+        return n;
+    }
+#endif // !SKY_EXCLUDE_CELL_SUPPORT
+    for (n = 0; n < sctx->num_cachelines; n++)
+        lines[n] = (uint16_t)n;
+    return n;
+}
+
+/*! \brief number of bytes of cache pool taken by the beacons of a cacheline
+ *
+ *  @param cl pointer to cacheline
+ *
+ *  @return size of beacon records in bytes
+ */
+uint32_t cacheline_bytes(Sky_cacheline_t *cl)
+{
+    uint32_t bytes = 0;
+
+#if !SKY_EXCLUDE_WIFI_SUPPORT
+    bytes += NUM_APS(cl) * (uint32_t)sizeof(Sky_cache_ap_t);
+#endif // !SKY_EXCLUDE_WIFI_SUPPORT
+#if !SKY_EXCLUDE_CELL_SUPPORT
+    bytes += NUM_CELLS(cl) * (uint32_t)sizeof(Sky_cache_cell_t);
+#endif // !SKY_EXCLUDE_CELL_SUPPORT
+    return bytes;
+}
+
+/*! \brief return the beacon records of a cacheline to the cache pool
+ *
+ *   The pool is kept compacted, records of later cachelines are moved down
+ *   to close the gap, so free space is always at the end of the pool.
+ *
+ *  @param sctx Skyhook session context
+ *  @param cl pointer to cacheline
+ */
+static void cache_pool_free(Sky_sctx_t *sctx, Sky_cacheline_t *cl)
+{
+    uint32_t bytes = cacheline_bytes(cl);
+    uint8_t *pool = (uint8_t *)CACHE_POOL(sctx);
+
+    if (bytes) {
+        memmove(pool + cl->offset, pool + cl->offset + bytes,
+            sctx->cache_pool_used - cl->offset - bytes);
+        sctx->cache_pool_used -= bytes;
+        for (int i = 0; i < sctx->num_cachelines; i++) {
+            Sky_cacheline_t *other = &sctx->cacheline[i];
+
+            if (NUM_BEACONS(other) && other->offset > cl->offset)
+                other->offset -= bytes;
+        }
+    }
+    cl->num_beacons = 0;
+    cl->num_ap = 0;
+    cl->offset = 0;
+}
+
+/*! \brief copy the fields examined when searching the cache out of a newly filled cacheline
+ *
+ *   Only needed when CACHE_SOA_LAYOUT is enabled, otherwise the accessors read
+ *   the cached beacon records directly.
+ *
+ *  @param sctx Skyhook session context
+ *  @param cl pointer to cacheline
+ */
+void pack_cacheline(Sky_sctx_t *sctx, Sky_cacheline_t *cl)
+{
+#if CACHE_SOA_LAYOUT
+#if !SKY_EXCLUDE_WIFI_SUPPORT
+    for (int j = 0; j < NUM_APS(cl); j++) {
+        Sky_cache_ap_t *a = CACHE_AP(sctx, cl, j);
+
+        memcpy(cl->ap_mac[j], a->mac, MAC_SIZE);
+        cl->ap_rssi[j] = (int8_t)a->rssi;
+        cl->ap_flags[j] = a->flags;
+    }
+#endif // !SKY_EXCLUDE_WIFI_SUPPORT
+#if !SKY_EXCLUDE_CELL_SUPPORT
+    for (int j = NUM_APS(cl); j < NUM_BEACONS(cl); j++)
+        cl->cell_key[j] = cached_cell_key(CACHE_CELL(sctx, cl, j));
+#endif // !SKY_EXCLUDE_CELL_SUPPORT
+#else
+    (void)sctx; /* suppress warning unused parameter */
+    (void)cl; /* suppress warning unused parameter */
+#endif // CACHE_SOA_LAYOUT
+}
+
+/*! \brief hits per hour since a cacheline was last used, the more the better to keep
+ *
+ *  @param rctx Skyhook request context
+ *  @param cl pointer to cacheline
+ *
+ *  @return weighted hit count
+ */
+static double hit_weight(Sky_rctx_t *rctx, Sky_cacheline_t *cl)
+{
+    double hours = difftime(rctx->header.time, cl->used) / SECONDS_IN_HOUR;
+
+    return (cl->hits + 1) / (1.0 + (hours > 0 ? hours : 0));
+}
+
+/*! \brief test whether cacheline a should be replaced before cacheline b
+ *
+ *  @param rctx Skyhook request context
+ *  @param a pointer to cacheline
+ *  @param b pointer to cacheline
+ *
+ *  @return true if a is the better cacheline to replace
+ */
+static bool evict_before(Sky_rctx_t *rctx, Sky_cacheline_t *a, Sky_cacheline_t *b)
+{
+    double wa, wb;
+
+    switch (rctx->session->cache_policy) {
+    case SKY_CACHE_POLICY_LFU:
+        if (a->hits != b->hits)
+            return a->hits < b->hits;
+        break;
+    case SKY_CACHE_POLICY_HIT_WEIGHTED:
+        wa = hit_weight(rctx, a);
+        wb = hit_weight(rctx, b);
+        if (wa != wb)
+            return wa < wb;
+        break;
+    default:
+        break;
+    }
+    /* least recently used */
+    return difftime(a->used, b->used) < 0;
+}
+
+/*! \brief find a cacheline in use to clear when the cache pool has no room
+ *
+ *   The cacheline is chosen by the eviction policy of the session as by
+ *   find_victim(), or is the oldest, at the head of the expiry list, if the
+ *   session has none.
+ *
+ *  @param rctx Skyhook request context
+ *  @param cl pointer to cacheline being saved, which is never chosen
+ *
+ *  @return pointer to cacheline, or NULL if no other cacheline is in use
+ */
+static Sky_cacheline_t *pool_victim(Sky_rctx_t *rctx, Sky_cacheline_t *cl)
+{
+    Sky_sctx_t *sctx = rctx->session;
+    Sky_cacheline_t *victim = NULL;
+
+    for (int k = 0; k < sctx->num_expiry; k++) {
+        Sky_cacheline_t *c = &sctx->cacheline[sctx->expiry[k]];
+
+        if (c == cl)
+            continue;
+        if (sctx->cache_policy == SKY_CACHE_POLICY_SCORE ||
+            sctx->cache_policy >= SKY_CACHE_POLICY_MAX)
+            return c;
+        if (victim == NULL || evict_before(rctx, c, victim))
+            victim = c;
+    }
+    return victim;
+}
+
+/*! \brief copy the beacons of the request context into the cache pool for a cacheline
+ *
+ *   The cacheline must be empty. If the pool has no room for the beacons, other
+ *   cachelines are cleared until it does, see pool_victim(). Any extra APs, e.g.
+ *   those kept from a cacheline being merged, are saved after the request APs.
+ *
+ *  @param rctx Skyhook request context
+ *  @param cl pointer to empty cacheline
+ *  @param extra extra APs to save, or NULL
+ *  @param num_extra number of extra APs
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR if the beacons could never fit in the pool
+ */
+Sky_status_t save_cacheline_beacons(
+    Sky_rctx_t *rctx, Sky_cacheline_t *cl, const Sky_cache_ap_t *extra, int num_extra)
+{
+    Sky_sctx_t *sctx = rctx->session;
+    uint32_t bytes;
+    int j;
+
+    cl->num_beacons = (uint16_t)(NUM_BEACONS(rctx) + num_extra);
+    cl->num_ap = (uint16_t)(NUM_APS(rctx) + num_extra);
+    bytes = cacheline_bytes(cl);
+    cl->num_beacons = cl->num_ap = 0; /* nothing in pool yet */
+    if (bytes > sctx->cache_pool_size) {
+        LOGFMT(rctx, SKY_LOG_LEVEL_ERROR, "%d bytes of beacons exceed cache pool", (int)bytes);
+        return SKY_ERROR;
+    }
+
+    /* evict cachelines, chosen by the eviction policy, until there is room */
+    while (sctx->cache_pool_used + bytes > sctx->cache_pool_size) {
+        Sky_cacheline_t *victim = pool_victim(rctx, cl);
+
+        if (victim == NULL)
+            return SKY_ERROR; /* pool accounting is inconsistent */
+        LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "evicting cache %d of %d to make room",
+            (int)(victim - sctx->cacheline), sctx->num_cachelines);
+        clear_cacheline(rctx, victim);
+        CACHE_STAT(sctx, evictions);
+    }
+
+    cl->num_beacons = (uint16_t)(NUM_BEACONS(rctx) + num_extra);
+    cl->num_ap = (uint16_t)(NUM_APS(rctx) + num_extra);
+    cl->offset = sctx->cache_pool_used;
+    sctx->cache_pool_used += bytes;
+
+#if !SKY_EXCLUDE_WIFI_SUPPORT
+    /* extra APs follow those of the request */
+    for (j = 0; j < num_extra; j++)
+        *CACHE_AP(sctx, cl, NUM_APS(rctx) + j) = extra[j];
+#else
+    (void)extra;
+#endif // !SKY_EXCLUDE_WIFI_SUPPORT
+    for (j = 0; j < NUM_BEACONS(rctx); j++) {
+        Beacon_t *b = &RCTX_BEACON(rctx, j);
+
+#if !SKY_EXCLUDE_WIFI_SUPPORT
+        if (j < NUM_APS(rctx)) {
+            Sky_cache_ap_t *a = CACHE_AP(sctx, cl, j);
+
+            a->age = b->h.age;
+            a->freq = b->ap.freq;
+            memcpy(a->mac, b->ap.mac, MAC_SIZE);
+            a->rssi = b->h.rssi;
+            a->flags = (uint8_t)((b->ap.property.used ? CL_AP_FLAG_USED : 0) |
+                                 (b->h.connected ? CL_AP_FLAG_CONNECTED : 0));
+            a->vg_len = b->ap.vg_len;
+            a->vg_used = 0;
+            for (int v = 0; v < MAX_VAP_PER_AP; v++) {
+                if (b->ap.vg_prop[v].used)
+                    a->vg_used |= (uint16_t)(1 << v);
+            }
+            memcpy(a->vg, b->ap.vg, sizeof(a->vg));
+            continue;
+        }
+#endif // !SKY_EXCLUDE_WIFI_SUPPORT
+#if !SKY_EXCLUDE_CELL_SUPPORT
+        {
+            Sky_cache_cell_t *c = CACHE_CELL(sctx, cl, j + num_extra);
+
+            c->age = b->h.age;
+            c->id3 = b->cell.id3;
+            c->id4[0] = (uint32_t)(uint64_t)b->cell.id4;
+            c->id4[1] = (uint32_t)((uint64_t)b->cell.id4 >> 32);
+            c->freq = b->cell.freq;
+            c->ta = b->cell.ta;
+            c->id1 = b->cell.id1;
+            c->id2 = b->cell.id2;
+            c->id5 = b->cell.id5;
+            c->rssi = b->h.rssi;
+            c->type = (uint8_t)b->h.type;
+            c->connected = (uint8_t)b->h.connected;
+        }
+#endif // !SKY_EXCLUDE_CELL_SUPPORT
+    }
+    pack_cacheline(sctx, cl);
+#if !SKY_EXCLUDE_CELL_SUPPORT
+    serving_bucket_add(rctx, cl);
+#endif // !SKY_EXCLUDE_CELL_SUPPORT
+#if !SKY_EXCLUDE_GNSS_SUPPORT
+    gnss_grid_add(rctx, cl);
+#endif // !SKY_EXCLUDE_GNSS_SUPPORT
+#if !SKY_EXCLUDE_WIFI_SUPPORT
+    cacheline_changed(rctx, cl, NUM_APS(rctx));
+#endif // !SKY_EXCLUDE_WIFI_SUPPORT
+    return SKY_SUCCESS;
+}
+
+/*! \brief copy one beacon of a cacheline out of the cache pool
+ *
+ *  @param sctx Skyhook session context
+ *  @param cl pointer to cacheline
+ *  @param j index of beacon in cacheline, APs first
+ *  @param b where to save the beacon
+ */
+void get_cached_beacon(Sky_sctx_t *sctx, Sky_cacheline_t *cl, int j, Beacon_t *b)
+{
+    memset(b, 0, sizeof(*b));
+    b->h.magic = BEACON_MAGIC;
+#if !SKY_EXCLUDE_WIFI_SUPPORT
+    if (j < NUM_APS(cl)) {
+        Sky_cache_ap_t *a = CACHE_AP(sctx, cl, j);
+
+        b->h.type = SKY_BEACON_AP;
+        b->h.age = a->age;
+        b->h.rssi = a->rssi;
+        b->h.connected = (a->flags & CL_AP_FLAG_CONNECTED) ? 1 : 0;
+        b->ap.freq = a->freq;
+        memcpy(b->ap.mac, a->mac, MAC_SIZE);
+        b->ap.property.used = (a->flags & CL_AP_FLAG_USED) ? 1 : 0;
+        b->ap.vg_len = a->vg_len;
+        for (int v = 0; v < MAX_VAP_PER_AP; v++)
+            b->ap.vg_prop[v].used = (a->vg_used >> v) & 1;
+        memcpy(b->ap.vg, a->vg, sizeof(a->vg));
+        return;
+    }
+#endif // !SKY_EXCLUDE_WIFI_SUPPORT
+#if !SKY_EXCLUDE_CELL_SUPPORT
+    {
+        Sky_cache_cell_t *c = CACHE_CELL(sctx, cl, j);
+
+        b->h.type = c->type;
+        b->h.age = c->age;
+        b->h.rssi = c->rssi;
+        b->h.connected = (int8_t)c->connected;
+        b->cell.id1 = c->id1;
+        b->cell.id2 = c->id2;
+        b->cell.id3 = c->id3;
+        b->cell.id4 = (int64_t)(((uint64_t)c->id4[1] << 32) | c->id4[0]);
+        b->cell.id5 = c->id5;
+        b->cell.freq = c->freq;
+        b->cell.ta = c->ta;
+    }
+#else
+    (void)sctx; /* suppress warning unused parameter */
+    (void)cl; /* suppress warning unused parameter */
+#endif // !SKY_EXCLUDE_CELL_SUPPORT
+}
+
+/*! \brief add the APs of a newly filled cacheline to the cache index
+ *
+ *  @param rctx Skyhook request context
+ *  @param cl pointer to cacheline
+ */
+void cache_index_add(Sky_rctx_t *rctx, Sky_cacheline_t *cl)
+{
+#if !SKY_EXCLUDE_WIFI_SUPPORT
+    Sky_sctx_t *sctx = rctx->session;
+
+    for (int j = 0; j < NUM_APS(cl); j++) {
+        Sky_cache_index_t *e = cache_index_find(sctx, CL_AP_MAC(sctx, cl, j));
+
+        if (e == NULL) {
+            LOGFMT(rctx, SKY_LOG_LEVEL_ERROR, "cache index full");
+            return;
+        }
+        if (e->lines == 0)
+            memcpy(e->mac, CL_AP_MAC(sctx, cl, j), MAC_SIZE);
+        e->lines++;
+        if (CL_AP_USED(sctx, cl, j))
+            e->used++;
+    }
+#else
+    (void)rctx; /* suppress warning unused parameter */
+    (void)cl; /* suppress warning unused parameter */
+#endif // !SKY_EXCLUDE_WIFI_SUPPORT
+}
+
+/*! \brief add a newly saved cacheline to the expiry list
+ *
+ *   The expiry list holds the index of every non-empty cacheline in order of
+ *   the time it was saved, so that expired cachelines are found at its head.
+ *   Lines are nearly always saved with the latest time, so are appended.
+ *
+ *  @param sctx Skyhook session context
+ *  @param cl pointer to cacheline, with its time set
+ */
+void cache_expiry_add(Sky_sctx_t *sctx, Sky_cacheline_t *cl)
+{
+    int i = sctx->num_expiry;
+
+    /* every line in use is already listed, the caller has not removed cl first */
+    if (i >= sctx->num_cachelines || i >= CACHE_SIZE)
+        return;
+    /* move later lines up to make room */
+    while (i > 0 && difftime(sctx->cacheline[sctx->expiry[i - 1]].time, cl->time) > 0) {
+        sctx->expiry[i] = sctx->expiry[i - 1];
+        i--;
+    }
+    sctx->expiry[i] = (uint16_t)(cl - sctx->cacheline);
+    sctx->num_expiry++;
+}
+
+/*! \brief remove a cacheline from the expiry list
+ *
+ *  @param sctx Skyhook session context
+ *  @param cl pointer to cacheline
+ */
+static void cache_expiry_remove(Sky_sctx_t *sctx, Sky_cacheline_t *cl)
+{
+    uint16_t idx = (uint16_t)(cl - sctx->cacheline);
+
+    for (int i = 0; i < sctx->num_expiry; i++) {
+        if (sctx->expiry[i] == idx) {
+            memmove(&sctx->expiry[i], &sctx->expiry[i + 1],
+                (sctx->num_expiry - i - 1) * sizeof(sctx->expiry[0]));
+            sctx->num_expiry--;
+            return;
+        }
+    }
+}
+
+/*! \brief clear cachelines older than the cache age threshold
+ *
+ *   Only the head of the expiry list is examined, so the cost is in
+ *   proportion to the number of cachelines which have expired.
+ *   If time is unavailable, all cachelines are cleared.
+ *
+ *  @param rctx Skyhook request context
+ *  @param now time of request, or TIME_UNAVAILABLE
+ *
+ *  @return number of cachelines cleared
+ */
+int expire_cachelines(Sky_rctx_t *rctx, time_t now)
+{
+    Sky_sctx_t *sctx = rctx->session;
+    Sky_cacheline_t *cl;
+    int n = 0;
+
+    while (sctx->num_expiry > 0) {
+        cl = &sctx->cacheline[sctx->expiry[0]];
+        if (now != TIME_UNAVAILABLE &&
+            difftime(now, cl->time) <= CONFIG(sctx, cache_age_threshold) * SECONDS_IN_HOUR)
+            break;
+        LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "cache %d of %d cleared due to %s (%d)",
+            sctx->expiry[0], sctx->num_cachelines,
+            now == TIME_UNAVAILABLE ? "time being unavailable" : "age",
+            (int)difftime(now, cl->time));
+        clear_cacheline(rctx, cl);
+        CACHE_STAT(sctx, expirations);
+        n++;
+    }
+    return n;
+}
+
+/*! \brief find an empty cacheline
+ *
+ *   The cache is known to be full, without looking at any cacheline, when
+ *   every cacheline is in the expiry list.
+ *
+ *  @param sctx Skyhook session context
+ *  @param last true to find the last empty cacheline rather than the first
+ *
+ *  @return index of empty cacheline, or -1 if cache is full
+ */
+int find_empty_cacheline(Sky_sctx_t *sctx, bool last)
+{
+    if (sctx->num_expiry >= sctx->num_cachelines)
+        return -1;
+    for (int i = 0; i < sctx->num_cachelines; i++) {
+        int c = last ? sctx->num_cachelines - 1 - i : i;
+
+        if (sctx->cacheline[c].time == CACHE_EMPTY)
+            return c;
+    }
+    return -1;
+}
+
+/*! \brief mark a cacheline empty, remove its APs from the cache index and
+ *         return its beacons to the cache pool
+ *
+ *  @param rctx Skyhook request context
+ *  @param cl pointer to cacheline
+ */
+void clear_cacheline(Sky_rctx_t *rctx, Sky_cacheline_t *cl)
+{
+#if !SKY_EXCLUDE_WIFI_SUPPORT
+    if (cl->time != CACHE_EMPTY) {
+        for (int j = 0; j < NUM_APS(cl); j++)
+            cache_index_remove_ap(
+                rctx->session, CL_AP_MAC(rctx->session, cl, j), CL_AP_USED(rctx->session, cl, j));
+    }
+    cacheline_changed(rctx, cl, 0);
+#endif // !SKY_EXCLUDE_WIFI_SUPPORT
+    if (cl->time != CACHE_EMPTY)
+        cache_expiry_remove(rctx->session, cl);
+#if !SKY_EXCLUDE_CELL_SUPPORT
+    serving_bucket_remove(rctx->session, cl);
+#endif // !SKY_EXCLUDE_CELL_SUPPORT
+#if !SKY_EXCLUDE_GNSS_SUPPORT
+    gnss_grid_remove(rctx->session, cl);
+#endif // !SKY_EXCLUDE_GNSS_SUPPORT
+    cache_pool_free(rctx->session, cl);
+    cl->time = cl->used = CACHE_EMPTY;
+    cl->hits = 0;
+}
+
+/*! \brief check if a beacon is in cache
+ *
+ *   APs are looked up by MAC in the cache index, which records how many
+ *   cachelines hold the AP and in how many of those it is marked 'used'.
+ *   Other beacons are found by scanning all cachelines in the cache.
+ *   If the given beacon is found in the cache true is returned otherwise
+ *   false. A beacon may appear in multiple cachelines.
+ *   If beacon is found and the cached beacon is marked 'used', the given
+ *   beacon is marked as 'used' also.
+ *
+ *  @param rctx Skyhook request context
+ *  @param b pointer to new beacon
+ *
+ *  @return true if beacon successfully found or false
+ */
+bool beacon_in_cache(Sky_rctx_t *rctx, Beacon_t *b)
+{
+    bool result = false;
+
+#if !SKY_EXCLUDE_WIFI_SUPPORT
+    if (is_ap_type(b)) {
+        Sky_cache_index_t *e = cache_index_find(rctx->session, b->ap.mac);
+
+        if (e == NULL || e->lines == 0)
+            return false;
+        if (e->used)
+            b->ap.property.used = true;
+        return true;
+    }
+#endif // !SKY_EXCLUDE_WIFI_SUPPORT
+
+    for (int i = 0; i < rctx->session->num_cachelines; i++) {
+        if (beacon_in_cacheline(rctx, b, &rctx->session->cacheline[i])) {
+            result = true; /* beacon is in cache */
+            if (is_ap_type(b) && b->ap.property.used)
+                break; /* beacon is in cached and used, can stop search */
+        }
+    }
+    return result;
+}
+
+/*! \brief check if a beacon is in a cacheline
+ *
+ *   Scan all beacons in the cacheline. If the type matches the given beacon, compare
+ *   the appropriate attributes. APs are compared by MAC through the cacheline
+ *   accessors, and only cells with a matching key are copied out of the cache
+ *   pool and compared in full. If the given beacon is found in the cacheline
+ *   true is returned otherwise false. Also if cached beacon has the Used property,
+ *   set it in the beacon we searched for.
+ *
+ *  @param rctx Skyhook request context
+ *  @param b pointer to new beacon
+ *  @param cl pointer to cacheline
+ *
+ *  @return true if beacon successfully found or false
+ */
+bool beacon_in_cacheline(Sky_rctx_t *rctx, Beacon_t *b, Sky_cacheline_t *cl)
+{
+    Sky_sctx_t *sctx = rctx->session;
+    Beacon_t cached;
+    int j;
+
+    if (cl->time == CACHE_EMPTY) {
+        return false;
+    }
+
+#if !SKY_EXCLUDE_WIFI_SUPPORT
+    if (is_ap_type(b)) {
+        for (j = 0; j < NUM_APS(cl); j++) {
+            if (memcmp(b->ap.mac, CL_AP_MAC(sctx, cl, j), MAC_SIZE) == 0) {
+                if (CL_AP_USED(sctx, cl, j))
+                    b->ap.property.used = true;
+                return true;
+            }
+        }
+        return false;
+    }
+#endif // !SKY_EXCLUDE_WIFI_SUPPORT
+
+#if !SKY_EXCLUDE_CELL_SUPPORT
+    if (is_cell_type(b)) {
+        uint32_t key = cell_key(b);
+
+        for (j = NUM_APS(cl); j < NUM_BEACONS(cl); j++) {
+            bool equal = false;
+
+            if (CL_CELL_KEY(sctx, cl, j) != key)
+                continue;
+            get_cached_beacon(sctx, cl, j, &cached);
+            if (sky_plugin_equal(rctx, NULL, b, &cached, &equal) == SKY_SUCCESS && equal)
+                return true;
+        }
+        return false;
+    }
+#endif // !SKY_EXCLUDE_CELL_SUPPORT
+
+    for (j = 0; j < NUM_BEACONS(cl); j++) {
+        bool equal = false;
+
+        get_cached_beacon(sctx, cl, j, &cached);
+        if (sky_plugin_equal(rctx, NULL, b, &cached, &equal) == SKY_SUCCESS && equal)
+            return true;
+    }
+    return false;
+}
+
+/*! \brief find cache entry with oldest entry
+ *
+ *  @param rctx Skyhook request context
+ *
+ *  @return index of oldest cache entry, or empty
+ */
+int find_oldest(Sky_rctx_t *rctx)
+{
+    Sky_sctx_t *sctx = rctx->session;
+    int oldestc;
+
+    /* if there is only one cacheline, or time is unavailable */
+    if (sctx->num_cachelines == 1 || rctx->header.time == TIME_UNAVAILABLE)
+        return 0;
+
+    /* empty cacheline if there is one, else head of expiry list */
+    if ((oldestc = find_empty_cacheline(sctx, false)) < 0)
+        oldestc = sctx->num_expiry ? sctx->expiry[0] : 0;
+    LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "cacheline %d oldest time %d", oldestc,
+        (int)sctx->cacheline[oldestc].time);
+    return oldestc;
+}
+
+/*! \brief find the cacheline to replace with a new server response
+ *
+ *   An empty cacheline is always chosen first, otherwise the cacheline
+ *   chosen depends on the eviction policy of the session.
+ *
+ *  @param rctx Skyhook request context
+ *
+ *  @return index of cacheline to replace
+ */
+int find_victim(Sky_rctx_t *rctx)
+{
+    Sky_sctx_t *sctx = rctx->session;
+    int i, victim = 0;
+
+    if (sctx->cache_policy == SKY_CACHE_POLICY_SCORE || sctx->cache_policy >= SKY_CACHE_POLICY_MAX)
+        return find_oldest(rctx);
+
+    for (i = 0; i < sctx->num_cachelines; i++) {
+        if (sctx->cacheline[i].time == CACHE_EMPTY)
+            return i;
+        if (evict_before(rctx, &sctx->cacheline[i], &sctx->cacheline[victim]))
+            victim = i;
+    }
+    LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "cacheline %d evicted by policy %d, %d hits", victim,
+        sctx->cache_policy, sctx->cacheline[victim].hits);
+    return victim;
+}
+
+#if !SKY_EXCLUDE_GNSS_SUPPORT
+/*! \brief test whether gnss in new scan is preferable to that in cache
+ *
+ *  if new scan has better gnss that that in cache, it is better to update cache
+ *  by sending new scan to server.
+ *
+ *  true only if gnss fix in cache is worse than new scan
+ *  false if cached gnss is better
+ *
+ *  @param rctx Skyhook request context
+ *  @param cl the cacheline to count in
+ *
+ *  @return true or false
+ */
+int cached_gnss_worse(Sky_rctx_t *rctx, Sky_cacheline_t *cl)
+{
+    if (!has_gnss(rctx))
+        /* new scan doesn't include gnss */
+        return false;
+
+    if (!has_gnss(cl)) {
+#ifdef VERBOSE_DEBUG
+        /* new scan includes gnss, but cached scan does not */
+        LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "cache miss! Cacheline has no gnss!");
+#endif // VERBOSE_DEBUG
+        CACHE_REJECT(rctx, CACHE_REJECT_GNSS);
+        return true;
+    }
+
+    /* at this point both new and cached scans include GNSS */
+    if (rctx->gnss.hpe < cl->gnss.hpe) {
+#ifdef VERBOSE_DEBUG
+        /* New gnss is more accurate than cached gnss */
+        LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "cache miss! Cacheline has worse gnss hpe!");
+#endif // VERBOSE_DEBUG
+        CACHE_REJECT(rctx, CACHE_REJECT_GNSS);
+        return true;
+    }
+
+    /* compare unit vectors of the fixes, prepared once by to_cache and search_cache */
+    float dx = rctx->gnss_vec[0] - cl->gnss_vec[0];
+    float dy = rctx->gnss_vec[1] - cl->gnss_vec[1];
+    float dz = rctx->gnss_vec[2] - cl->gnss_vec[2];
+
+    if (dx * dx + dy * dy + dz * dz >= rctx->gnss_chord2) {
+#ifdef VERBOSE_DEBUG
+        /* Cached gnss location is outside radius of uncertainty at 68% of new gnss */
+        LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG,
+            "cache miss! Distance to cacheline gnss fix (%dm) is larger than HPE of new gnss fix (%dm)",
+            (int)distance_A_to_B(rctx->gnss.lat, rctx->gnss.lon, cl->gnss.lat, cl->gnss.lon),
+            rctx->gnss.hpe);
+#endif // VERBOSE_DEBUG
+        CACHE_REJECT(rctx, CACHE_REJECT_GNSS);
+        return true;
+    }
+
+    return false;
+}
+#endif // !SKY_EXCLUDE_GNSS_SUPPORT
+
+#if !SKY_EXCLUDE_CELL_SUPPORT
+/*! \brief test serving cell in workspace has changed from that in cache
+ *
+ *  @return true or false
+ *
+ *  false if either request context or cache has no cells
  *  false if highest priority cell (which is
  *  assumed to be the serving cell, regardless of whether or
  *  not the user has marked it "connected") matches cache
@@ -454,7 +1732,7 @@ int cached_gnss_worse(Sky_rctx_t *rctx, Sky_cacheline_t *cl)
  */
 int serving_cell_changed(Sky_rctx_t *rctx, Sky_cacheline_t *cl)
 {
-    Beacon_t *w, *c;
+    Beacon_t *w, c;
     bool equal = false;
 
     if (NUM_CELLS(rctx) == 0) {
@@ -471,23 +1749,466 @@ int serving_cell_changed(Sky_rctx_t *rctx, Sky_cacheline_t *cl)
         return false;
     }
 
-    w = &rctx->beacon[NUM_APS(rctx)];
-    c = &cl->beacon[NUM_APS(cl)];
-    if (is_cell_nmr(w) || is_cell_nmr(c)) {
+    w = &RCTX_BEACON(rctx, NUM_APS(rctx));
+    get_cached_beacon(rctx->session, cl, NUM_APS(cl), &c);
+    if (is_cell_nmr(w) || is_cell_nmr(&c)) {
 #if VERBOSE_DEBUG
         LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "no significant cell in cache or request rctx");
 #endif // VERBOSE_DEBUG
         return false;
     }
 
-    if (sky_plugin_equal(rctx, NULL, w, c, &equal) == SKY_SUCCESS && equal)
+    if (CL_CELL_KEY(rctx->session, cl, NUM_APS(cl)) == cell_key(w) &&
+        sky_plugin_equal(rctx, NULL, w, &c, &equal) == SKY_SUCCESS && equal)
         return false;
     LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "cell mismatch");
+    CACHE_REJECT(rctx, CACHE_REJECT_CELL);
     return true;
 }
 #endif // !SKY_EXCLUDE_CELL_SUPPORT
+
+#if SKY_OFFLINE_LOCATE && !SKY_EXCLUDE_WIFI_SUPPORT
+/* strength of an AP when comparing scans, 0 for an AP which was not seen */
+#define AP_STRENGTH(rssi) (EFFECTIVE_RSSI(rssi) + 128)
+
+/*! \brief weighted Jaccard similarity of the APs of the request and a cacheline
+ *
+ *   The sum over all APs of the lower strength seen by the two scans,
+ *   divided by the sum of the higher strength.
+ *
+ *  @param rctx Skyhook request context
+ *  @param cl pointer to cacheline
+ *
+ *  @return similarity, 0.0 (no APs in common) to 1.0 (same APs and rssi)
+ */
+static float ap_similarity(Sky_rctx_t *rctx, Sky_cacheline_t *cl)
+{
+    Sky_sctx_t *sctx = rctx->session;
+    int32_t lower = 0, higher = 0;
+    int j, k;
+
+    /* every cached AP counts toward the higher sum, less those also in the request */
+    for (k = 0; k < NUM_APS(cl); k++)
+        higher += AP_STRENGTH(CL_AP_RSSI(sctx, cl, k));
+    for (j = 0; j < NUM_APS(rctx); j++) {
+        int32_t a = AP_STRENGTH(RCTX_BEACON(rctx, j).h.rssi);
+
+        k = cacheline_ap_index(sctx, cl, RCTX_BEACON(rctx, j).ap.mac);
+        if (k < 0) {
+            higher += a;
+        } else {
+            int32_t b = AP_STRENGTH(CL_AP_RSSI(sctx, cl, k));
+
+            lower += a < b ? a : b;
+            higher += (a > b ? a : b) - b;
+        }
+    }
+    return higher ? (float)lower / (float)higher : 0.0f;
+}
+
+/*! \brief estimate location from the cachelines whose APs are most like those of the request
+ *
+ *   Up to OFFLINE_LOCATE_NEIGHBORS cachelines with similarity of at least
+ *   OFFLINE_LOCATE_THRESHOLD percent are combined, weighted by similarity.
+ *   Uncertainty is their weighted mean hpe plus the spread of their locations.
+ *
+ *  @param rctx Skyhook request context
+ *  @param loc where to save the estimated location
+ *
+ *  @return number of cachelines combined, 0 if none were similar enough
+ */
+int locate_offline(Sky_rctx_t *rctx, Sky_location_t *loc)
+{
+    Sky_sctx_t *sctx = rctx->session;
+    Sky_cacheline_t *cl;
+    int best[OFFLINE_LOCATE_NEIGHBORS];
+    float score[OFFLINE_LOCATE_NEIGHBORS];
+    float lat[OFFLINE_LOCATE_NEIGHBORS], lon[OFFLINE_LOCATE_NEIGHBORS];
+    float hpe[OFFLINE_LOCATE_NEIGHBORS];
+    bool counted = cache_count_valid(rctx);
+    int n = 0, i, k;
+
+    if (NUM_APS(rctx) == 0)
+        return 0;
+    for (k = 0; k < sctx->num_expiry; k++) {
+        float sim;
+
+        i = sctx->expiry[k];
+        cl = &sctx->cacheline[i];
+        if (NUM_APS(cl) == 0 || cl->loc.location_status != SKY_LOCATION_STATUS_SUCCESS ||
+            (counted && rctx->cache_count[i] == 0))
+            continue;
+        sim = ap_similarity(rctx, cl);
+        if (sim * 100.0f < OFFLINE_LOCATE_THRESHOLD)
+            continue;
+        /* insert into the most similar cachelines, most similar first */
+        int j = n < OFFLINE_LOCATE_NEIGHBORS ? n++ : OFFLINE_LOCATE_NEIGHBORS;
+
+        for (; j > 0 && score[j - 1] < sim; j--) {
+            if (j < OFFLINE_LOCATE_NEIGHBORS) {
+                best[j] = best[j - 1];
+                score[j] = score[j - 1];
+            }
+        }
+        if (j < OFFLINE_LOCATE_NEIGHBORS) {
+            best[j] = i;
+            score[j] = sim;
+        }
+    }
+    if (n == 0)
+        return 0;
+
+    for (k = 0; k < n; k++) {
+        cl = &sctx->cacheline[best[k]];
+        lat[k] = cl->loc.lat;
+        lon[k] = cl->loc.lon;
+        hpe[k] = cl->loc.hpe;
+    }
+    combine_locations(n, score, lat, lon, hpe, loc);
+    loc->time = rctx->header.time;
+    loc->location_source = SKY_LOCATION_SOURCE_WIFI;
+    loc->location_status = SKY_LOCATION_STATUS_SUCCESS;
+    loc->dl_app_data = NULL;
+    loc->dl_app_data_len = 0;
+    LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "%d cachelines, best %d (%d%%), hpe %d", n, best[0],
+        (int)(score[0] * 100), loc->hpe);
+    return n;
+}
+#endif // SKY_OFFLINE_LOCATE && !SKY_EXCLUDE_WIFI_SUPPORT
 #endif // CACHE_SIZE
 
+#if SKY_AP_DATABASE && !SKY_EXCLUDE_WIFI_SUPPORT
+/*! \brief read a little-endian integer from the AP database
+ *
+ *  @param p pointer to first byte
+ *  @param size number of bytes
+ *
+ *  @return value
+ */
+static uint32_t ap_db_uint(const uint8_t *p, int size)
+{
+    uint32_t v = 0;
+
+    while (size--)
+        v = (v << 8) | p[size];
+    return v;
+}
+
+/*! \brief find an AP in the AP database by binary search of its records
+ *
+ *  @param db pointer to AP database
+ *  @param count number of records
+ *  @param mac MAC of AP
+ *
+ *  @return pointer to record of AP, or NULL if not found
+ */
+static const uint8_t *ap_db_find(const uint8_t *db, uint32_t count, const uint8_t mac[])
+{
+    const uint8_t *records = db + SKY_AP_DB_HEADER_SIZE;
+    uint32_t lo = 0, hi = count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const uint8_t *r = records + mid * SKY_AP_DB_RECORD_SIZE;
+        int diff = memcmp(r, mac, MAC_SIZE);
+
+        if (diff == 0)
+            return r;
+        else if (diff < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+/*! \brief estimate location from the APs of the request found in an AP database
+ *
+ *   The database is read in place, e.g. from flash or a memory mapped file.
+ *   Each AP found is weighted by its signal strength, and by the inverse
+ *   square of its hpe in the database.
+ *
+ *  @param rctx Skyhook request context
+ *  @param db pointer to AP database
+ *  @param db_len length of AP database in bytes
+ *  @param loc where to save the estimated location
+ *
+ *  @return number of APs found, -1 if the database is not valid
+ */
+int locate_ap_database(Sky_rctx_t *rctx, const uint8_t *db, uint32_t db_len, Sky_location_t *loc)
+{
+    float weight[MAX_AP_BEACONS], lat[MAX_AP_BEACONS], lon[MAX_AP_BEACONS], hpe[MAX_AP_BEACONS];
+    uint32_t count;
+    int n = 0;
+
+    if (db_len < SKY_AP_DB_HEADER_SIZE || memcmp(db, SKY_AP_DB_MAGIC, 8) != 0)
+        return -1;
+    count = ap_db_uint(db + 8, 4);
+    if (count > (db_len - SKY_AP_DB_HEADER_SIZE) / SKY_AP_DB_RECORD_SIZE)
+        return -1;
+
+    for (int j = 0; j < NUM_APS(rctx) && n < MAX_AP_BEACONS; j++) {
+        const uint8_t *r = ap_db_find(db, count, RCTX_BEACON(rctx, j).ap.mac);
+
+        if (r == NULL)
+            continue;
+        hpe[n] = (float)ap_db_uint(r + 6, 2);
+        lat[n] = (float)((int32_t)ap_db_uint(r + 8, 4) / 1e7);
+        lon[n] = (float)((int32_t)ap_db_uint(r + 12, 4) / 1e7);
+        weight[n] = (float)(EFFECTIVE_RSSI(RCTX_BEACON(rctx, j).h.rssi) + 128) /
+                    (hpe[n] < 1.0f ? 1.0f : hpe[n] * hpe[n]);
+        n++;
+    }
+    LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "%d of %d APs in AP database of %d", n, NUM_APS(rctx),
+        (int)count);
+    if (n < AP_DATABASE_MIN_APS || n == 0)
+        return n;
+
+    combine_locations(n, weight, lat, lon, hpe, loc);
+    loc->time = rctx->header.time;
+    loc->location_source = SKY_LOCATION_SOURCE_WIFI;
+    loc->location_status = SKY_LOCATION_STATUS_SUCCESS;
+    loc->dl_app_data = NULL;
+    loc->dl_app_data_len = 0;
+    return n;
+}
+#endif // SKY_AP_DATABASE && !SKY_EXCLUDE_WIFI_SUPPORT
+
+#if AP_LOCATION_TABLE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
+/*! \brief find an AP in the learned AP table by binary search
+ *
+ *  @param sctx Skyhook session context
+ *  @param mac MAC of AP
+ *  @param pos where to save the index at which the AP is, or would be inserted
+ *
+ *  @return true if AP is in table
+ */
+static bool ap_location_find(Sky_sctx_t *sctx, const uint8_t mac[], int *pos)
+{
+    int lo = 0, hi = sctx->num_ap_locations;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int diff = memcmp(sctx->ap_location[mid].mac, mac, MAC_SIZE);
+
+        if (diff == 0) {
+            *pos = mid;
+            return true;
+        } else if (diff < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *pos = lo;
+    return false;
+}
+
+/*! \brief move the estimate of an AP location toward a server location
+ *
+ *  @param v estimate in degrees * 1e7
+ *  @param deg server location in degrees
+ *  @param count number of server locations in estimate, including this one
+ *  @param wrap true for longitude, which wraps at 180 degrees
+ *
+ *  @return new estimate
+ */
+static int32_t ap_location_mean(int32_t v, float deg, int count, bool wrap)
+{
+    int64_t d = (int64_t)(deg * 1e7) - v;
+
+    if (wrap && d > 1800000000)
+        d -= 3600000000LL;
+    else if (wrap && d < -1800000000)
+        d += 3600000000LL;
+    d = v + d / count;
+    if (wrap && d > 1800000000)
+        d -= 3600000000LL;
+    else if (wrap && d < -1800000000)
+        d += 3600000000LL;
+    return (int32_t)d;
+}
+
+/*! \brief learn the locations of the APs used by the server from its location
+ *
+ *   Each AP marked used has its estimate moved toward the server location,
+ *   which is taken as the mean of the last AP_LOCATION_MAX_COUNT or so. An AP
+ *   not in the table replaces the least recently used, when the table is full.
+ *
+ *  @param rctx Skyhook request context
+ *  @param loc location reported by server
+ */
+void learn_ap_locations(Sky_rctx_t *rctx, Sky_location_t *loc)
+{
+    Sky_sctx_t *sctx = rctx->session;
+    int learned = 0;
+
+    for (int j = 0; j < NUM_APS(rctx); j++) {
+        Beacon_t *b = &RCTX_BEACON(rctx, j);
+        Sky_ap_location_t *a;
+        int pos, k;
+
+        if (!b->ap.property.used)
+            continue;
+        if (!ap_location_find(sctx, b->ap.mac, &pos)) {
+            if (sctx->num_ap_locations == AP_LOCATION_TABLE_SIZE) {
+                /* replace least recently used */
+                for (k = 0, pos = 1; pos < sctx->num_ap_locations; pos++)
+                    if (sctx->ap_location[pos].used < sctx->ap_location[k].used)
+                        k = pos;
+                memmove(&sctx->ap_location[k], &sctx->ap_location[k + 1],
+                    (sctx->num_ap_locations - k - 1) * sizeof(Sky_ap_location_t));
+                sctx->num_ap_locations--;
+                ap_location_find(sctx, b->ap.mac, &pos);
+            }
+            memmove(&sctx->ap_location[pos + 1], &sctx->ap_location[pos],
+                (sctx->num_ap_locations - pos) * sizeof(Sky_ap_location_t));
+            sctx->num_ap_locations++;
+            a = &sctx->ap_location[pos];
+            memcpy(a->mac, b->ap.mac, MAC_SIZE);
+            a->count = 0;
+        }
+        a = &sctx->ap_location[pos];
+        if (a->count < AP_LOCATION_MAX_COUNT)
+            a->count++;
+        if (a->count == 1) {
+            a->lat = (int32_t)(loc->lat * 1e7);
+            a->lon = (int32_t)(loc->lon * 1e7);
+            a->hpe = loc->hpe;
+        } else {
+            a->lat = ap_location_mean(a->lat, loc->lat, a->count, false);
+            a->lon = ap_location_mean(a->lon, loc->lon, a->count, true);
+            a->hpe = (uint16_t)(a->hpe + ((int)loc->hpe - a->hpe) / a->count);
+        }
+        a->used = ++sctx->ap_location_clock;
+        learned++;
+    }
+    LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "learned %d APs, %d in table", learned,
+        sctx->num_ap_locations);
+}
+
+/*! \brief estimate location from the APs of the request found in the learned AP table
+ *
+ *   Each AP found is weighted by its signal strength, and by the inverse
+ *   square of its hpe.
+ *
+ *  @param rctx Skyhook request context
+ *  @param loc where to save the estimated location
+ *
+ *  @return number of APs found
+ */
+int locate_ap_table(Sky_rctx_t *rctx, Sky_location_t *loc)
+{
+    Sky_sctx_t *sctx = rctx->session;
+    float weight[MAX_AP_BEACONS], lat[MAX_AP_BEACONS], lon[MAX_AP_BEACONS], hpe[MAX_AP_BEACONS];
+    int n = 0, pos;
+
+    for (int j = 0; j < NUM_APS(rctx) && n < MAX_AP_BEACONS; j++) {
+        Sky_ap_location_t *a;
+
+        if (!ap_location_find(sctx, RCTX_BEACON(rctx, j).ap.mac, &pos))
+            continue;
+        a = &sctx->ap_location[pos];
+        a->used = ++sctx->ap_location_clock;
+        hpe[n] = a->hpe;
+        lat[n] = (float)(a->lat / 1e7);
+        lon[n] = (float)(a->lon / 1e7);
+        weight[n] = (float)(EFFECTIVE_RSSI(RCTX_BEACON(rctx, j).h.rssi) + 128) /
+                    (hpe[n] < 1.0f ? 1.0f : hpe[n] * hpe[n]);
+        n++;
+    }
+    LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "%d of %d APs in learned AP table", n, NUM_APS(rctx));
+    if (n < AP_LOCATION_TABLE_MIN_APS || n == 0)
+        return n;
+
+    combine_locations(n, weight, lat, lon, hpe, loc);
+    loc->time = rctx->header.time;
+    loc->location_source = SKY_LOCATION_SOURCE_WIFI;
+    loc->location_status = SKY_LOCATION_STATUS_SUCCESS;
+    loc->dl_app_data = NULL;
+    loc->dl_app_data_len = 0;
+    return n;
+}
+#endif // AP_LOCATION_TABLE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
+
+#if SKY_CACHE_STATS && CACHE_SIZE
+/*! \brief count a search of the cache and, for a miss, its reason
+ *
+ *   A miss is put down to the best cacheline scoring too low if there was one,
+ *   otherwise to the cachelines passed over for a changed serving cell or worse
+ *   GNSS fix, else to the cache holding nothing which could be compared.
+ *
+ *  @param rctx Skyhook request context
+ *  @param compared false if the cache could not be searched
+ */
+static void count_cache_lookup(Sky_rctx_t *rctx, bool compared)
+{
+    Sky_cache_stats_t *stats = &rctx->session->cache_stats;
+
+    stats->lookups++;
+    if (IS_CACHE_HIT(rctx)) {
+        stats->hits++;
+        return;
+    }
+    stats->misses++;
+    if (!compared || rctx->session->num_expiry == 0)
+        stats->miss_empty++;
+    else if (rctx->get_from < 0 && (rctx->cache_rejects & CACHE_REJECT_CELL))
+        stats->miss_cell_changed++;
+    else if (rctx->get_from < 0 && (rctx->cache_rejects & CACHE_REJECT_GNSS))
+        stats->miss_gnss_worse++;
+    else
+        stats->miss_score++;
+}
+#endif // SKY_CACHE_STATS && CACHE_SIZE
+
+#if SKY_ADAPTIVE_THRESHOLD && CACHE_SIZE
+/*! \brief adjust the cache match threshold by whether a cache hit was confirmed by the server
+ *
+ *   Only a cache hit whose scan was sent to the server can be checked, that is one ignored
+ *   by the application or forced to a miss. Otherwise the request carried the cached beacons,
+ *   so the server location says nothing about the match.
+ *   A cache hit is wrong if the server location is further than hpe from the cached
+ *   location. Once more than the target percentage of a window of checked hits are wrong,
+ *   the threshold is raised a step. A full window with no more wrong lowers it a step.
+ *   The threshold stays within ADAPTIVE_THRESHOLD_RANGE of that set by the server.
+ *
+ *  @param rctx Skyhook request context
+ *  @param loc location reported by the server
+ */
+void adapt_match_threshold(Sky_rctx_t *rctx, Sky_location_t *loc)
+{
+    Sky_sctx_t *sctx = rctx->session;
+    Sky_cacheline_t *cl;
+    int offset = sctx->threshold_offset;
+
+    if (rctx->check_from < 0 || loc->location_status != SKY_LOCATION_STATUS_SUCCESS)
+        return;
+    cl = &sctx->cacheline[rctx->check_from];
+    if (cl->time == CACHE_EMPTY)
+        return;
+
+    sctx->threshold_checks++;
+    if (distance_equirect(cl->loc.lat, cl->loc.lon, loc->lat, loc->lon) > (float)cl->loc.hpe)
+        sctx->threshold_errors++;
+    if (sctx->threshold_errors * 100 > ADAPTIVE_THRESHOLD_TARGET_ERROR * ADAPTIVE_THRESHOLD_WINDOW)
+        offset += ADAPTIVE_THRESHOLD_STEP;
+    else if (sctx->threshold_checks >= ADAPTIVE_THRESHOLD_WINDOW)
+        offset -= ADAPTIVE_THRESHOLD_STEP;
+    else
+        return;
+
+    /* begin a new window */
+    sctx->threshold_checks = sctx->threshold_errors = 0;
+    if (offset > ADAPTIVE_THRESHOLD_RANGE)
+        offset = ADAPTIVE_THRESHOLD_RANGE;
+    else if (offset < -ADAPTIVE_THRESHOLD_RANGE)
+        offset = -ADAPTIVE_THRESHOLD_RANGE;
+    sctx->threshold_offset = (int8_t)offset;
+    LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "cache match threshold %d (%d set by server)",
+        match_all_threshold(sctx), CONFIG(sctx, cache_match_all_threshold));
+}
+#endif // SKY_ADAPTIVE_THRESHOLD && CACHE_SIZE
+
 /*! \brief get location from cache
  *
  *  The request context is updated with the index of cacheline with best match
@@ -505,16 +2226,43 @@ int search_cache(Sky_rctx_t *rctx)
     rctx->hit = false;
     return (rctx->get_from = -1);
 #else
+#if !SKY_EXCLUDE_GNSS_SUPPORT
+    if (has_gnss(rctx)) {
+        gnss_unit_vector(rctx->gnss.lat, rctx->gnss.lon, rctx->gnss_vec);
+        rctx->gnss_chord2 = gnss_chord2(rctx->gnss.hpe);
+    }
+#endif // !SKY_EXCLUDE_GNSS_SUPPORT
+#if SKY_CACHE_STATS
+    rctx->cache_rejects = 0;
+#endif // SKY_CACHE_STATS
+#if SKY_ADAPTIVE_THRESHOLD
+    rctx->check_from = -1;
+#endif // SKY_ADAPTIVE_THRESHOLD
     /* Avoid using the cache if we have good reason */
     /* to believe that system time is bad or no cache */
     if (rctx->session->num_cachelines < 1 ||
-        difftime(rctx->header.time, TIMESTAMP_2019_03_01) < 0 ||
-        sky_plugin_match_cache(rctx, NULL) != SKY_SUCCESS) {
-        /* no match to cacheline */
+        difftime(rctx->header.time, TIMESTAMP_2019_03_01) < 0) {
         rctx->get_from = -1;
-        return (rctx->hit = false);
+        rctx->hit = false;
+#if SKY_CACHE_STATS
+        count_cache_lookup(rctx, false);
+#endif // SKY_CACHE_STATS
+    } else {
+        if (sky_plugin_match_cache(rctx, NULL) != SKY_SUCCESS) {
+            /* no match to cacheline */
+            rctx->get_from = -1;
+            rctx->hit = false;
+        }
+#if SKY_CACHE_STATS
+        count_cache_lookup(rctx, true);
+#endif // SKY_CACHE_STATS
     }
 
+    /* plugins choose where to save a new server response, unless the session has an
+     * eviction policy, in which case a cache hit is refreshed or a victim replaced */
+    if (rctx->session->num_cachelines > 0 &&
+        rctx->session->cache_policy != SKY_CACHE_POLICY_SCORE)
+        rctx->save_to = (int16_t)(IS_CACHE_HIT(rctx) ? rctx->get_from : find_victim(rctx));
     return (rctx->hit);
 #endif // CACHE_SIZE == 0
 }
@@ -39,12 +39,19 @@
 #define NUM_BEACONS(p) ((p)->num_beacons)
 #define IMPLIES(a, b) (!(a) || (b))
 #define NUM_VAPS(b) ((b)->ap.vg_len)
+/* beacon at index i, in priority order, of a request context */
+#define RCTX_BEACON(p, i) ((p)->beacon[(p)->order[(i)]])
+/* number of entries in the hash used to find duplicate beacons of a request context */
+#define BEACON_HASH_SIZE (2 * (TOTAL_BEACONS + 1))
 
 /* VAP data is prefixed by length and AP index */
 #define VAP_LENGTH (0)
 #define VAP_PARENT (1)
 #define VAP_FIRST_DATA (2)
 
+/* bytes in the bitmap of hashed AP MACs kept with each cacheline */
+#define AP_SIGNATURE_SIZE 32
+
 #define NIBBLE_MASK(n) (0xF0 >> (4 * ((n)&1)))
 #define LOCAL_ADMIN_MASK(byte) (0x02 & (byte))
 
@@ -202,19 +209,148 @@ typedef struct gnss {
 } Gnss_t;
 #endif // !SKY_EXCLUDE_GNSS_SUPPORT
 
+#if !SKY_EXCLUDE_WIFI_SUPPORT
+/*! \brief compact copy of an AP held in the cache pool
+ */
+typedef struct sky_cache_ap {
+    uint32_t age;
+    uint32_t freq;
+    uint8_t mac[MAC_SIZE];
+    int16_t rssi;
+    uint8_t flags; /* CL_AP_FLAG_* */
+    uint8_t vg_len;
+    uint16_t vg_used; /* Used property of each Virtual AP, one bit each */
+    Vap_t vg[MAX_VAP_PER_AP + 2]; /* Virtual APs */
+} Sky_cache_ap_t;
+#else
+typedef struct sky_cache_ap Sky_cache_ap_t; /* incomplete, as no APs are cached */
+#endif // !SKY_EXCLUDE_WIFI_SUPPORT
+
+#if !SKY_EXCLUDE_CELL_SUPPORT
+/*! \brief compact copy of a cell held in the cache pool
+ */
+typedef struct sky_cache_cell {
+    uint32_t age;
+    int32_t id3;
+    uint32_t id4[2]; /* low and high words, so records need only 4 byte alignment */
+    int32_t freq;
+    int32_t ta;
+    uint16_t id1;
+    uint16_t id2;
+    int16_t id5;
+    int16_t rssi;
+    uint8_t type;
+    uint8_t connected;
+} Sky_cache_cell_t;
+#endif // !SKY_EXCLUDE_CELL_SUPPORT
+
+/* Bytes of cache pool needed by the largest cacheline (cell records are the larger) */
+#if !SKY_EXCLUDE_CELL_SUPPORT
+#define CACHELINE_MAX_BYTES (TOTAL_BEACONS * sizeof(Sky_cache_cell_t))
+#else
+#define CACHELINE_MAX_BYTES (MAX_AP_BEACONS * sizeof(Sky_cache_ap_t))
+#endif // !SKY_EXCLUDE_CELL_SUPPORT
+
+/* Bytes of cache pool reserved for each cacheline, rounded to whole words */
+#if CACHELINE_POOL_SIZE
+#define CACHE_POOL_PER_LINE ((CACHELINE_POOL_SIZE + 3) / 4 * 4)
+#else
+#define CACHE_POOL_PER_LINE ((CACHELINE_MAX_BYTES + 3) / 4 * 4)
+#endif // CACHELINE_POOL_SIZE
+
+/* Slots of cache index reserved for each cacheline, twice its APs keeps probe sequences short */
+#define CACHE_INDEX_PER_LINE (2 * MAX_AP_BEACONS)
+
+/* Buckets partitioning cachelines by serving cell, bucket 0 holds lines with no serving cell */
+#define SERVING_CELL_BUCKETS 16
+
+/* Grid of GNSS fixes, in cells of GNSS_GRID_DEGREES, hashed into GNSS_GRID_BUCKETS buckets */
+#define GNSS_GRID_DEGREES 0.01
+#define GNSS_GRID_BUCKETS 16
+/* A request GNSS fix whose HPE spans more grid cells than this is not looked up in the grid */
+#define GNSS_GRID_MAX_CELLS 16
+#define METERS_PER_DEGREE (1000 * 6371 * 3.14159265358979 / 180)
+
 /*! \brief each cacheline holds a copy of a scan and the server response
+ *
+ *   The beacons of a cacheline are held as compact records in the cache pool
+ *   of the session context, all of its APs followed by all of its cells.
  */
 typedef struct sky_cacheline {
     uint16_t num_beacons; /* number of beacons */
     uint16_t num_ap; /* number of AP beacons in list (0 == none) */
     time_t time;
-    Beacon_t beacon[TOTAL_BEACONS]; /* beacons */
+    time_t used; /* time cacheline was saved or last gave a cache hit */
+    uint16_t hits; /* number of cache hits since cacheline was saved */
+    uint32_t offset; /* byte offset of the beacon records in the cache pool */
+#if !SKY_EXCLUDE_WIFI_SUPPORT
+    uint8_t ap_order[MAX_AP_BEACONS]; /* index of each AP, in ascending MAC order */
+    uint8_t ap_signature[AP_SIGNATURE_SIZE]; /* bitmap of hashed AP MACs */
+#endif // !SKY_EXCLUDE_WIFI_SUPPORT
+#if CACHE_SOA_LAYOUT
+#if !SKY_EXCLUDE_WIFI_SUPPORT
+    uint8_t ap_mac[MAX_AP_BEACONS][MAC_SIZE]; /* MAC of each AP */
+    int8_t ap_rssi[MAX_AP_BEACONS]; /* rssi of each AP */
+    uint8_t ap_flags[MAX_AP_BEACONS]; /* CL_AP_FLAG_* of each AP */
+#endif // !SKY_EXCLUDE_WIFI_SUPPORT
+#if !SKY_EXCLUDE_CELL_SUPPORT
+    uint32_t cell_key[TOTAL_BEACONS]; /* cell_key() of each cell, indexed by beacon */
+#endif // !SKY_EXCLUDE_CELL_SUPPORT
+#endif // CACHE_SOA_LAYOUT
+#if !SKY_EXCLUDE_GNSS_SUPPORT
+    float gnss_vec[3]; /* unit vector of GNSS fix, see gnss_unit_vector() */
+    int32_t grid_lat; /* grid cell of GNSS fix */
+    int32_t grid_lon;
+    uint16_t grid_next; /* next cacheline + 1 in same GNSS grid bucket, 0 if last */
+#endif // !SKY_EXCLUDE_GNSS_SUPPORT
+#if !SKY_EXCLUDE_CELL_SUPPORT
+    uint32_t serving_key; /* key of serving cell, 0 if none or NMR */
+    uint16_t serving_next; /* next cacheline + 1 in same serving cell bucket, 0 if last */
+#endif // !SKY_EXCLUDE_CELL_SUPPORT
 #if !SKY_EXCLUDE_GNSS_SUPPORT
     Gnss_t gnss; /* GNSS info */
 #endif // !SKY_EXCLUDE_GNSS_SUPPORT
     Sky_location_t loc; /* Skyhook location */
 } Sky_cacheline_t;
 
+/* Access the beacon records of a cacheline in the cache pool */
+#define CACHE_RECORDS(sctx, cl) ((uint8_t *)CACHE_POOL(sctx) + (cl)->offset)
+#define CACHE_AP(sctx, cl, j) ((Sky_cache_ap_t *)CACHE_RECORDS(sctx, cl) + (j))
+#if !SKY_EXCLUDE_WIFI_SUPPORT
+#define CACHE_CELL(sctx, cl, j)                                                                    \
+    ((Sky_cache_cell_t *)(CACHE_RECORDS(sctx, cl) + NUM_APS(cl) * sizeof(Sky_cache_ap_t)) +        \
+        ((j)-NUM_APS(cl)))
+#else
+#define CACHE_CELL(sctx, cl, j) ((Sky_cache_cell_t *)CACHE_RECORDS(sctx, cl) + (j))
+#endif // !SKY_EXCLUDE_WIFI_SUPPORT
+
+/* Access the fields of cached beacons examined when searching the cache */
+#define CL_AP_FLAG_USED 0x01
+#define CL_AP_FLAG_CONNECTED 0x02
+#if CACHE_SOA_LAYOUT
+#define CL_AP_MAC(sctx, cl, j) ((cl)->ap_mac[j])
+#define CL_AP_RSSI(sctx, cl, j) ((cl)->ap_rssi[j])
+#define CL_AP_USED(sctx, cl, j) (((cl)->ap_flags[j] & CL_AP_FLAG_USED) != 0)
+#define CL_AP_CONNECTED(sctx, cl, j) (((cl)->ap_flags[j] & CL_AP_FLAG_CONNECTED) != 0)
+#define CL_CELL_KEY(sctx, cl, j) ((cl)->cell_key[j])
+#else
+#define CL_AP_MAC(sctx, cl, j) (CACHE_AP(sctx, cl, j)->mac)
+#define CL_AP_RSSI(sctx, cl, j) (CACHE_AP(sctx, cl, j)->rssi)
+#define CL_AP_USED(sctx, cl, j) ((CACHE_AP(sctx, cl, j)->flags & CL_AP_FLAG_USED) != 0)
+#define CL_AP_CONNECTED(sctx, cl, j) ((CACHE_AP(sctx, cl, j)->flags & CL_AP_FLAG_CONNECTED) != 0)
+#define CL_CELL_KEY(sctx, cl, j) cached_cell_key(CACHE_CELL(sctx, cl, j))
+#endif // CACHE_SOA_LAYOUT
+
+#if CACHE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
+/*! \brief index entry for one AP MAC address held in the cache
+ */
+typedef struct sky_cache_index {
+    uint8_t mac[MAC_SIZE];
+    uint16_t lines; /* number of cachelines holding this AP (0 == empty slot) */
+    uint16_t used; /* number of those cachelines in which this AP is Used */
+} Sky_cache_index_t;
+#endif // CACHE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
+
 /*! \brief TBR states, 1) Disabled (not in use), 2) Unregistered, 3) Registered
  */
 typedef enum sky_tbr_state {
@@ -243,6 +379,21 @@ typedef struct sky_config_pad {
     /* add more configuration params here */
 } Sky_config_t;
 
+#if AP_LOCATION_TABLE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
+/* the estimate of an AP location follows at most this many server locations */
+#define AP_LOCATION_MAX_COUNT 16
+
+/*! \brief location of an AP learned from server locations which used it
+ */
+typedef struct sky_ap_location {
+    uint8_t mac[MAC_SIZE];
+    uint16_t hpe; /* mean hpe of server locations in meters */
+    int32_t lat, lon; /* mean of server locations in degrees * 1e7 */
+    uint16_t count; /* number of server locations in mean, up to AP_LOCATION_MAX_COUNT */
+    uint32_t used; /* ap_location_clock when last learned or used to locate */
+} Sky_ap_location_t;
+#endif // AP_LOCATION_TABLE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
+
 /*! \brief Session Context - holds cache lines as well as parameters defined when Libel is opened
  */
 typedef struct sky_sctx {
@@ -265,42 +416,141 @@ typedef struct sky_sctx {
     Sky_errno_t backoff; /* last auth error */
     uint32_t partner_id; /* partner ID */
     uint8_t aes_key[AES_KEYLEN]; /* aes key */
-#if CACHE_SIZE
-    int num_cachelines; /* number of cachelines */
-    Sky_cacheline_t cacheline[CACHE_SIZE]; /* beacons */
-#endif // CACHE_SIZE
     Sky_config_t config; /* dynamic config parameters */
     uint8_t cache_hits; /* count the client cache hits */
+    Sky_cache_policy_t cache_policy; /* choice of cacheline to replace */
+    uint8_t cache_consolidate; /* percentage of APs in common to merge into a cacheline, 0 never */
+#if SKY_CACHE_STATS
+    Sky_cache_stats_t cache_stats; /* counts of cache activity, see sky_get_cache_stats() */
+#endif // SKY_CACHE_STATS
+#if SKY_ADAPTIVE_THRESHOLD && CACHE_SIZE
+    int8_t threshold_offset; /* adaptive adjustment of cache_match_all_threshold */
+    uint8_t threshold_checks; /* cache hits checked against the server in this window */
+    uint8_t threshold_errors; /* checked cache hits further than hpe from the server location */
+#endif // SKY_ADAPTIVE_THRESHOLD && CACHE_SIZE
+#if AP_LOCATION_TABLE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
+    uint16_t num_ap_locations; /* number of APs in learned AP table */
+    uint32_t ap_location_clock; /* incremented as learned AP table is updated or used */
+    Sky_ap_location_t ap_location[AP_LOCATION_TABLE_SIZE]; /* learned AP table, by MAC */
+#endif // AP_LOCATION_TABLE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
+#if CACHE_SIZE
+    int num_cachelines; /* number of cachelines, chosen by sky_open() */
+    uint32_t cache_pool_size; /* bytes of cache pool */
+    uint32_t cache_pool_used; /* bytes of cache pool in use */
+    uint32_t cache_gen; /* incremented whenever a cacheline is saved or cleared */
+    uint16_t num_expiry; /* number of cachelines in expiry list, i.e. not empty */
+    uint16_t expiry[CACHE_SIZE]; /* index of each non-empty cacheline, oldest first */
+#if !SKY_EXCLUDE_CELL_SUPPORT
+    uint16_t serving_bucket[SERVING_CELL_BUCKETS]; /* first cacheline + 1 in bucket, 0 if none */
+#endif // !SKY_EXCLUDE_CELL_SUPPORT
+#if !SKY_EXCLUDE_GNSS_SUPPORT
+    uint16_t gnss_grid[GNSS_GRID_BUCKETS]; /* first cacheline + 1 with GNSS in bucket, 0 if none */
+#endif // !SKY_EXCLUDE_GNSS_SUPPORT
+    /* num_cachelines cachelines, followed by the cache pool holding the beacon
+     * records of all cachelines and then the index of cached APs hashed by MAC */
+    Sky_cacheline_t cacheline[];
+#endif // CACHE_SIZE
 } Sky_sctx_t;
 
+#if CACHE_SIZE
+/* Access the cache pool and cache index which follow the cachelines */
+#define CACHE_POOL(sctx) ((uint32_t *)&(sctx)->cacheline[(sctx)->num_cachelines])
+#define CACHE_INDEX(sctx) ((Sky_cache_index_t *)((uint8_t *)CACHE_POOL(sctx) + (sctx)->cache_pool_size))
+#define CACHE_INDEX_SLOTS(sctx) ((uint32_t)(sctx)->num_cachelines * CACHE_INDEX_PER_LINE)
+#endif // CACHE_SIZE
+
 /*! \brief Request Context - temporary space used to build a request
  */
 typedef struct sky_rctx {
     Sky_header_t header; /* magic, size, timestamp, crc32 */
     uint16_t num_beacons; /* number of beacons in list (0 == none) */
     uint16_t num_ap; /* number of AP beacons in list (0 == none) */
-    Beacon_t beacon[TOTAL_BEACONS + 1]; /* beacon data */
+    Beacon_t beacon[TOTAL_BEACONS + 1]; /* beacon data, in slots which never move */
+    uint8_t order[TOTAL_BEACONS + 1]; /* slot of each beacon in priority order, unused slots last */
+    uint8_t beacon_hash[BEACON_HASH_SIZE]; /* slot + 1 of each beacon by key, 0 if empty */
 #if !SKY_EXCLUDE_GNSS_SUPPORT
     Gnss_t gnss; /* GNSS info */
+    float gnss_vec[3]; /* unit vector of GNSS fix, set when searching cache */
+    float gnss_chord2; /* squared unit vector distance within HPE of GNSS fix */
 #endif // !SKY_EXCLUDE_GNSS_SUPPORT
     bool hit; /* status of search of cache for match to new scan (true/false) */
     int16_t get_from; /* cacheline with good match to scan (-1 for miss) */
     int16_t save_to; /* cacheline with best match for saving scan*/
+#if SKY_CACHE_STATS
+    uint8_t cache_rejects; /* CACHE_REJECT_* reasons cachelines were passed over in search */
+#endif // SKY_CACHE_STATS
+#if SKY_ADAPTIVE_THRESHOLD && CACHE_SIZE
+    int16_t check_from; /* cacheline of a cache hit sent to the server with the scan (-1 none) */
+#endif // SKY_ADAPTIVE_THRESHOLD && CACHE_SIZE
     Sky_sctx_t *session;
     Sky_tbr_state_t auth_state; /* tbr disabled, need to register or got token */
     uint32_t sky_dl_app_data_len; /* downlink app data length */
     uint8_t sky_dl_app_data[SKY_MAX_DL_APP_DATA]; /* downlink app data */
+#if CACHE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
+    uint32_t cache_gen; /* session cache_gen for which cache_count is valid */
+    uint32_t cache_count_key; /* combined hash of the MACs of the APs counted */
+    uint8_t cache_count[CACHE_SIZE]; /* number of request APs held in each cacheline */
+#endif // CACHE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
 } Sky_rctx_t;
 
+/* Reasons a cacheline was passed over when searching the cache */
+#define CACHE_REJECT_CELL 0x01 /* serving cell changed */
+#define CACHE_REJECT_GNSS 0x02 /* cached GNSS fix worse or too distant */
+
+#if SKY_CACHE_STATS
+#define CACHE_STAT(sctx, counter) ((sctx)->cache_stats.counter++)
+#define CACHE_REJECT(rctx, reason) ((rctx)->cache_rejects |= (reason))
+#else
+#define CACHE_STAT(sctx, counter) ((void)0)
+#define CACHE_REJECT(rctx, reason) ((void)0)
+#endif // SKY_CACHE_STATS
+
 int compare_connected_used(Beacon_t *a, Beacon_t *b);
 Sky_status_t add_beacon(Sky_rctx_t *rctx, Sky_errno_t *sky_errno, Beacon_t *b, time_t timestamp);
+Sky_status_t add_valid_beacon(
+    Sky_rctx_t *rctx, Sky_errno_t *sky_errno, Beacon_t *b, time_t timestamp);
 int ap_beacon_in_vg(Sky_rctx_t *rctx, Beacon_t *va, Beacon_t *vb, Sky_beacon_property_t *prop);
 bool beacon_in_cache(Sky_rctx_t *rctx, Beacon_t *b);
 bool beacon_in_cacheline(Sky_rctx_t *rctx, Beacon_t *b, Sky_cacheline_t *cl);
+void cache_index_add(Sky_rctx_t *rctx, Sky_cacheline_t *cl);
+void pack_cacheline(Sky_sctx_t *sctx, Sky_cacheline_t *cl);
+#if !SKY_EXCLUDE_CELL_SUPPORT
+uint32_t cell_key(Beacon_t *b);
+uint32_t cached_cell_key(Sky_cache_cell_t *c);
+#endif // !SKY_EXCLUDE_CELL_SUPPORT
+uint32_t cacheline_bytes(Sky_cacheline_t *cl);
+Sky_status_t save_cacheline_beacons(
+    Sky_rctx_t *rctx, Sky_cacheline_t *cl, const Sky_cache_ap_t *extra, int num_extra);
+void get_cached_beacon(Sky_sctx_t *sctx, Sky_cacheline_t *cl, int j, Beacon_t *b);
+void clear_cacheline(Sky_rctx_t *rctx, Sky_cacheline_t *cl);
+void cache_expiry_add(Sky_sctx_t *sctx, Sky_cacheline_t *cl);
+int expire_cachelines(Sky_rctx_t *rctx, time_t now);
+int find_empty_cacheline(Sky_sctx_t *sctx, bool last);
+int cache_candidates(Sky_rctx_t *rctx, uint16_t *lines);
+void update_cache_count(Sky_rctx_t *rctx, Beacon_t *b, int delta);
+bool cache_count_valid(Sky_rctx_t *rctx);
+int find_consolidation(
+    Sky_rctx_t *rctx, Sky_location_t *loc, Sky_cache_ap_t *extra, int *num_extra);
 int serving_cell_changed(Sky_rctx_t *rctx, Sky_cacheline_t *cl);
 int cached_gnss_worse(Sky_rctx_t *rctx, Sky_cacheline_t *cl);
 int find_oldest(Sky_rctx_t *rctx);
+int find_victim(Sky_rctx_t *rctx);
 int search_cache(Sky_rctx_t *rctx);
+#if SKY_ADAPTIVE_THRESHOLD && CACHE_SIZE
+void adapt_match_threshold(Sky_rctx_t *rctx, Sky_location_t *loc);
+#endif // SKY_ADAPTIVE_THRESHOLD && CACHE_SIZE
+#if SKY_OFFLINE_LOCATE && CACHE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
+int locate_offline(Sky_rctx_t *rctx, Sky_location_t *loc);
+#endif // SKY_OFFLINE_LOCATE && CACHE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
+#if AP_LOCATION_TABLE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
+void learn_ap_locations(Sky_rctx_t *rctx, Sky_location_t *loc);
+int locate_ap_table(Sky_rctx_t *rctx, Sky_location_t *loc);
+#endif // AP_LOCATION_TABLE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
+#if SKY_AP_DATABASE && !SKY_EXCLUDE_WIFI_SUPPORT
+int locate_ap_database(Sky_rctx_t *rctx, const uint8_t *db, uint32_t db_len, Sky_location_t *loc);
+#endif // SKY_AP_DATABASE && !SKY_EXCLUDE_WIFI_SUPPORT
 Sky_status_t remove_beacon(Sky_rctx_t *rctx, int index);
+int beacon_index(Sky_rctx_t *rctx, Beacon_t *b);
+void beacon_hash_rebuild(Sky_rctx_t *rctx);
 
 #endif // SKY_BEACONS_H
@@ -41,6 +41,9 @@
 #ifndef TOTAL_BEACONS
 #define TOTAL_BEACONS 28
 #endif
+#if TOTAL_BEACONS > 254
+#error "TOTAL_BEACONS must be less than 255"
+#endif
 
 /*! \brief The maximum number of AP beacons passed to the server in a request
  */
@@ -90,12 +93,134 @@
 #define CACHE_RSSI_THRESHOLD 90
 #endif
 
-/*! \brief The number of entries in the scan/response cache
+/*! \brief The maximum number of entries in the scan/response cache. The number
+ *   actually used is chosen when the session is opened, see sky_open()
  */
 #ifndef CACHE_SIZE
 #define CACHE_SIZE 1
 #endif
 
+/*! \brief The eviction policy of a new session, one of Sky_cache_policy_t. May be changed
+ *   with sky_set_option(CONF_CACHE_EVICTION_POLICY)
+ */
+#ifndef CACHE_EVICTION_POLICY
+#define CACHE_EVICTION_POLICY SKY_CACHE_POLICY_SCORE
+#endif
+
+/*! \brief The percentage of APs a new scan must share with a cacheline, whose location
+ *   is within hpe of the new location, to be merged into that cacheline rather than
+ *   saved to another. May be changed with sky_set_option(CONF_CACHE_CONSOLIDATE_THRESHOLD).
+ *   0 disables merging
+ */
+#ifndef CACHE_CONSOLIDATE_THRESHOLD
+#define CACHE_CONSOLIDATE_THRESHOLD 0
+#endif
+
+/*! \brief Set to true to adjust the cache match threshold on the device. Cache hits whose
+ *   scan is still sent to the server are checked against the server location, and the
+ *   threshold is lowered while few cached locations miss it by more than their hpe, and
+ *   raised when too many do
+ */
+#ifndef SKY_ADAPTIVE_THRESHOLD
+#define SKY_ADAPTIVE_THRESHOLD false
+#endif
+
+/*! \brief The most, in percent, the adaptive threshold may move from the cache match
+ *   threshold set by the server
+ */
+#ifndef ADAPTIVE_THRESHOLD_RANGE
+#define ADAPTIVE_THRESHOLD_RANGE 20
+#endif
+
+/*! \brief The size, in percent, of each adjustment of the adaptive threshold
+ */
+#ifndef ADAPTIVE_THRESHOLD_STEP
+#define ADAPTIVE_THRESHOLD_STEP 5
+#endif
+
+/*! \brief The number of checked cache hits after which the adaptive threshold is lowered
+ *   if no more than ADAPTIVE_THRESHOLD_TARGET_ERROR percent were wrong
+ */
+#ifndef ADAPTIVE_THRESHOLD_WINDOW
+#define ADAPTIVE_THRESHOLD_WINDOW 16
+#endif
+
+/*! \brief The percentage of checked cache hits allowed to be further than their hpe from
+ *   the server location before the adaptive threshold is raised
+ */
+#ifndef ADAPTIVE_THRESHOLD_TARGET_ERROR
+#define ADAPTIVE_THRESHOLD_TARGET_ERROR 10
+#endif
+
+/*! \brief The number of bytes of cache pool reserved per cacheline for the beacons
+ *   of all cachelines. Cachelines take only the space their beacons need, so less
+ *   than a full cacheline allows more cachelines in the same space, the oldest
+ *   being evicted when the pool runs out. 0 reserves room for full cachelines
+ */
+#ifndef CACHELINE_POOL_SIZE
+#define CACHELINE_POOL_SIZE 0
+#endif
+
+/*! \brief Set to true to lay out the fields examined when searching the cache
+ *   (AP MACs, rssi and flags, cell keys) as contiguous arrays in each cacheline
+ */
+#ifndef CACHE_SOA_LAYOUT
+#define CACHE_SOA_LAYOUT false
+#endif
+
+/*! \brief Set to true to count cache lookups, hits, misses by reason, evictions and
+ *   expirations in the session, see sky_get_cache_stats()
+ */
+#ifndef SKY_CACHE_STATS
+#define SKY_CACHE_STATS false
+#endif
+
+/*! \brief Set to true to include sky_locate_offline(), which estimates a location from
+ *   the cached scans most similar to a request which misses the cache
+ */
+#ifndef SKY_OFFLINE_LOCATE
+#define SKY_OFFLINE_LOCATE false
+#endif
+
+/*! \brief The maximum number of most similar cached scans combined by sky_locate_offline()
+ */
+#ifndef OFFLINE_LOCATE_NEIGHBORS
+#define OFFLINE_LOCATE_NEIGHBORS 3
+#endif
+
+/*! \brief The percentage similarity a cached scan needs to be used by sky_locate_offline()
+ */
+#ifndef OFFLINE_LOCATE_THRESHOLD
+#define OFFLINE_LOCATE_THRESHOLD 30
+#endif
+
+/*! \brief Set to true to include sky_locate_ap_database(), which estimates a location
+ *   from the APs of a request found in a database of AP locations
+ */
+#ifndef SKY_AP_DATABASE
+#define SKY_AP_DATABASE false
+#endif
+
+/*! \brief The minimum number of request APs found in the AP database to estimate a location
+ */
+#ifndef AP_DATABASE_MIN_APS
+#define AP_DATABASE_MIN_APS 2
+#endif
+
+/*! \brief The number of APs in the table of locations learned from the APs used by the
+ *   server, see sky_locate_ap_table(). The least recently used is replaced when full.
+ *   0 disables the table
+ */
+#ifndef AP_LOCATION_TABLE_SIZE
+#define AP_LOCATION_TABLE_SIZE 0
+#endif
+
+/*! \brief The minimum number of request APs found in the learned AP table to estimate a location
+ */
+#ifndef AP_LOCATION_TABLE_MIN_APS
+#define AP_LOCATION_TABLE_MIN_APS 2
+#endif
+
 /*! \brief The maximum space the dynamic configuration parameters may take up in bytes
  */
 #ifndef MAX_CLIENTCONFIG_SIZE
@@ -144,7 +269,8 @@
 #endif
 
 #else // UNITTESTS
-/* Unit Tests are always built with AP, Cell and GNSS suport included and cache size of 10
+/* Unit Tests are always built with AP, Cell and GNSS suport included, cache size of 10
+ * cache statistics, adaptive threshold, offline locate, AP database and a learned AP table of 8
  */
 
 #ifdef SKY_EXCLUDE_SANITY_CHECKS
@@ -171,6 +297,31 @@
 #undef CACHE_SIZE
 #endif
 #define CACHE_SIZE 10
+
+#ifdef SKY_CACHE_STATS
+#undef SKY_CACHE_STATS
+#endif
+#define SKY_CACHE_STATS true
+
+#ifdef SKY_ADAPTIVE_THRESHOLD
+#undef SKY_ADAPTIVE_THRESHOLD
+#endif
+#define SKY_ADAPTIVE_THRESHOLD true
+
+#ifdef SKY_OFFLINE_LOCATE
+#undef SKY_OFFLINE_LOCATE
+#endif
+#define SKY_OFFLINE_LOCATE true
+
+#ifdef SKY_AP_DATABASE
+#undef SKY_AP_DATABASE
+#endif
+#define SKY_AP_DATABASE true
+
+#ifdef AP_LOCATION_TABLE_SIZE
+#undef AP_LOCATION_TABLE_SIZE
+#endif
+#define AP_LOCATION_TABLE_SIZE 8
 #endif // UNITTESTS
 
 #endif
@@ -59,6 +59,7 @@ static size_t strnlen_(char *s, size_t maxlen);
  *  @param sku unique name of device family, must be non-empty to enable TBR Auth
  *  @param cc County code where device is being registered, 0 if unknown
  *  @param session_buf pointer to a session buffer
+ *  @param num_cachelines number of cachelines for a new session, 0 to CACHE_SIZE
  *  @param min_level logging function is called for msg with equal or greater level
  *  @param logf pointer to logging function
  *  @param rand_bytes pointer to random function
@@ -68,15 +69,20 @@ static size_t strnlen_(char *s, size_t maxlen);
  *
  *  If session buffer is being restored from a previous session, cache is restored.
  *  If session buffer is an empty buffer, a new session is started with empty cache.
+ *  A new session has num_cachelines cachelines, and the session buffer must hold at least
+ *  sky_sizeof_session_ctx(NULL, num_cachelines) bytes. A restored session keeps the
+ *  number of cachelines it was created with.
  *  sky_open will return an error if the library is already open and (sky_close has not been called).
  *  Device ID length will be truncated to 16 if larger, without causing an error.
  */
 Sky_status_t sky_open(Sky_errno_t *sky_errno, uint8_t *device_id, uint32_t id_len,
     uint32_t partner_id, uint8_t aes_key[AES_KEYLEN], char *sku, uint32_t cc, Sky_sctx_t *sctx,
-    Sky_log_level_t min_level, Sky_loggerfn_t logf, Sky_randfn_t rand_bytes, Sky_timefn_t gettime)
+    uint16_t num_cachelines, Sky_log_level_t min_level, Sky_loggerfn_t logf,
+    Sky_randfn_t rand_bytes, Sky_timefn_t gettime)
 {
     Sky_sctx_t *session;
     int sku_len;
+    uint32_t size, pool_size;
 #if SKY_LOGGING
     char buf[SKY_LOG_LENGTH];
 #endif // SKY_LOGGING
@@ -125,20 +131,24 @@ Sky_status_t sky_open(Sky_errno_t *sky_errno, uint8_t *device_id, uint32_t id_le
 
     /* Initialize the session context if needed */
     if (session->header.magic == 0) {
-        memset(session, 0, sizeof(Sky_sctx_t));
+        if ((size = session_ctx_size(num_cachelines, &pool_size)) == 0) {
+            if (logf != NULL && SKY_LOG_LEVEL_ERROR <= min_level)
+                (*logf)(SKY_LOG_LEVEL_ERROR, "Number of cachelines exceeds CACHE_SIZE!");
+            return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+        }
+        memset(session, 0, size);
         session->header.magic = SKY_MAGIC;
-        session->header.size = sizeof(Sky_sctx_t);
+        session->header.size = size;
         session->header.time = (*gettime)(NULL);
         session->header.crc32 = sky_crc32(&session->header.magic,
             (uint8_t *)&session->header.crc32 - (uint8_t *)&session->header.magic);
+        session->cache_policy = CACHE_EVICTION_POLICY;
+        session->cache_consolidate = CACHE_CONSOLIDATE_THRESHOLD;
 #if CACHE_SIZE
-        session->num_cachelines = CACHE_SIZE;
-        for (int i = 0; i < CACHE_SIZE; i++) {
-            for (int j = 0; j < TOTAL_BEACONS; j++) {
-                session->cacheline[i].beacon[j].h.magic = BEACON_MAGIC;
-                session->cacheline[i].beacon[j].h.type = SKY_BEACON_MAX;
-            }
-        }
+        session->num_cachelines = num_cachelines;
+        session->cache_pool_size = pool_size;
+#else
+        (void)pool_size;
 #endif // CACHE_SIZE
 #if SKY_LOGGING
     } else {
@@ -183,16 +193,17 @@ Sky_status_t sky_open(Sky_errno_t *sky_errno, uint8_t *device_id, uint32_t id_le
 /*! \brief Determines the size of a session buffer
  *
  *  @param session Pointer to session buffer or NULL
+ *  @param num_cachelines Number of cachelines required, if session is NULL
  *
  *  @return Size of session buffer or 0 to indicate that the buffer was invalid
  */
-int32_t sky_sizeof_session_ctx(Sky_sctx_t *sctx)
+int32_t sky_sizeof_session_ctx(Sky_sctx_t *sctx, uint16_t num_cachelines)
 {
     /* if no session pointer provided, return size required,
      * else return the size of the session buffer
      */
     if (sctx == NULL)
-        return sizeof(Sky_sctx_t);
+        return (int32_t)session_ctx_size(num_cachelines, NULL);
 
     /* Cache space required
      *
@@ -204,8 +215,10 @@ int32_t sky_sizeof_session_ctx(Sky_sctx_t *sctx)
                                                                  (uint8_t *)&sctx->header.magic)) {
         return 0;
     }
-    if (sctx->header.size == sizeof(Sky_sctx_t))
-        return (int32_t)sctx->header.size;
+    /* only the header may have been read so far, so match its size to a supported cache size */
+    for (int n = 0; n <= CACHE_SIZE; n++)
+        if (sctx->header.size == session_ctx_size(n, NULL))
+            return (int32_t)sctx->header.size;
     return 0;
 }
 
@@ -301,6 +314,9 @@ Sky_rctx_t *sky_new_request(Sky_rctx_t *rctx, uint32_t rbufsize, Sky_sctx_t *sct
 
     rctx->hit = false;
     rctx->get_from = rctx->save_to = -1;
+#if SKY_ADAPTIVE_THRESHOLD && CACHE_SIZE
+    rctx->check_from = -1;
+#endif // SKY_ADAPTIVE_THRESHOLD && CACHE_SIZE
     rctx->session = sctx;
     rctx->auth_state = !is_tbr_enabled(rctx)               ? STATE_TBR_DISABLED :
                        sctx->token_id == TBR_TOKEN_UNKNOWN ? STATE_TBR_UNREGISTERED :
@@ -309,6 +325,8 @@ Sky_rctx_t *sky_new_request(Sky_rctx_t *rctx, uint32_t rbufsize, Sky_sctx_t *sct
         rctx->beacon[i].h.magic = BEACON_MAGIC;
         rctx->beacon[i].h.type = SKY_BEACON_MAX;
     }
+    for (i = 0; i < TOTAL_BEACONS + 1; i++)
+        rctx->order[i] = (uint8_t)i;
 #if !SKY_EXCLUDE_GNSS_SUPPORT
     rctx->gnss.lat = NAN; /* empty */
 #endif // !SKY_EXCLUDE_GNSS_SUPPORT
@@ -326,27 +344,24 @@ Sky_rctx_t *sky_new_request(Sky_rctx_t *rctx, uint32_t rbufsize, Sky_sctx_t *sct
 
 #if CACHE_SIZE
     LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "%d cachelines configured", sctx->num_cachelines);
-    for (i = 0; i < CACHE_SIZE; i++) {
-        if (sctx->cacheline[i].num_ap > CONFIG(sctx, max_ap_beacons) ||
-            sctx->cacheline[i].num_beacons > CONFIG(sctx, total_beacons)) {
-            sctx->cacheline[i].time = TIME_UNAVAILABLE;
+    /* only non-empty cachelines, those in the expiry list, can exceed the Dynamic Parameters */
+    for (i = sctx->num_expiry - 1; i >= 0; i--) {
+        Sky_cacheline_t *cl = &sctx->cacheline[sctx->expiry[i]];
+
+        if (cl->num_ap > CONFIG(sctx, max_ap_beacons) ||
+            cl->num_beacons > CONFIG(sctx, total_beacons)) {
             LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG,
                 "cache %d of %d cleared due to new Dynamic Parameters. Total beacons %d vs %d, AP %d vs %d",
-                i, CACHE_SIZE, CONFIG(sctx, total_beacons), sctx->cacheline[i].num_beacons,
-                CONFIG(sctx, max_ap_beacons), sctx->cacheline[i].num_ap);
-        }
-        if (sctx->cacheline[i].time != CACHE_EMPTY && now == TIME_UNAVAILABLE) {
-            sctx->cacheline[i].time = CACHE_EMPTY;
-            LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG,
-                "cache %d of %d cleared due to time being unavailable", i, CACHE_SIZE);
-        } else if (sctx->cacheline[i].time != CACHE_EMPTY &&
-                   difftime(now, sctx->cacheline[i].time) >
-                       CONFIG(sctx, cache_age_threshold) * SECONDS_IN_HOUR) {
-            sctx->cacheline[i].time = CACHE_EMPTY;
-            LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "cache %d of %d cleared due to age (%d)", i,
-                CACHE_SIZE, (int)difftime(now, sctx->cacheline[i].time));
+                sctx->expiry[i], sctx->num_cachelines, CONFIG(sctx, total_beacons),
+                cl->num_beacons, CONFIG(sctx, max_ap_beacons), cl->num_ap);
+            clear_cacheline(rctx, cl);
+            CACHE_STAT(sctx, config_clears);
         }
     }
+    expire_cachelines(rctx, now);
+#if !SKY_EXCLUDE_WIFI_SUPPORT
+    rctx->cache_gen = sctx->cache_gen; /* no APs yet, so none held in any cacheline */
+#endif // !SKY_EXCLUDE_WIFI_SUPPORT
 #endif // CACHE_SIZE
     sctx->ul_app_data_len = ul_app_data_len;
     memcpy(sctx->ul_app_data, ul_app_data, ul_app_data_len);
@@ -357,6 +372,27 @@ Sky_rctx_t *sky_new_request(Sky_rctx_t *rctx, uint32_t rbufsize, Sky_sctx_t *sct
 }
 
 #if !SKY_EXCLUDE_WIFI_SUPPORT
+/*! \brief  Fills in an AP beacon
+ *
+ *  @param b beacon to fill in
+ *  @param mac pointer to mac address of the Wi-Fi beacon
+ *  @param rssi Received Signal Strength Intensity, -10 through -127, -1 if unknown
+ *  @param frequency center frequency of channel in MHz, 2400 through 6000, -1 if unknown
+ *  @param is_connected this beacon is currently connected, false if unknown
+ */
+static void init_ap_beacon(
+    Beacon_t *b, const uint8_t mac[MAC_SIZE], int16_t rssi, int32_t frequency, bool is_connected)
+{
+    memset(b, 0, sizeof(*b));
+    b->h.magic = BEACON_MAGIC;
+    b->h.type = SKY_BEACON_AP;
+    b->h.connected = (int8_t)is_connected;
+    b->h.rssi = rssi;
+    memcpy(b->ap.mac, mac, MAC_SIZE);
+    b->ap.freq = frequency;
+    b->ap.property.used = false;
+}
+
 /*! \brief  Adds the wifi ap information to the request context
  *
  *  @param rctx Skyhook request context
@@ -383,17 +419,52 @@ Sky_status_t sky_add_ap_beacon(Sky_rctx_t *rctx, Sky_errno_t *sky_errno, uint8_t
         (int)timestamp == TIME_UNAVAILABLE ? 0 : (int)difftime(rctx->header.time, timestamp));
 
     /* Create AP beacon */
-    memset(&b, 0, sizeof(b));
-    b.h.magic = BEACON_MAGIC;
-    b.h.type = SKY_BEACON_AP;
-    b.h.connected = (int8_t)is_connected;
-    b.h.rssi = rssi;
-    memcpy(b.ap.mac, mac, MAC_SIZE);
-    b.ap.freq = frequency;
-    b.ap.property.used = false;
+    init_ap_beacon(&b, mac, rssi, frequency, is_connected);
 
     return add_beacon(rctx, sky_errno, &b, timestamp);
 }
+
+/*! \brief  Adds the wifi ap information of a whole scan to the request context
+ *
+ *  The request context is checked once for the scan, then each AP is added in
+ *  turn exactly as by sky_add_ap_beacon(), so the result is the same as adding
+ *  the APs one at a time in the same order.
+ *
+ *  @param rctx Skyhook request context
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param aps pointer to array of APs scanned
+ *  @param num_aps number of APs in array
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code. On error, the APs
+ *  before the one in error have been added
+ */
+Sky_status_t sky_add_ap_beacons(
+    Sky_rctx_t *rctx, Sky_errno_t *sky_errno, const Sky_ap_scan_t *aps, uint32_t num_aps)
+{
+    Beacon_t b;
+
+#if !SKY_EXCLUDE_SANITY_CHECKS
+    if (!validate_request_ctx(rctx))
+        return set_error_status(sky_errno, SKY_ERROR_BAD_REQUEST_CTX);
+#else
+    if (!rctx)
+        return set_error_status(sky_errno, SKY_ERROR_BAD_REQUEST_CTX);
+#endif // !SKY_EXCLUDE_SANITY_CHECKS
+
+    if (!rctx->session->open_flag)
+        return set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
+
+    if (aps == NULL && num_aps != 0)
+        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+
+    LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "%d APs", num_aps);
+    for (uint32_t i = 0; i < num_aps; i++) {
+        init_ap_beacon(&b, aps[i].mac, aps[i].rssi, aps[i].frequency, aps[i].is_connected);
+        if (add_valid_beacon(rctx, sky_errno, &b, aps[i].timestamp) != SKY_SUCCESS)
+            return SKY_ERROR;
+    }
+    return set_error_status(sky_errno, SKY_ERROR_NONE);
+}
 #endif // !SKY_EXCLUDE_WIFI_SUPPORT
 
 #if !SKY_EXCLUDE_CELL_SUPPORT
@@ -869,6 +940,10 @@ Sky_status_t sky_search_cache(
     /* check cache match result */
     if (IS_CACHE_HIT(rctx)) {
         cl = &sctx->cacheline[rctx->get_from];
+        /* note the use of the cacheline for the eviction policy */
+        if (cl->hits < UINT16_MAX)
+            cl->hits++;
+        cl->used = rctx->header.time;
         if (loc != NULL) {
             *loc = cl->loc;
             /* no downlink data to report to user */
@@ -918,6 +993,9 @@ Sky_status_t sky_ignore_cache_hit(Sky_rctx_t *rctx, Sky_errno_t *sky_errno)
     if (IS_CACHE_HIT(rctx)) {
         LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Clearing hit status for cacheline %d!", rctx->get_from);
         rctx->hit = false;
+#if SKY_ADAPTIVE_THRESHOLD
+        rctx->check_from = rctx->get_from; /* scan is sent, so the server checks the hit */
+#endif // SKY_ADAPTIVE_THRESHOLD
     } else {
         LOGFMT(rctx, SKY_LOG_LEVEL_WARNING, "No cache entry selected to clear");
     }
@@ -928,6 +1006,161 @@ Sky_status_t sky_ignore_cache_hit(Sky_rctx_t *rctx, Sky_errno_t *sky_errno)
 #endif // CACHE_SIZE
 }
 
+#if SKY_CACHE_STATS
+/*! \brief Read the counts of cache activity of a session
+ *
+ *  @param sctx Skyhook session context
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param stats where to save the counts
+ *  @param reset true to zero the counts once read
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
+ */
+Sky_status_t sky_get_cache_stats(
+    Sky_sctx_t *sctx, Sky_errno_t *sky_errno, Sky_cache_stats_t *stats, bool reset)
+{
+    if (stats == NULL)
+        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+    if (!validate_session_ctx(sctx, NULL))
+        return set_error_status(sky_errno, SKY_ERROR_BAD_SESSION_CTX);
+
+    *stats = sctx->cache_stats;
+    if (reset)
+        memset(&sctx->cache_stats, 0, sizeof(sctx->cache_stats));
+    return set_error_status(sky_errno, SKY_ERROR_NONE);
+}
+#endif // SKY_CACHE_STATS
+
+#if SKY_OFFLINE_LOCATE
+/*! \brief estimate location from the most similar cached scans
+ *
+ *   Intended for use after a cache miss, so that the application may decide
+ *   whether the estimate is good enough to skip the server request.
+ *
+ *  @param rctx Skyhook request context
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param loc where to save the estimated location
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
+ */
+Sky_status_t sky_locate_offline(Sky_rctx_t *rctx, Sky_errno_t *sky_errno, Sky_location_t *loc)
+{
+#if !SKY_EXCLUDE_SANITY_CHECKS
+    if (!validate_request_ctx(rctx))
+        return set_error_status(sky_errno, SKY_ERROR_BAD_REQUEST_CTX);
+#endif // !SKY_EXCLUDE_SANITY_CHECKS
+
+    if (loc == NULL)
+        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+
+#if CACHE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
+    if (locate_offline(rctx, loc) > 0) {
+#ifdef SKY_DEBUG
+        LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Location offline: %d.%06d,%d.%06d hpe:%d", (int)loc->lat,
+            (int)fabs(round(1000000 * (loc->lat - (int)loc->lat))), (int)loc->lon,
+            (int)fabs(round(1000000 * (loc->lon - (int)loc->lon))), loc->hpe);
+#endif // SKY_DEBUG
+        return set_error_status(sky_errno, SKY_ERROR_NONE);
+    }
+#endif // CACHE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
+    LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "No cached scan similar enough to locate offline");
+    loc->location_source = SKY_LOCATION_SOURCE_UNKNOWN;
+    loc->location_status = SKY_LOCATION_STATUS_UNABLE_TO_LOCATE;
+    return set_error_status(sky_errno, SKY_ERROR_LOCATION_UNKNOWN);
+}
+#endif // SKY_OFFLINE_LOCATE
+
+#if SKY_AP_DATABASE
+/*! \brief estimate location from the APs of the request found in an AP database
+ *
+ *   The database is read in place, so it may be held in flash or a memory
+ *   mapped file. Intended for use before sky_encode_request(), so that the
+ *   server is contacted only when the database does not cover the request.
+ *
+ *  @param rctx Skyhook request context
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param db pointer to AP database, see SKY_AP_DB_MAGIC
+ *  @param db_len length of AP database in bytes
+ *  @param loc where to save the estimated location
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
+ */
+Sky_status_t sky_locate_ap_database(Sky_rctx_t *rctx, Sky_errno_t *sky_errno, const void *db,
+    uint32_t db_len, Sky_location_t *loc)
+{
+    int n = 0;
+
+#if !SKY_EXCLUDE_SANITY_CHECKS
+    if (!validate_request_ctx(rctx))
+        return set_error_status(sky_errno, SKY_ERROR_BAD_REQUEST_CTX);
+#endif // !SKY_EXCLUDE_SANITY_CHECKS
+
+    if (db == NULL || loc == NULL)
+        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+
+#if !SKY_EXCLUDE_WIFI_SUPPORT
+    if ((n = locate_ap_database(rctx, db, db_len, loc)) < 0) {
+        LOGFMT(rctx, SKY_LOG_LEVEL_ERROR, "AP database is not valid");
+        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+    }
+    if (n >= AP_DATABASE_MIN_APS && n > 0) {
+#ifdef SKY_DEBUG
+        LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Location from AP database: %d.%06d,%d.%06d hpe:%d",
+            (int)loc->lat, (int)fabs(round(1000000 * (loc->lat - (int)loc->lat))), (int)loc->lon,
+            (int)fabs(round(1000000 * (loc->lon - (int)loc->lon))), loc->hpe);
+#endif // SKY_DEBUG
+        return set_error_status(sky_errno, SKY_ERROR_NONE);
+    }
+#endif // !SKY_EXCLUDE_WIFI_SUPPORT
+    LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Too few APs in AP database (%d)", n);
+    loc->location_source = SKY_LOCATION_SOURCE_UNKNOWN;
+    loc->location_status = SKY_LOCATION_STATUS_UNABLE_TO_LOCATE;
+    return set_error_status(sky_errno, SKY_ERROR_LOCATION_UNKNOWN);
+}
+#endif // SKY_AP_DATABASE
+
+#if AP_LOCATION_TABLE_SIZE
+/*! \brief estimate location from the APs of the request found in the learned AP table
+ *
+ *   The table holds the locations of APs used by the server in earlier
+ *   responses. Intended for use when sky_search_cache() reports a cache miss,
+ *   so that the server is contacted only for APs not yet learned.
+ *
+ *  @param rctx Skyhook request context
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param loc where to save the estimated location
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
+ */
+Sky_status_t sky_locate_ap_table(Sky_rctx_t *rctx, Sky_errno_t *sky_errno, Sky_location_t *loc)
+{
+    int n = 0;
+
+#if !SKY_EXCLUDE_SANITY_CHECKS
+    if (!validate_request_ctx(rctx))
+        return set_error_status(sky_errno, SKY_ERROR_BAD_REQUEST_CTX);
+#endif // !SKY_EXCLUDE_SANITY_CHECKS
+
+    if (loc == NULL)
+        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+
+#if !SKY_EXCLUDE_WIFI_SUPPORT
+    if ((n = locate_ap_table(rctx, loc)) >= AP_LOCATION_TABLE_MIN_APS && n > 0) {
+#ifdef SKY_DEBUG
+        LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Location from learned APs: %d.%06d,%d.%06d hpe:%d",
+            (int)loc->lat, (int)fabs(round(1000000 * (loc->lat - (int)loc->lat))), (int)loc->lon,
+            (int)fabs(round(1000000 * (loc->lon - (int)loc->lon))), loc->hpe);
+#endif // SKY_DEBUG
+        return set_error_status(sky_errno, SKY_ERROR_NONE);
+    }
+#endif // !SKY_EXCLUDE_WIFI_SUPPORT
+    LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Too few APs in learned AP table (%d)", n);
+    loc->location_source = SKY_LOCATION_SOURCE_UNKNOWN;
+    loc->location_status = SKY_LOCATION_STATUS_UNABLE_TO_LOCATE;
+    return set_error_status(sky_errno, SKY_ERROR_LOCATION_UNKNOWN);
+}
+#endif // AP_LOCATION_TABLE_SIZE
+
 /*! \brief Determines the required size of the network request buffer
  *
  *  Size is determined by doing a dry run of encoding the request
@@ -984,14 +1217,24 @@ Sky_status_t sky_sizeof_request_buf(Sky_rctx_t *rctx, uint32_t *size, Sky_errno_
                 NUM_BEACONS(rctx) = cl->num_beacons;
                 NUM_APS(rctx) = cl->num_ap;
                 for (int j = 0; j < NUM_BEACONS(rctx); j++)
-                    rctx->beacon[j] = cl->beacon[j];
+                    get_cached_beacon(sctx, cl, j, &RCTX_BEACON(rctx, j));
+                beacon_hash_rebuild(rctx);
 #if !SKY_EXCLUDE_GNSS_SUPPORT
                 rctx->gnss = cl->gnss;
 #endif // !SKY_EXCLUDE_GNSS_SUPPORT
             }
         } else {
+#if SKY_ADAPTIVE_THRESHOLD
+            rctx->check_from = rctx->get_from; /* scan is sent, so the server checks the hit */
+#endif // SKY_ADAPTIVE_THRESHOLD
             rctx->get_from = -1; /* force cache miss after 127 consecutive cache hits */
             sctx->cache_hits = 0; /* report 0 for cache miss */
+#if SKY_CACHE_STATS
+            if (sctx->cache_stats.hits > 0)
+                sctx->cache_stats.hits--;
+            sctx->cache_stats.misses++;
+            sctx->cache_stats.miss_forced++;
+#endif // SKY_CACHE_STATS
         }
     } else {
 #if !SKY_EXCLUDE_WIFI_SUPPORT
@@ -1137,6 +1380,10 @@ Sky_status_t sky_decode_response(Sky_rctx_t *rctx, Sky_errno_t *sky_errno, void
             sctx->backoff = SKY_ERROR_NONE;
             loc->time = (*sctx->timefn)(NULL);
 
+#if SKY_ADAPTIVE_THRESHOLD && CACHE_SIZE
+            /* a cache hit whose scan was sent to the server checks the cached location */
+            adapt_match_threshold(rctx, loc);
+#endif // SKY_ADAPTIVE_THRESHOLD && CACHE_SIZE
 #if CACHE_SIZE > 0
             /* Add location and current beacons to Cache */
             if (sky_plugin_add_to_cache(rctx, sky_errno, loc) != SKY_SUCCESS)
@@ -1154,6 +1401,9 @@ Sky_status_t sky_decode_response(Sky_rctx_t *rctx, Sky_errno_t *sky_errno, void
                     (int)loc->lon, (int)fabs(round(1000000.0 * (loc->lon - (int)loc->lon))),
                     loc->hpe, sky_psource(loc), loc->dl_app_data_len);
 #endif // CACHE_SIZE > 0
+#if AP_LOCATION_TABLE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
+            learn_ap_locations(rctx, loc);
+#endif // AP_LOCATION_TABLE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
 
             return set_error_status(sky_errno, SKY_ERROR_NONE);
         case SKY_LOCATION_STATUS_AUTH_ERROR:
@@ -1233,6 +1483,12 @@ Sky_status_t sky_get_option(
     case CONF_LOGGING_LEVEL:
         *value = sctx->min_level;
         break;
+    case CONF_CACHE_EVICTION_POLICY:
+        *value = sctx->cache_policy;
+        break;
+    case CONF_CACHE_CONSOLIDATE_THRESHOLD:
+        *value = sctx->cache_consolidate;
+        break;
     default:
         err = SKY_ERROR_BAD_PARAMETERS;
         break;
@@ -1318,6 +1574,20 @@ Sky_status_t sky_set_option(
     case CONF_LOGGING_LEVEL:
         sctx->min_level = value;
         break;
+    case CONF_CACHE_EVICTION_POLICY:
+        if (value < 0 || value >= SKY_CACHE_POLICY_MAX) {
+            err = SKY_ERROR_BAD_PARAMETERS;
+            break;
+        }
+        sctx->cache_policy = value;
+        break;
+    case CONF_CACHE_CONSOLIDATE_THRESHOLD:
+        if (value > 100) {
+            err = SKY_ERROR_BAD_PARAMETERS;
+            break;
+        }
+        sctx->cache_consolidate = (uint8_t)value;
+        break;
     default:
         err = SKY_ERROR_BAD_PARAMETERS;
     }
@@ -52,6 +52,15 @@
 #define SKY_UNKNOWN_ID6 ((int32_t)-1)
 #define SKY_UNKNOWN_TA ((int32_t)-1)
 
+/* Layout of an AP location database, see sky_locate_ap_database(). Integers are little-endian.
+ * Header: magic (8 bytes), number of records (uint32_t), reserved (uint32_t)
+ * Record: mac (6 bytes), hpe in meters (uint16_t), lat and lon in degrees * 1e7 (int32_t each)
+ * Records are sorted by mac
+ */
+#define SKY_AP_DB_MAGIC "SKYAPDB1"
+#define SKY_AP_DB_HEADER_SIZE 16
+#define SKY_AP_DB_RECORD_SIZE 16
+
 /*! \brief API return value
  */
 typedef enum {
@@ -141,6 +150,32 @@ typedef enum {
     SKY_LOG_LEVEL_ALL = SKY_LOG_LEVEL_DEBUG,
 } Sky_log_level_t;
 
+/*! \brief cache eviction policies, which choose the cacheline replaced by a new server response
+ */
+typedef enum {
+    SKY_CACHE_POLICY_SCORE = 0, // Line matching new scan least (AP) or best (cell), else oldest
+    SKY_CACHE_POLICY_LRU, // Least recently saved or hit
+    SKY_CACHE_POLICY_LFU, // Fewest hits, least recently used of equals
+    SKY_CACHE_POLICY_HIT_WEIGHTED, // Fewest hits per hour since last used
+    SKY_CACHE_POLICY_MAX,
+} Sky_cache_policy_t;
+
+/*! \brief counts of cache activity since the session was created, see sky_get_cache_stats()
+ */
+typedef struct sky_cache_stats {
+    uint32_t lookups; // Searches of the cache by sky_search_cache()
+    uint32_t hits; // Lookups which found a matching cacheline
+    uint32_t misses; // Lookups which did not, the sum of the miss counts below
+    uint32_t miss_empty; // No cached scan to compare, i.e. cache empty or time unavailable
+    uint32_t miss_cell_changed; // Serving cell differed in cachelines otherwise not matched
+    uint32_t miss_gnss_worse; // GNSS fix worse or distant in cachelines otherwise not matched
+    uint32_t miss_score; // Best cacheline score below threshold
+    uint32_t miss_forced; // Hit forced to a miss after 127 consecutive hits
+    uint32_t evictions; // Cachelines replaced to save a new location, or cleared for pool space
+    uint32_t expirations; // Cachelines cleared by age, or because time was unavailable
+    uint32_t config_clears; // Cachelines cleared as too large for new Dynamic Parameters
+} Sky_cache_stats_t;
+
 /*! \brief pointer to logger callback function
  */
 typedef int (*Sky_loggerfn_t)(Sky_log_level_t level, char *s);
@@ -177,6 +212,8 @@ typedef enum config_names {
     CONF_MAX_VAP_PER_AP,
     CONF_MAX_VAP_PER_RQ,
     CONF_LOGGING_LEVEL,
+    CONF_CACHE_EVICTION_POLICY,
+    CONF_CACHE_CONSOLIDATE_THRESHOLD,
     /* Add more config variables here */
     CONF_UNKNOWN,
 } Sky_config_name_t;
@@ -187,14 +224,25 @@ typedef enum config_names {
 #include "utilities.h"
 #include "plugin.h"
 
+/*! \brief Wi-Fi scan result, see sky_add_ap_beacons()
+ */
+typedef struct sky_ap_scan {
+    uint8_t mac[MAC_SIZE];
+    bool is_connected; // this beacon is currently connected, false if unknown
+    int16_t rssi; // -10 through -127, -1 if unknown
+    int32_t frequency; // center frequency of channel in MHz, -1 if unknown
+    time_t timestamp; // when the scan was performed, (time_t)-1 if unknown
+} Sky_ap_scan_t;
+
 Sky_status_t sky_open(Sky_errno_t *sky_errno, uint8_t *device_id, uint32_t id_len,
     uint32_t partner_id, uint8_t aes_key[AES_KEYLEN], char *sku, uint32_t cc, Sky_sctx_t *sctx,
-    Sky_log_level_t min_level, Sky_loggerfn_t logf, Sky_randfn_t rand_bytes, Sky_timefn_t gettime);
+    uint16_t num_cachelines, Sky_log_level_t min_level, Sky_loggerfn_t logf,
+    Sky_randfn_t rand_bytes, Sky_timefn_t gettime);
 
 Sky_status_t sky_search_cache(
     Sky_rctx_t *rctx, Sky_errno_t *sky_errno, bool *cache_hit, Sky_location_t *loc);
 
-int32_t sky_sizeof_session_ctx(Sky_sctx_t *sctx);
+int32_t sky_sizeof_session_ctx(Sky_sctx_t *sctx, uint16_t num_cachelines);
 
 int32_t sky_sizeof_request_ctx(void);
 
@@ -204,6 +252,9 @@ Sky_rctx_t *sky_new_request(Sky_rctx_t *rctx, uint32_t rbufsize, Sky_sctx_t *sct
 Sky_status_t sky_add_ap_beacon(Sky_rctx_t *rctx, Sky_errno_t *sky_errno, uint8_t mac[MAC_SIZE],
     time_t timestamp, int16_t rssi, int32_t freq, bool is_connected);
 
+Sky_status_t sky_add_ap_beacons(
+    Sky_rctx_t *rctx, Sky_errno_t *sky_errno, const Sky_ap_scan_t *aps, uint32_t num_aps);
+
 Sky_status_t sky_add_cell_lte_beacon(Sky_rctx_t *rctx, Sky_errno_t *sky_errno, int32_t tac,
     int64_t e_cellid, uint16_t mcc, uint16_t mnc, int16_t pci, int32_t earfcn, int32_t ta,
     time_t timestamp, int16_t rsrp, bool is_connected);
@@ -248,6 +299,24 @@ Sky_status_t sky_add_gnss(Sky_rctx_t *rctx, Sky_errno_t *sky_errno, float lat, f
 
 Sky_status_t sky_ignore_cache_hit(Sky_rctx_t *rctx, Sky_errno_t *sky_errno);
 
+#if SKY_CACHE_STATS
+Sky_status_t sky_get_cache_stats(
+    Sky_sctx_t *sctx, Sky_errno_t *sky_errno, Sky_cache_stats_t *stats, bool reset);
+#endif // SKY_CACHE_STATS
+
+#if SKY_OFFLINE_LOCATE
+Sky_status_t sky_locate_offline(Sky_rctx_t *rctx, Sky_errno_t *sky_errno, Sky_location_t *loc);
+#endif // SKY_OFFLINE_LOCATE
+
+#if SKY_AP_DATABASE
+Sky_status_t sky_locate_ap_database(Sky_rctx_t *rctx, Sky_errno_t *sky_errno, const void *db,
+    uint32_t db_len, Sky_location_t *loc);
+#endif // SKY_AP_DATABASE
+
+#if AP_LOCATION_TABLE_SIZE
+Sky_status_t sky_locate_ap_table(Sky_rctx_t *rctx, Sky_errno_t *sky_errno, Sky_location_t *loc);
+#endif // AP_LOCATION_TABLE_SIZE
+
 Sky_status_t sky_encode_request(Sky_rctx_t *rctx, Sky_errno_t *sky_errno, void *request_buf,
     uint32_t bufsize, uint32_t *response_size);
 
@@ -574,14 +574,14 @@ int32_t apply_used_info_to_ap(Sky_rctx_t *ctx, const uint8_t *used, int size)
         return -1;
 
     for (i = 0; i < NUM_APS(ctx); i++) {
-        ctx->beacon[nap].ap.property.used = GET_USED_AP(used, size, nap);
+        RCTX_BEACON(ctx, nap).ap.property.used = GET_USED_AP(used, size, nap);
         if (nap++ > size * CHAR_BIT)
             break;
     }
     for (v = 0; v < CONFIG(ctx->session, max_vap_per_ap); v++) {
         for (i = 0; i < NUM_APS(ctx); i++) {
-            if (v < NUM_VAPS(&ctx->beacon[i])) {
-                ctx->beacon[i].ap.vg_prop[v].used = GET_USED_AP(used, size, nap);
+            if (v < NUM_VAPS(&RCTX_BEACON(ctx, i))) {
+                RCTX_BEACON(ctx, i).ap.vg_prop[v].used = GET_USED_AP(used, size, nap);
                 if (nap++ > size * CHAR_BIT)
                     break;
             }
@@ -736,6 +736,66 @@ int32_t deserialize_response(Sky_rctx_t *ctx, uint8_t *buf, uint32_t buf_len, Sk
     return ret;
 }
 
+#ifdef UNITTESTS
+int32_t serialize_response(Sky_rctx_t *ctx, uint8_t *buf, uint32_t buf_len, Sky_location_t *loc)
+{
+    size_t rs_size, aes_padding_length, crypto_info_size, hdr_size, total_length;
+    struct AES_ctx aes_ctx;
+
+    RsHeader rs_hdr = RsHeader_init_default;
+    CryptoInfo rs_crypto_info = CryptoInfo_init_default;
+
+    Rs rs = Rs_init_default;
+
+    pb_ostream_t ostream;
+
+    rs.lat = loc->lat;
+    rs.lon = loc->lon;
+    rs.hpe = loc->hpe;
+    rs.source = (Rs_Source)loc->location_source;
+    rs.token_id = (int32_t)ctx->session->token_id;
+
+    // Account for necessary encryption padding.
+    pb_get_encoded_size(&rs_size, Rs_fields, &rs);
+    aes_padding_length = (AES_BLOCKLEN - rs_size % AES_BLOCKLEN) % AES_BLOCKLEN;
+
+    rs_crypto_info.iv.size = AES_BLOCKLEN;
+    rs_crypto_info.aes_padding_length = (int32_t)aes_padding_length;
+    pb_get_encoded_size(&crypto_info_size, CryptoInfo_fields, &rs_crypto_info);
+
+    rs_hdr.crypto_info_length = (int32_t)crypto_info_size;
+    rs_hdr.rs_length = (int32_t)(rs_size + aes_padding_length);
+    rs_hdr.status = (RsHeader_Status)loc->location_status;
+    pb_get_encoded_size(&hdr_size, RsHeader_fields, &rs_hdr);
+
+    total_length = 1 + hdr_size + crypto_info_size + rs_size + aes_padding_length;
+    if (total_length > buf_len)
+        return -1;
+    memset(buf, 0, buf_len);
+
+    // First byte of message on wire is the length (in bytes) of the response header.
+    *buf++ = (uint8_t)hdr_size;
+    ostream = pb_ostream_from_buffer(buf, hdr_size);
+    if (!pb_encode(&ostream, RsHeader_fields, &rs_hdr))
+        return -1;
+    buf += hdr_size;
+
+    ostream = pb_ostream_from_buffer(buf, crypto_info_size);
+    if (!pb_encode(&ostream, CryptoInfo_fields, &rs_crypto_info))
+        return -1;
+    buf += crypto_info_size;
+
+    ostream = pb_ostream_from_buffer(buf, rs_size);
+    if (!pb_encode(&ostream, Rs_fields, &rs))
+        return -1;
+
+    AES_init_ctx_iv(&aes_ctx, get_ctx_aes_key(ctx), rs_crypto_info.iv.bytes);
+    AES_CBC_encrypt_buffer(&aes_ctx, buf, rs_size + aes_padding_length);
+
+    return (int32_t)total_length;
+}
+#endif // UNITTESTS
+
 #if !SKY_EXCLUDE_GNSS_SUPPORT
 static int64_t get_gnss_lat_scaled(Sky_rctx_t *ctx, uint32_t idx)
 {
@@ -36,4 +36,10 @@ int32_t deserialize_response(Sky_rctx_t *ctx, uint8_t *buf, uint32_t buf_len, Sk
 // Calculate the maximum buffer space needed for the ELG server response
 int32_t get_maximum_response_size(void);
 
+#ifdef UNITTESTS
+// Encode and encrypt a response into buffer, as the server would.
+int32_t serialize_response(Sky_rctx_t *ctx, uint8_t *response_buf, uint32_t bufsize,
+    Sky_location_t *loc);
+#endif // UNITTESTS
+
 #endif
@@ -116,7 +116,7 @@ Sky_rctx_t *_test_sky_ctx()
         0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
     uint32_t bufsize;
 
-    bufsize = sky_sizeof_session_ctx(NULL);
+    bufsize = sky_sizeof_session_ctx(NULL, CACHE_SIZE);
     if (bufsize == 0 || bufsize > 32768) {
         fprintf(stderr, "sky_sizeof_session_ctx returned bad value, Can't continue\n");
         exit(-1);
@@ -126,7 +126,7 @@ Sky_rctx_t *_test_sky_ctx()
     memset(session, '\0', bufsize);
 
     if (sky_open(&_ctx_errno, (uint8_t *)TEST_DEVICE_ID, 6, TEST_PARTNER_ID, _aes_key, TEST_SKU,
-            200, session, SKY_LOG_LEVEL_DEBUG, _test_log, NULL, &time) == SKY_ERROR) {
+            200, session, CACHE_SIZE, SKY_LOG_LEVEL_DEBUG, _test_log, NULL, &time) == SKY_ERROR) {
         fprintf(stderr, "Failure setting up mock context, aborting!\n");
         exit(-1);
     }
@@ -23,6 +23,7 @@
  *
  */
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
 #include <time.h>
 #include <math.h>
@@ -248,15 +249,21 @@ bool validate_request_ctx(Sky_rctx_t *rctx)
     if (rctx->header.magic == SKY_MAGIC &&
         rctx->header.crc32 == sky_crc32(&rctx->header.magic, (uint8_t *)&rctx->header.crc32 -
                                                                  (uint8_t *)&rctx->header.magic)) {
+        for (i = 0; i < TOTAL_BEACONS + 1; i++) {
+            if (rctx->order[i] > TOTAL_BEACONS) {
+                LOGFMT(rctx, SKY_LOG_LEVEL_ERROR, "Bad beacon order #%d of %d", i, TOTAL_BEACONS);
+                return false;
+            }
+        }
         for (i = 0; i < TOTAL_BEACONS; i++) {
             if (i < NUM_BEACONS(rctx)) {
-                if (!validate_beacon(&rctx->beacon[i], rctx)) {
+                if (!validate_beacon(&RCTX_BEACON(rctx, i), rctx)) {
                     LOGFMT(rctx, SKY_LOG_LEVEL_ERROR, "Bad beacon #%d of %d", i, TOTAL_BEACONS);
                     return false;
                 }
             } else {
-                if (rctx->beacon[i].h.magic != BEACON_MAGIC ||
-                    rctx->beacon[i].h.type > SKY_BEACON_MAX) {
+                if (RCTX_BEACON(rctx, i).h.magic != BEACON_MAGIC ||
+                    RCTX_BEACON(rctx, i).h.type > SKY_BEACON_MAX) {
                     LOGFMT(
                         rctx, SKY_LOG_LEVEL_ERROR, "Bad empty beacon #%d of %d", i, TOTAL_BEACONS);
                     return false;
@@ -271,6 +278,43 @@ bool validate_request_ctx(Sky_rctx_t *rctx)
 }
 #endif // !SKY_EXCLUDE_SANITY_CHECKS
 
+/*! \brief compute the size of a session context holding a number of cachelines
+ *
+ *   The cachelines are followed by the cache pool, which is never smaller than
+ *   one full cacheline, and by the cache index.
+ *
+ *  @param num_cachelines number of cachelines
+ *  @param pool_size where to save the bytes of cache pool, or NULL
+ *
+ *  @return size in bytes, or 0 if num_cachelines is not in the range 0 to CACHE_SIZE
+ */
+uint32_t session_ctx_size(int num_cachelines, uint32_t *pool_size)
+{
+#if CACHE_SIZE
+    uint32_t pool = 0;
+    uint32_t size;
+
+    if (num_cachelines < 0 || num_cachelines > CACHE_SIZE)
+        return 0;
+    if (num_cachelines) {
+        pool = (uint32_t)num_cachelines * CACHE_POOL_PER_LINE;
+        if (pool < (CACHELINE_MAX_BYTES + 3) / 4 * 4)
+            pool = (CACHELINE_MAX_BYTES + 3) / 4 * 4;
+    }
+    if (pool_size != NULL)
+        *pool_size = pool;
+    size = offsetof(Sky_sctx_t, cacheline) + num_cachelines * sizeof(Sky_cacheline_t) + pool;
+#if !SKY_EXCLUDE_WIFI_SUPPORT
+    size += num_cachelines * CACHE_INDEX_PER_LINE * sizeof(Sky_cache_index_t);
+#endif // !SKY_EXCLUDE_WIFI_SUPPORT
+    return size;
+#else
+    if (pool_size != NULL)
+        *pool_size = 0;
+    return num_cachelines == 0 ? sizeof(Sky_sctx_t) : 0;
+#endif // CACHE_SIZE
+}
+
 /*! \brief validate the session context buffer - Cant use LOGFMT here
  *
  *  @param c pointer to csession context buffer
@@ -300,7 +344,11 @@ bool validate_session_ctx(Sky_sctx_t *sctx, Sky_loggerfn_t logf)
     if (sctx->header.crc32 == sky_crc32(&sctx->header.magic, (uint8_t *)&sctx->header.crc32 -
                                                                  (uint8_t *)&sctx->header.magic)) {
 #if CACHE_SIZE
-        if (sctx->header.size != sizeof(Sky_sctx_t)) {
+        uint32_t pool_size;
+
+        if (sctx->header.size < offsetof(Sky_sctx_t, cacheline) ||
+            sctx->header.size != session_ctx_size(sctx->num_cachelines, &pool_size) ||
+            sctx->cache_pool_size != pool_size) {
 #if SKY_LOGGING
             if (logf != NULL)
                 (*logf)(SKY_LOG_LEVEL_ERROR,
@@ -309,9 +357,48 @@ bool validate_session_ctx(Sky_sctx_t *sctx, Sky_loggerfn_t logf)
             return false;
         }
 
-        for (int i = 0; i < sctx->num_cachelines; i++) {
-            int j;
+        if (sctx->num_expiry > sctx->num_cachelines) {
+#if SKY_LOGGING
+            if (logf != NULL)
+                (*logf)(SKY_LOG_LEVEL_ERROR, "Session ctx validation failed: Bad expiry list");
+#endif // SKY_LOGGING
+            return false;
+        }
+#if !SKY_EXCLUDE_CELL_SUPPORT
+        for (int i = 0; i < SERVING_CELL_BUCKETS; i++) {
+            if (sctx->serving_bucket[i] > sctx->num_cachelines) {
+#if SKY_LOGGING
+                if (logf != NULL)
+                    (*logf)(SKY_LOG_LEVEL_ERROR,
+                        "Session ctx validation failed: Bad serving cell bucket");
+#endif // SKY_LOGGING
+                return false;
+            }
+        }
+#endif // !SKY_EXCLUDE_CELL_SUPPORT
+#if !SKY_EXCLUDE_GNSS_SUPPORT
+        for (int i = 0; i < GNSS_GRID_BUCKETS; i++) {
+            if (sctx->gnss_grid[i] > sctx->num_cachelines) {
+#if SKY_LOGGING
+                if (logf != NULL)
+                    (*logf)(SKY_LOG_LEVEL_ERROR, "Session ctx validation failed: Bad GNSS grid");
+#endif // SKY_LOGGING
+                return false;
+            }
+        }
+#endif // !SKY_EXCLUDE_GNSS_SUPPORT
+        for (int i = 0; i < sctx->num_expiry; i++) {
+            if (sctx->expiry[i] >= sctx->num_cachelines ||
+                sctx->cacheline[sctx->expiry[i]].time == CACHE_EMPTY) {
+#if SKY_LOGGING
+                if (logf != NULL)
+                    (*logf)(SKY_LOG_LEVEL_ERROR, "Session ctx validation failed: Bad expiry list");
+#endif // SKY_LOGGING
+                return false;
+            }
+        }
 
+        for (int i = 0; i < sctx->num_cachelines; i++) {
             if (sctx->cacheline[i].num_beacons > TOTAL_BEACONS) {
 #if SKY_LOGGING
                 if (logf != NULL)
@@ -321,16 +408,28 @@ bool validate_session_ctx(Sky_sctx_t *sctx, Sky_loggerfn_t logf)
                 return false;
             }
 
-            for (j = 0; j < TOTAL_BEACONS; j++) {
-                if (sctx->cacheline[i].beacon[j].h.magic != BEACON_MAGIC) {
+            if (sctx->cacheline[i].num_ap > sctx->cacheline[i].num_beacons ||
+#if !SKY_EXCLUDE_CELL_SUPPORT
+                sctx->cacheline[i].serving_next > sctx->num_cachelines ||
+#endif // !SKY_EXCLUDE_CELL_SUPPORT
+#if !SKY_EXCLUDE_GNSS_SUPPORT
+                sctx->cacheline[i].grid_next > sctx->num_cachelines ||
+#endif // !SKY_EXCLUDE_GNSS_SUPPORT
+                sctx->cacheline[i].offset + cacheline_bytes(&sctx->cacheline[i]) >
+                    sctx->cache_pool_used ||
+                sctx->cache_pool_used > sctx->cache_pool_size) {
 #if SKY_LOGGING
-                    if (logf != NULL)
-                        (*logf)(
-                            SKY_LOG_LEVEL_ERROR, "Session ctx validation failed: Bad beacon info");
+                if (logf != NULL)
+                    (*logf)(SKY_LOG_LEVEL_ERROR, "Session ctx validation failed: Bad beacon info");
 #endif // SKY_LOGGING
-                    return false;
-                }
-                if (sctx->cacheline[i].beacon[j].h.type > SKY_BEACON_MAX) {
+                return false;
+            }
+#if !SKY_EXCLUDE_CELL_SUPPORT
+            for (int j = NUM_APS(&sctx->cacheline[i]); j < NUM_BEACONS(&sctx->cacheline[i]);
+                 j++) {
+                uint8_t type = CACHE_CELL(sctx, &sctx->cacheline[i], j)->type;
+
+                if (type < SKY_BEACON_FIRST_CELL_TYPE || type > SKY_BEACON_LAST_CELL_TYPE) {
 #if SKY_LOGGING
                     if (logf != NULL)
                         (*logf)(
@@ -339,8 +438,18 @@ bool validate_session_ctx(Sky_sctx_t *sctx, Sky_loggerfn_t logf)
                     return false;
                 }
             }
+#endif // !SKY_EXCLUDE_CELL_SUPPORT
         }
 #endif // CACHE_SIZE
+#if AP_LOCATION_TABLE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
+        if (sctx->num_ap_locations > AP_LOCATION_TABLE_SIZE) {
+#if SKY_LOGGING
+            if (logf != NULL)
+                (*logf)(SKY_LOG_LEVEL_ERROR, "Session ctx validation failed: Bad learned AP table");
+#endif // SKY_LOGGING
+            return false;
+        }
+#endif // AP_LOCATION_TABLE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
     } else {
 #if SKY_LOGGING
         if (logf != NULL)
@@ -595,48 +704,18 @@ void dump_ap(Sky_rctx_t *rctx, char *prefix, Beacon_t *b, const char *file, cons
 }
 #endif // !SKY_EXCLUDE_WIFI_SUPPORT
 
-/*! \brief dump a beacon
+#if SKY_LOGGING
+/*! \brief dump the fields of a beacon after a prefix identifying it
  *
  *  @param rctx request rctx pointer
+ *  @param prefixstr identification of the beacon, space is appended
  *  @param b the beacon to dump
  *  @param file the file name where LOG_BUFFER was invoked
  *  @param function the function name where LOG_BUFFER was invoked
- *
- *  @returns 0 for success or negative number for error
  */
-void dump_beacon(Sky_rctx_t *rctx, char *str, Beacon_t *b, const char *file, const char *func)
+static void dump_beacon_fields(
+    Sky_rctx_t *rctx, char prefixstr[50], Beacon_t *b, const char *file, const char *func)
 {
-#if SKY_LOGGING
-    char prefixstr[50] = { '\0' };
-    int idx_b;
-#if CACHE_SIZE
-    int idx_c;
-#endif // CACHE_SIZE
-
-    /* Test whether beacon is in cache or request rctx */
-    if (b >= rctx->beacon && b < rctx->beacon + TOTAL_BEACONS + 1) {
-        idx_b = (int)(b - rctx->beacon);
-        snprintf(prefixstr, sizeof(prefixstr), "%s     %-2d%s %7s", str, idx_b,
-            b->h.connected ? "*" : " ", sky_pbeacon(b));
-#if CACHE_SIZE
-    } else if (rctx->session) {
-        Sky_cacheline_t *c;
-
-        for (c = rctx->session->cacheline; c < rctx->session->cacheline + CACHE_SIZE; c++) {
-            if (b >= c->beacon && b < c->beacon + TOTAL_BEACONS) {
-                idx_b = b - c->beacon;
-                idx_c = c - rctx->session->cacheline;
-                snprintf(prefixstr, sizeof(prefixstr), "%s %2d:%-2d%s %7s", str, idx_c, idx_b,
-                    b->h.connected ? "*" : " ", sky_pbeacon(b));
-                break;
-            }
-        }
-#endif // CACHE_SIZE
-    } else {
-        snprintf(prefixstr, sizeof(prefixstr), "%s     ? %s %7s", str, b->h.connected ? "*" : " ",
-            sky_pbeacon(b));
-    }
-
     switch (b->h.type) {
 #if !SKY_EXCLUDE_WIFI_SUPPORT
     case SKY_BEACON_AP:
@@ -672,6 +751,33 @@ void dump_beacon(Sky_rctx_t *rctx, char *str, Beacon_t *b, const char *file, con
         logfmt(file, func, rctx, SKY_LOG_LEVEL_DEBUG, "%s: Type: Unknown", prefixstr);
         break;
     }
+}
+#endif // SKY_LOGGING
+
+/*! \brief dump a beacon
+ *
+ *  @param rctx request rctx pointer
+ *  @param b the beacon to dump
+ *  @param file the file name where LOG_BUFFER was invoked
+ *  @param function the function name where LOG_BUFFER was invoked
+ *
+ *  @returns 0 for success or negative number for error
+ */
+void dump_beacon(Sky_rctx_t *rctx, char *str, Beacon_t *b, const char *file, const char *func)
+{
+#if SKY_LOGGING
+    char prefixstr[50] = { '\0' };
+    int idx_b;
+
+    /* Test whether beacon is in request rctx */
+    if ((idx_b = beacon_index(rctx, b)) >= 0) {
+        snprintf(prefixstr, sizeof(prefixstr), "%s     %-2d%s %7s", str, idx_b,
+            b->h.connected ? "*" : " ", sky_pbeacon(b));
+    } else {
+        snprintf(prefixstr, sizeof(prefixstr), "%s     ? %s %7s", str, b->h.connected ? "*" : " ",
+            sky_pbeacon(b));
+    }
+    dump_beacon_fields(rctx, prefixstr, b, file, func);
 #else
     (void)rctx;
     (void)str;
@@ -726,7 +832,7 @@ void dump_request_ctx(Sky_rctx_t *rctx, const char *file, const char *func)
 #endif // !SKY_EXCLUDE_GNSS_SUPPORT
 
     for (i = 0; i < NUM_BEACONS(rctx); i++)
-        dump_beacon(rctx, "req", &rctx->beacon[i], file, func);
+        dump_beacon(rctx, "req", &RCTX_BEACON(rctx, i), file, func);
 
     if (CONFIG(rctx->session, last_config_time) == CONFIG_UPDATE_DUE) {
         logfmt(file, func, rctx, SKY_LOG_LEVEL_DEBUG,
@@ -785,7 +891,13 @@ void dump_cache(Sky_rctx_t *rctx, const char *file, const char *func)
             dump_gnss(rctx, __FILE__, __FUNCTION__, &cl->gnss);
 #endif // !SKY_EXCLUDE_GNSS_SUPPORT
             for (j = 0; j < cl->num_beacons; j++) {
-                dump_beacon(rctx, "cache", &cl->beacon[j], file, func);
+                char prefixstr[50];
+                Beacon_t b;
+
+                get_cached_beacon(rctx->session, cl, j, &b);
+                snprintf(prefixstr, sizeof(prefixstr), "cache %2d:%-2d%s %7s", i, j,
+                    b.h.connected ? "*" : " ", sky_pbeacon(&b));
+                dump_beacon_fields(rctx, prefixstr, &b, file, func);
             }
         }
     }
@@ -829,6 +941,23 @@ void config_defaults(Sky_sctx_t *sctx)
     /* Add new config parameters here */
 }
 
+/*! \brief the cache match threshold for all APs, as adjusted by the adaptive threshold
+ *
+ *  @param sctx Skyhook session context
+ *
+ *  @return threshold in percent
+ */
+uint32_t match_all_threshold(Sky_sctx_t *sctx)
+{
+#if SKY_ADAPTIVE_THRESHOLD && CACHE_SIZE
+    int32_t threshold = (int32_t)CONFIG(sctx, cache_match_all_threshold) + sctx->threshold_offset;
+
+    return threshold < 1 ? 1 : threshold > 100 ? 100 : (uint32_t)threshold;
+#else
+    return CONFIG(sctx, cache_match_all_threshold);
+#endif // SKY_ADAPTIVE_THRESHOLD && CACHE_SIZE
+}
+
 /*! \brief field extraction for dynamic use of Nanopb (rctx partner_id)
  *
  *  @param rctx request rctx buffer
@@ -969,9 +1098,9 @@ int32_t get_num_beacons(Sky_rctx_t *rctx, Sky_beacon_type_t t)
         return NUM_APS(rctx);
     } else {
         for (i = NUM_APS(rctx), b = 0; i < NUM_BEACONS(rctx); i++) {
-            if (rctx->beacon[i].h.type == t)
+            if (RCTX_BEACON(rctx, i).h.type == t)
                 b++;
-            if (b && rctx->beacon[i].h.type != t)
+            if (b && RCTX_BEACON(rctx, i).h.type != t)
                 break; /* End of beacons of this type */
         }
     }
@@ -994,7 +1123,7 @@ int32_t get_num_cells(Sky_rctx_t *rctx)
     }
 
     for (i = NUM_APS(rctx), b = 0; i < NUM_BEACONS(rctx); i++) {
-        if (is_cell_type(&rctx->beacon[i]))
+        if (is_cell_type(&RCTX_BEACON(rctx, i)))
             b++;
     }
 
@@ -1017,11 +1146,11 @@ int get_base_beacons(Sky_rctx_t *rctx, Sky_beacon_type_t t)
         return 0;
     }
     if (t == SKY_BEACON_AP) {
-        if (rctx->beacon[0].h.type == t)
+        if (RCTX_BEACON(rctx, 0).h.type == t)
             return i;
     } else {
         for (i = NUM_APS(rctx); i < NUM_BEACONS(rctx); i++) {
-            if (rctx->beacon[i].h.type == t)
+            if (RCTX_BEACON(rctx, i).h.type == t)
                 return i;
         }
     }
@@ -1057,7 +1186,7 @@ uint8_t *get_ap_mac(Sky_rctx_t *rctx, uint32_t idx)
         // LOGFMT(rctx, SKY_LOG_LEVEL_ERROR, "Bad param");
         return 0;
     }
-    return rctx->beacon[idx].ap.mac;
+    return RCTX_BEACON(rctx, idx).ap.mac;
 }
 
 /*! \brief field extraction for dynamic use of Nanopb (AP/freq)
@@ -1073,7 +1202,7 @@ int64_t get_ap_freq(Sky_rctx_t *rctx, uint32_t idx)
         // LOGFMT(rctx, SKY_LOG_LEVEL_ERROR, "Bad param");
         return 0;
     }
-    return rctx->beacon[idx].ap.freq;
+    return RCTX_BEACON(rctx, idx).ap.freq;
 }
 #endif // !SKY_EXCLUDE_WIFI_SUPPORT
 
@@ -1090,7 +1219,7 @@ int64_t get_ap_rssi(Sky_rctx_t *rctx, uint32_t idx)
         // LOGFMT(rctx, SKY_LOG_LEVEL_ERROR, "Bad param");
         return 0;
     }
-    return rctx->beacon[idx].h.rssi;
+    return RCTX_BEACON(rctx, idx).h.rssi;
 }
 
 /*! \brief field extraction for dynamic use of Nanopb (AP/is_connected)
@@ -1106,7 +1235,7 @@ bool get_ap_is_connected(Sky_rctx_t *rctx, uint32_t idx)
         // LOGFMT(rctx, SKY_LOG_LEVEL_ERROR, "Bad param");
         return false;
     }
-    return rctx->beacon[idx].h.connected;
+    return RCTX_BEACON(rctx, idx).h.connected;
 }
 
 /*! \brief field extraction for dynamic use of Nanopb (AP/timestamp)
@@ -1122,7 +1251,7 @@ int64_t get_ap_age(Sky_rctx_t *rctx, uint32_t idx)
         // LOGFMT(rctx, SKY_LOG_LEVEL_ERROR, "Bad param");
         return 0;
     }
-    return rctx->beacon[idx].h.age;
+    return RCTX_BEACON(rctx, idx).h.age;
 }
 
 #if !SKY_EXCLUDE_CELL_SUPPORT
@@ -1140,7 +1269,7 @@ Beacon_t *get_cell(Sky_rctx_t *rctx, uint32_t idx)
         return 0;
     }
 
-    return &rctx->beacon[NUM_APS(rctx) + idx];
+    return &RCTX_BEACON(rctx, NUM_APS(rctx) + idx);
 }
 
 /*! \brief Get cell type
@@ -1492,7 +1621,7 @@ int32_t get_num_vaps(Sky_rctx_t *rctx)
         return 0;
     }
     for (j = 0; j < NUM_APS(rctx); j++) {
-        w = &rctx->beacon[j];
+        w = &RCTX_BEACON(rctx, j);
         nv += (w->ap.vg[VAP_LENGTH].len ? 1 : 0);
 #if SKY_LOGGING
         total_vap += w->ap.vg[VAP_LENGTH].len;
@@ -1522,7 +1651,7 @@ uint8_t *get_vap_data(Sky_rctx_t *rctx, uint32_t idx)
     /* Walk through APs counting vap, when the idx is the current Virtual Group */
     /* return the Virtual AP data */
     for (j = 0; j < NUM_APS(rctx); j++) {
-        w = &rctx->beacon[j];
+        w = &RCTX_BEACON(rctx, j);
         // LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "AP: %d Group #: %d num_beacons: %d nvg: %d", j, idx, w->ap.vg_len, nvg);
         if (w->ap.vg[VAP_LENGTH].len && nvg == idx) {
             // LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Group: %d AP: %d idx: %d num_beacons: %d ap: %d", idx, j, idx,
@@ -1560,7 +1689,7 @@ void select_vap(Sky_rctx_t *rctx)
         /* then walk through again, truncating the compressed bytes */
         no_more = true;
         for (j = 0; j < NUM_APS(rctx); j++) {
-            w = &rctx->beacon[j];
+            w = &RCTX_BEACON(rctx, j);
             if (w->ap.vg_len > cap_vap[j]) {
                 cap_vap[j]++;
                 nvap++;
@@ -1573,7 +1702,7 @@ void select_vap(Sky_rctx_t *rctx)
     }
     /* Complete the virtual group patch bytes with index of parent and update length */
     for (j = 0; j < NUM_APS(rctx); j++) {
-        w = &rctx->beacon[j];
+        w = &RCTX_BEACON(rctx, j);
         w->ap.vg[VAP_PARENT].ap = j;
 #if VERBOSE_DEBUG
         LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "AP: %d num_beacons: %d -> %d", w->ap.vg[VAP_PARENT].ap,
@@ -1616,8 +1745,9 @@ int sky_rand_fn(uint8_t *rand_buf, uint32_t bufsize)
  *  @param a_lon longitude of position B in degrees
  *  @returns distance distance in meters
  */
-#define PI (acos(-1.0))
+#define PI 3.14159265358979323846
 #define RADIANS(d) (PI / 180.0f * (d))
+#define EARTH_RADIUS (1000 * 6371.0)
 float distance_A_to_B(float lat_a, float lon_a, float lat_b, float lon_b)
 {
     return (float)(1000 * 6371 *
@@ -1626,6 +1756,242 @@ float distance_A_to_B(float lat_a, float lon_a, float lat_b, float lon_b)
                             cos(RADIANS(lon_a - lon_b))));
 }
 
+/*! \brief Calculate the unit vector from the center of the earth through a gps coordinate
+ *
+ *   Distances between points may be compared using only their unit vectors,
+ *   see gnss_chord2(), without any trig.
+ *
+ *  @param lat latitude in degrees
+ *  @param lon longitude in degrees
+ *  @param v where to save x, y and z of unit vector
+ */
+void gnss_unit_vector(float lat, float lon, float v[3])
+{
+    double c = cos(RADIANS(lat));
+
+    v[0] = (float)(c * cos(RADIANS(lon)));
+    v[1] = (float)(c * sin(RADIANS(lon)));
+    v[2] = (float)sin(RADIANS(lat));
+}
+
+/*! \brief Calculate the squared distance between the unit vectors of points a given distance apart
+ *
+ *   Two points are further apart than distance when the sum of the squared
+ *   differences of their unit vectors is larger than gnss_chord2(distance).
+ *
+ *  @param distance distance in meters along the surface of the earth
+ *
+ *  @return squared chord length on the unit sphere
+ */
+float gnss_chord2(uint32_t distance)
+{
+    double chord = 2 * sin(distance / (2 * 1000 * 6371.0));
+
+    return (float)(chord * chord);
+}
+
+/*! \brief Calculate distance between two gps coordinates using the haversine formula
+ *
+ *   Unlike the spherical law of cosines in distance_A_to_B(), which loses
+ *   precision for points close together, this is accurate at any range.
+ *
+ *  @param lat_a latitude of position A in degrees
+ *  @param lon_a longitude of position A in degrees
+ *  @param lat_b latitude of position B in degrees
+ *  @param lon_b longitude of position B in degrees
+ *
+ *  @return distance in meters
+ */
+float distance_haversine(float lat_a, float lon_a, float lat_b, float lon_b)
+{
+    double s_lat = sin(RADIANS(lat_b - lat_a) / 2);
+    double s_lon = sin(RADIANS(lon_b - lon_a) / 2);
+    double h = s_lat * s_lat + cos(RADIANS(lat_a)) * cos(RADIANS(lat_b)) * s_lon * s_lon;
+
+    return (float)(2 * EARTH_RADIUS * asin(sqrt(h < 1.0 ? h : 1.0)));
+}
+
+/*! \brief Calculate distance between two gps coordinates using an equirectangular projection
+ *
+ *   Needs one cos() and one sqrt(). Relative error is below 0.01% for points
+ *   up to 100 km apart at latitudes up to 70 degrees, plus about 0.5 m from
+ *   float precision. Use distance_haversine() for longer ranges.
+ *
+ *  @param lat_a latitude of position A in degrees
+ *  @param lon_a longitude of position A in degrees
+ *  @param lat_b latitude of position B in degrees
+ *  @param lon_b longitude of position B in degrees
+ *
+ *  @return distance in meters
+ */
+float distance_equirect(float lat_a, float lon_a, float lat_b, float lon_b)
+{
+    float dlon = lon_b - lon_a;
+    float x, y;
+
+    if (dlon > 180.0f)
+        dlon -= 360.0f;
+    else if (dlon < -180.0f)
+        dlon += 360.0f;
+    x = (float)(RADIANS(dlon) * cos(RADIANS((lat_a + lat_b) / 2)));
+    y = (float)RADIANS(lat_b - lat_a);
+    return (float)EARTH_RADIUS * sqrtf(x * x + y * y);
+}
+
+/*! \brief Calculate distances from one gps coordinate to many using an equirectangular projection
+ *
+ *   The cosine of latitude is taken once, at position A, so the loop has no
+ *   calls and may be vectorized by the compiler. Relative error is below 0.1%
+ *   for points up to 10 km from A at latitudes up to 70 degrees. As with
+ *   distance_equirect(), longitudes are compared across the antimeridian.
+ *
+ *  @param lat_a latitude of position A in degrees
+ *  @param lon_a longitude of position A in degrees
+ *  @param lat latitude of each position B in degrees
+ *  @param lon longitude of each position B in degrees
+ *  @param dist where to save distance to each position B in meters
+ *  @param n number of positions B
+ */
+void distance_batch(
+    float lat_a, float lon_a, const float *lat, const float *lon, float *dist, int n)
+{
+    const float kx = (float)(EARTH_RADIUS * RADIANS(1.0) * cos(RADIANS(lat_a)));
+    const float ky = (float)(EARTH_RADIUS * RADIANS(1.0));
+
+    for (int i = 0; i < n; i++) {
+        float dlon = lon[i] - lon_a;
+        float x, y;
+
+        /* wrap to +/-180 degrees as distance_equirect() does, without a branch */
+        dlon -= 360.0f * (float)(int)(dlon / 180.0f);
+        x = kx * dlon;
+        y = ky * (lat[i] - lat_a);
+
+        dist[i] = sqrtf(x * x + y * y);
+    }
+}
+
+/* cos of each whole degree of latitude 0 to 90 in Q15 */
+static const uint16_t cos_q15[91] = { 32768, 32763, 32748, 32723, 32688, 32643, 32588, 32524,
+    32449, 32365, 32270, 32166, 32052, 31928, 31795, 31651, 31499, 31336, 31164, 30983, 30792,
+    30592, 30382, 30163, 29935, 29698, 29452, 29197, 28932, 28660, 28378, 28088, 27789, 27482,
+    27166, 26842, 26510, 26170, 25822, 25466, 25102, 24730, 24351, 23965, 23571, 23170, 22763,
+    22348, 21926, 21498, 21063, 20622, 20174, 19720, 19261, 18795, 18324, 17847, 17364, 16877,
+    16384, 15886, 15384, 14876, 14365, 13848, 13328, 12803, 12275, 11743, 11207, 10668, 10126,
+    9580, 9032, 8481, 7927, 7371, 6813, 6252, 5690, 5126, 4560, 3993, 3425, 2856, 2286, 1715, 1144,
+    572, 0 };
+
+/*! \brief integer square root
+ *
+ *  @param v value
+ *
+ *  @return largest integer whose square is no more than v
+ */
+static uint64_t isqrt64(uint64_t v)
+{
+    uint64_t r = 0, bit = (uint64_t)1 << 62;
+
+    while (bit > v)
+        bit >>= 2;
+    while (bit) {
+        if (v >= r + bit) {
+            v -= r + bit;
+            r = (r >> 1) + bit;
+        } else
+            r >>= 1;
+        bit >>= 2;
+    }
+    return r;
+}
+
+/*! \brief Calculate distance between two gps coordinates in fixed point
+ *
+ *   An equirectangular projection using only integer arithmetic, for
+ *   processors without floating point. The cosine of latitude is interpolated
+ *   from a table of whole degrees. Relative error is below 0.05% for points
+ *   up to 100 km apart at latitudes up to 70 degrees.
+ *
+ *  @param lat_a latitude of position A in 1e-7 degrees
+ *  @param lon_a longitude of position A in 1e-7 degrees
+ *  @param lat_b latitude of position B in 1e-7 degrees
+ *  @param lon_b longitude of position B in 1e-7 degrees
+ *
+ *  @return distance in meters
+ */
+uint32_t distance_fixed(int32_t lat_a, int32_t lon_a, int32_t lat_b, int32_t lon_b)
+{
+    int64_t dlon = (int64_t)lon_b - lon_a;
+    int64_t dlat = (int64_t)lat_b - lat_a;
+    int64_t mean = ((int64_t)lat_a + lat_b) / 2;
+    uint32_t deg, frac, c;
+    int64_t x;
+
+    if (dlon > 1800000000)
+        dlon -= 3600000000LL;
+    else if (dlon < -1800000000)
+        dlon += 3600000000LL;
+    if (mean < 0)
+        mean = -mean;
+    deg = (uint32_t)(mean / 10000000);
+    frac = (uint32_t)(mean % 10000000);
+    if (deg >= 90)
+        c = 0;
+    else
+        c = cos_q15[deg] - (uint32_t)(((uint64_t)(cos_q15[deg] - cos_q15[deg + 1]) * frac) / 10000000);
+    x = (dlon * (int64_t)c) >> 15;
+    /* 1e-7 degree of arc is 0.0111195 m */
+    return (uint32_t)((isqrt64((uint64_t)(x * x + dlat * dlat)) * 111195 + 5000000) / 10000000);
+}
+
+/*! \brief Combine several location estimates into one, each weighted
+ *
+ *   Longitudes are taken relative to the first estimate, so as not to average
+ *   across 180 degrees. The resulting hpe is the weighted mean hpe plus the
+ *   weighted RMS distance of the estimates from the combined position.
+ *
+ *  @param n number of estimates, at least 1
+ *  @param weight weight of each estimate, with a positive sum
+ *  @param lat latitude of each estimate in degrees
+ *  @param lon longitude of each estimate in degrees
+ *  @param hpe hpe of each estimate in meters
+ *  @param loc where to save lat, lon and hpe of the combined location
+ */
+void combine_locations(int n, const float *weight, const float *lat, const float *lon,
+    const float *hpe, Sky_location_t *loc)
+{
+    float sum = 0.0f, clat = 0.0f, clon = 0.0f, chpe = 0.0f, spread = 0.0f;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        float dlon = lon[i] - lon[0];
+
+        if (dlon > 180.0f)
+            dlon -= 360.0f;
+        else if (dlon < -180.0f)
+            dlon += 360.0f;
+        sum += weight[i];
+        clat += weight[i] * lat[i];
+        clon += weight[i] * dlon;
+        chpe += weight[i] * hpe[i];
+    }
+    clat /= sum;
+    clon = lon[0] + clon / sum;
+    if (clon > 180.0f)
+        clon -= 360.0f;
+    else if (clon < -180.0f)
+        clon += 360.0f;
+    for (i = 0; i < n; i++) {
+        float d = distance_equirect(clat, clon, lat[i], lon[i]);
+
+        spread += weight[i] * d * d;
+    }
+    chpe = chpe / sum + sqrtf(spread / sum);
+
+    loc->lat = clat;
+    loc->lon = clon;
+    loc->hpe = chpe < UINT16_MAX ? (uint16_t)chpe : UINT16_MAX;
+}
+
 #ifdef UNITTESTS
 
 BEGIN_TESTS(test_utilities)
@@ -46,6 +46,7 @@
 Sky_status_t set_error_status(Sky_errno_t *sky_errno, Sky_errno_t code);
 bool validate_beacon(Beacon_t *b, Sky_rctx_t *rctx);
 bool validate_request_ctx(Sky_rctx_t *rctx);
+uint32_t session_ctx_size(int num_cachelines, uint32_t *pool_size);
 bool validate_session_ctx(Sky_sctx_t *sctx, Sky_loggerfn_t logf);
 bool is_tbr_enabled(Sky_rctx_t *rctx);
 #if SKY_LOGGING
@@ -63,6 +64,7 @@ void dump_cache(Sky_rctx_t *rctx, const char *file, const char *func);
 int dump_hex16(const char *file, const char *function, Sky_rctx_t *rctx, Sky_log_level_t level,
     void *buffer, uint32_t bufsize, uint32_t buf_offset);
 void config_defaults(Sky_sctx_t *sctx);
+uint32_t match_all_threshold(Sky_sctx_t *sctx);
 int32_t get_num_beacons(Sky_rctx_t *rctx, Sky_beacon_type_t t);
 int32_t get_num_cells(Sky_rctx_t *rctx);
 int get_base_beacons(Sky_rctx_t *rctx, Sky_beacon_type_t t);
@@ -115,4 +117,13 @@ void select_vap(Sky_rctx_t *rctx);
 
 int sky_rand_fn(uint8_t *rand_buf, uint32_t bufsize);
 float distance_A_to_B(float lat_a, float lon_a, float lat_b, float lon_b);
+void gnss_unit_vector(float lat, float lon, float v[3]);
+float gnss_chord2(uint32_t distance);
+float distance_haversine(float lat_a, float lon_a, float lat_b, float lon_b);
+float distance_equirect(float lat_a, float lon_a, float lat_b, float lon_b);
+void distance_batch(
+    float lat_a, float lon_a, const float *lat, const float *lon, float *dist, int n);
+uint32_t distance_fixed(int32_t lat_a, int32_t lon_a, int32_t lat_b, int32_t lon_b);
+void combine_locations(int n, const float *weight, const float *lat, const float *lon,
+    const float *hpe, Sky_location_t *loc);
 #endif
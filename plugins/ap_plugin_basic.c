@@ -30,16 +30,21 @@
 #include <math.h>
 #include <limits.h>
 #include "libel.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 /* set VERBOSE_DEBUG to true to enable extra logging */
 #ifndef VERBOSE_DEBUG
 #define VERBOSE_DEBUG false
 #endif // VERBOSE_DEBUG
 
-#define IDX(b, rctx) ((b) - (rctx)->beacon)
+#define IDX(b, rctx) beacon_index((rctx), (b))
 #define ABS(a) (((a) < 0) ? (-(a)) : (a))
 #define AP_BELOW_RSSI_THRESHOLD(ctx, idx)                                                          \
-    (EFFECTIVE_RSSI((ctx)->beacon[(idx)].h.rssi) <                                                 \
+    (EFFECTIVE_RSSI(RCTX_BEACON((ctx), (idx)).h.rssi) <                                            \
         -(int)CONFIG((ctx)->session, cache_neg_rssi_threshold))
 
 /* Attribute priorities are prioritized as follows
@@ -149,14 +154,36 @@ static Sky_status_t compare(Sky_rctx_t *rctx, Beacon_t *a, Beacon_t *b, int *dif
 }
 
 #if !SKY_EXCLUDE_WIFI_SUPPORT
+#define MAC_NIBBLES (MAC_SIZE * 2)
+#define LOCAL_ADMIN_BIT (0x02ULL << (8 * (MAC_SIZE - 1)))
+#define NIBBLE_LSBS 0x111111111111ULL /* least significant bit of every nibble in packed MAC */
+
+/*! \brief pack a MAC address into an integer, first byte most significant
+ *
+ *  @param mac pointer to MAC address
+ *
+ *  @return packed MAC
+ */
+static uint64_t mac_pack(const uint8_t mac[])
+{
+    uint64_t packed = 0;
+
+    for (int n = 0; n < MAC_SIZE; n++)
+        packed = (packed << 8) | mac[n];
+    return packed;
+}
+
 /*! \brief test two MAC addresses for being members of same virtual Group
  *
  *   Similar means the two mac addresses differ only in one nibble AND
  *   if that nibble is the second-least-significant bit of second hex digit,
  *   then that bit must match too.
  *
- *  @param macA pointer to the first MAC
- *  @param macB pointer to the second MAC
+ *   The nibbles which differ are found all at once: each nibble of the XOR of the
+ *   MACs is folded into its low bit, and at most one such bit may be set.
+ *
+ *  @param a the first MAC packed by mac_pack
+ *  @param b the second MAC packed by mac_pack
  *  @param pn pointer to nibble index of where they differ if similar (0-11) (needed for premium)
  *
  *  @return negative, 0 or positive:
@@ -166,56 +193,324 @@ static Sky_status_t compare(Sky_rctx_t *rctx, Beacon_t *a, Beacon_t *b, int *dif
  *
  *  if macs are similar, and pn is not NULL, *pn is set to nibble index of difference
  */
-static int mac_similar(const uint8_t macA[], const uint8_t macB[], int *pn)
+static int mac_similar(uint64_t a, uint64_t b, int *pn)
 {
-    size_t num_diff = 0; // Num hex digits which differ
-    size_t idx_diff = 0; // nibble digit which differs
-    size_t n;
-    int result = 1;
+    uint64_t diff = a ^ b;
+    uint64_t nibbles = (diff | (diff >> 1) | (diff >> 2) | (diff >> 3)) & NIBBLE_LSBS;
+    int n;
 
-    /* for each nibble, increment count if different */
-    for (n = 0; n < MAC_SIZE * 2; n++) {
-        if ((macA[n / 2] & NIBBLE_MASK(n)) != (macB[n / 2] & NIBBLE_MASK(n))) {
-            if (++num_diff > 1)
-                return 0;
-            idx_diff = n;
-            result = macA[n / 2] - macB[n / 2];
-        }
+    /* more than one nibble differs, or their respective local admin bits differ */
+    if ((nibbles & (nibbles - 1)) != 0 || (diff & LOCAL_ADMIN_BIT) != 0)
+        return 0; /* not similar */
+
+    /* report which nibble is different */
+    if (pn) {
+        for (n = MAC_NIBBLES - 1; nibbles > 1; nibbles >>= 4)
+            n--;
+        *pn = nibbles ? n : 0;
     }
+    return a < b ? -1 : 1;
+}
 
-    /* No more than one nibble is different, so they're similar. Unless their respective
-     * local admin bits differ, in which case, they're not.
-     */
-    if (LOCAL_ADMIN_MASK(macA[0]) != LOCAL_ADMIN_MASK(macB[0])) {
-        return 0; /* not similar */
+#if CACHE_SIZE
+/*! \brief test one packed MAC address against an array of them
+ *
+ *   Where SSE2 or NEON is available, two MACs are tested at a time in vector
+ *   registers, the same way as mac_similar(). The remaining MACs are tested
+ *   by a loop with no branches, so compilers may vectorize it
+ *
+ *  @param mac MAC packed by mac_pack
+ *  @param macs array of packed MACs
+ *  @param num_macs number of MACs in array
+ *  @param similar where to save, for each MAC in array, true if similar to mac
+ *
+ *  @return number of MACs in array which are similar to mac
+ */
+static int mac_similar_batch(uint64_t mac, const uint64_t macs[], int num_macs, bool similar[])
+{
+    int i = 0, num_similar = 0;
+#if defined(__SSE2__)
+    const __m128i m = _mm_set1_epi64x((long long)mac);
+    const __m128i lsbs = _mm_set1_epi64x((long long)NIBBLE_LSBS);
+    const __m128i admin = _mm_set1_epi64x((long long)LOCAL_ADMIN_BIT);
+    const __m128i one = _mm_set1_epi64x(1);
+
+    for (; i + 1 < num_macs; i += 2) {
+        __m128i diff = _mm_xor_si128(m, _mm_loadu_si128((const __m128i *)&macs[i]));
+        __m128i nibbles = _mm_and_si128(
+            _mm_or_si128(_mm_or_si128(diff, _mm_srli_epi64(diff, 1)),
+                _mm_or_si128(_mm_srli_epi64(diff, 2), _mm_srli_epi64(diff, 3))),
+            lsbs);
+        __m128i bad = _mm_or_si128(
+            _mm_and_si128(nibbles, _mm_sub_epi64(nibbles, one)), _mm_and_si128(diff, admin));
+        /* SSE2 compares 32 bit lanes, a MAC is similar when both halves of its lane are zero */
+        __m128i zero = _mm_cmpeq_epi32(bad, _mm_setzero_si128());
+        int mask = _mm_movemask_epi8(
+            _mm_and_si128(zero, _mm_shuffle_epi32(zero, _MM_SHUFFLE(2, 3, 0, 1))));
+
+        similar[i] = (mask & 0x00ff) == 0x00ff;
+        similar[i + 1] = (mask & 0xff00) == 0xff00;
+        num_similar += similar[i] + similar[i + 1];
+    }
+#elif defined(__ARM_NEON)
+    const uint64x2_t m = vdupq_n_u64(mac);
+    const uint64x2_t lsbs = vdupq_n_u64(NIBBLE_LSBS);
+    const uint64x2_t admin = vdupq_n_u64(LOCAL_ADMIN_BIT);
+    const uint64x2_t one = vdupq_n_u64(1);
+
+    for (; i + 1 < num_macs; i += 2) {
+        uint64x2_t diff = veorq_u64(m, vld1q_u64(&macs[i]));
+        uint64x2_t nibbles =
+            vandq_u64(vorrq_u64(vorrq_u64(diff, vshrq_n_u64(diff, 1)),
+                          vorrq_u64(vshrq_n_u64(diff, 2), vshrq_n_u64(diff, 3))),
+                lsbs);
+        uint64x2_t bad =
+            vorrq_u64(vandq_u64(nibbles, vsubq_u64(nibbles, one)), vandq_u64(diff, admin));
+
+        similar[i] = vgetq_lane_u64(bad, 0) == 0;
+        similar[i + 1] = vgetq_lane_u64(bad, 1) == 0;
+        num_similar += similar[i] + similar[i + 1];
     }
+#endif // __SSE2__ / __ARM_NEON
+    for (; i < num_macs; i++) {
+        uint64_t diff = mac ^ macs[i];
+        uint64_t nibbles = (diff | (diff >> 1) | (diff >> 2) | (diff >> 3)) & NIBBLE_LSBS;
 
-    /* report which nibble is different */
-    if (pn)
-        *pn = idx_diff;
-    return result;
+        similar[i] = ((nibbles & (nibbles - 1)) | (diff & LOCAL_ADMIN_BIT)) == 0;
+        num_similar += similar[i];
+    }
+    return num_similar;
+}
+#endif // CACHE_SIZE
+
+/* Virtual group keys
+ *
+ * Two MACs are similar when they are the same apart from one nibble, n. Wildcarding
+ * nibble n of both MACs (but keeping the local admin bit) then gives the same key.
+ * Each AP has one key per nibble, so APs are similar exactly when they share a key
+ * for the same nibble, and virtual groups can be found by hashing the keys.
+ */
+#define MAX_VG_APS (MAX_AP_BEACONS + 1) /* request rctx may hold one extra AP while filtering */
+#define VG_TABLE_SIZE (2 * MAC_NIBBLES * MAX_VG_APS) /* table is at most half full */
+
+/*! \brief table of virtual group keys of APs in request rctx
+ */
+typedef struct {
+    uint64_t mac[MAX_VG_APS]; /* MAC of each AP packed into an integer */
+    struct {
+        uint8_t ap; /* 1 + index of AP with this key (0 == empty slot) */
+        uint8_t nibble; /* nibble wildcarded in this key */
+    } slot[VG_TABLE_SIZE];
+} Vg_table_t;
+
+/*! \brief key of a MAC with one nibble wildcarded
+ *
+ *  @param mac MAC packed into an integer
+ *  @param n nibble index (0-11)
+ *
+ *  @return key
+ */
+static uint64_t vg_key(uint64_t mac, int n)
+{
+    return mac & (~(0xFULL << (4 * (MAC_NIBBLES - 1 - n))) | LOCAL_ADMIN_BIT);
+}
+
+/*! \brief home slot of a key in the virtual group table
+ *
+ *  @param key key of MAC with nibble n wildcarded
+ *  @param n nibble index (0-11)
+ *
+ *  @return slot index
+ */
+static uint32_t vg_slot(uint64_t key, int n)
+{
+    key ^= (uint64_t)n << 48;
+    key *= 0x9E3779B97F4A7C15ULL; /* Fibonacci hashing */
+    return (uint32_t)(key >> 32) % VG_TABLE_SIZE;
+}
+
+/*! \brief prepare an empty virtual group table for the APs in request rctx
+ *
+ *  @param vg pointer to table
+ *  @param rctx Skyhook request context
+ */
+static void vg_table_init(Vg_table_t *vg, Sky_rctx_t *rctx)
+{
+    for (int i = 0; i < NUM_APS(rctx) && i < MAX_VG_APS; i++)
+        vg->mac[i] = mac_pack(RCTX_BEACON(rctx, i).ap.mac);
+    memset(vg->slot, 0, sizeof(vg->slot));
+}
+
+/*! \brief add all keys of an AP to the virtual group table
+ *
+ *  @param vg pointer to table
+ *  @param ap index of AP in request rctx
+ */
+static void vg_table_add(Vg_table_t *vg, int ap)
+{
+    for (int n = 0; n < MAC_NIBBLES; n++) {
+        uint32_t s = vg_slot(vg_key(vg->mac[ap], n), n);
+
+        while (vg->slot[s].ap)
+            s = (s + 1) % VG_TABLE_SIZE;
+        vg->slot[s].ap = (uint8_t)(ap + 1);
+        vg->slot[s].nibble = (uint8_t)n;
+    }
+}
+
+/*! \brief find the APs in the virtual group table which are similar to an AP
+ *
+ *  @param vg pointer to table
+ *  @param ap index of AP in request rctx
+ *  @param found where to save the indexes of similar APs, or NULL
+ *
+ *  @return number of similar APs found (at most 1 if found is NULL)
+ */
+static int vg_table_similar(Vg_table_t *vg, int ap, int found[])
+{
+    int num_found = 0;
+
+    for (int n = 0; n < MAC_NIBBLES; n++) {
+        uint64_t key = vg_key(vg->mac[ap], n);
+
+        for (uint32_t s = vg_slot(key, n); vg->slot[s].ap; s = (s + 1) % VG_TABLE_SIZE) {
+            int other = vg->slot[s].ap - 1, k;
+
+            if (other == ap || vg->slot[s].nibble != n || vg_key(vg->mac[other], n) != key)
+                continue;
+            if (found == NULL)
+                return 1;
+            /* identical MACs share every key, so report each AP only once */
+            for (k = 0; k < num_found && found[k] != other; k++)
+                ;
+            if (k == num_found)
+                found[num_found++] = other;
+        }
+    }
+    return num_found;
 }
 
 #if CACHE_SIZE
+/*! \brief sort AP indices into ascending MAC order
+ *
+ *   Insertion sort, as AP lists are short
+ *
+ *  @param rctx Skyhook request context
+ *  @param order where to save the index of each AP in MAC order
+ */
+static void sort_aps_by_mac(Sky_rctx_t *rctx, uint8_t order[])
+{
+    int i, j;
+
+    for (i = 0; i < NUM_APS(rctx); i++) {
+        uint8_t idx = (uint8_t)i;
+
+        for (j = i; j > 0 && memcmp(RCTX_BEACON(rctx, order[j - 1]).ap.mac,
+                                 RCTX_BEACON(rctx, idx).ap.mac, MAC_SIZE) > 0;
+             j--)
+            order[j] = order[j - 1];
+        order[j] = idx;
+    }
+}
+
+/*! \brief order the APs of a cacheline by MAC
+ *
+ *  @param sctx Skyhook session context
+ *  @param cl pointer to cacheline, whose ap_order is set
+ */
+static void sort_cached_aps_by_mac(Sky_sctx_t *sctx, Sky_cacheline_t *cl)
+{
+    int i, j;
+
+#if CACHE_SOA_LAYOUT
+    (void)sctx; /* suppress warning unused parameter */
+#endif // CACHE_SOA_LAYOUT
+    for (i = 0; i < NUM_APS(cl); i++) {
+        uint8_t idx = (uint8_t)i;
+
+        for (j = i; j > 0 && memcmp(CL_AP_MAC(sctx, cl, cl->ap_order[j - 1]),
+                                 CL_AP_MAC(sctx, cl, idx), MAC_SIZE) > 0;
+             j--)
+            cl->ap_order[j] = cl->ap_order[j - 1];
+        cl->ap_order[j] = idx;
+    }
+}
+
+/*! \brief compute the two signature bits of an AP
+ *
+ *   MACs in the same virtual group differ in a single nibble, so they agree on
+ *   either all the high nibbles or all the low nibbles of the address. One
+ *   bit is hashed from each set of nibbles, so APs which are identical or
+ *   similar always have a signature bit in common.
+ *
+ *  @param mac pointer to MAC address
+ *  @param bits where to save the two bit indices
+ */
+static void ap_signature_bits(const uint8_t mac[], uint8_t bits[2])
+{
+    uint32_t hi = 2166136261u, lo = 2166136261u; /* FNV-1a */
+
+    for (int n = 0; n < MAC_SIZE; n++) {
+        hi = (hi ^ (mac[n] & 0xF0)) * 16777619u;
+        lo = (lo ^ (mac[n] & 0x0F)) * 16777619u;
+    }
+    bits[0] = (uint8_t)((hi >> 24) % (AP_SIGNATURE_SIZE * 8));
+    bits[1] = (uint8_t)((lo >> 24) % (AP_SIGNATURE_SIZE * 8));
+}
+
+#define SIGNATURE_HAS_BIT(sig, bit) ((sig)[(bit) / 8] & (1 << ((bit) % 8)))
+
 /*! \brief count number of cached APs in request rctx relative to a cacheline
  *         APs that belong to same Virtual group are considered present in cache
  *
+ *   Identical APs are counted by a merge-join of the request and cacheline APs,
+ *   both in MAC order. Only APs left unmatched are then compared pairwise
+ *   for membership of the same virtual group.
+ *
  *  @param rctx Skyhook request context
+ *  @param order index of each request rctx AP, in ascending MAC order
  *  @param cl the cacheline to count in, otherwise count in request rctx
  *
  *  @return number of cached APs or -1 for fatal error
  */
-static int count_cached_aps_in_request_ctx(Sky_rctx_t *rctx, Sky_cacheline_t *cl)
+static int count_cached_aps_in_request_ctx(
+    Sky_rctx_t *rctx, const uint8_t order[], Sky_cacheline_t *cl)
 {
     int num_aps_cached = 0;
-    int j, i;
+    int j, i, diff;
     bool matched[MAX_AP_BEACONS] = { false }; /* each AP in cache is matched only once */
+    bool found[TOTAL_BEACONS + 1] = { false }; /* request rctx APs already matched */
+    bool similar[MAX_AP_BEACONS]; /* cacheline APs similar to request rctx AP */
+    uint64_t cl_mac[MAX_AP_BEACONS]; /* packed MACs of cacheline APs */
+
+    /* step through both sorted lists together, counting identical APs */
+    for (j = 0, i = 0; j < NUM_APS(rctx) && i < NUM_APS(cl);) {
+        diff = memcmp(RCTX_BEACON(rctx, order[j]).ap.mac,
+            CL_AP_MAC(rctx->session, cl, cl->ap_order[i]), MAC_SIZE);
+        if (diff < 0)
+            j++;
+        else if (diff > 0)
+            i++;
+        else {
+            found[order[j++]] = true;
+            matched[cl->ap_order[i++]] = true;
+            num_aps_cached++;
+        }
+    }
 
-    /* step through each AP in request context looking for a matching AP in cache */
-    for (j = 0; j < NUM_APS(rctx); j++) {
+    if (num_aps_cached == NUM_APS(rctx) || num_aps_cached == NUM_APS(cl))
+        return num_aps_cached; /* no APs left to compare */
+
+    /* step through remaining APs in request context looking for a similar AP in cache */
+    for (i = 0; i < NUM_APS(cl); i++)
+        cl_mac[i] = mac_pack(CL_AP_MAC(rctx->session, cl, i));
+    for (j = 0; j < NUM_APS(rctx) && num_aps_cached < NUM_APS(cl); j++) {
+        if (found[j] ||
+            mac_similar_batch(
+                mac_pack(RCTX_BEACON(rctx, j).ap.mac), cl_mac, NUM_APS(cl), similar) == 0)
+            continue;
         for (i = 0; i < NUM_APS(cl); i++) {
-            if (!matched[i] &&
-                (mac_similar(rctx->beacon[j].ap.mac, cl->beacon[i].ap.mac, NULL) != 0)) {
+            if (!matched[i] && similar[i]) {
                 num_aps_cached++;
                 matched[i] = true;
                 break;
@@ -239,27 +534,18 @@ static int count_cached_aps_in_request_ctx(Sky_rctx_t *rctx, Sky_cacheline_t *cl
  */
 static uint32_t count_uniq_vg(Sky_rctx_t *rctx)
 {
-    bool redundant_ap[MAX_AP_BEACONS] = { false };
+    Vg_table_t vg; /* keys of the APs counted so far */
     int num_aps = 0;
-    int i, j;
+    int i;
 
+    vg_table_init(&vg, rctx);
     /* step through APs in request ctx */
-    for (i = 0; i < NUM_APS(rctx); i++) {
-        if (!redundant_ap[i]) {
-            /* count those that are not part of a VG */
-            num_aps++;
-        } else
-            continue; /* this AP is known to be in a VG so skip it */
-
-        /* Scan remaining APs looking for any in the same VG as the current AP */
-        /* compare each beacon to all others, ignoring APs already known to be in VG */
-        for (j = i + 1; j < NUM_APS(rctx); j++) {
-            if (!redundant_ap[j]) {
-                if (mac_similar(rctx->beacon[i].ap.mac, rctx->beacon[j].ap.mac, NULL) != 0) {
-                    redundant_ap[j] = true; /* note that this AP is a member of VG */
-                }
-            }
-        }
+    for (i = 0; i < NUM_APS(rctx) && i < MAX_VG_APS; i++) {
+        /* skip APs in the same VG as an AP already counted */
+        if (vg_table_similar(&vg, i, NULL))
+            continue;
+        num_aps++;
+        vg_table_add(&vg, i);
     }
     LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "%d APs are unique", num_aps);
     return num_aps;
@@ -278,7 +564,9 @@ static uint32_t count_uniq_vg(Sky_rctx_t *rctx)
  */
 static bool remove_virtual_ap(Sky_rctx_t *rctx)
 {
-    int i, j;
+    int i, j, k, num_similar;
+    int similar[MAX_VG_APS]; /* APs in same virtual group as AP j */
+    Vg_table_t vg; /* keys of APs which are not connected */
     Beacon_t *vap_a = NULL;
     Beacon_t *vap_b = NULL;
     Beacon_t *worst_vap = NULL;
@@ -287,42 +575,50 @@ static bool remove_virtual_ap(Sky_rctx_t *rctx)
         return false;
     }
 
-    if (rctx->beacon[0].h.type != SKY_BEACON_AP) {
+    if (RCTX_BEACON(rctx, 0).h.type != SKY_BEACON_AP) {
         LOGFMT(rctx, SKY_LOG_LEVEL_CRITICAL, "beacon type not WiFi");
         return false;
     }
 
+    /* index the APs, ignoring those which are connected */
+    vg_table_init(&vg, rctx);
+    for (j = 0; j < NUM_APS(rctx) && j < MAX_VG_APS; j++) {
+        if (!RCTX_BEACON(rctx, j).h.connected)
+            vg_table_add(&vg, j);
+    }
+
     /*
-     * Iterate over all beacon pairs. For each pair whose members are "similar" to
-     * one another (i.e., which are part of the same virtual AP (VAP) group),
-     * identify which member of the pair is a candidate for removal. After iterating,
-     * remove the worse such candidate. Note: connected APs are ignored.
+     * Iterate over all beacon pairs whose members are "similar" to one another
+     * (i.e., which are part of the same virtual AP (VAP) group), as found in the
+     * table of keys. For each pair, identify which member of the pair is a candidate
+     * for removal. After iterating, remove the worse such candidate.
      */
     for (j = NUM_APS(rctx) - 1; j > 0; j--) {
         /* if connected, ignore this AP */
-        if (rctx->beacon[j].h.connected)
+        if (j >= MAX_VG_APS || RCTX_BEACON(rctx, j).h.connected)
             continue;
-        for (i = j - 1; i >= 0; i--) {
-            /* if connected, ignore this AP */
-            if (rctx->beacon[i].h.connected)
+        num_similar = vg_table_similar(&vg, j, similar);
+        for (k = 0; k < num_similar; k++) {
+            /* each pair is considered once, when j is the later AP */
+            if ((i = similar[k]) > j)
                 continue;
 
-            int mac_diff = mac_similar(
-                rctx->beacon[i].ap.mac, rctx->beacon[j].ap.mac, NULL); // <0 => i is better
+            int mac_diff = mac_similar(vg.mac[i], vg.mac[j], NULL); // <0 => i is better
             if (mac_diff != 0) {
                 /* The MACs are similar (part of the same VAP group). Removal candidate is
                  * the one with worse properties, or, if properties are the same, the one with
                  * the higher MAC address.
                  */
-                int preferred_status = COMPARE_CONNECTED_USED(&rctx->beacon[i], &rctx->beacon[j]);
+                int preferred_status =
+                    COMPARE_CONNECTED_USED(&RCTX_BEACON(rctx, i), &RCTX_BEACON(rctx, j));
                 if (preferred_status > 0 || (preferred_status == 0 && mac_diff < 0)) {
                     /* i is better (either because of major properties or mac). j becomes removal candidate */
-                    vap_a = &rctx->beacon[j];
-                    vap_b = &rctx->beacon[i];
+                    vap_a = &RCTX_BEACON(rctx, j);
+                    vap_b = &RCTX_BEACON(rctx, i);
                 } else {
                     /* j is better. i becomes removal candidate */
-                    vap_a = &rctx->beacon[i];
-                    vap_b = &rctx->beacon[j];
+                    vap_a = &RCTX_BEACON(rctx, i);
+                    vap_b = &RCTX_BEACON(rctx, j);
                 }
 #if VERBOSE_DEBUG
                 LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "%d similar and worse than %d%s",
@@ -368,11 +664,11 @@ static bool remove_oldest_ap(Sky_rctx_t *rctx)
 
     /* Find the youngest and oldest APs */
     for (i = 0; i < NUM_APS(rctx); i++) {
-        if (rctx->beacon[i].h.age < youngest_age) {
-            youngest_age = rctx->beacon[i].h.age;
+        if (RCTX_BEACON(rctx, i).h.age < youngest_age) {
+            youngest_age = RCTX_BEACON(rctx, i).h.age;
         }
-        if (rctx->beacon[i].h.age > oldest_age) {
-            oldest_age = rctx->beacon[i].h.age;
+        if (RCTX_BEACON(rctx, i).h.age > oldest_age) {
+            oldest_age = RCTX_BEACON(rctx, i).h.age;
             oldest_idx = i;
         }
     }
@@ -401,7 +697,6 @@ static Sky_status_t remove_worst(Sky_rctx_t *rctx)
 #if !SKY_EXCLUDE_WIFI_SUPPORT
     int idx_of_worst;
 
-    idx_of_worst = set_priorities(rctx);
     /* no work to do if request context is not full of max APs */
     if (NUM_APS(rctx) <= CONFIG(rctx->session, max_ap_beacons)) {
         LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "No need to remove AP");
@@ -409,11 +704,12 @@ static Sky_status_t remove_worst(Sky_rctx_t *rctx)
     }
 
     DUMP_REQUEST_CTX(rctx);
-    LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Overall worst AP idx: %d", idx_of_worst);
 
     /* beacon is AP and is subject to filtering */
     /* discard virtual duplicates or remove one based on age, rssi distribution etc */
+    /* priorities are only needed if neither of the first two removes an AP */
     if (!remove_virtual_ap(rctx) && !remove_oldest_ap(rctx)) {
+        idx_of_worst = set_priorities(rctx);
         LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "removing worst AP idx: %d", idx_of_worst);
         return remove_beacon(rctx, idx_of_worst);
     }
@@ -432,6 +728,10 @@ static Sky_status_t remove_worst(Sky_rctx_t *rctx)
  *    . If just a few APs, compare all APs with higher threshold
  *    . If no APs, compare cells for 100% match
  *
+ *   APs with the same MAC in request rctx and cacheline are counted as
+ *   beacons are added, so when those account for all APs of either, the
+ *   cacheline is scored without comparing APs again.
+ *
  *   If any cacheline score meets threshold, accept it
  *   setting hit to true and from_cache to cachline index.
  *   While searching, keep track of best cacheline to
@@ -447,6 +747,8 @@ static Sky_status_t match(Sky_rctx_t *rctx)
 {
 #if CACHE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
     int i; /* i iterates through cacheline */
+    int k, n; /* k iterates through the n cachelines listed in lines */
+    uint16_t lines[CACHE_SIZE]; /* cachelines which may share the serving cell of request */
     float ratio; /* 0.0 <= ratio <= 1.0 is the degree to which request rctx matches cacheline
                     In typical case this is the intersection(request rctx, cache) / union(request rctx, cache) */
     float bestratio = 0.0f;
@@ -457,40 +759,43 @@ static Sky_status_t match(Sky_rctx_t *rctx)
     int bestc = -1;
     int16_t bestput = -1;
     int bestthresh = 0;
+    int j, possible; /* possible is upper bound of APs in both request rctx and cacheline */
+    uint8_t ap_order[TOTAL_BEACONS + 1]; /* request rctx APs in MAC order */
+    uint8_t ap_bits[TOTAL_BEACONS + 1][2]; /* signature bits of request rctx APs */
+    bool counted; /* APs held in each cacheline were counted as they were added */
+    bool sorted = false; /* ap_order and ap_bits are only needed if counts are not enough */
     Sky_cacheline_t *cl;
 
-    /* expire old cachelines and note first empty cacheline as best line to save to */
-    for (i = 0; i < rctx->session->num_cachelines; i++) {
-        cl = &rctx->session->cacheline[i];
-        /* if cacheline is old, mark it empty */
-        if (cl->time != CACHE_EMPTY &&
-            (rctx->header.time - cl->time) >
-                (CONFIG(rctx->session, cache_age_threshold) * SECONDS_IN_HOUR)) {
-            LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Cacheline %d expired", i);
-            cl->time = CACHE_EMPTY;
-        }
-        if (cl->time == CACHE_EMPTY) {
-            /* We've found an empty cache line, which is the best */
-            /* possible place to put a new scan. Mark it as such. */
-            bestput = (int16_t)i;
-            bestputratio = 0.0f;
-        }
+    /* expire old cachelines and note last empty cacheline as best line to save to */
+    expire_cachelines(rctx, rctx->header.time);
+    if ((bestput = (int16_t)find_empty_cacheline(rctx->session, true)) >= 0) {
+        /* We've found an empty cache line, which is the best */
+        /* possible place to put a new scan. Mark it as such. */
+        bestputratio = 0.0f;
     }
 
     if (NUM_APS(rctx) == 0) {
         LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Unable to compare using APs. No cache match");
         LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Best cacheline to save location: %d of %d score %d",
-            bestput, CACHE_SIZE, (int)round((double)bestputratio * 100));
+            bestput, rctx->session->num_cachelines, (int)round((double)bestputratio * 100));
         return SKY_ERROR;
     }
 
     DUMP_REQUEST_CTX(rctx);
     DUMP_CACHE(rctx);
 
-    /* score each cacheline wrt beacon match ratio */
-    for (i = 0; i < rctx->session->num_cachelines; i++) {
+    counted = cache_count_valid(rctx);
+    if (count_uniq_vg(rctx) <= CONFIG(rctx->session, cache_beacon_threshold))
+        threshold = 99; /* cache hit requires 100% */
+    else
+        threshold = (int)match_all_threshold(rctx->session);
+
+    /* score each cacheline which may share the serving cell wrt beacon match ratio */
+    n = cache_candidates(rctx, lines);
+    for (k = 0; k < n; k++) {
+        i = lines[k];
         cl = &rctx->session->cacheline[i];
-        threshold = score = 0;
+        score = 0;
         ratio = 0.0f;
         if (cl->time == CACHE_EMPTY) {
             LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Cache: %d: Score 0 for empty cacheline", i);
@@ -508,19 +813,47 @@ static Sky_status_t match(Sky_rctx_t *rctx)
             LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG,
                 "Cache: %d: Score 0 for cacheline with difference cell or worse gnss", i);
             continue;
+        } else if (counted && (rctx->cache_count[i] == NUM_APS(rctx) ||
+                                  rctx->cache_count[i] == NUM_APS(cl))) {
+            /* every AP of request rctx or cacheline has the same MAC in the other,
+             * so no further APs can match as members of a virtual group */
+            score = num_aps_cached = rctx->cache_count[i];
+            if (NUM_APS(cl)) {
+                int unionAB = NUM_APS(rctx) + NUM_APS(cl) - num_aps_cached;
+                ratio = (float)score / unionAB;
+            }
+            LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Cache: %d: score %d (%d APs counted as added) vs %d",
+                i, (int)round((double)ratio * 100), score, threshold);
         } else {
-            /* count number of matching APs in request rctx and cache */
-            if ((num_aps_cached = count_cached_aps_in_request_ctx(rctx, cl)) < 0) {
+            if (!sorted) {
+                sort_aps_by_mac(rctx, ap_order);
+                for (j = 0; j < NUM_APS(rctx); j++)
+                    ap_signature_bits(RCTX_BEACON(rctx, j).ap.mac, ap_bits[j]);
+                sorted = true;
+            }
+            /* only APs with a bit in the cacheline signature can be counted as cached */
+            for (j = 0, possible = 0; j < NUM_APS(rctx) && possible < NUM_APS(cl); j++) {
+                if (SIGNATURE_HAS_BIT(cl->ap_signature, ap_bits[j][0]) ||
+                    SIGNATURE_HAS_BIT(cl->ap_signature, ap_bits[j][1]))
+                    possible++;
+            }
+            if (possible == 0) {
+                LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Cache: %d: Score 0 for no APs in common", i);
+            } else if (bestputratio == 0.0f &&
+                       (float)possible * 100 <=
+                           (float)threshold * (NUM_APS(rctx) + NUM_APS(cl) - possible)) {
+                /* line can neither be a hit nor a better line to save to */
+                LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Cache: %d: Skipped, at most %d APs in common",
+                    i, possible);
+                continue;
+            } else if ((num_aps_cached = count_cached_aps_in_request_ctx(rctx, ap_order, cl)) < 0) {
+                /* count number of matching APs in request rctx and cache */
                 return SKY_ERROR;
             } else if (NUM_APS(rctx) && NUM_APS(cl)) {
                 /* Score based on ALL APs */
                 LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Cache: %d: Score based on ALL APs", i);
                 score = num_aps_cached;
                 int unionAB = NUM_APS(rctx) + NUM_APS(cl) - num_aps_cached;
-                if (count_uniq_vg(rctx) <= CONFIG(rctx->session, cache_beacon_threshold))
-                    threshold = 99; /* cache hit requires 100% */
-                else
-                    threshold = CONFIG(rctx->session, cache_match_all_threshold);
                 ratio = (float)score / unionAB;
                 LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Cache: %d: score %d (%d/%d) vs %d", i,
                     (int)round((double)ratio * 100), score, unionAB, threshold);
@@ -555,7 +888,7 @@ static Sky_status_t match(Sky_rctx_t *rctx)
             bestc, (int)round((double)bestratio * 100), bestthresh);
         LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Best cacheline to save location: %d of %d score %d",
             bestput, rctx->session->num_cachelines, (int)round((double)bestputratio * 100));
-        rctx->get_from = false;
+        rctx->hit = false;
     }
     return SKY_SUCCESS;
 #else
@@ -580,45 +913,70 @@ static Sky_status_t to_cache(Sky_rctx_t *rctx, Sky_location_t *loc)
 {
 #if CACHE_SIZE && !SKY_EXCLUDE_WIFI_SUPPORT
     int i = rctx->save_to;
-    int j;
+    int j, merge = -1, num_extra = 0;
+    uint16_t hits;
     Sky_cacheline_t *cl;
+    Sky_cache_ap_t extra[MAX_AP_BEACONS];
 
-    /* compare current time to Mar 1st 2019 */
-    if (loc->time <= TIMESTAMP_2019_03_01) {
+    /* compare current time to Mar 1st 2019, and check that the session has a cache */
+    if (loc->time <= TIMESTAMP_2019_03_01 || rctx->session->num_cachelines < 1) {
         return SKY_ERROR;
     }
 
+    /* a scan of the same place as a cacheline is merged into it */
+    if (loc->location_status == SKY_LOCATION_STATUS_SUCCESS &&
+        (merge = find_consolidation(rctx, loc, extra, &num_extra)) >= 0)
+        i = merge;
     /* if best 'save-to' location was not set by beacon_score, use oldest */
-    if (i < 0) {
-        i = find_oldest(rctx);
-        LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "find_oldest chose cache %d of %d", i,
+    else if (i < 0) {
+        i = find_victim(rctx);
+        LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "find_victim chose cache %d of %d", i,
             rctx->session->num_cachelines);
     }
     cl = &rctx->session->cacheline[i];
+    /* a cacheline refreshed after giving a cache hit, or merged, keeps its hit count */
+    hits = ((IS_CACHE_HIT(rctx) && i == rctx->get_from) || i == merge) ? cl->hits : 0;
     if (loc->location_status != SKY_LOCATION_STATUS_SUCCESS) {
         LOGFMT(rctx, SKY_LOG_LEVEL_WARNING, "Won't add unknown location to cache");
-        cl->time = CACHE_EMPTY; /* clear cacheline */
+        clear_cacheline(rctx, cl);
         LOGFMT(
             rctx, SKY_LOG_LEVEL_DEBUG, "clearing cache %d of %d", i, rctx->session->num_cachelines);
         return SKY_ERROR;
     } else if (cl->time == CACHE_EMPTY)
         LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Saving to empty cache %d of %d", i,
             rctx->session->num_cachelines);
-    else
+    else {
         LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Saving to cache %d of %d", i,
             rctx->session->num_cachelines);
+        clear_cacheline(rctx, cl); /* drop replaced APs from cache index */
+        if (i != merge && !(IS_CACHE_HIT(rctx) && i == rctx->get_from))
+            CACHE_STAT(rctx->session, evictions);
+    }
 
-    cl->num_beacons = NUM_BEACONS(rctx);
-    cl->num_ap = NUM_APS(rctx);
+    if (save_cacheline_beacons(rctx, cl, extra, num_extra) != SKY_SUCCESS) {
+        LOGFMT(rctx, SKY_LOG_LEVEL_WARNING, "No room in cache for %d beacons", NUM_BEACONS(rctx));
+        return SKY_ERROR;
+    }
 #if !SKY_EXCLUDE_GNSS_SUPPORT
     cl->gnss = rctx->gnss;
+    if (has_gnss(cl))
+        gnss_unit_vector(cl->gnss.lat, cl->gnss.lon, cl->gnss_vec);
 #endif // !SKY_EXCLUDE_GNSS_SUPPORT
     cl->loc = *loc;
-    cl->time = loc->time;
-
-    for (j = 0; j < NUM_BEACONS(rctx); j++) {
-        cl->beacon[j] = rctx->beacon[j];
+    cl->time = cl->used = loc->time;
+    cl->hits = hits;
+    cache_expiry_add(rctx->session, cl);
+
+    sort_cached_aps_by_mac(rctx->session, cl);
+    memset(cl->ap_signature, 0, sizeof(cl->ap_signature));
+    for (j = 0; j < NUM_APS(cl); j++) {
+        uint8_t bits[2];
+
+        ap_signature_bits(CL_AP_MAC(rctx->session, cl, j), bits);
+        cl->ap_signature[bits[0] / 8] |= (uint8_t)(1 << (bits[0] % 8));
+        cl->ap_signature[bits[1] / 8] |= (uint8_t)(1 << (bits[1] % 8));
     }
+    cache_index_add(rctx, cl);
     DUMP_CACHE(rctx);
     return SKY_SUCCESS;
 #else
@@ -642,40 +1000,39 @@ static Sky_status_t to_cache(Sky_rctx_t *rctx, Sky_location_t *loc)
  * 2. present in cache: bit 8
  * 3. RSSI deviation from ideal: bits 0-7 plus the fractional part
  *
+ * The band of RSSI values across all APs is the same for every AP, so it is
+ * computed once by the caller.
+ *
  *  @param rctx pointer to request context
- *  @param b pointer to AP
+ *  @param idx index of AP
+ *  @param highest_rssi effective rssi of the strongest AP
+ *  @param band_width spacing of ideal rssi values from one AP to the next
  *
  *  @return computed priority
  */
-static float get_priority(Sky_rctx_t *rctx, Beacon_t *b)
+static float get_priority(Sky_rctx_t *rctx, int idx, int highest_rssi, float band_width)
 {
+    Beacon_t *b = &RCTX_BEACON(rctx, idx);
     float priority = 0;
     float deviation;
-    int lowest_rssi, highest_rssi;
-    float band_width, ideal_rssi;
+    float ideal_rssi;
 
     if (b->h.connected)
         priority += (float)CONNECTED;
 
-    /* Compute the range of RSSI values across all APs. */
-    /* (Note that the list of APs is in rssi order so index 0 is the strongest beacon.) */
-    highest_rssi = EFFECTIVE_RSSI(rctx->beacon[0].h.rssi);
-    lowest_rssi = EFFECTIVE_RSSI(rctx->beacon[NUM_APS(rctx) - 1].h.rssi);
-
     /* Find the deviation of the AP's RSSI from its ideal RSSI. Subtract this number from
      * 128 so that smaller deviations are considered better.
      */
-    band_width = (float)(highest_rssi - lowest_rssi) / (float)(NUM_APS(rctx) - 1);
-    ideal_rssi = (float)highest_rssi - band_width * (float)(IDX(b, rctx));
+    ideal_rssi = (float)highest_rssi - band_width * (float)idx;
     deviation = ABS(EFFECTIVE_RSSI(b->h.rssi) - ideal_rssi);
     priority += 128 - deviation;
-    LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "%d bandwidth:%.1f ideal:%.1f dev:%.1f priority:%.1f",
-        IDX(b, rctx), band_width, ideal_rssi, deviation, priority);
+    LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "%d bandwidth:%.1f ideal:%.1f dev:%.1f priority:%.1f", idx,
+        band_width, ideal_rssi, deviation, priority);
 
 #if VERBOSE_DEBUGC
-    LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "%d rssi:%d ideal:%.1f priority:%.1f", IDX(b, rctx),
+    LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "%d rssi:%d ideal:%.1f priority:%.1f", idx,
         EFFECTIVE_RSSI(b->h.rssi), deviation, priority);
-    LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "%d rssi:%d ideal:%d.%d priority:%d.%d", IDX(b, rctx),
+    LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "%d rssi:%d ideal:%d.%d priority:%d.%d", idx,
         EFFECTIVE_RSSI(b->h.rssi), deviation, (int)(deviation * 10), (int)priority,
         (int)((priority - (int)priority) * 10));
 #endif // VERBOSE_DEBUGC
@@ -697,8 +1054,16 @@ static int set_priorities(Sky_rctx_t *rctx)
     int j, jump, up_down;
     int idx_of_worst = NUM_APS(rctx) / 2;
     float priority_of_worst = HIGHEST_PRIORITY;
+    int lowest_rssi, highest_rssi;
+    float band_width;
     bool weak_only;
 
+    /* Compute the range of RSSI values across all APs. */
+    /* (Note that the list of APs is in rssi order so index 0 is the strongest beacon.) */
+    highest_rssi = EFFECTIVE_RSSI(RCTX_BEACON(rctx, 0).h.rssi);
+    lowest_rssi = EFFECTIVE_RSSI(RCTX_BEACON(rctx, NUM_APS(rctx) - 1).h.rssi);
+    band_width = (float)(highest_rssi - lowest_rssi) / (float)(NUM_APS(rctx) - 1);
+
     /* if weakest AP is below threshold
      * look for lowest priority weak beacon */
     weak_only = (AP_BELOW_RSSI_THRESHOLD(rctx, NUM_APS(rctx) - 1));
@@ -706,14 +1071,14 @@ static int set_priorities(Sky_rctx_t *rctx)
     /* search to the middle of range looking for worst AP */
     for (jump = NUM_APS(rctx), up_down = 1, j = 0; j >= 0 && j < NUM_APS(rctx) && jump > 0;
          jump--, j += up_down * jump, up_down = -up_down) {
-        rctx->beacon[j].h.priority = get_priority(rctx, &rctx->beacon[j]);
+        RCTX_BEACON(rctx, j).h.priority = get_priority(rctx, j, highest_rssi, band_width);
         if ((weak_only && AP_BELOW_RSSI_THRESHOLD(rctx, j)) ||
-            rctx->beacon[j].h.priority <= priority_of_worst) {
+            RCTX_BEACON(rctx, j).h.priority <= priority_of_worst) {
             /* break a priority tie with mac */
-            if (rctx->beacon[j].h.priority != priority_of_worst ||
-                COMPARE_MAC(&rctx->beacon[j], &rctx->beacon[idx_of_worst]) < 0) {
+            if (RCTX_BEACON(rctx, j).h.priority != priority_of_worst ||
+                COMPARE_MAC(&RCTX_BEACON(rctx, j), &RCTX_BEACON(rctx, idx_of_worst)) < 0) {
                 idx_of_worst = j;
-                priority_of_worst = rctx->beacon[j].h.priority;
+                priority_of_worst = RCTX_BEACON(rctx, j).h.priority;
                 LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "idx_of_worst %d", idx_of_worst);
             }
         }
@@ -763,9 +1128,9 @@ TEST_FUNC(test_ap_plugin)
          *  >>> beacons.c:remove_beacon() req     2     Wi-Fi            MAC 3B:5E:0C:B0:17:4D 3660MHz rssi:-90 age:0 pri:128.0
 
          */
-        ASSERT(ctx->beacon[0].ap.mac[5] == 0x4B);
-        ASSERT(ctx->beacon[1].ap.mac[5] == 0x4C);
-        ASSERT(ctx->beacon[2].ap.mac[5] == 0x4D);
+        ASSERT(RCTX_BEACON(ctx, 0).ap.mac[5] == 0x4B);
+        ASSERT(RCTX_BEACON(ctx, 1).ap.mac[5] == 0x4C);
+        ASSERT(RCTX_BEACON(ctx, 2).ap.mac[5] == 0x4D);
     });
     TEST("remove_worst removes ap with higher mac if same rssi", ctx, {
         Sky_errno_t sky_errno;
@@ -791,9 +1156,9 @@ TEST_FUNC(test_ap_plugin)
                sky_add_ap_beacon(ctx, &sky_errno, mac4, TIME_UNAVAILABLE, -73, freq, false));
         ASSERT(ctx->num_beacons == 3);
         ASSERT(ctx->num_ap == 3);
-        ASSERT(ctx->beacon[0].ap.mac[5] == 0x4C);
-        ASSERT(ctx->beacon[1].ap.mac[5] == 0x49);
-        ASSERT(ctx->beacon[2].ap.mac[5] == 0x4B);
+        ASSERT(RCTX_BEACON(ctx, 0).ap.mac[5] == 0x4C);
+        ASSERT(RCTX_BEACON(ctx, 1).ap.mac[5] == 0x49);
+        ASSERT(RCTX_BEACON(ctx, 2).ap.mac[5] == 0x4B);
     });
     TEST("remove_worst removes ap with higher mac if same rssi unless connected", ctx, {
         Sky_errno_t sky_errno;
@@ -819,9 +1184,9 @@ TEST_FUNC(test_ap_plugin)
                sky_add_ap_beacon(ctx, &sky_errno, mac4, TIME_UNAVAILABLE, -73, freq, false));
         ASSERT(ctx->num_beacons == 3);
         ASSERT(ctx->num_ap == 3);
-        ASSERT(ctx->beacon[0].ap.mac[5] == 0x4C);
-        ASSERT(ctx->beacon[1].ap.mac[5] == 0x4A);
-        ASSERT(ctx->beacon[2].ap.mac[5] == 0x4B);
+        ASSERT(RCTX_BEACON(ctx, 0).ap.mac[5] == 0x4C);
+        ASSERT(RCTX_BEACON(ctx, 1).ap.mac[5] == 0x4A);
+        ASSERT(RCTX_BEACON(ctx, 2).ap.mac[5] == 0x4B);
     });
     TEST("remove_worst removes highest mac VAP", ctx, {
         Sky_errno_t sky_errno;
@@ -848,9 +1213,9 @@ TEST_FUNC(test_ap_plugin)
                sky_add_ap_beacon(ctx, &sky_errno, mac4, TIME_UNAVAILABLE, rssi--, freq, false));
         ASSERT(ctx->num_beacons == 3);
         ASSERT(ctx->num_ap == 3);
-        ASSERT(ctx->beacon[0].ap.mac[5] == 0x4B);
-        ASSERT(ctx->beacon[1].ap.mac[5] == 0x4C);
-        ASSERT(ctx->beacon[2].ap.mac[5] == 0x4A);
+        ASSERT(RCTX_BEACON(ctx, 0).ap.mac[5] == 0x4B);
+        ASSERT(RCTX_BEACON(ctx, 1).ap.mac[5] == 0x4C);
+        ASSERT(RCTX_BEACON(ctx, 2).ap.mac[5] == 0x4A);
     });
     TEST("remove_worst respects connected properties removing VAP", ctx, {
         Sky_errno_t sky_errno;
@@ -877,9 +1242,9 @@ TEST_FUNC(test_ap_plugin)
                sky_add_ap_beacon(ctx, &sky_errno, mac4, TIME_UNAVAILABLE, rssi--, freq, true));
         ASSERT(ctx->num_beacons == 3);
         ASSERT(ctx->num_ap == 3);
-        ASSERT(ctx->beacon[0].ap.mac[5] == 0x4B);
-        ASSERT(ctx->beacon[1].ap.mac[5] == 0x4A);
-        ASSERT(ctx->beacon[2].ap.mac[5] == 0x4D);
+        ASSERT(RCTX_BEACON(ctx, 0).ap.mac[5] == 0x4B);
+        ASSERT(RCTX_BEACON(ctx, 1).ap.mac[5] == 0x4A);
+        ASSERT(RCTX_BEACON(ctx, 2).ap.mac[5] == 0x4D);
     });
     TEST("remove_worst removes VAP with highest mac", ctx, {
         Sky_errno_t sky_errno;
@@ -906,9 +1271,9 @@ TEST_FUNC(test_ap_plugin)
                sky_add_ap_beacon(ctx, &sky_errno, mac4, TIME_UNAVAILABLE, rssi--, freq, false));
         ASSERT(ctx->num_beacons == 3);
         ASSERT(ctx->num_ap == 3);
-        ASSERT(ctx->beacon[0].ap.mac[5] == 0x4B);
-        ASSERT(ctx->beacon[1].ap.mac[5] == 0xAC);
-        ASSERT(ctx->beacon[2].ap.mac[5] == 0x4A);
+        ASSERT(RCTX_BEACON(ctx, 0).ap.mac[5] == 0x4B);
+        ASSERT(RCTX_BEACON(ctx, 1).ap.mac[5] == 0xAC);
+        ASSERT(RCTX_BEACON(ctx, 2).ap.mac[5] == 0x4A);
     });
 
     GROUP("test 4 cache lines, both adding cached beacons and searching cache for a match");
@@ -934,7 +1299,7 @@ TEST_FUNC(test_ap_plugin)
                sky_add_ap_beacon(rctx, &sky_errno, mac1, rctx->header.time, rssi--, freq, false));
         sky_plugin_add_to_cache(
             rctx, &sky_errno, &loc); /* By default, saves to first empty cacheline */
-        ASSERT(memcmp(mac1, rctx->session->cacheline[0].beacon[0].ap.mac, sizeof(mac1)) == 0);
+        ASSERT(memcmp(mac1, CL_AP_MAC(rctx->session, &rctx->session->cacheline[0], 0), sizeof(mac1)) == 0);
 
         sky_search_cache(rctx, &sky_errno, NULL, &loc);
         ASSERT(IS_CACHE_HIT(rctx) == true);
@@ -948,7 +1313,7 @@ TEST_FUNC(test_ap_plugin)
         ASSERT(SKY_SUCCESS ==
                sky_add_ap_beacon(rctx, &sky_errno, mac2, rctx->header.time, rssi--, freq, false));
         sky_plugin_add_to_cache(rctx, &sky_errno, &loc);
-        ASSERT(memcmp(mac2, rctx->session->cacheline[1].beacon[1].ap.mac, sizeof(mac2)) == 0);
+        ASSERT(memcmp(mac2, CL_AP_MAC(rctx->session, &rctx->session->cacheline[1], 1), sizeof(mac2)) == 0);
 
         sky_search_cache(rctx, &sky_errno, NULL, &loc);
         ASSERT(IS_CACHE_HIT(rctx) == true);
@@ -962,7 +1327,7 @@ TEST_FUNC(test_ap_plugin)
         ASSERT(SKY_SUCCESS ==
                sky_add_ap_beacon(rctx, &sky_errno, mac3, rctx->header.time, rssi--, freq, false));
         sky_plugin_add_to_cache(rctx, &sky_errno, &loc);
-        ASSERT(memcmp(mac3, rctx->session->cacheline[2].beacon[2].ap.mac, sizeof(mac3)) == 0);
+        ASSERT(memcmp(mac3, CL_AP_MAC(rctx->session, &rctx->session->cacheline[2], 2), sizeof(mac3)) == 0);
 
         sky_search_cache(rctx, &sky_errno, NULL, &loc);
         ASSERT(IS_CACHE_HIT(rctx) == true);
@@ -976,7 +1341,7 @@ TEST_FUNC(test_ap_plugin)
         ASSERT(SKY_SUCCESS ==
                sky_add_ap_beacon(rctx, &sky_errno, mac4, rctx->header.time, rssi--, freq, false));
         sky_plugin_add_to_cache(rctx, &sky_errno, &loc);
-        ASSERT(memcmp(mac4, rctx->session->cacheline[3].beacon[3].ap.mac, sizeof(mac4)) == 0);
+        ASSERT(memcmp(mac4, CL_AP_MAC(rctx->session, &rctx->session->cacheline[3], 3), sizeof(mac4)) == 0);
 
         sky_search_cache(rctx, &sky_errno, NULL, &loc);
         ASSERT(IS_CACHE_HIT(rctx) == true);
@@ -1003,6 +1368,33 @@ TEST_FUNC(test_ap_plugin)
     });
 }
 
+/* index of the AP remove_virtual_ap() removed when it compared every pair of APs */
+static int worst_virtual_ap_pairwise(Sky_rctx_t *rctx)
+{
+    int i, j, vap, status, mac_diff, worst = -1;
+
+    for (j = NUM_APS(rctx) - 1; j > 0; j--) {
+        if (RCTX_BEACON(rctx, j).h.connected)
+            continue;
+        for (i = j - 1; i >= 0; i--) {
+            if (RCTX_BEACON(rctx, i).h.connected)
+                continue;
+            mac_diff = mac_similar(
+                mac_pack(RCTX_BEACON(rctx, i).ap.mac), mac_pack(RCTX_BEACON(rctx, j).ap.mac), NULL);
+            if (mac_diff == 0)
+                continue;
+            status = COMPARE_CONNECTED_USED(&RCTX_BEACON(rctx, i), &RCTX_BEACON(rctx, j));
+            vap = (status > 0 || (status == 0 && mac_diff < 0)) ? j : i;
+            if (worst >= 0)
+                status = COMPARE_CONNECTED_USED(&RCTX_BEACON(rctx, vap), &RCTX_BEACON(rctx, worst));
+            if (worst < 0 || status > 0 ||
+                (status == 0 && COMPARE_MAC(&RCTX_BEACON(rctx, vap), &RCTX_BEACON(rctx, worst)) < 0))
+                worst = vap;
+        }
+    }
+    return worst;
+}
+
 TEST_FUNC(test_ap_plugin_vg)
 {
     GROUP("count_uniq_vg");
@@ -1116,12 +1508,737 @@ TEST_FUNC(test_ap_plugin_vg)
         ASSERT(rctx->num_ap == 4);
         ASSERT(count_uniq_vg(rctx) == 2);
     });
+    TEST("count_uniq_vg agrees with pairwise comparison of MACs", rctx, {
+        uint32_t seed = 12345;
+        int trial, i, j, expected;
+
+        for (trial = 0; trial < 50; trial++) {
+            bool redundant[MAX_AP_BEACONS] = { false };
+
+            /* MACs differ only in a few nibbles, so many are similar */
+            for (i = 0; i < MAX_AP_BEACONS; i++) {
+                uint8_t mac[] = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0xAB };
+
+                seed = seed * 1103515245 + 12345;
+                mac[0] ^= (seed >> 16) & 0x02; /* local admin bit */
+                mac[3] ^= (seed >> 20) & 0x11;
+                mac[5] ^= (seed >> 24) & 0x31;
+                _test_ap(&RCTX_BEACON(rctx, i), "000000000000", TIME_UNAVAILABLE, -30, 3660, false);
+                memcpy(RCTX_BEACON(rctx, i).ap.mac, mac, MAC_SIZE);
+            }
+            rctx->num_beacons = rctx->num_ap = MAX_AP_BEACONS;
+
+            for (i = 0, expected = 0; i < MAX_AP_BEACONS; i++) {
+                if (redundant[i])
+                    continue;
+                expected++;
+                for (j = i + 1; j < MAX_AP_BEACONS; j++)
+                    if (mac_similar(mac_pack(RCTX_BEACON(rctx, i).ap.mac),
+                            mac_pack(RCTX_BEACON(rctx, j).ap.mac), NULL))
+                        redundant[j] = true;
+            }
+            ASSERT(count_uniq_vg(rctx) == (uint32_t)expected);
+        }
+    });
+    TEST("virtual groups of MACs differing in each nibble agree with pairwise comparison", rctx, {
+        uint32_t seed = 97531;
+        int n, trial, i, j, m, expected, worst, wrong = 0;
+
+        for (n = 0; n < MAC_NIBBLES; n++) {
+            for (trial = 0; trial < 10; trial++) {
+                bool redundant[MAX_VG_APS] = { false };
+                uint8_t base[MAC_SIZE], removed[MAC_SIZE];
+
+                for (i = 0; i < MAC_SIZE; i++) {
+                    seed = seed * 1103515245 + 12345;
+                    base[i] = (uint8_t)(seed >> 16);
+                }
+                /* one more AP than allowed, all unique and differing from the first in nibble n.
+                 * The last few also differ in another nibble, and so are in other groups
+                 */
+                for (i = 0; i < MAX_VG_APS; i++) {
+                    uint8_t mac[MAC_SIZE];
+
+                    seed = seed * 1103515245 + 12345;
+                    memcpy(mac, base, MAC_SIZE);
+                    mac[n / 2] = (uint8_t)((mac[n / 2] & ~NIBBLE_MASK(n)) |
+                                           ((n & 1) ? i & 0xF : (i & 0xF) << 4));
+                    if (i >= 16) {
+                        m = (n + 1 + (int)(seed >> 16) % (MAC_NIBBLES - 1)) % MAC_NIBBLES;
+                        mac[m / 2] ^= (uint8_t)((m & 1) ? 1 + (seed >> 20) % 15 :
+                                                          (1 + (seed >> 20) % 15) << 4);
+                    } else if (n != 1 && (seed >> 24) & 1)
+                        mac[0] ^= 0x02; /* local admin bit */
+                    _test_ap(&RCTX_BEACON(rctx, i), "000000000000", TIME_UNAVAILABLE, -30 - i,
+                        3660, i == 0 && trial % 3 == 0);
+                    memcpy(RCTX_BEACON(rctx, i).ap.mac, mac, MAC_SIZE);
+                    RCTX_BEACON(rctx, i).ap.property.used = (seed >> 25) & 1;
+                }
+                rctx->num_beacons = rctx->num_ap = MAX_VG_APS;
+
+                for (i = 0, expected = 0; i < MAX_VG_APS; i++) {
+                    if (redundant[i])
+                        continue;
+                    expected++;
+                    for (j = i + 1; j < MAX_VG_APS; j++)
+                        if (mac_similar(mac_pack(RCTX_BEACON(rctx, i).ap.mac),
+                                mac_pack(RCTX_BEACON(rctx, j).ap.mac), NULL))
+                            redundant[j] = true;
+                }
+                wrong += count_uniq_vg(rctx) != (uint32_t)expected;
+
+                /* the same AP is removed as when every pair was compared */
+                worst = worst_virtual_ap_pairwise(rctx);
+                if (worst >= 0)
+                    memcpy(removed, RCTX_BEACON(rctx, worst).ap.mac, MAC_SIZE);
+                wrong += remove_virtual_ap(rctx) != (worst >= 0);
+                wrong += NUM_APS(rctx) != MAX_VG_APS - (worst >= 0);
+                for (i = 0; i < NUM_APS(rctx) && worst >= 0; i++)
+                    wrong += memcmp(RCTX_BEACON(rctx, i).ap.mac, removed, MAC_SIZE) == 0;
+            }
+        }
+        ASSERT(wrong == 0);
+    });
+}
+
+/* reference nibble by nibble comparison, as mac_similar was before MACs were packed */
+static int mac_similar_nibbles(const uint8_t macA[], const uint8_t macB[], int *pn)
+{
+    int num_diff = 0, idx_diff = 0, result = 1, n;
+
+    for (n = 0; n < MAC_NIBBLES; n++) {
+        if ((macA[n / 2] & NIBBLE_MASK(n)) != (macB[n / 2] & NIBBLE_MASK(n))) {
+            if (++num_diff > 1)
+                return 0;
+            idx_diff = n;
+            result = macA[n / 2] - macB[n / 2];
+        }
+    }
+    if (LOCAL_ADMIN_MASK(macA[0]) != LOCAL_ADMIN_MASK(macB[0]))
+        return 0;
+    if (pn)
+        *pn = idx_diff;
+    return result;
+}
+
+TEST_FUNC(test_ap_plugin_mac_similar)
+{
+    GROUP("mac_similar");
+    TEST("mac_similar agrees with nibble by nibble comparison", rctx, {
+        uint32_t seed = 54321;
+        uint8_t a[MAC_SIZE], b[MAC_SIZE];
+        bool similar[1];
+        int trial, n, pn, ref_pn, ref, wrong = 0;
+
+        for (trial = 0; trial < 10000; trial++) {
+            for (n = 0; n < MAC_SIZE; n++) {
+                seed = seed * 1103515245 + 12345;
+                a[n] = b[n] = (uint8_t)(seed >> 16);
+            }
+            /* flip up to three random nibbles of b */
+            for (n = 0; n < trial % 4; n++) {
+                seed = seed * 1103515245 + 12345;
+                b[(seed >> 16) % MAC_SIZE] ^= (uint8_t)(seed >> 24);
+            }
+            pn = ref_pn = -1;
+            ref = mac_similar_nibbles(a, b, &ref_pn);
+            if (ref == 0)
+                wrong += mac_similar(mac_pack(a), mac_pack(b), &pn) != 0 ||
+                         mac_similar_batch(mac_pack(a), (uint64_t[]){ mac_pack(b) }, 1, similar) != 0;
+            else
+                wrong += mac_similar(mac_pack(a), mac_pack(b), &pn) != (ref < 0 ? -1 : 1) ||
+                         pn != ref_pn ||
+                         mac_similar_batch(mac_pack(a), (uint64_t[]){ mac_pack(b) }, 1, similar) != 1;
+        }
+        ASSERT(wrong == 0);
+    });
+    TEST("mac_similar agrees with nibble by nibble comparison for each wildcarded nibble", rctx, {
+        uint8_t mac[] = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0xAB };
+        uint8_t vap[MAC_SIZE];
+        int n, v, pn, ref_pn, ref, wrong = 0;
+
+        for (n = 0; n < MAC_NIBBLES; n++) {
+            for (v = 0; v < 16; v++) {
+                memcpy(vap, mac, MAC_SIZE);
+                vap[n / 2] = (uint8_t)((vap[n / 2] & ~NIBBLE_MASK(n)) | ((n & 1) ? v : v << 4));
+                pn = ref_pn = -1;
+                ref = mac_similar_nibbles(mac, vap, &ref_pn);
+                wrong += (mac_similar(mac_pack(mac), mac_pack(vap), &pn) != 0) != (ref != 0);
+                if (ref != 0 && memcmp(mac, vap, MAC_SIZE) != 0)
+                    wrong += mac_similar(mac_pack(mac), mac_pack(vap), NULL) != (ref < 0 ? -1 : 1) ||
+                             pn != n || ref_pn != n;
+                /* only the nibble holding the local admin bit may make them dissimilar */
+                wrong += ref == 0 && !(n == 1 && LOCAL_ADMIN_MASK(v) != LOCAL_ADMIN_MASK(mac[0]));
+            }
+        }
+        ASSERT(wrong == 0);
+    });
+    TEST("mac_similar_batch agrees with mac_similar for each MAC in array", rctx, {
+        uint32_t seed = 98765;
+        uint8_t mac[] = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0xAB };
+        uint8_t vap[MAC_SIZE];
+        uint64_t macs[MAC_NIBBLES * 16 + 3];
+        bool similar[MAC_NIBBLES * 16 + 3];
+        int n, v, i, num, expected, count, wrong = 0;
+
+        /* every wildcarded nibble, then a few random MACs, an odd number in all */
+        for (num = 0, n = 0; n < MAC_NIBBLES; n++) {
+            for (v = 0; v < 16; v++) {
+                memcpy(vap, mac, MAC_SIZE);
+                vap[n / 2] = (uint8_t)((vap[n / 2] & ~NIBBLE_MASK(n)) | ((n & 1) ? v : v << 4));
+                macs[num++] = mac_pack(vap);
+            }
+        }
+        for (i = 0; i < 3; i++) {
+            seed = seed * 1103515245 + 12345;
+            macs[num++] = mac_pack(mac) ^ ((uint64_t)seed << 8);
+        }
+        /* each length, so that every lane and the scalar tail are used */
+        for (count = 0; count <= num; count++) {
+            for (i = 0, expected = 0; i < count; i++)
+                expected += mac_similar(mac_pack(mac), macs[i], NULL) != 0;
+            wrong += mac_similar_batch(mac_pack(mac), macs, count, similar) != expected;
+            for (i = 0; i < count; i++)
+                wrong += similar[i] != (mac_similar(mac_pack(mac), macs[i], NULL) != 0);
+        }
+        ASSERT(wrong == 0);
+    });
+    TEST("benchmark mac_similar", rctx, {
+        enum { N = 20 };
+        uint8_t mac[N][MAC_SIZE];
+        uint64_t packed[N];
+        bool similar[N];
+        volatile int sink = 0;
+        uint32_t seed = 13579;
+        clock_t t0, t1, t2, t3;
+        int i, j;
+
+        /* half the MACs are in the virtual group of the first */
+        for (i = 0; i < N; i++) {
+            seed = seed * 1103515245 + 12345;
+            memcpy(mac[i], (uint8_t[]){ 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0xAB }, MAC_SIZE);
+            mac[i][(seed >> 16) % MAC_SIZE] ^= (uint8_t)((i & 1) ? 0x03 : seed >> 24);
+            packed[i] = mac_pack(mac[i]);
+        }
+        t0 = clock();
+        for (int r = 0; r < 5000; r++)
+            for (j = 0; j < N; j++)
+                for (i = 0; i < N; i++)
+                    sink += mac_similar_nibbles(mac[j], mac[i], NULL) != 0;
+        t1 = clock();
+        for (int r = 0; r < 5000; r++)
+            for (j = 0; j < N; j++)
+                for (i = 0; i < N; i++)
+                    sink += mac_similar(packed[j], packed[i], NULL) != 0;
+        t2 = clock();
+        for (int r = 0; r < 5000; r++)
+            for (j = 0; j < N; j++)
+                sink += mac_similar_batch(packed[j], packed, N, similar);
+        t3 = clock();
+        LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG,
+            "2000000 MAC pairs: nibbles %dus, packed %dus, batch %dus",
+            (int)((t1 - t0) * 1000000 / CLOCKS_PER_SEC), (int)((t2 - t1) * 1000000 / CLOCKS_PER_SEC),
+            (int)((t3 - t2) * 1000000 / CLOCKS_PER_SEC));
+        ASSERT(sink > 0);
+    });
+}
+
+/* count cached APs pairwise, identical APs first, then each remaining request AP
+ * against the first similar cached AP not yet matched
+ */
+static int count_cached_aps_pairwise(Sky_rctx_t *rctx, Sky_cacheline_t *cl)
+{
+    bool matched[MAX_AP_BEACONS] = { false };
+    bool found[TOTAL_BEACONS + 1] = { false };
+    int num_aps_cached = 0;
+    int i, j;
+
+    for (j = 0; j < NUM_APS(rctx); j++) {
+        for (i = 0; i < NUM_APS(cl); i++) {
+            if (!matched[i] && memcmp(RCTX_BEACON(rctx, j).ap.mac,
+                                   CL_AP_MAC(rctx->session, cl, i), MAC_SIZE) == 0) {
+                found[j] = matched[i] = true;
+                num_aps_cached++;
+                break;
+            }
+        }
+    }
+    for (j = 0; j < NUM_APS(rctx); j++) {
+        for (i = 0; i < NUM_APS(cl) && !found[j]; i++) {
+            if (!matched[i] && mac_similar(mac_pack(RCTX_BEACON(rctx, j).ap.mac),
+                                   mac_pack(CL_AP_MAC(rctx->session, cl, i)), NULL) != 0) {
+                found[j] = matched[i] = true;
+                num_aps_cached++;
+            }
+        }
+    }
+    return num_aps_cached;
+}
+
+TEST_FUNC(test_ap_plugin_count_cached)
+{
+    GROUP("count_cached_aps_in_request_ctx");
+    TEST("count_cached_aps_in_request_ctx counts identical and virtual group APs", rctx, {
+        Sky_errno_t sky_errno;
+        uint8_t mac1[] = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0xAB }; /* cached */
+        int16_t rssi = -30;
+        int32_t freq = 3660;
+        uint8_t mac2[] = { 0xCC, 0xEE, 0xCC, 0xBB, 0x77, 0xDD }; /* cached */
+        uint8_t mac3[] = { 0x1D, 0x5C, 0x2B, 0x8A, 0x38, 0x2C }; /* not cached */
+        uint8_t mac4[] = { 0x3D, 0x4C, 0x5B, 0x1A, 0x28, 0x5C }; /* VG member of cached AP */
+        uint8_t ap_order[TOTAL_BEACONS + 1];
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+
+        loc.time = rctx->header.time;
+        ASSERT(SKY_SUCCESS ==
+               sky_add_ap_beacon(rctx, &sky_errno, mac1, TIME_UNAVAILABLE, rssi--, freq, false));
+        ASSERT(SKY_SUCCESS ==
+               sky_add_ap_beacon(rctx, &sky_errno, mac2, TIME_UNAVAILABLE, rssi--, freq, false));
+        ASSERT(SKY_SUCCESS ==
+               sky_add_ap_beacon(rctx, &sky_errno, mac4, TIME_UNAVAILABLE, rssi--, freq, false));
+        ASSERT(SKY_SUCCESS == sky_plugin_add_to_cache(rctx, &sky_errno, &loc));
+        ASSERT(rctx->session->cacheline[0].ap_order[0] == 2); /* 0x3D... */
+        ASSERT(rctx->session->cacheline[0].ap_order[1] == 0); /* 0x4C... */
+        ASSERT(rctx->session->cacheline[0].ap_order[2] == 1); /* 0xCC... */
+
+        /* request has two identical APs, one VG member and one new AP */
+        init_req_ctx(rctx);
+        rctx->num_beacons = rctx->num_ap = 0;
+        mac4[4] = 0x29;
+        ASSERT(SKY_SUCCESS ==
+               sky_add_ap_beacon(rctx, &sky_errno, mac3, TIME_UNAVAILABLE, rssi--, freq, false));
+        ASSERT(SKY_SUCCESS ==
+               sky_add_ap_beacon(rctx, &sky_errno, mac4, TIME_UNAVAILABLE, rssi--, freq, false));
+        ASSERT(SKY_SUCCESS ==
+               sky_add_ap_beacon(rctx, &sky_errno, mac2, TIME_UNAVAILABLE, rssi--, freq, false));
+        ASSERT(SKY_SUCCESS ==
+               sky_add_ap_beacon(rctx, &sky_errno, mac1, TIME_UNAVAILABLE, rssi--, freq, false));
+        sort_aps_by_mac(rctx, ap_order);
+        ASSERT(count_cached_aps_in_request_ctx(rctx, ap_order, &rctx->session->cacheline[0]) == 3);
+    });
+    TEST("count_cached_aps_in_request_ctx agrees with pairwise count of random scans", rctx, {
+        Sky_errno_t sky_errno;
+        uint8_t mac[MAC_SIZE];
+        uint8_t ap_order[TOTAL_BEACONS + 1];
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+        Sky_cacheline_t *cl = &rctx->session->cacheline[0];
+        uint32_t seed = 24680;
+        int scan, side, k, wrong = 0;
+
+        loc.time = rctx->header.time;
+        for (scan = 0; scan < 200; scan++) {
+            /* cache a scan, then count it in another scan of APs drawn from the same MACs */
+            for (side = 0; side < 2; side++) {
+                init_req_ctx(rctx);
+                rctx->num_beacons = rctx->num_ap = 0;
+                for (k = 0; k < 12; k++) {
+                    seed = seed * 1103515245 + 12345;
+                    memcpy(mac, (uint8_t[]){ 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0xAB }, MAC_SIZE);
+                    /* one or two of the last four nibbles differ from the first MAC */
+                    mac[4 + ((seed >> 16) & 1)] ^= (uint8_t)((seed >> 20) & 0x03);
+                    if ((seed >> 24) & 1)
+                        mac[5] ^= (uint8_t)((seed >> 25) & 0x30);
+                    if (sky_add_ap_beacon(rctx, &sky_errno, mac, rctx->header.time, -30 - k, 3660,
+                            false) != SKY_SUCCESS)
+                        wrong++;
+                }
+                if (side == 0) {
+                    rctx->save_to = 0;
+                    if (sky_plugin_add_to_cache(rctx, &sky_errno, &loc) != SKY_SUCCESS)
+                        wrong++;
+                }
+            }
+            sort_aps_by_mac(rctx, ap_order);
+            wrong += count_cached_aps_in_request_ctx(rctx, ap_order, cl) !=
+                     count_cached_aps_pairwise(rctx, cl);
+        }
+        ASSERT(wrong == 0);
+    });
+}
+
+TEST_FUNC(test_ap_plugin_signature)
+{
+    GROUP("cacheline signature");
+    TEST("similar APs always share a signature bit", rctx, {
+        uint8_t mac[] = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0xAB };
+        uint8_t vap[MAC_SIZE];
+        uint8_t a[2], b[2];
+        int n, v;
+
+        ap_signature_bits(mac, a);
+        for (n = 0; n < MAC_SIZE * 2; n++) {
+            for (v = 0; v < 16; v++) {
+                memcpy(vap, mac, MAC_SIZE);
+                vap[n / 2] = (uint8_t)((vap[n / 2] & ~NIBBLE_MASK(n)) |
+                                       ((n & 1) ? v : v << 4));
+                ap_signature_bits(vap, b);
+                ASSERT(a[0] == b[0] || a[1] == b[1]);
+            }
+        }
+    });
+    TEST("match finds hit among cachelines with no APs in common", rctx, {
+        Sky_errno_t sky_errno;
+        uint8_t mac[] = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x4B };
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+        int i, j;
+
+        loc.time = rctx->header.time;
+        /* fill every cacheline with a scan of different APs */
+        for (i = 0; i < CACHE_SIZE; i++) {
+            init_req_ctx(rctx);
+            rctx->num_beacons = rctx->num_ap = 0;
+            for (j = 0; j < 6; j++) {
+                mac[3] = mac[4] = (uint8_t)(0x11 * i);
+                mac[5] = (uint8_t)(0x11 * j);
+                ASSERT(SKY_SUCCESS == sky_add_ap_beacon(rctx, &sky_errno, mac, rctx->header.time,
+                                          -30 - j, 3660, false));
+            }
+            rctx->save_to = i;
+            ASSERT(SKY_SUCCESS == sky_plugin_add_to_cache(rctx, &sky_errno, &loc));
+        }
+        /* scan of the APs in the last cacheline hits that cacheline */
+        ASSERT(SKY_SUCCESS == sky_search_cache(rctx, &sky_errno, NULL, &loc));
+        ASSERT(IS_CACHE_HIT(rctx) == true);
+        ASSERT(rctx->get_from == CACHE_SIZE - 1);
+
+        /* scan of new APs misses */
+        init_req_ctx(rctx);
+        rctx->num_beacons = rctx->num_ap = 0;
+        for (j = 0; j < 6; j++) {
+            mac[3] = mac[4] = 0xEE;
+            mac[5] = (uint8_t)(0x11 * j);
+            ASSERT(SKY_SUCCESS == sky_add_ap_beacon(rctx, &sky_errno, mac, rctx->header.time,
+                                      -30 - j, 3660, false));
+        }
+        ASSERT(SKY_SUCCESS == sky_search_cache(rctx, &sky_errno, NULL, &loc));
+        ASSERT(IS_CACHE_HIT(rctx) == false);
+    });
+    TEST("cachelines skipped by signature give the same result as counting their APs", rctx, {
+        Sky_errno_t sky_errno;
+        uint8_t mac[] = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x4B };
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+        /* request APs as cacheline and AP index, cacheline 0xE for APs not cached */
+        static const uint8_t scans[][6][2] = {
+            { { 2, 0 }, { 2, 1 }, { 2, 2 }, { 2, 3 }, { 2, 4 }, { 0, 0 } }, /* hit */
+            { { 3, 0 }, { 3, 1 }, { 3, 2 }, { 3, 3 }, { 3, 4 }, { 1, 5 } }, /* hit */
+            { { 3, 0 }, { 3, 1 }, { 3, 2 }, { 3, 3 }, { 0, 5 }, { 1, 5 } }, /* miss */
+            { { 0, 0 }, { 0, 1 }, { 1, 0 }, { 1, 1 }, { 0xE, 0 }, { 0xE, 1 } }, /* miss */
+            { { 0, 2 }, { 0xE, 1 }, { 0xE, 2 }, { 0xE, 3 }, { 0xE, 4 }, { 0xE, 5 } }, /* miss */
+        };
+        Sky_sctx_t *sctx = rctx->session;
+        uint8_t signature[CACHE_SIZE][AP_SIGNATURE_SIZE];
+        uint8_t bits[2];
+        bool hit;
+        int16_t get_from, save_to;
+        int s, i, j, possible, threshold, skipped = 0, wrong = 0;
+
+        loc.time = rctx->header.time;
+        /* fill half the cachelines, each with a scan of different APs */
+        for (i = 0; i < CACHE_SIZE / 2; i++) {
+            init_req_ctx(rctx);
+            rctx->num_beacons = rctx->num_ap = 0;
+            for (j = 0; j < 6; j++) {
+                mac[3] = mac[4] = (uint8_t)(0x11 * i);
+                mac[5] = (uint8_t)(0x11 * j);
+                ASSERT(SKY_SUCCESS == sky_add_ap_beacon(rctx, &sky_errno, mac, rctx->header.time,
+                                          -30 - j, 3660, false));
+            }
+            rctx->save_to = i;
+            ASSERT(SKY_SUCCESS == sky_plugin_add_to_cache(rctx, &sky_errno, &loc));
+        }
+        for (s = 0; s < (int)(sizeof(scans) / sizeof(scans[0])); s++) {
+            init_req_ctx(rctx);
+            rctx->num_beacons = rctx->num_ap = 0;
+            for (j = 0; j < 6; j++) {
+                mac[3] = mac[4] = (uint8_t)(0x11 * scans[s][j][0]);
+                mac[5] = (uint8_t)(0x11 * scans[s][j][1]);
+                if (sky_add_ap_beacon(rctx, &sky_errno, mac, rctx->header.time, -30 - j, 3660,
+                        false) != SKY_SUCCESS)
+                    wrong++;
+            }
+            /* count the cachelines which match() skips by signature */
+            threshold = count_uniq_vg(rctx) <= CONFIG(sctx, cache_beacon_threshold) ?
+                            99 :
+                            (int)match_all_threshold(sctx);
+            for (i = 0; i < CACHE_SIZE / 2; i++) {
+                for (j = 0, possible = 0; j < NUM_APS(rctx); j++) {
+                    ap_signature_bits(RCTX_BEACON(rctx, j).ap.mac, bits);
+                    possible += SIGNATURE_HAS_BIT(sctx->cacheline[i].ap_signature, bits[0]) ||
+                                SIGNATURE_HAS_BIT(sctx->cacheline[i].ap_signature, bits[1]);
+                }
+                skipped += possible > 0 &&
+                           possible * 100 <= threshold * (NUM_APS(rctx) +
+                                                             NUM_APS(&sctx->cacheline[i]) -
+                                                             possible);
+            }
+            wrong += match(rctx) != SKY_SUCCESS;
+            hit = IS_CACHE_HIT(rctx);
+            get_from = rctx->get_from;
+            save_to = rctx->save_to;
+
+            /* with every signature bit set no cacheline is skipped */
+            for (i = 0; i < CACHE_SIZE; i++) {
+                memcpy(signature[i], sctx->cacheline[i].ap_signature, AP_SIGNATURE_SIZE);
+                memset(sctx->cacheline[i].ap_signature, 0xFF, AP_SIGNATURE_SIZE);
+            }
+            wrong += match(rctx) != SKY_SUCCESS;
+            wrong += IS_CACHE_HIT(rctx) != hit || rctx->save_to != save_to;
+            wrong += hit && rctx->get_from != get_from;
+            wrong += hit != (s < 2);
+            for (i = 0; i < CACHE_SIZE; i++)
+                memcpy(sctx->cacheline[i].ap_signature, signature[i], AP_SIGNATURE_SIZE);
+        }
+        ASSERT(wrong == 0);
+        ASSERT(skipped > 0);
+    });
+}
+
+/* replace request APs with APs first to last, which differ only in the last byte of MAC */
+static bool consolidate_scan(Sky_rctx_t *rctx, int first, int last, int used_below)
+{
+    Sky_errno_t sky_errno;
+    uint8_t mac[] = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x00 };
+    int j;
+
+    init_req_ctx(rctx);
+    rctx->num_beacons = rctx->num_ap = 0;
+    for (j = first; j <= last; j++) {
+        mac[5] = (uint8_t)j;
+        if (sky_add_ap_beacon(rctx, &sky_errno, mac, rctx->header.time, -30 - j, 3660, false) !=
+            SKY_SUCCESS)
+            return false;
+    }
+    for (j = 0; j < NUM_APS(rctx); j++)
+        RCTX_BEACON(rctx, j).ap.property.used = RCTX_BEACON(rctx, j).ap.mac[5] < used_below;
+    return NUM_APS(rctx) == last - first + 1;
+}
+
+TEST_FUNC(test_ap_plugin_consolidate)
+{
+    GROUP("cacheline consolidation");
+    TEST("scan of the same place is merged into cacheline keeping its Used APs", rctx, {
+        Sky_errno_t sky_errno;
+        uint8_t mac[] = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x00 };
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+        Sky_cacheline_t *cl = &rctx->session->cacheline[0];
+        int j;
+
+        ASSERT(SKY_SUCCESS ==
+               sky_set_option(rctx, &sky_errno, CONF_CACHE_CONSOLIDATE_THRESHOLD, 50));
+        loc.time = rctx->header.time;
+        /* APs 0-5, of which 0-3 are Used */
+        for (j = 0; j < 6; j++) {
+            mac[5] = (uint8_t)j;
+            ASSERT(SKY_SUCCESS == sky_add_ap_beacon(rctx, &sky_errno, mac, rctx->header.time,
+                                      -30 - j, 3660, false));
+        }
+        for (j = 0; j < NUM_APS(rctx); j++)
+            RCTX_BEACON(rctx, j).ap.property.used = RCTX_BEACON(rctx, j).ap.mac[5] < 4;
+        rctx->save_to = 0;
+        ASSERT(SKY_SUCCESS == sky_plugin_add_to_cache(rctx, &sky_errno, &loc));
+
+        /* APs 1-6 (5 of 7 in common) 10m away are merged, keeping Used AP 0 */
+        init_req_ctx(rctx);
+        rctx->num_beacons = rctx->num_ap = 0;
+        for (j = 1; j < 7; j++) {
+            mac[5] = (uint8_t)j;
+            ASSERT(SKY_SUCCESS == sky_add_ap_beacon(rctx, &sky_errno, mac, rctx->header.time,
+                                      -30 - j, 3660, false));
+        }
+        loc.lat += 0.0001f;
+        rctx->save_to = 5;
+        ASSERT(SKY_SUCCESS == sky_plugin_add_to_cache(rctx, &sky_errno, &loc));
+        ASSERT(NUM_APS(cl) == 7 && rctx->session->cacheline[5].time == CACHE_EMPTY);
+        /* APs 0-6, in MAC order */
+        for (j = 0; j < NUM_APS(cl); j++)
+            if (CL_AP_MAC(rctx->session, cl, cl->ap_order[j])[5] != j)
+                break;
+        ASSERT(j == 7);
+        ASSERT(cl->loc.lat == loc.lat);
+
+        /* the same APs 1km away are not merged */
+        loc.lat += 0.01f;
+        ASSERT(SKY_SUCCESS == sky_plugin_add_to_cache(rctx, &sky_errno, &loc));
+        ASSERT(NUM_APS(&rctx->session->cacheline[5]) == 6);
+    });
+    TEST("only Used APs of the cacheline are carried over", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+        Sky_cacheline_t *cl = &rctx->session->cacheline[0];
+        Sky_cache_ap_t extra[MAX_AP_BEACONS];
+        int j, num_extra;
+
+        ASSERT(SKY_SUCCESS ==
+               sky_set_option(rctx, &sky_errno, CONF_CACHE_CONSOLIDATE_THRESHOLD, 50));
+        loc.time = rctx->header.time;
+        /* APs 0-9, of which 0 and 1 are Used */
+        ASSERT(consolidate_scan(rctx, 0, 9, 2));
+        rctx->save_to = 0;
+        ASSERT(SKY_SUCCESS == sky_plugin_add_to_cache(rctx, &sky_errno, &loc));
+
+        /* APs 4-11 (6 of 12 in common), Unused APs 2 and 3 are dropped */
+        ASSERT(consolidate_scan(rctx, 4, 11, 0));
+        ASSERT(find_consolidation(rctx, &loc, extra, &num_extra) == 0);
+        ASSERT(num_extra == 2);
+        ASSERT(extra[0].mac[5] < 2 && extra[1].mac[5] < 2 && extra[0].mac[5] != extra[1].mac[5]);
+        rctx->save_to = 1;
+        ASSERT(SKY_SUCCESS == sky_plugin_add_to_cache(rctx, &sky_errno, &loc));
+        ASSERT(NUM_APS(cl) == 10);
+        /* APs 0, 1 and 4-11, in MAC order */
+        for (j = 0; j < NUM_APS(cl); j++)
+            if (CL_AP_MAC(rctx->session, cl, cl->ap_order[j])[5] != (j < 2 ? j : j + 2))
+                break;
+        ASSERT(j == 10);
+        ASSERT(rctx->session->cacheline[1].time == CACHE_EMPTY);
+    });
+    TEST("APs carried over are limited by room in the request", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+        Sky_cacheline_t *cl = &rctx->session->cacheline[0];
+        Sky_cache_ap_t extra[MAX_AP_BEACONS];
+        int num_extra, k;
+
+        ASSERT(SKY_SUCCESS ==
+               sky_set_option(rctx, &sky_errno, CONF_CACHE_CONSOLIDATE_THRESHOLD, 50));
+        loc.time = rctx->header.time;
+        /* MAX_AP_BEACONS APs, all Used */
+        ASSERT(consolidate_scan(rctx, 0, MAX_AP_BEACONS - 1, MAX_AP_BEACONS));
+        rctx->save_to = 0;
+        ASSERT(SKY_SUCCESS == sky_plugin_add_to_cache(rctx, &sky_errno, &loc));
+
+        /* request with all but 4 of the cached APs and 2 new ones has room for 2 of the 4 */
+        ASSERT(consolidate_scan(rctx, 4, MAX_AP_BEACONS + 1, 0));
+        ASSERT(find_consolidation(rctx, &loc, extra, &num_extra) == 0);
+        ASSERT(num_extra == 2);
+        rctx->save_to = 1;
+        ASSERT(SKY_SUCCESS == sky_plugin_add_to_cache(rctx, &sky_errno, &loc));
+        ASSERT(NUM_APS(cl) == MAX_AP_BEACONS);
+
+        /* a lower configured AP limit leaves room for fewer APs */
+        ASSERT(consolidate_scan(rctx, 4, 13, 0));
+        ASSERT(SKY_SUCCESS == sky_set_option(rctx, &sky_errno, CONF_MAX_AP_BEACONS, 12));
+        ASSERT(find_consolidation(rctx, &loc, extra, &num_extra) == 0);
+        ASSERT(num_extra == 2);
+        ASSERT(SKY_SUCCESS ==
+               sky_set_option(rctx, &sky_errno, CONF_MAX_AP_BEACONS, MAX_AP_BEACONS));
+
+        /* cells count against the total beacon limit */
+        for (k = 0; k < TOTAL_BEACONS - MAX_AP_BEACONS; k++) {
+            ASSERT(SKY_SUCCESS == sky_add_cell_lte_beacon(rctx, &sky_errno, 24674 + k,
+                                      202274050 + k, 441, 53, 21 + k, 5901 + k, 2,
+                                      rctx->header.time, -90 - k, false));
+        }
+        ASSERT(NUM_APS(rctx) == 10 && NUM_BEACONS(rctx) == 10 + TOTAL_BEACONS - MAX_AP_BEACONS);
+        ASSERT(SKY_SUCCESS ==
+               sky_set_option(rctx, &sky_errno, CONF_TOTAL_BEACONS, NUM_BEACONS(rctx) + 2));
+        ASSERT(find_consolidation(rctx, &loc, extra, &num_extra) == 0);
+        ASSERT(num_extra == 2);
+    });
+    TEST("merged cacheline keeps its hits, is refreshed and moves to the end of the expiry list",
+        rctx, {
+            Sky_errno_t sky_errno;
+            Sky_location_t loc = { .lat = 35.511315,
+                .lon = 139.618906,
+                .hpe = 16,
+                .location_source = SKY_LOCATION_SOURCE_WIFI,
+                .location_status = SKY_LOCATION_STATUS_SUCCESS };
+            Sky_sctx_t *sctx = rctx->session;
+
+            ASSERT(SKY_SUCCESS ==
+                   sky_set_option(rctx, &sky_errno, CONF_CACHE_CONSOLIDATE_THRESHOLD, 50));
+            loc.time = rctx->header.time - 20;
+            ASSERT(consolidate_scan(rctx, 0, 5, 6));
+            rctx->save_to = 0;
+            ASSERT(SKY_SUCCESS == sky_plugin_add_to_cache(rctx, &sky_errno, &loc));
+            sctx->cacheline[0].hits = 3;
+
+            /* an unrelated scan far away is saved later */
+            loc.time += 10;
+            loc.lat += 1;
+            ASSERT(consolidate_scan(rctx, 0x80, 0x85, 0));
+            rctx->save_to = 1;
+            ASSERT(SKY_SUCCESS == sky_plugin_add_to_cache(rctx, &sky_errno, &loc));
+            ASSERT(sctx->num_expiry == 2 && sctx->expiry[0] == 0 && sctx->expiry[1] == 1);
+
+            /* a later scan of the first place is merged into cacheline 0 */
+            loc.time += 10;
+            loc.lat -= 1;
+            ASSERT(consolidate_scan(rctx, 1, 6, 0));
+            rctx->save_to = 2;
+            ASSERT(SKY_SUCCESS == sky_plugin_add_to_cache(rctx, &sky_errno, &loc));
+            ASSERT(sctx->cacheline[2].time == CACHE_EMPTY);
+            ASSERT(sctx->cacheline[0].hits == 3);
+            ASSERT(sctx->cacheline[0].time == loc.time);
+            ASSERT(sctx->num_expiry == 2 && sctx->expiry[0] == 1 && sctx->expiry[1] == 0);
+        });
+    TEST("scan of the same APs further away than hpe is not merged", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+        Sky_cache_ap_t extra[MAX_AP_BEACONS];
+        int num_extra;
+
+        ASSERT(SKY_SUCCESS ==
+               sky_set_option(rctx, &sky_errno, CONF_CACHE_CONSOLIDATE_THRESHOLD, 50));
+        loc.time = rctx->header.time;
+        ASSERT(consolidate_scan(rctx, 0, 5, 6));
+        rctx->save_to = 0;
+        ASSERT(SKY_SUCCESS == sky_plugin_add_to_cache(rctx, &sky_errno, &loc));
+
+        /* about 22m north, beyond the hpe of 16m of both locations */
+        loc.lat += 0.0002f;
+        ASSERT(find_consolidation(rctx, &loc, extra, &num_extra) == -1);
+        ASSERT(num_extra == 0);
+        rctx->save_to = 1;
+        ASSERT(SKY_SUCCESS == sky_plugin_add_to_cache(rctx, &sky_errno, &loc));
+        ASSERT(NUM_APS(&rctx->session->cacheline[0]) == 6);
+        ASSERT(NUM_APS(&rctx->session->cacheline[1]) == 6);
+
+        /* within the larger hpe of the new location it is merged */
+        loc.hpe = 30;
+        ASSERT(find_consolidation(rctx, &loc, extra, &num_extra) >= 0);
+    });
 }
 
 static Sky_status_t unit_tests(void *_ctx)
 {
     GROUP_CALL("Remove Worst", test_ap_plugin);
     GROUP_CALL("count_uniq_vg", test_ap_plugin_vg);
+    GROUP_CALL("mac_similar", test_ap_plugin_mac_similar);
+    GROUP_CALL("count_cached_aps_in_request_ctx", test_ap_plugin_count_cached);
+    GROUP_CALL("cacheline signature", test_ap_plugin_signature);
+    GROUP_CALL("cacheline consolidation", test_ap_plugin_consolidate);
     return SKY_SUCCESS;
 }
 
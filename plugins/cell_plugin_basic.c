@@ -188,7 +188,7 @@ static Sky_status_t remove_worst(Sky_rctx_t *rctx)
     DUMP_REQUEST_CTX(rctx);
 
     /* sanity check last beacon, if we get here, it should be a cell */
-    if (is_cell_type(&rctx->beacon[NUM_BEACONS(rctx) - 1])) {
+    if (is_cell_type(&RCTX_BEACON(rctx, NUM_BEACONS(rctx) - 1))) {
         /* cells are in priority order
          * remove last beacon
          */
@@ -225,6 +225,8 @@ static Sky_status_t match(Sky_rctx_t *rctx)
 {
 #if CACHE_SIZE && !SKY_EXCLUDE_CELL_SUPPORT
     int i; /* i iterates through cacheline */
+    int k, n; /* k iterates through the n cachelines listed in lines */
+    uint16_t lines[CACHE_SIZE]; /* cachelines which may share the serving cell of request */
     float ratio; /* 0.0 <= ratio <= 1.0 is the degree to which request context matches cacheline
                     In typical case this is the intersection(request context, cache) / union(request context, cache) */
     float bestratio = 0.0f;
@@ -240,36 +242,24 @@ static Sky_status_t match(Sky_rctx_t *rctx)
     DUMP_CACHE(rctx);
 
     /* expire old cachelines and note first empty cacheline as best line to save to */
-    for (i = 0; i < rctx->session->num_cachelines; i++) {
-        cl = &rctx->session->cacheline[i];
-        /* if cacheline is old, mark it empty */
-        if (cl->time != TIME_UNAVAILABLE &&
-            (rctx->header.time - cl->time) >
-                (CONFIG(rctx->session, cache_age_threshold) * SECONDS_IN_HOUR)) {
-            LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Cacheline %d expired", i);
-            cl->time = CACHE_EMPTY;
-        }
-        /* if line is empty and it is the first one, remember it */
-        if (cl->time == CACHE_EMPTY) {
-            if (bestputratio < 1.0) {
-                bestput = (int16_t)i;
-                bestputratio = 1.0f;
-            }
-        }
-    }
+    expire_cachelines(rctx, rctx->header.time);
+    if ((bestput = (int16_t)find_empty_cacheline(rctx->session, false)) >= 0)
+        bestputratio = 1.0f;
 
     if (NUM_CELLS(rctx) == 0) {
         LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Unable to compare using Cells. No cache match");
         LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Best cacheline to save location: %d of %d score %d",
-            bestput, CACHE_SIZE, (int)round((double)bestputratio * 100));
+            bestput, rctx->session->num_cachelines, (int)round((double)bestputratio * 100));
         return SKY_ERROR;
     }
 
     DUMP_REQUEST_CTX(rctx);
     DUMP_CACHE(rctx);
 
-    /* score each cacheline wrt beacon match ratio */
-    for (i = 0; i < rctx->session->num_cachelines; i++) {
+    /* score each cacheline which may share the serving cell wrt beacon match ratio */
+    n = cache_candidates(rctx, lines);
+    for (k = 0; k < n; k++) {
+        i = lines[k];
         cl = &rctx->session->cacheline[i];
         threshold = score = 0;
         ratio = 0.0f;
@@ -293,14 +283,15 @@ static Sky_status_t match(Sky_rctx_t *rctx)
         } else {
             /* count number of matching cells */
             LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG, "Cache: %d: Score based on cell beacons", i);
-            threshold = CONFIG(rctx->session, cache_match_all_threshold);
+            threshold = (int)match_all_threshold(rctx->session);
             score = 0;
             for (int j = NUM_APS(rctx); j < NUM_BEACONS(rctx); j++) {
-                if (beacon_in_cacheline(rctx, &rctx->beacon[j], &rctx->session->cacheline[i])) {
+                if (beacon_in_cacheline(
+                        rctx, &RCTX_BEACON(rctx, j), &rctx->session->cacheline[i])) {
 #if VERBOSE_DEBUG
                     LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG,
                         "Cell Beacon %d type %s matches cache %d of %d Score %d", j,
-                        sky_pbeacon(&rctx->beacon[j]), i, rctx->session->num_cachelines,
+                        sky_pbeacon(&RCTX_BEACON(rctx, j)), i, rctx->session->num_cachelines,
                         (int)score);
 #endif // VERBOSE_DEBUG
                     score = score + 1;
@@ -415,12 +406,12 @@ TEST_FUNC(test_cell_plugin)
          *       1    NR-NMR     0 412MHz rssi:-108 age:0
          *       2   LTE-NMR     0 412MHz rssi:-108 age:0
          */
-        ASSERT(rctx->beacon[0].h.type == SKY_BEACON_LTE);
-        ASSERT(rctx->beacon[1].h.type == SKY_BEACON_NR);
-        ASSERT(rctx->beacon[2].h.type == SKY_BEACON_LTE);
-        ASSERT(rctx->beacon[0].h.connected == true);
-        ASSERT(rctx->beacon[1].h.connected == false);
-        ASSERT(rctx->beacon[2].h.connected == false);
+        ASSERT(RCTX_BEACON(rctx, 0).h.type == SKY_BEACON_LTE);
+        ASSERT(RCTX_BEACON(rctx, 1).h.type == SKY_BEACON_NR);
+        ASSERT(RCTX_BEACON(rctx, 2).h.type == SKY_BEACON_LTE);
+        ASSERT(RCTX_BEACON(rctx, 0).h.connected == true);
+        ASSERT(RCTX_BEACON(rctx, 1).h.connected == false);
+        ASSERT(RCTX_BEACON(rctx, 2).h.connected == false);
     });
     TEST("remove_worst respects connected properties", rctx, {
         Sky_errno_t sky_errno;
@@ -457,9 +448,9 @@ TEST_FUNC(test_cell_plugin)
          *          1       LTE     311,480,25614,25664526,387 1000MHz rssi:-108 ta:0 age:0
          *          2    NB-IoT     515,2,20263,15664525,25 255MHz rssi:-108 ta:0 age:0
          */
-        ASSERT(rctx->beacon[0].h.type == SKY_BEACON_UMTS);
-        ASSERT(rctx->beacon[1].h.type == SKY_BEACON_LTE);
-        ASSERT(rctx->beacon[2].h.type == SKY_BEACON_NBIOT);
+        ASSERT(RCTX_BEACON(rctx, 0).h.type == SKY_BEACON_UMTS);
+        ASSERT(RCTX_BEACON(rctx, 1).h.type == SKY_BEACON_LTE);
+        ASSERT(RCTX_BEACON(rctx, 2).h.type == SKY_BEACON_NBIOT);
     });
 }
 
@@ -214,6 +214,9 @@ int load_config(char *filename, Config_t *config)
                 config->factory_reset = true;
             continue;
         }
+        if (sscanf(line, "AP_DATABASE %79s", config->ap_database) == 1) {
+            continue;
+        }
     }
     config->configfile = filename;
     fclose(fp);
@@ -252,4 +255,5 @@ void print_config(Config_t *config)
     printf("Debounce: %s\n", config->debounce ? "true" : "false");
     printf("Uplink data: %s\n", ul_app_data);
     printf("Factory reset: %s\n", config->factory_reset ? "true" : "false");
+    printf("AP database: %s\n", config->ap_database);
 }
@@ -44,6 +44,7 @@ typedef struct client_config {
     uint8_t ul_app_data[SKY_MAX_UL_APP_DATA];
     uint32_t ul_app_data_len;
     bool factory_reset; /* true means simulate factory reset */
+    char ap_database[80]; /* AP database file, see sky_locate_ap_database() */
 } Config_t;
 
 uint32_t hex2bin(char *hexstr, uint32_t hexlen, uint8_t *result, uint32_t reslen);
@@ -27,6 +27,10 @@
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "libel.h"
 #include "send.h"
 #include "config.h"
@@ -193,7 +197,7 @@ static int save_session_context(Sky_sctx_t *sctx, char *file_name)
     FILE *fio;
     uint32_t session_size;
 
-    if ((session_size = sky_sizeof_session_ctx(sctx)) == 0 || strlen(file_name) == 0) {
+    if ((session_size = sky_sizeof_session_ctx(sctx, 0)) == 0 || strlen(file_name) == 0) {
         free(sctx);
         return -1; /* nothing to save */
     }
@@ -232,7 +236,7 @@ static Sky_sctx_t *retrieve_session_context(Config_t *config)
         if ((fio = fopen(config->statefile, "r")) != NULL) {
             if (fread((void *)tmp, sizeof(tmp), 1, fio) == 1) {
                 /* query header for actual size */
-                if ((sbufsize = sky_sizeof_session_ctx((void *)tmp)) > 0) {
+                if ((sbufsize = sky_sizeof_session_ctx((void *)tmp, 0)) > 0) {
                     rewind(fio);
                     sctx = malloc(sbufsize);
                     if (fread(sctx, sbufsize, 1, fio) == 1) {
@@ -251,7 +255,7 @@ static Sky_sctx_t *retrieve_session_context(Config_t *config)
     }
     if (config->factory_reset)
         printf("Clearing state due to Factory reset\n");
-    sbufsize = sky_sizeof_session_ctx(NULL); /* Get size of new buffer */
+    sbufsize = sky_sizeof_session_ctx(NULL, CACHE_SIZE); /* Get size of new buffer */
     sctx = malloc(sbufsize);
     memset(sctx, 0, sbufsize); /* empty buffer causes immediate Token based registration */
     printf("Allocated empty state buffer %d bytes\n", sbufsize);
@@ -348,6 +352,47 @@ static time_t mytime(time_t *t)
         return time(NULL);
 }
 
+#if SKY_AP_DATABASE
+/*! \brief estimate location from AP database file, which is memory mapped on first use
+ *
+ *  @param rctx pointer to request context
+ *  @param config pointer to configuration
+ *  @param loc where to save the location
+ *
+ *  @return true if location was found in AP database
+ */
+static bool locate_from_ap_database(void *rctx, Config_t *config, Sky_location_t *loc)
+{
+    static void *db = NULL;
+    static uint32_t db_len;
+    Sky_errno_t sky_errno;
+
+    if (config->ap_database[0] == '\0')
+        return false;
+    if (db == NULL) {
+        struct stat st;
+        int fd = open(config->ap_database, O_RDONLY);
+
+        if (fd < 0 || fstat(fd, &st) < 0 ||
+            (db = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+            printf("Error: unable to map AP database - %s\n", config->ap_database);
+            config->ap_database[0] = '\0';
+            db = NULL;
+            if (fd >= 0)
+                close(fd);
+            return false;
+        }
+        db_len = (uint32_t)st.st_size;
+        close(fd);
+    }
+    if (sky_locate_ap_database(rctx, &sky_errno, db, db_len, loc) != SKY_SUCCESS) {
+        printf("sky_locate_ap_database: '%s'\n", sky_perror(sky_errno));
+        return false;
+    }
+    return true;
+}
+#endif // SKY_AP_DATABASE
+
 /*! \brief locate function
  *
  *  Add a set of beacon scans process the request
@@ -495,6 +540,15 @@ static int locate(void *rctx, uint32_t rbufsize, Sky_sctx_t *sctx, Config_t *con
         if (cache_hit)
             printf("Location found in cache\n");
     }
+#if SKY_AP_DATABASE
+    else if (locate_from_ap_database(rctx, config, loc)) {
+        /* APs of the new scan cover a known site. Application may use the location
+         * without contacting the server
+         */
+        printf("Location found in AP database\n");
+        return true;
+    }
+#endif // SKY_AP_DATABASE
 
 /* Encode the appropriate scan into a server request.
  * If cache hit status is true, the scan is taken from the matching cacheline
@@ -623,7 +677,8 @@ int main(int argc, char *argv[])
      * time a location is to be performed.
      */
     ret_status = sky_open(&sky_errno, config.device_id, config.device_len, config.partner_id,
-        config.key, config.sku, config.cc, sctx, SKY_LOG_LEVEL_ALL, &logger, &rand_bytes, &mytime);
+        config.key, config.sku, config.cc, sctx, CACHE_SIZE, SKY_LOG_LEVEL_ALL, &logger, &rand_bytes,
+        &mytime);
     if (ret_status != SKY_SUCCESS) {
         printf("sky_open returned error (%s), Can't continue\n", sky_perror(sky_errno));
         exit(-1);
@@ -0,0 +1,201 @@
+/*! \file tools/apdb_build.c
+ *  \brief AP database builder - Skyhook Embedded Library
+ *
+ * Copyright (c) 2020 Skyhook, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+/*
+ * Builds an AP location database for sky_locate_ap_database() from a CSV file
+ * with one AP per line:
+ *
+ *   mac,latitude,longitude,hpe
+ *
+ * e.g. 4C:5E:0C:B0:17:4B,42.348,-71.078,25
+ * The mac may be written with or without ':' or '-' separators. Blank lines
+ * and lines starting with '#' are ignored. Lines longer than 256 characters are
+ * reported and ignored. Where a mac appears more than once, the last line is used.
+ *
+ * usage: apdb_build input.csv output.db
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include "libel.h"
+
+#define MAX_LINE_LENGTH 256
+
+typedef struct apdb_record {
+    uint8_t mac[MAC_SIZE];
+    uint16_t hpe;
+    int32_t lat, lon;
+    uint32_t line; /* line number in CSV file */
+} Apdb_record_t;
+
+/*! \brief parse a MAC address
+ *
+ *  @param str pointer to MAC as 12 hex digits with optional separators
+ *  @param mac where to save MAC
+ *
+ *  @return 0 for success, -1 if not a valid MAC
+ */
+static int parse_mac(const char *str, uint8_t mac[MAC_SIZE])
+{
+    int n = 0;
+
+    for (; *str && !isspace((unsigned char)*str) && n < 2 * MAC_SIZE; str++) {
+        int v;
+
+        if (*str == ':' || *str == '-')
+            continue;
+        if (!isxdigit((unsigned char)*str))
+            return -1;
+        v = isdigit((unsigned char)*str) ? *str - '0' : tolower((unsigned char)*str) - 'a' + 10;
+        mac[n / 2] = (uint8_t)(n % 2 ? (mac[n / 2] << 4) | v : v);
+        n++;
+    }
+    return n == 2 * MAC_SIZE ? 0 : -1;
+}
+
+/*! \brief order records by MAC, then by line number
+ *
+ *  @param a pointer to first record
+ *  @param b pointer to second record
+ *
+ *  @return less than, equal to or greater than zero
+ */
+static int compare_records(const void *a, const void *b)
+{
+    const Apdb_record_t *ra = a, *rb = b;
+    int diff = memcmp(ra->mac, rb->mac, MAC_SIZE);
+
+    if (diff)
+        return diff;
+    return ra->line < rb->line ? -1 : ra->line > rb->line;
+}
+
+/*! \brief write a little-endian integer
+ *
+ *  @param fp file to write to
+ *  @param v value
+ *  @param size number of bytes
+ *
+ *  @return 0 for success, -1 for error
+ */
+static int put_uint(FILE *fp, uint32_t v, int size)
+{
+    while (size--) {
+        if (fputc((int)(v & 0xFF), fp) == EOF)
+            return -1;
+        v >>= 8;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    char line[MAX_LINE_LENGTH + 1];
+    char mac[MAX_LINE_LENGTH + 1]; /* as long as the line, so the field always fits */
+    Apdb_record_t *records = NULL;
+    uint32_t num_records = 0, max_records = 0, count = 0, line_num = 0, i;
+    FILE *in, *out;
+
+    if (argc != 3) {
+        printf("usage: %s input.csv output.db\n", argv[0]);
+        exit(-1);
+    }
+    if ((in = fopen(argv[1], "r")) == NULL) {
+        printf("Error: unable to open input file - %s\n", argv[1]);
+        exit(-1);
+    }
+
+    while (fgets(line, sizeof(line), in)) {
+        Apdb_record_t r;
+        double lat, lon, hpe;
+        size_t len = strlen(line);
+        int c;
+
+        line_num++;
+        /* a line which fills the buffer is too long unless its end is next */
+        if (len && line[len - 1] != '\n' && (c = fgetc(in)) != EOF && c != '\n') {
+            printf("Error: ignoring line %u - longer than %d characters\n", line_num,
+                MAX_LINE_LENGTH);
+            while ((c = fgetc(in)) != EOF && c != '\n')
+                ;
+            continue;
+        }
+        if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line))
+            continue;
+        if (sscanf(line, " %[^,],%lf,%lf,%lf", mac, &lat, &lon, &hpe) != 4 ||
+            parse_mac(mac, r.mac) != 0 || fabs(lat) > 90.0 || fabs(lon) > 180.0 || hpe < 0.0) {
+            printf("Error: ignoring line %u - %s", line_num, line);
+            continue;
+        }
+        r.lat = (int32_t)lround(lat * 1e7);
+        r.lon = (int32_t)lround(lon * 1e7);
+        r.hpe = hpe > UINT16_MAX ? UINT16_MAX : (uint16_t)lround(hpe);
+        r.line = line_num;
+        if (num_records == max_records) {
+            Apdb_record_t *p;
+
+            max_records = max_records ? 2 * max_records : 1024;
+            if ((p = realloc(records, max_records * sizeof(*records))) == NULL) {
+                printf("Error: out of memory\n");
+                exit(-1);
+            }
+            records = p;
+        }
+        records[num_records++] = r;
+    }
+    fclose(in);
+
+    /* sort by MAC, keeping only the last line of each MAC */
+    if (num_records)
+        qsort(records, num_records, sizeof(*records), compare_records);
+    for (i = 0; i < num_records; i++) {
+        if (i + 1 < num_records && memcmp(records[i].mac, records[i + 1].mac, MAC_SIZE) == 0)
+            continue;
+        records[count++] = records[i];
+    }
+
+    if ((out = fopen(argv[2], "wb")) == NULL) {
+        printf("Error: unable to open output file - %s\n", argv[2]);
+        exit(-1);
+    }
+    if (fwrite(SKY_AP_DB_MAGIC, 1, 8, out) != 8 || put_uint(out, count, 4) ||
+        put_uint(out, 0, 4)) {
+        printf("Error: unable to write output file - %s\n", argv[2]);
+        exit(-1);
+    }
+    for (i = 0; i < count; i++) {
+        if (fwrite(records[i].mac, 1, MAC_SIZE, out) != MAC_SIZE ||
+            put_uint(out, records[i].hpe, 2) || put_uint(out, (uint32_t)records[i].lat, 4) ||
+            put_uint(out, (uint32_t)records[i].lon, 4)) {
+            printf("Error: unable to write output file - %s\n", argv[2]);
+            exit(-1);
+        }
+    }
+    fclose(out);
+    free(records);
+    printf("%u APs written to %s\n", count, argv[2]);
+    return 0;
+}
@@ -6,7 +6,7 @@ TEST_FUNC(test_validate_request_ctx)
         rctx->num_beacons > TOTAL_BEACONS + 1
         rctx->num_ap > MAX_AP_BEACONS + 1
         rctx->header.crc32 == sky_crc32(...)
-        rctx->beacon[i].h.magic != BEACON_MAGIC || rctx->beacon[i].h.type > SKY_BEACON_MAX
+        RCTX_BEACON(rctx, i).h.magic != BEACON_MAGIC || RCTX_BEACON(rctx, i).h.type > SKY_BEACON_MAX
         */
     TEST("should return false with NULL rctx", rctx,
         { ASSERT(false == validate_request_ctx(NULL)); });
@@ -35,12 +35,12 @@ TEST_FUNC(test_validate_request_ctx)
     });
 
     TEST("should return false with corrupt beacon in rctx (magic)", rctx, {
-        rctx->beacon[0].h.magic = 1234;
+        RCTX_BEACON(rctx, 0).h.magic = 1234;
         ASSERT(false == validate_request_ctx(rctx));
     });
 
     TEST("should return false with corrupt beacon in rctx (type)", rctx, {
-        rctx->beacon[0].h.type = 1234;
+        RCTX_BEACON(rctx, 0).h.type = 1234;
         ASSERT(false == validate_request_ctx(rctx));
     });
 }
@@ -119,9 +119,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &b));
-        ASSERT(CELL_EQ(&b, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&b, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("should return A better NR over LTE", rctx, {
@@ -131,9 +131,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &b));
-        ASSERT(CELL_EQ(&b, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&b, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("should return A better newer LTE over NR", rctx, {
@@ -143,9 +143,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &b));
-        ASSERT(CELL_EQ(&b, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&b, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("should return A better connected LTE over newer NR", rctx, {
@@ -155,9 +155,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &b));
-        ASSERT(CELL_EQ(&b, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&b, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("should return A better with one connected with different cells", rctx, {
@@ -167,9 +167,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &b));
-        ASSERT(CELL_EQ(&b, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&b, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("should return A better with one connected with older cells", rctx, {
@@ -179,9 +179,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &b));
-        ASSERT(CELL_EQ(&b, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&b, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("should return A better with one NMR with same cell type", rctx, {
@@ -191,9 +191,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &b));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("should return A better with two NMR one younger", rctx, {
@@ -203,9 +203,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &b));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("should return A better diff with two NMR one stronger", rctx, {
@@ -214,9 +214,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &b));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("should report 1st better with two very similar cells", rctx, {
@@ -226,9 +226,9 @@ TEST_FUNC(test_beacon_order)
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &a));
         ASSERT(SKY_SUCCESS ==
                insert_beacon(rctx, NULL, &b)); /* New cell inserted before if very similar */
-        ASSERT(CELL_EQ(&b, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) > 0);
+        ASSERT(CELL_EQ(&b, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) > 0);
     });
 
     TEST("should report 1st best with two NMR very similar", rctx, {
@@ -238,9 +238,9 @@ TEST_FUNC(test_beacon_order)
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &a));
         ASSERT(SKY_SUCCESS ==
                insert_beacon(rctx, NULL, &b)); /* New NMR inserted before if very similar */
-        ASSERT(CELL_EQ(&b, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) > 0);
+        ASSERT(CELL_EQ(&b, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) > 0);
     });
 
     TEST("should return A better with one NMR with different cell type", rctx, {
@@ -249,9 +249,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &b));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     GROUP("is_beacon_first Cells different");
@@ -261,9 +261,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &b));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("is_beacon_first: NR better than UMTS", rctx, {
@@ -272,9 +272,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &b));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("is_beacon_first: NR better than NBIOT", rctx, {
@@ -283,9 +283,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &b));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("is_beacon_first: NR better than CDMA", rctx, {
@@ -294,9 +294,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &b));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("is_beacon_first: NR better than GSM", rctx, {
@@ -305,9 +305,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &b));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("is_beacon_first: LTE better than UMTS", rctx, {
@@ -316,9 +316,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &b));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("is_beacon_first: LTE better than NBIOT", rctx, {
@@ -327,9 +327,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &b));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("is_beacon_first: LTE better than CDMA", rctx, {
@@ -338,9 +338,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &b));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("is_beacon_first: LTE better than GSM", rctx, {
@@ -349,9 +349,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &b));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("is_beacon_first: UMTS better than NBIOT", rctx, {
@@ -360,9 +360,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &b));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("is_beacon_first: UMTS better than CDMA", rctx, {
@@ -371,9 +371,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &b));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("is_beacon_first: UMTS better than GSM", rctx, {
@@ -382,9 +382,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &b));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("is_beacon_first: NBIOT better than CDMA", rctx, {
@@ -393,9 +393,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &b));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("is_beacon_first: NBIOT better than GSM", rctx, {
@@ -404,9 +404,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &b));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("is_beacon_first: CDMA better than GSM", rctx, {
@@ -415,9 +415,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &b));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     GROUP("is_beacon_first Cells same type");
@@ -427,9 +427,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &b));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 
     TEST("is_beacon_first: one NMR", rctx, {
@@ -438,9 +438,9 @@ TEST_FUNC(test_beacon_order)
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &a));
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, NULL, &b));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[0]));
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[0], &rctx->beacon[1]) > 0);
-        ASSERT(is_beacon_first(rctx, &rctx->beacon[1], &rctx->beacon[0]) < 0);
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 0)));
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 0), &RCTX_BEACON(rctx, 1)) > 0);
+        ASSERT(is_beacon_first(rctx, &RCTX_BEACON(rctx, 1), &RCTX_BEACON(rctx, 0)) < 0);
     });
 }
 
@@ -566,6 +566,76 @@ TEST_FUNC(test_distance)
         ASSERT(fabs(1147.117852f - distance_A_to_B(34.26004, -84.519028, 34.26503, -84.529953)) <
                2.7f);
     });
+
+    TEST("unit vectors of points 1147m apart are within 1150m but not 1144m", rctx, {
+        float a[3], b[3], d2 = 0;
+
+        gnss_unit_vector(34.26004, -84.519028, a);
+        gnss_unit_vector(34.26503, -84.529953, b);
+        for (int i = 0; i < 3; i++)
+            d2 += (a[i] - b[i]) * (a[i] - b[i]);
+        ASSERT(d2 < gnss_chord2(1150));
+        ASSERT(d2 > gnss_chord2(1144));
+    });
+
+    TEST("fast distance functions agree with distance_A_to_B", rctx, {
+        /* pairs of points from 1m to 100km apart */
+        float p[][4] = { { 48.940511, 2.233437, 48.957394, 2.267373 },
+            { 34.26004, -84.519028, 34.26503, -84.529953 },
+            { 35.511315, 139.618906, 35.511325, 139.618906 },
+            { -33.8688, 151.2093, -33.9688, 151.3093 }, { 64.1466, -21.9426, 64.5466, -21.2426 },
+            { 0.5, 179.9, 0.5, -179.9 } };
+        float batch;
+        int wrong = 0;
+
+        for (int i = 0; i < 6; i++) {
+            float ref = distance_haversine(p[i][0], p[i][1], p[i][2], p[i][3]);
+            float tol = 0.001f * ref + 1.0f;
+
+            if (ref > 100) /* law of cosines loses precision for points close together */
+                wrong += fabs(distance_A_to_B(p[i][0], p[i][1], p[i][2], p[i][3]) - ref) >= tol;
+            wrong += fabs(distance_equirect(p[i][0], p[i][1], p[i][2], p[i][3]) - ref) >= tol;
+            wrong += fabs(distance_fixed((int32_t)(p[i][0] * 1e7), (int32_t)(p[i][1] * 1e7),
+                              (int32_t)(p[i][2] * 1e7), (int32_t)(p[i][3] * 1e7)) -
+                          ref) >= tol;
+            /* batch form takes the cosine of latitude at A, so is less accurate far from A */
+            distance_batch(p[i][0], p[i][1], &p[i][2], &p[i][3], &batch, 1);
+            wrong += fabs(batch - ref) >= 0.003f * ref + 1.0f;
+        }
+        ASSERT(wrong == 0);
+    });
+
+    TEST("benchmark distance functions", rctx, {
+        enum { N = 1000 };
+        float lat[N], lon[N], dist[N];
+        volatile float sink = 0;
+        clock_t t0, t1, t2, t3;
+        int i;
+
+        for (i = 0; i < N; i++) {
+            lat[i] = 48.94f + (float)i / (100 * N);
+            lon[i] = 2.23f + (float)i / (50 * N);
+        }
+        t0 = clock();
+        for (int r = 0; r < 100; r++)
+            for (i = 0; i < N; i++)
+                sink += distance_A_to_B(48.94f, 2.23f, lat[i], lon[i]);
+        t1 = clock();
+        for (int r = 0; r < 100; r++)
+            for (i = 0; i < N; i++)
+                sink += distance_equirect(48.94f, 2.23f, lat[i], lon[i]);
+        t2 = clock();
+        for (int r = 0; r < 100; r++) {
+            distance_batch(48.94f, 2.23f, lat, lon, dist, N);
+            sink += dist[N - 1];
+        }
+        t3 = clock();
+        LOGFMT(rctx, SKY_LOG_LEVEL_DEBUG,
+            "100000 distances: distance_A_to_B %dus, equirect %dus, batch %dus",
+            (int)((t1 - t0) * 1000000 / CLOCKS_PER_SEC), (int)((t2 - t1) * 1000000 / CLOCKS_PER_SEC),
+            (int)((t3 - t2) * 1000000 / CLOCKS_PER_SEC));
+        ASSERT(sink > 0);
+    });
 }
 
 TEST_FUNC(test_insert)
@@ -576,7 +646,7 @@ TEST_FUNC(test_insert)
         Sky_errno_t sky_errno;
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
-        ASSERT(AP_EQ(&a, rctx->beacon));
+        ASSERT(AP_EQ(&a, &RCTX_BEACON(rctx, 0)));
     });
 
     TEST("should insert 3 APs A, B, C in rctx in rssi order B, A, C", rctx, {
@@ -586,16 +656,16 @@ TEST_FUNC(test_insert)
         Sky_errno_t sky_errno;
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
-        ASSERT(AP_EQ(&a, rctx->beacon));
+        ASSERT(AP_EQ(&a, &RCTX_BEACON(rctx, 0)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &b));
-        ASSERT(AP_EQ(&b, rctx->beacon));
+        ASSERT(AP_EQ(&b, &RCTX_BEACON(rctx, 0)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &c));
         ASSERT(NUM_BEACONS(rctx) == 3);
-        ASSERT(AP_EQ(&b, rctx->beacon));
-        ASSERT(AP_EQ(&a, rctx->beacon + 1));
-        ASSERT(AP_EQ(&c, rctx->beacon + 2));
+        ASSERT(AP_EQ(&b, &RCTX_BEACON(rctx, 0)));
+        ASSERT(AP_EQ(&a, &RCTX_BEACON(rctx, 1)));
+        ASSERT(AP_EQ(&c, &RCTX_BEACON(rctx, 2)));
     });
 
     TEST("should insert 3 APs C, A, B in rctx in rssi order B, A, C", rctx, {
@@ -605,16 +675,16 @@ TEST_FUNC(test_insert)
         Sky_errno_t sky_errno;
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &c));
-        ASSERT(AP_EQ(&c, rctx->beacon));
+        ASSERT(AP_EQ(&c, &RCTX_BEACON(rctx, 0)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
-        ASSERT(AP_EQ(&a, rctx->beacon));
+        ASSERT(AP_EQ(&a, &RCTX_BEACON(rctx, 0)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &b));
         ASSERT(NUM_BEACONS(rctx) == 3);
-        ASSERT(AP_EQ(&b, rctx->beacon));
-        ASSERT(AP_EQ(&a, rctx->beacon + 1));
-        ASSERT(AP_EQ(&c, rctx->beacon + 2));
+        ASSERT(AP_EQ(&b, &RCTX_BEACON(rctx, 0)));
+        ASSERT(AP_EQ(&a, &RCTX_BEACON(rctx, 1)));
+        ASSERT(AP_EQ(&c, &RCTX_BEACON(rctx, 2)));
     });
 
     TEST("should insert 3 APs A, C, B in rctx in rssi order B, A, C", rctx, {
@@ -624,16 +694,16 @@ TEST_FUNC(test_insert)
         Sky_errno_t sky_errno;
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
-        ASSERT(AP_EQ(&a, rctx->beacon));
+        ASSERT(AP_EQ(&a, &RCTX_BEACON(rctx, 0)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &c));
-        ASSERT(AP_EQ(&c, rctx->beacon + 1));
+        ASSERT(AP_EQ(&c, &RCTX_BEACON(rctx, 1)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &b));
         ASSERT(NUM_BEACONS(rctx) == 3);
-        ASSERT(AP_EQ(&b, rctx->beacon));
-        ASSERT(AP_EQ(&a, rctx->beacon + 1));
-        ASSERT(AP_EQ(&c, rctx->beacon + 2));
+        ASSERT(AP_EQ(&b, &RCTX_BEACON(rctx, 0)));
+        ASSERT(AP_EQ(&a, &RCTX_BEACON(rctx, 1)));
+        ASSERT(AP_EQ(&c, &RCTX_BEACON(rctx, 2)));
     });
 
     TEST("should insert 3 APs C, B, A in rctx in rssi order B, A, C", rctx, {
@@ -643,16 +713,16 @@ TEST_FUNC(test_insert)
         Sky_errno_t sky_errno;
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &c));
-        ASSERT(AP_EQ(&c, rctx->beacon));
+        ASSERT(AP_EQ(&c, &RCTX_BEACON(rctx, 0)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &b));
-        ASSERT(AP_EQ(&b, rctx->beacon));
+        ASSERT(AP_EQ(&b, &RCTX_BEACON(rctx, 0)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
         ASSERT(NUM_BEACONS(rctx) == 3);
-        ASSERT(AP_EQ(&b, rctx->beacon));
-        ASSERT(AP_EQ(&a, rctx->beacon + 1));
-        ASSERT(AP_EQ(&c, rctx->beacon + 2));
+        ASSERT(AP_EQ(&b, &RCTX_BEACON(rctx, 0)));
+        ASSERT(AP_EQ(&a, &RCTX_BEACON(rctx, 1)));
+        ASSERT(AP_EQ(&c, &RCTX_BEACON(rctx, 2)));
     });
 
     TEST("should insert 3 APs B, A, C in rctx in rssi order B, A, C", rctx, {
@@ -662,16 +732,16 @@ TEST_FUNC(test_insert)
         Sky_errno_t sky_errno;
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &b));
-        ASSERT(AP_EQ(&b, rctx->beacon));
+        ASSERT(AP_EQ(&b, &RCTX_BEACON(rctx, 0)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
-        ASSERT(AP_EQ(&a, rctx->beacon + 1));
+        ASSERT(AP_EQ(&a, &RCTX_BEACON(rctx, 1)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &c));
         ASSERT(NUM_BEACONS(rctx) == 3);
-        ASSERT(AP_EQ(&b, rctx->beacon));
-        ASSERT(AP_EQ(&a, rctx->beacon + 1));
-        ASSERT(AP_EQ(&c, rctx->beacon + 2));
+        ASSERT(AP_EQ(&b, &RCTX_BEACON(rctx, 0)));
+        ASSERT(AP_EQ(&a, &RCTX_BEACON(rctx, 1)));
+        ASSERT(AP_EQ(&c, &RCTX_BEACON(rctx, 2)));
     });
 
     TEST("should insert 3 APs B, C, A in rctx in rssi order B, A, C", rctx, {
@@ -681,16 +751,16 @@ TEST_FUNC(test_insert)
         Sky_errno_t sky_errno;
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &b));
-        ASSERT(AP_EQ(&b, rctx->beacon));
+        ASSERT(AP_EQ(&b, &RCTX_BEACON(rctx, 0)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &c));
-        ASSERT(AP_EQ(&c, rctx->beacon + 1));
+        ASSERT(AP_EQ(&c, &RCTX_BEACON(rctx, 1)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
         ASSERT(NUM_BEACONS(rctx) == 3);
-        ASSERT(AP_EQ(&b, rctx->beacon));
-        ASSERT(AP_EQ(&a, rctx->beacon + 1));
-        ASSERT(AP_EQ(&c, rctx->beacon + 2));
+        ASSERT(AP_EQ(&b, &RCTX_BEACON(rctx, 0)));
+        ASSERT(AP_EQ(&a, &RCTX_BEACON(rctx, 1)));
+        ASSERT(AP_EQ(&c, &RCTX_BEACON(rctx, 2)));
     });
 
     TEST("should insert 3 APs B, C, A, with C connected, in rssi order B, A, C", rctx, {
@@ -700,16 +770,16 @@ TEST_FUNC(test_insert)
         Sky_errno_t sky_errno;
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &b));
-        ASSERT(AP_EQ(&b, rctx->beacon));
+        ASSERT(AP_EQ(&b, &RCTX_BEACON(rctx, 0)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &c));
-        ASSERT(AP_EQ(&c, rctx->beacon + 1));
+        ASSERT(AP_EQ(&c, &RCTX_BEACON(rctx, 1)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
         ASSERT(NUM_BEACONS(rctx) == 3);
-        ASSERT(AP_EQ(&b, rctx->beacon));
-        ASSERT(AP_EQ(&a, rctx->beacon + 1));
-        ASSERT(AP_EQ(&c, rctx->beacon + 2));
+        ASSERT(AP_EQ(&b, &RCTX_BEACON(rctx, 0)));
+        ASSERT(AP_EQ(&a, &RCTX_BEACON(rctx, 1)));
+        ASSERT(AP_EQ(&c, &RCTX_BEACON(rctx, 2)));
     });
 
     TEST("should insert 3 APs B, C, A, with C younger, in rssi order B, A, C", rctx, {
@@ -719,16 +789,16 @@ TEST_FUNC(test_insert)
         Sky_errno_t sky_errno;
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &b));
-        ASSERT(AP_EQ(&b, rctx->beacon));
+        ASSERT(AP_EQ(&b, &RCTX_BEACON(rctx, 0)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &c));
-        ASSERT(AP_EQ(&c, rctx->beacon + 1));
+        ASSERT(AP_EQ(&c, &RCTX_BEACON(rctx, 1)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
         ASSERT(NUM_BEACONS(rctx) == 3);
-        ASSERT(AP_EQ(&b, rctx->beacon));
-        ASSERT(AP_EQ(&a, rctx->beacon + 1));
-        ASSERT(AP_EQ(&c, rctx->beacon + 2));
+        ASSERT(AP_EQ(&b, &RCTX_BEACON(rctx, 0)));
+        ASSERT(AP_EQ(&a, &RCTX_BEACON(rctx, 1)));
+        ASSERT(AP_EQ(&c, &RCTX_BEACON(rctx, 2)));
     });
 
     TEST("should insert 3 APs B, C, A, with only MAC diff, in mac order C, A, B", rctx, {
@@ -738,16 +808,16 @@ TEST_FUNC(test_insert)
         Sky_errno_t sky_errno;
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &b));
-        ASSERT(AP_EQ(&b, rctx->beacon));
+        ASSERT(AP_EQ(&b, &RCTX_BEACON(rctx, 0)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &c));
-        ASSERT(AP_EQ(&c, rctx->beacon));
+        ASSERT(AP_EQ(&c, &RCTX_BEACON(rctx, 0)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
         ASSERT(NUM_BEACONS(rctx) == 3);
-        ASSERT(AP_EQ(&c, rctx->beacon));
-        ASSERT(AP_EQ(&a, rctx->beacon + 1));
-        ASSERT(AP_EQ(&b, rctx->beacon + 2));
+        ASSERT(AP_EQ(&c, &RCTX_BEACON(rctx, 0)));
+        ASSERT(AP_EQ(&a, &RCTX_BEACON(rctx, 1)));
+        ASSERT(AP_EQ(&b, &RCTX_BEACON(rctx, 2)));
     });
 
     TEST("should insert 3 Cells B, C, A, with only age diff, in priority order C, A, B", rctx, {
@@ -757,16 +827,16 @@ TEST_FUNC(test_insert)
         Sky_errno_t sky_errno;
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &b));
-        ASSERT(CELL_EQ(&b, &rctx->beacon[0]));
+        ASSERT(CELL_EQ(&b, &RCTX_BEACON(rctx, 0)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &c));
-        ASSERT(CELL_EQ(&c, &rctx->beacon[0]));
+        ASSERT(CELL_EQ(&c, &RCTX_BEACON(rctx, 0)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
         ASSERT(NUM_BEACONS(rctx) == 3);
-        ASSERT(CELL_EQ(&c, &rctx->beacon[0]));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[1]));
-        ASSERT(CELL_EQ(&b, &rctx->beacon[2]));
+        ASSERT(CELL_EQ(&c, &RCTX_BEACON(rctx, 0)));
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 1)));
+        ASSERT(CELL_EQ(&b, &RCTX_BEACON(rctx, 2)));
     });
 
     GROUP("insert_beacon duplicate handling");
@@ -780,14 +850,14 @@ TEST_FUNC(test_insert)
         Sky_errno_t sky_errno;
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
-        ASSERT(AP_EQ(&a, rctx->beacon));
+        ASSERT(AP_EQ(&a, &RCTX_BEACON(rctx, 0)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &b));
-        ASSERT(AP_EQ(&b, rctx->beacon));
+        ASSERT(AP_EQ(&b, &RCTX_BEACON(rctx, 0)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &c));
         ASSERT(NUM_BEACONS(rctx) == 1);
-        ASSERT(AP_EQ(&b, rctx->beacon));
+        ASSERT(AP_EQ(&b, &RCTX_BEACON(rctx, 0)));
     });
 
     TEST("should insert 1 for duplicate APs age diff ignore connected", rctx, {
@@ -799,14 +869,14 @@ TEST_FUNC(test_insert)
         Sky_errno_t sky_errno;
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
-        ASSERT(AP_EQ(&a, rctx->beacon));
+        ASSERT(AP_EQ(&a, &RCTX_BEACON(rctx, 0)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &b));
-        ASSERT(AP_EQ(&b, rctx->beacon));
+        ASSERT(AP_EQ(&b, &RCTX_BEACON(rctx, 0)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &c));
         ASSERT(NUM_BEACONS(rctx) == 1);
-        ASSERT(AP_EQ(&b, rctx->beacon));
+        ASSERT(AP_EQ(&b, &RCTX_BEACON(rctx, 0)));
     });
 
     TEST("should insert 1 for duplicate APs A, B, C with rssi and connected diff", rctx, {
@@ -818,14 +888,14 @@ TEST_FUNC(test_insert)
         Sky_errno_t sky_errno;
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
-        ASSERT(AP_EQ(&a, rctx->beacon));
+        ASSERT(AP_EQ(&a, &RCTX_BEACON(rctx, 0)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &b));
-        ASSERT(AP_EQ(&b, rctx->beacon));
+        ASSERT(AP_EQ(&b, &RCTX_BEACON(rctx, 0)));
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &c));
         ASSERT(NUM_BEACONS(rctx) == 1);
-        ASSERT(AP_EQ(&b, rctx->beacon));
+        ASSERT(AP_EQ(&b, &RCTX_BEACON(rctx, 0)));
     });
 
     TEST("should insert 1 for duplicate Cells B, C, A, with only age diff", rctx, {
@@ -837,16 +907,59 @@ TEST_FUNC(test_insert)
         Sky_errno_t sky_errno;
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[0]));
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 0)));
         ASSERT(NUM_BEACONS(rctx) == 1);
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &b));
-        ASSERT(CELL_EQ(&a, &rctx->beacon[0]));
+        ASSERT(CELL_EQ(&a, &RCTX_BEACON(rctx, 0)));
         ASSERT(NUM_BEACONS(rctx) == 1);
 
         ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &c));
         ASSERT(NUM_BEACONS(rctx) == 1);
-        ASSERT(CELL_EQ(&c, &rctx->beacon[0]));
+        ASSERT(CELL_EQ(&c, &RCTX_BEACON(rctx, 0)));
+    });
+
+    TEST("should keep beacons in their slots as others are inserted and removed", rctx, {
+        AP(a, "ABCDEF010203", 2, -88, 2412, false);
+        AP(b, "ABCDEF010201", 2, -48, 2412, false);
+        AP(c, "CBADEF010201", 2, -108, 2412, false);
+        Sky_errno_t sky_errno;
+
+        ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
+        ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &b));
+        ASSERT(AP_EQ(&a, &rctx->beacon[0]) && AP_EQ(&b, &rctx->beacon[1]));
+        ASSERT(beacon_index(rctx, &rctx->beacon[0]) == 1);
+        ASSERT(beacon_index(rctx, &rctx->beacon[1]) == 0);
+
+        ASSERT(SKY_SUCCESS == remove_beacon(rctx, 0));
+        ASSERT(NUM_BEACONS(rctx) == 1 && AP_EQ(&a, &rctx->beacon[0]));
+        ASSERT(beacon_index(rctx, &rctx->beacon[1]) == -1);
+
+        ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &c));
+        ASSERT(AP_EQ(&c, &rctx->beacon[1]) && beacon_index(rctx, &rctx->beacon[1]) == 1);
+        ASSERT(AP_EQ(&a, &RCTX_BEACON(rctx, 0)) && AP_EQ(&c, &RCTX_BEACON(rctx, 1)));
+    });
+
+    TEST("should find every beacon by hash as others are removed", rctx, {
+        AP(a, "ABCDEF010200", 2, -30, 2412, false);
+        Sky_errno_t sky_errno;
+        int j, found = 0;
+
+        for (j = 0; j < MAX_AP_BEACONS + 8; j++) {
+            a.ap.mac[5] = (uint8_t)(0x11 * j);
+            a.h.rssi = (int16_t)(-30 - (j * 13) % 60);
+            add_beacon(rctx, &sky_errno, &a, rctx->header.time);
+        }
+        for (j = 0; j < NUM_BEACONS(rctx); j++)
+            found += find_duplicate(rctx, &sky_errno, &RCTX_BEACON(rctx, j)) == j;
+        ASSERT(NUM_BEACONS(rctx) == MAX_AP_BEACONS && found == MAX_AP_BEACONS);
+
+        a = RCTX_BEACON(rctx, 3);
+        a.h.rssi -= 10; /* weaker duplicate is rejected */
+        ASSERT(SKY_SUCCESS == insert_beacon(rctx, &sky_errno, &a));
+        ASSERT(NUM_BEACONS(rctx) == MAX_AP_BEACONS);
+        ASSERT(SKY_SUCCESS == remove_beacon(rctx, 3));
+        ASSERT(find_duplicate(rctx, &sky_errno, &a) == -1);
     });
 }
 
@@ -867,14 +980,14 @@ TEST_FUNC(test_used)
             .ap.vg_len = 0 };
 
         /* 3 different APs */
-        rctx->beacon[0] = b;
+        RCTX_BEACON(rctx, 0) = b;
         b.ap.mac[3] = 0xaa;
-        rctx->beacon[1] = b;
+        RCTX_BEACON(rctx, 1) = b;
         rctx->num_beacons = 2;
         rctx->num_ap = 2;
         loc.time = rctx->header.time;
-        rctx->beacon[0].ap.property.used = true;
-        rctx->beacon[1].ap.property.used = true;
+        RCTX_BEACON(rctx, 0).ap.property.used = true;
+        RCTX_BEACON(rctx, 1).ap.property.used = true;
 
         sky_plugin_add_to_cache(rctx, &sky_errno, &loc);
         rctx->num_beacons = 0;
@@ -886,6 +999,596 @@ TEST_FUNC(test_used)
     });
 }
 
+TEST_FUNC(test_cache_index)
+{
+    GROUP("cache index tracks cached APs");
+    TEST("AP is found in cache only while its cacheline is in use", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+        AP(a, "ABCDEFAACCDD", 10, -108, 4433, false);
+        AP(b, "ABCDEFAACCDE", 10, -78, 4433, false);
+
+        RCTX_BEACON(rctx, 0) = a;
+        RCTX_BEACON(rctx, 0).ap.property.used = true;
+        rctx->num_beacons = 1;
+        rctx->num_ap = 1;
+        loc.time = rctx->header.time;
+
+        ASSERT(beacon_in_cache(rctx, &a) == false);
+        ASSERT(sky_plugin_add_to_cache(rctx, &sky_errno, &loc) == SKY_SUCCESS);
+        ASSERT(beacon_in_cache(rctx, &a) == true);
+        ASSERT(a.ap.property.used == true);
+        ASSERT(beacon_in_cache(rctx, &b) == false);
+
+        clear_cacheline(rctx, &rctx->session->cacheline[0]);
+        ASSERT(beacon_in_cache(rctx, &a) == false);
+    });
+
+    TEST("cache index stays consistent as cachelines are replaced", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+        AP(b, "ABCDEFAACCDD", 10, -78, 4433, false);
+        int i, j;
+
+        loc.time = rctx->header.time;
+        /* every cacheline holds the same first AP and unique others */
+        for (i = 0; i < CACHE_SIZE; i++) {
+            for (j = 0; j < MAX_AP_BEACONS; j++) {
+                RCTX_BEACON(rctx, j) = b;
+                RCTX_BEACON(rctx, j).ap.mac[4] = (uint8_t)(j ? i : 0xFF);
+                RCTX_BEACON(rctx, j).ap.mac[5] = (uint8_t)j;
+            }
+            rctx->num_beacons = rctx->num_ap = MAX_AP_BEACONS;
+            rctx->save_to = i;
+            ASSERT(sky_plugin_add_to_cache(rctx, &sky_errno, &loc) == SKY_SUCCESS);
+        }
+        /* overwrite odd cachelines with new APs */
+        for (i = 1; i < CACHE_SIZE; i += 2) {
+            for (j = 0; j < MAX_AP_BEACONS; j++)
+                RCTX_BEACON(rctx, j).ap.mac[3] = 0x11;
+            rctx->save_to = i;
+            ASSERT(sky_plugin_add_to_cache(rctx, &sky_errno, &loc) == SKY_SUCCESS);
+        }
+        /* every AP in the cache is found, and only those */
+        for (i = 0; i < CACHE_SIZE; i++) {
+            for (j = 0; j < MAX_AP_BEACONS; j++) {
+                Beacon_t c;
+
+                get_cached_beacon(rctx->session, &rctx->session->cacheline[i], j, &c);
+
+                ASSERT(beacon_in_cache(rctx, &c) == true);
+                c.ap.mac[3] = 0x22;
+                ASSERT(beacon_in_cache(rctx, &c) == false);
+            }
+        }
+        /* shared AP survives until the last cacheline holding it is cleared */
+        for (i = 0; i < CACHE_SIZE; i++) {
+            Beacon_t c;
+
+            get_cached_beacon(rctx->session, &rctx->session->cacheline[i], 0, &c);
+            ASSERT(beacon_in_cache(rctx, &c) == true);
+            clear_cacheline(rctx, &rctx->session->cacheline[i]);
+        }
+        for (i = 0; i < (int)CACHE_INDEX_SLOTS(rctx->session); i++)
+            ASSERT(CACHE_INDEX(rctx->session)[i].lines == 0);
+    });
+}
+
+TEST_FUNC(test_cacheline_accessors)
+{
+    GROUP("beacon_in_cacheline");
+    TEST("cached APs and cells are found through the cacheline accessors", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+        AP(a, "ABCDEFAACCDD", 10, -108, 4433, false);
+        AP(b, "ABCDEFAACCDE", 10, -78, 4433, true);
+        LTE(c, 10, -108, true, 311, 480, 25614, 25664526, 387, 1000);
+        LTE(d, 10, -108, false, 311, 480, 25614, 25664527, 387, 1000);
+        Sky_cacheline_t *cl = &rctx->session->cacheline[0];
+
+        RCTX_BEACON(rctx, 0) = a;
+        RCTX_BEACON(rctx, 0).ap.property.used = true;
+        RCTX_BEACON(rctx, 1) = c;
+        rctx->num_beacons = 2;
+        rctx->num_ap = 1;
+        rctx->save_to = 0;
+        loc.time = rctx->header.time;
+        ASSERT(sky_plugin_add_to_cache(rctx, &sky_errno, &loc) == SKY_SUCCESS);
+
+        ASSERT(memcmp(CL_AP_MAC(rctx->session, cl, 0), a.ap.mac, MAC_SIZE) == 0);
+        ASSERT(CL_AP_RSSI(rctx->session, cl, 0) == -108);
+        ASSERT(CL_AP_USED(rctx->session, cl, 0) && !CL_AP_CONNECTED(rctx->session, cl, 0));
+        ASSERT(CL_CELL_KEY(rctx->session, cl, 1) == cell_key(&c));
+        ASSERT(cell_key(&c) != cell_key(&d));
+
+        ASSERT(beacon_in_cacheline(rctx, &a, cl) == true);
+        ASSERT(a.ap.property.used == true);
+        ASSERT(beacon_in_cacheline(rctx, &b, cl) == false);
+        ASSERT(beacon_in_cacheline(rctx, &c, cl) == true);
+        ASSERT(beacon_in_cacheline(rctx, &d, cl) == false);
+    });
+    TEST("cacheline accessors agree with the cached beacon records", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+        Sky_sctx_t *sctx = rctx->session;
+        int i, j, wrong = 0;
+
+        loc.time = rctx->header.time;
+        for (i = 0; i < 3; i++) {
+            for (j = 0; j < 4 + i; j++) {
+                AP(a, "ABCDEFAACC00", 10, -60, 4433, false);
+                a.h.rssi = (int16_t)(-60 - j);
+                a.h.connected = j == 1;
+                a.ap.mac[4] = (uint8_t)i;
+                a.ap.mac[5] = (uint8_t)(0x10 * j);
+                a.ap.property.used = j % 2 == 0;
+                RCTX_BEACON(rctx, j) = a;
+            }
+            rctx->num_ap = (uint16_t)j;
+            for (; j < 4 + 2 * i + 1; j++) {
+                LTE(c, 10, -108, false, 311, 480, 25614, 25664526, 387, 1000);
+                c.cell.id4 += 10 * i + j;
+                RCTX_BEACON(rctx, j) = c;
+            }
+            rctx->num_beacons = (uint16_t)j;
+            rctx->save_to = (int16_t)i;
+            ASSERT(sky_plugin_add_to_cache(rctx, &sky_errno, &loc) == SKY_SUCCESS);
+        }
+
+        for (i = 0; i < 3; i++) {
+            Sky_cacheline_t *cl = &sctx->cacheline[i];
+
+            for (j = 0; j < NUM_APS(cl); j++) {
+                Sky_cache_ap_t *r = CACHE_AP(sctx, cl, j);
+
+                wrong += memcmp(CL_AP_MAC(sctx, cl, j), r->mac, MAC_SIZE) != 0;
+                wrong += CL_AP_RSSI(sctx, cl, j) != r->rssi;
+                wrong += CL_AP_USED(sctx, cl, j) != ((r->flags & CL_AP_FLAG_USED) != 0);
+                wrong += CL_AP_CONNECTED(sctx, cl, j) != ((r->flags & CL_AP_FLAG_CONNECTED) != 0);
+            }
+            for (; j < NUM_BEACONS(cl); j++)
+                wrong += CL_CELL_KEY(sctx, cl, j) != cached_cell_key(CACHE_CELL(sctx, cl, j));
+        }
+        ASSERT(NUM_APS(&sctx->cacheline[2]) == 6 && NUM_BEACONS(&sctx->cacheline[2]) == 9);
+        ASSERT(wrong == 0);
+    });
+}
+
+TEST_FUNC(test_cache_pool)
+{
+    GROUP("cache pool");
+    TEST("cached beacons are copied out of the pool unchanged", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+        AP(a, "ABCDEFAACCDD", 10, -108, 4433, true);
+        NR(c, 10, -130, false, 213, 142, 15614, 68719476735, 25, 1000);
+        Beacon_t b;
+
+        a.ap.property.used = true;
+        a.ap.vg_len = 2;
+        a.ap.vg[VAP_LENGTH].len = 2;
+        a.ap.vg[VAP_PARENT].ap = 0;
+        a.ap.vg[VAP_FIRST_DATA].data.nibble_idx = 11;
+        a.ap.vg[VAP_FIRST_DATA].data.value = 0xE;
+        a.ap.vg_prop[0].used = true;
+        RCTX_BEACON(rctx, 0) = a;
+        RCTX_BEACON(rctx, 1) = c;
+        rctx->num_beacons = 2;
+        rctx->num_ap = 1;
+        rctx->save_to = 0;
+        loc.time = rctx->header.time;
+        ASSERT(sky_plugin_add_to_cache(rctx, &sky_errno, &loc) == SKY_SUCCESS);
+
+        get_cached_beacon(rctx->session, &rctx->session->cacheline[0], 0, &b);
+        ASSERT(AP_EQ(&a, &b));
+        ASSERT(b.ap.property.used && b.ap.vg_prop[0].used && !b.ap.vg_prop[1].used);
+        ASSERT(b.ap.vg_len == 2 && memcmp(b.ap.vg, a.ap.vg, sizeof(a.ap.vg)) == 0);
+        ASSERT(b.h.age == a.h.age);
+        get_cached_beacon(rctx->session, &rctx->session->cacheline[0], 1, &b);
+        ASSERT(CELL_EQ(&c, &b));
+        ASSERT(b.cell.ta == c.cell.ta && b.h.age == c.h.age);
+    });
+    TEST("clearing a cacheline compacts the pool", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+        AP(a, "ABCDEFAACCDD", 10, -108, 4433, false);
+        Sky_sctx_t *sctx = rctx->session;
+        uint32_t used;
+        int i;
+
+        loc.time = rctx->header.time;
+        for (i = 0; i < 3; i++) {
+            RCTX_BEACON(rctx, 0) = a;
+            RCTX_BEACON(rctx, 0).ap.mac[0] = (uint8_t)(0x10 * i);
+            RCTX_BEACON(rctx, 1) = a;
+            RCTX_BEACON(rctx, 1).ap.mac[1] = (uint8_t)(0x10 * i);
+            rctx->num_beacons = rctx->num_ap = 2;
+            rctx->save_to = i;
+            ASSERT(sky_plugin_add_to_cache(rctx, &sky_errno, &loc) == SKY_SUCCESS);
+        }
+        used = sctx->cache_pool_used;
+        ASSERT(used == cacheline_bytes(&sctx->cacheline[0]) + cacheline_bytes(&sctx->cacheline[1]) +
+                           cacheline_bytes(&sctx->cacheline[2]));
+
+        clear_cacheline(rctx, &sctx->cacheline[1]);
+        ASSERT(sctx->cache_pool_used == used - 2 * sizeof(Sky_cache_ap_t));
+        ASSERT(NUM_BEACONS(&sctx->cacheline[1]) == 0);
+        ASSERT(CL_AP_MAC(sctx, &sctx->cacheline[0], 0)[0] == 0x00);
+        ASSERT(CL_AP_MAC(sctx, &sctx->cacheline[2], 0)[0] == 0x20);
+        ASSERT(CL_AP_MAC(sctx, &sctx->cacheline[2], 1)[1] == 0x20);
+        ASSERT(sctx->cacheline[2].offset + cacheline_bytes(&sctx->cacheline[2]) ==
+               sctx->cache_pool_used);
+    });
+    /* fill cachelines 0-2 and the pool, line 1 having the fewest hits */
+#define FILL_POOL(rctx, sky_errno, loc, a)                                                         \
+    do {                                                                                           \
+        for (int _i = 0; _i < 3; _i++) {                                                           \
+            RCTX_BEACON(rctx, 0) = a;                                                              \
+            RCTX_BEACON(rctx, 0).ap.mac[0] = (uint8_t)(0x10 * _i);                                 \
+            RCTX_BEACON(rctx, 1) = a;                                                              \
+            RCTX_BEACON(rctx, 1).ap.mac[1] = (uint8_t)(0x10 * _i);                                 \
+            rctx->num_beacons = rctx->num_ap = 2;                                                  \
+            rctx->save_to = (int16_t)_i;                                                           \
+            sky_plugin_add_to_cache(rctx, &sky_errno, &loc);                                       \
+        }                                                                                          \
+        rctx->session->cacheline[0].hits = 5;                                                      \
+        rctx->session->cacheline[1].hits = 0;                                                      \
+        rctx->session->cacheline[2].hits = 2;                                                      \
+        rctx->session->cache_pool_size = rctx->session->cache_pool_used;                           \
+        RCTX_BEACON(rctx, 0).ap.mac[0] = RCTX_BEACON(rctx, 1).ap.mac[1] = 0x30;                    \
+        rctx->save_to = 3;                                                                         \
+    } while (0)
+    TEST("a full pool evicts the oldest cacheline without an eviction policy", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+        AP(a, "ABCDEFAACCDD", 10, -108, 4433, false);
+        Sky_sctx_t *sctx = rctx->session;
+
+        loc.time = rctx->header.time;
+        FILL_POOL(rctx, sky_errno, loc, a);
+        ASSERT(sctx->num_expiry == 3);
+        ASSERT(sky_plugin_add_to_cache(rctx, &sky_errno, &loc) == SKY_SUCCESS);
+        ASSERT(sctx->cacheline[0].time == CACHE_EMPTY);
+        ASSERT(sctx->cacheline[1].time != CACHE_EMPTY && sctx->cacheline[2].time != CACHE_EMPTY);
+        ASSERT(NUM_APS(&sctx->cacheline[3]) == 2);
+    });
+    TEST("a full pool evicts the cacheline chosen by the eviction policy", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+        AP(a, "ABCDEFAACCDD", 10, -108, 4433, false);
+        Sky_sctx_t *sctx = rctx->session;
+
+        ASSERT(SKY_SUCCESS ==
+               sky_set_option(rctx, &sky_errno, CONF_CACHE_EVICTION_POLICY, SKY_CACHE_POLICY_LFU));
+        loc.time = rctx->header.time;
+        FILL_POOL(rctx, sky_errno, loc, a);
+        ASSERT(sctx->num_expiry == 3);
+        ASSERT(sky_plugin_add_to_cache(rctx, &sky_errno, &loc) == SKY_SUCCESS);
+        ASSERT(sctx->cacheline[1].time == CACHE_EMPTY);
+        ASSERT(sctx->cacheline[0].time != CACHE_EMPTY && sctx->cacheline[2].time != CACHE_EMPTY);
+        ASSERT(NUM_APS(&sctx->cacheline[3]) == 2);
+    });
+#undef FILL_POOL
+}
+
+TEST_FUNC(test_cache_count)
+{
+    GROUP("running counts of request APs held in cache");
+    TEST("counts follow APs as they are added and removed", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+        AP(a, "ABCDEFAACCDD", 10, -108, 4433, false);
+        AP(b, "4C5E0CB0174B", 10, -78, 4433, false);
+        AP(c, "3B5E0CB0174D", 10, -88, 4433, false);
+        AP(d, "2A5E0CB0174C", 10, -98, 4433, false);
+        Beacon_t removed;
+
+        loc.time = rctx->header.time;
+        ASSERT(SKY_SUCCESS == add_beacon(rctx, &sky_errno, &a, rctx->header.time));
+        ASSERT(SKY_SUCCESS == add_beacon(rctx, &sky_errno, &b, rctx->header.time));
+        ASSERT(SKY_SUCCESS == add_beacon(rctx, &sky_errno, &c, rctx->header.time));
+        ASSERT(cache_count_valid(rctx) && rctx->cache_count[0] == 0);
+        ASSERT(sky_plugin_add_to_cache(rctx, &sky_errno, &loc) == SKY_SUCCESS);
+        ASSERT(cache_count_valid(rctx) && rctx->cache_count[0] == 3);
+
+        removed = RCTX_BEACON(rctx, 0);
+        ASSERT(SKY_SUCCESS == remove_beacon(rctx, 0));
+        ASSERT(cache_count_valid(rctx) && rctx->cache_count[0] == 2);
+        ASSERT(SKY_SUCCESS == add_beacon(rctx, &sky_errno, &d, rctx->header.time));
+        ASSERT(cache_count_valid(rctx) && rctx->cache_count[0] == 2);
+        ASSERT(SKY_SUCCESS == add_beacon(rctx, &sky_errno, &removed, rctx->header.time));
+        ASSERT(cache_count_valid(rctx) && rctx->cache_count[0] == 3);
+
+        clear_cacheline(rctx, &rctx->session->cacheline[0]);
+        ASSERT(cache_count_valid(rctx) && rctx->cache_count[0] == 0);
+    });
+    TEST("counts are not used once stale", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_rctx_t *other = malloc(sizeof(Sky_rctx_t));
+        AP(a, "ABCDEFAACCDD", 10, -108, 4433, false);
+
+        ASSERT(SKY_SUCCESS == add_beacon(rctx, &sky_errno, &a, rctx->header.time));
+        ASSERT(cache_count_valid(rctx));
+        RCTX_BEACON(rctx, 0).ap.mac[5] ^= 1; /* AP changed without removing it */
+        ASSERT(!cache_count_valid(rctx));
+        RCTX_BEACON(rctx, 0).ap.mac[5] ^= 1;
+        ASSERT(cache_count_valid(rctx));
+
+        *other = *rctx;
+        clear_cacheline(other, &rctx->session->cacheline[1]); /* cache changed by other request */
+        ASSERT(cache_count_valid(other));
+        ASSERT(!cache_count_valid(rctx));
+        free(other);
+    });
+}
+
+TEST_FUNC(test_find_victim)
+{
+    GROUP("choice of cacheline by eviction policy");
+    TEST("empty cacheline is chosen before any other", rctx, {
+        Sky_sctx_t *sctx = rctx->session;
+        int i;
+
+        for (i = 0; i < sctx->num_cachelines; i++)
+            sctx->cacheline[i].time = sctx->cacheline[i].used = rctx->header.time - i;
+        sctx->cacheline[3].time = CACHE_EMPTY;
+        sctx->cache_policy = SKY_CACHE_POLICY_LRU;
+        ASSERT(find_victim(rctx) == 3);
+    });
+    TEST("each policy chooses its own victim", rctx, {
+        Sky_sctx_t *sctx = rctx->session;
+        int i;
+
+        for (i = 0; i < sctx->num_cachelines; i++) {
+            sctx->cacheline[i].time = rctx->header.time - 3600;
+            sctx->cacheline[i].used = rctx->header.time;
+            sctx->cacheline[i].hits = 10;
+        }
+        /* line 1 least recently used, line 2 least used, line 4 worst of both */
+        sctx->cacheline[1].used = rctx->header.time - 5 * 3600;
+        sctx->cacheline[2].hits = 0;
+        sctx->cacheline[4].used = rctx->header.time - 2 * 3600;
+        sctx->cacheline[4].hits = 1;
+
+        sctx->cache_policy = SKY_CACHE_POLICY_LRU;
+        ASSERT(find_victim(rctx) == 1);
+        sctx->cache_policy = SKY_CACHE_POLICY_LFU;
+        ASSERT(find_victim(rctx) == 2);
+        sctx->cache_policy = SKY_CACHE_POLICY_HIT_WEIGHTED;
+        ASSERT(find_victim(rctx) == 4);
+    });
+}
+
+TEST_FUNC(test_cache_expiry)
+{
+    GROUP("expiry list of cachelines");
+    TEST("cachelines are listed oldest first and only expired ones cleared", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+        AP(a, "ABCDEFAACCDD", 10, -108, 4433, false);
+        Sky_sctx_t *sctx = rctx->session;
+        int age[] = { 30, 1, 25 }; /* hours */
+        int i;
+
+        for (i = 0; i < 3; i++) {
+            RCTX_BEACON(rctx, 0) = a;
+            RCTX_BEACON(rctx, 0).ap.mac[0] = (uint8_t)(0x10 * i);
+            rctx->num_beacons = rctx->num_ap = 1;
+            rctx->save_to = i;
+            loc.time = rctx->header.time - age[i] * SECONDS_IN_HOUR;
+            ASSERT(sky_plugin_add_to_cache(rctx, &sky_errno, &loc) == SKY_SUCCESS);
+        }
+        ASSERT(sctx->num_expiry == 3);
+        ASSERT(sctx->expiry[0] == 0 && sctx->expiry[1] == 2 && sctx->expiry[2] == 1);
+        ASSERT(find_empty_cacheline(sctx, false) == 3);
+
+        ASSERT(expire_cachelines(rctx, rctx->header.time) == 2);
+        ASSERT(sctx->num_expiry == 1 && sctx->expiry[0] == 1);
+        ASSERT(sctx->cacheline[0].time == CACHE_EMPTY && sctx->cacheline[2].time == CACHE_EMPTY);
+        ASSERT(expire_cachelines(rctx, rctx->header.time) == 0);
+        ASSERT(expire_cachelines(rctx, TIME_UNAVAILABLE) == 1);
+        ASSERT(sctx->num_expiry == 0 && sctx->cacheline[1].time == CACHE_EMPTY);
+    });
+}
+
+TEST_FUNC(test_cache_candidates)
+{
+    GROUP("cachelines partitioned by serving cell");
+    TEST("only cachelines with the same or no serving cell are listed", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+        AP(a, "ABCDEFAACCDD", 10, -108, 4433, false);
+        NR(c1, 10, -130, false, 213, 142, 15614, 68719476735, 25, 1000);
+        NR(c2, 10, -130, false, 213, 142, 15614, 68719476734, 25, 1000);
+        Beacon_t *serving[] = { NULL, &c1, &c2, &c1 };
+        uint16_t lines[CACHE_SIZE];
+        int i;
+
+        loc.time = rctx->header.time;
+        for (i = 0; i < 4; i++) {
+            RCTX_BEACON(rctx, 0) = a;
+            RCTX_BEACON(rctx, 0).ap.mac[0] = (uint8_t)(0x10 * i);
+            rctx->num_beacons = rctx->num_ap = 1;
+            if (serving[i]) {
+                RCTX_BEACON(rctx, 1) = *serving[i];
+                rctx->num_beacons = 2;
+            }
+            rctx->save_to = i;
+            ASSERT(sky_plugin_add_to_cache(rctx, &sky_errno, &loc) == SKY_SUCCESS);
+        }
+
+        /* request with serving cell c1 */
+        ASSERT(cache_candidates(rctx, lines) == 3);
+        ASSERT(lines[0] == 0 && lines[1] == 1 && lines[2] == 3);
+
+        /* request with no serving cell */
+        rctx->num_beacons = 1;
+        ASSERT(cache_candidates(rctx, lines) == rctx->session->num_cachelines);
+
+        /* cleared line leaves its bucket */
+        clear_cacheline(rctx, &rctx->session->cacheline[1]);
+        rctx->num_beacons = 2;
+        ASSERT(cache_candidates(rctx, lines) == 2);
+        ASSERT(lines[0] == 0 && lines[1] == 3);
+    });
+}
+
+TEST_FUNC(test_gnss_candidates)
+{
+    GROUP("cachelines indexed by GNSS grid");
+    TEST("only cachelines in grid cells within HPE of request GNSS fix are listed", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+        AP(a, "ABCDEFAACCDD", 10, -108, 4433, false);
+        /* fixes 0m, 900m north, 50km east and none */
+        float lat[] = { 35.505, 35.5131, 35.505, NAN };
+        float lon[] = { 139.605, 139.605, 140.155, 139.605 };
+        uint16_t lines[CACHE_SIZE];
+        int i;
+
+        loc.time = rctx->header.time;
+        for (i = 0; i < 4; i++) {
+            RCTX_BEACON(rctx, 0) = a;
+            RCTX_BEACON(rctx, 0).ap.mac[0] = (uint8_t)(0x10 * i);
+            rctx->num_beacons = rctx->num_ap = 1;
+            rctx->gnss.lat = lat[i];
+            rctx->gnss.lon = lon[i];
+            rctx->gnss.hpe = 20;
+            rctx->save_to = i;
+            ASSERT(sky_plugin_add_to_cache(rctx, &sky_errno, &loc) == SKY_SUCCESS);
+        }
+
+        rctx->gnss.lat = 35.505;
+        rctx->gnss.lon = 139.605;
+        rctx->gnss.hpe = 100;
+        ASSERT(cache_candidates(rctx, lines) == 1 && lines[0] == 0);
+        rctx->gnss.hpe = 1000;
+        ASSERT(cache_candidates(rctx, lines) == 2 && lines[0] == 0 && lines[1] == 1);
+
+        /* HPE too large for the grid, so every line is listed */
+        rctx->gnss.hpe = 100000;
+        ASSERT(cache_candidates(rctx, lines) == rctx->session->num_cachelines);
+
+        clear_cacheline(rctx, &rctx->session->cacheline[0]);
+        rctx->gnss.hpe = 1000;
+        ASSERT(cache_candidates(rctx, lines) == 1 && lines[0] == 1);
+    });
+}
+
+TEST_FUNC(test_ap_table)
+{
+    GROUP("learned AP table");
+    TEST("used APs follow the mean of server locations and locate the request", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_location_t loc = { .lat = 35.5, .lon = 139.6, .hpe = 20 };
+        AP(a, "ABCDEFAACCDD", 10, -50, 4433, false);
+        int pos;
+
+        for (int j = 0; j < 3; j++) {
+            RCTX_BEACON(rctx, j) = a;
+            RCTX_BEACON(rctx, j).ap.mac[5] = (uint8_t)j;
+            RCTX_BEACON(rctx, j).ap.property.used = j < 2;
+        }
+        rctx->num_beacons = rctx->num_ap = 3;
+        learn_ap_locations(rctx, &loc);
+        loc.lat = 35.502;
+        loc.hpe = 40;
+        learn_ap_locations(rctx, &loc);
+        ASSERT(rctx->session->num_ap_locations == 2);
+        ASSERT(ap_location_find(rctx->session, RCTX_BEACON(rctx, 0).ap.mac, &pos) && pos == 0);
+        ASSERT(abs(rctx->session->ap_location[0].lat - 355010000) < 100);
+        ASSERT(rctx->session->ap_location[0].hpe == 30);
+        ASSERT(!ap_location_find(rctx->session, RCTX_BEACON(rctx, 2).ap.mac, &pos) && pos == 2);
+
+        ASSERT(sky_locate_ap_table(rctx, &sky_errno, &loc) == SKY_SUCCESS);
+        ASSERT(fabs(loc.lat - 35.501) < 0.00001 && fabs(loc.lon - 139.6) < 0.00001);
+        ASSERT(loc.hpe == 30 && loc.location_source == SKY_LOCATION_SOURCE_WIFI);
+        rctx->num_beacons = rctx->num_ap = 1;
+        ASSERT(sky_locate_ap_table(rctx, &sky_errno, &loc) == SKY_ERROR);
+        ASSERT(sky_errno == SKY_ERROR_LOCATION_UNKNOWN);
+    });
+    TEST("least recently used AP is replaced when the table is full", rctx, {
+        Sky_location_t loc = { .lat = 35.5, .lon = 139.6, .hpe = 20 };
+        AP(a, "ABCDEFAACCDD", 10, -50, 4433, false);
+        int pos;
+
+        a.ap.property.used = true;
+        rctx->num_beacons = rctx->num_ap = 1;
+        for (int j = 0; j <= AP_LOCATION_TABLE_SIZE; j++) {
+            RCTX_BEACON(rctx, 0) = a;
+            RCTX_BEACON(rctx, 0).ap.mac[5] = (uint8_t)(AP_LOCATION_TABLE_SIZE - j);
+            if (j == AP_LOCATION_TABLE_SIZE) {
+                /* use the first AP learned to locate, so the second is least recently used */
+                RCTX_BEACON(rctx, 0).ap.mac[5] = AP_LOCATION_TABLE_SIZE;
+                locate_ap_table(rctx, &loc);
+                RCTX_BEACON(rctx, 0).ap.mac[5] = 0x80;
+            }
+            learn_ap_locations(rctx, &loc);
+        }
+        ASSERT(rctx->session->num_ap_locations == AP_LOCATION_TABLE_SIZE);
+        a.ap.mac[5] = AP_LOCATION_TABLE_SIZE;
+        ASSERT(ap_location_find(rctx->session, a.ap.mac, &pos));
+        a.ap.mac[5] = AP_LOCATION_TABLE_SIZE - 1;
+        ASSERT(!ap_location_find(rctx->session, a.ap.mac, &pos));
+        a.ap.mac[5] = 0x80;
+        ASSERT(ap_location_find(rctx->session, a.ap.mac, &pos) &&
+               pos == AP_LOCATION_TABLE_SIZE - 1);
+        for (pos = 1; pos < AP_LOCATION_TABLE_SIZE; pos++)
+            if (memcmp(rctx->session->ap_location[pos - 1].mac,
+                    rctx->session->ap_location[pos].mac, MAC_SIZE) >= 0)
+                break;
+        ASSERT(pos == AP_LOCATION_TABLE_SIZE);
+    });
+}
+
 BEGIN_TESTS(beacon_test)
 
 GROUP_CALL("validate_request_ctx", test_validate_request_ctx);
@@ -894,5 +1597,14 @@ GROUP_CALL("beacon_add", test_add);
 GROUP_CALL("beacon_insert", test_insert);
 GROUP_CALL("distance_A_to_B", test_distance);
 GROUP_CALL("beacon used", test_used);
+GROUP_CALL("cache index", test_cache_index);
+GROUP_CALL("cacheline accessors", test_cacheline_accessors);
+GROUP_CALL("cache pool", test_cache_pool);
+GROUP_CALL("cache count", test_cache_count);
+GROUP_CALL("find victim", test_find_victim);
+GROUP_CALL("cache expiry", test_cache_expiry);
+GROUP_CALL("cache candidates", test_cache_candidates);
+GROUP_CALL("gnss candidates", test_gnss_candidates);
+GROUP_CALL("learned AP table", test_ap_table);
 
 END_TESTS();
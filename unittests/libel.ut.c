@@ -20,21 +20,21 @@ TEST_FUNC(test_sky_open)
 
         memset(&nv_state, 0, sizeof(nv_state));
         ASSERT(SKY_SUCCESS == sky_open(&sky_errno, (uint8_t *)"ABCDEF", 6, 666,
-                                  (uint8_t *)"0123456789012345", "sku", 0, &nv_state,
+                                  (uint8_t *)"0123456789012345", "sku", 0, &nv_state, 0,
                                   SKY_LOG_LEVEL_DEBUG, _test_log, sky_rand_fn, good_time));
         ASSERT(sky_errno == SKY_ERROR_NONE);
         ASSERT(nv_state.partner_id == 666);
 
         ASSERT(SKY_SUCCESS == sky_close(&nv_state, &sky_errno));
-        ASSERT(sky_sizeof_session_ctx(&nv_state) == sizeof(Sky_sctx_t));
+        ASSERT(sky_sizeof_session_ctx(&nv_state, 0) == sky_sizeof_session_ctx(NULL, 0));
         ASSERT(SKY_SUCCESS == sky_open(&sky_errno, (uint8_t *)"ABCDEF", 6, 911,
-                                  (uint8_t *)"0123456789012345", "sku", 0, &nv_state,
+                                  (uint8_t *)"0123456789012345", "sku", 0, &nv_state, 0,
                                   SKY_LOG_LEVEL_DEBUG, _test_log, sky_rand_fn, good_time));
         ASSERT(sky_errno == SKY_ERROR_NONE);
         ASSERT(nv_state.partner_id == 911);
 
         ASSERT(SKY_ERROR == sky_open(&sky_errno, (uint8_t *)"ABCDEFGH", 8, 666,
-                                (uint8_t *)"01234567890123", "sk", 0, &nv_state,
+                                (uint8_t *)"01234567890123", "sk", 0, &nv_state, 0,
                                 SKY_LOG_LEVEL_DEBUG, _test_log, sky_rand_fn, good_time));
         ASSERT(sky_errno == SKY_ERROR_ALREADY_OPEN);
     });
@@ -44,11 +44,44 @@ TEST_FUNC(test_sky_open)
 
         memset(&nv_state, 0, sizeof(nv_state));
         ASSERT(SKY_SUCCESS == sky_open(&sky_errno, (uint8_t *)"ABCDEF", 6, 666,
-                                  (uint8_t *)"0123456789012345", "sku", 0, &nv_state,
+                                  (uint8_t *)"0123456789012345", "sku", 0, &nv_state, 0,
                                   SKY_LOG_LEVEL_DEBUG, _test_log, sky_rand_fn, good_time));
         ASSERT(SKY_SUCCESS == sky_close(&nv_state, &sky_errno));
         ASSERT(SKY_ERROR == sky_close(&nv_state, &sky_errno) && sky_errno == SKY_ERROR_NEVER_OPEN);
     });
+    TEST("sky_open sizes a new session by number of cachelines and a restored one keeps its own",
+        rctx, {
+            Sky_errno_t sky_errno;
+            int32_t size = sky_sizeof_session_ctx(NULL, 3);
+            Sky_sctx_t *nv_state = alloca(sky_sizeof_session_ctx(NULL, CACHE_SIZE));
+
+            ASSERT(sky_sizeof_session_ctx(NULL, 1) < size);
+            ASSERT(size < sky_sizeof_session_ctx(NULL, CACHE_SIZE));
+            ASSERT(sky_sizeof_session_ctx(NULL, CACHE_SIZE + 1) == 0);
+
+            memset(nv_state, 0, size);
+            ASSERT(SKY_SUCCESS == sky_open(&sky_errno, (uint8_t *)"ABCDEF", 6, 666,
+                                      (uint8_t *)"0123456789012345", "sku", 0, nv_state, 3,
+                                      SKY_LOG_LEVEL_DEBUG, _test_log, sky_rand_fn, good_time));
+            ASSERT(nv_state->num_cachelines == 3);
+            ASSERT(SKY_SUCCESS == sky_close(nv_state, &sky_errno));
+            ASSERT(sky_sizeof_session_ctx(nv_state, 0) == size);
+
+            /* restored session is valid, so requested number of cachelines is ignored */
+            ASSERT(SKY_SUCCESS == sky_open(&sky_errno, (uint8_t *)"ABCDEF", 6, 666,
+                                      (uint8_t *)"0123456789012345", "sku", 0, nv_state,
+                                      CACHE_SIZE, SKY_LOG_LEVEL_DEBUG, _test_log, sky_rand_fn,
+                                      good_time));
+            ASSERT(nv_state->num_cachelines == 3);
+            ASSERT(SKY_SUCCESS == sky_close(nv_state, &sky_errno));
+
+            memset(nv_state, 0, size);
+            ASSERT(SKY_ERROR == sky_open(&sky_errno, (uint8_t *)"ABCDEF", 6, 666,
+                                    (uint8_t *)"0123456789012345", "sku", 0, nv_state,
+                                    CACHE_SIZE + 1, SKY_LOG_LEVEL_DEBUG, _test_log, sky_rand_fn,
+                                    good_time));
+            ASSERT(sky_errno == SKY_ERROR_BAD_PARAMETERS);
+        });
 }
 
 TEST_FUNC(test_sky_new_request)
@@ -113,7 +146,7 @@ TEST_FUNC(test_sky_add)
 
         ASSERT(SKY_SUCCESS ==
                sky_add_ap_beacon(rctx, &sky_errno, mac, TIME_UNAVAILABLE, rssi, freq, connected));
-        ASSERT(rctx->beacon[0].h.age == 0 && rctx->header.time != TIME_UNAVAILABLE);
+        ASSERT(RCTX_BEACON(rctx, 0).h.age == 0 && rctx->header.time != TIME_UNAVAILABLE);
     });
     TEST("sky_add_ap_beacon set last_config to zero first time", rctx, {
         Sky_errno_t sky_errno;
@@ -166,6 +199,43 @@ TEST_FUNC(test_sky_add)
         ASSERT(SKY_ERROR == sky_add_ap_beacon(rctx, &sky_errno, mac, rctx->header.time + 3, rssi,
                                 freq, connected));
     });
+
+    TEST("sky_add_ap_beacons gives the same request as adding APs one at a time", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_ap_scan_t aps[MAX_AP_BEACONS + 10];
+        Beacon_t beacons[TOTAL_BEACONS + 1];
+        uint8_t order[TOTAL_BEACONS + 1];
+        int num_aps = MAX_AP_BEACONS + 10, num_beacons;
+        time_t now = rctx->header.time;
+
+        for (int j = 0; j < num_aps; j++) {
+            /* every fourth AP is a virtual AP of the one before */
+            uint8_t mac[] = { 0x28, 0x3B, 0x82, (uint8_t)(j - j % 4 / 3), 0xE0, (uint8_t)j };
+
+            memcpy(aps[j].mac, mac, MAC_SIZE);
+            aps[j].rssi = (int16_t)(-30 - (j * 7) % 60);
+            aps[j].frequency = 3660;
+            aps[j].is_connected = j == 5;
+            aps[j].timestamp = rctx->header.time - j % 3;
+        }
+        aps[num_aps - 1] = aps[2]; /* and a duplicate */
+        for (int j = 0; j < num_aps; j++)
+            sky_add_ap_beacon(rctx, &sky_errno, aps[j].mac, aps[j].timestamp, aps[j].rssi,
+                aps[j].frequency, aps[j].is_connected);
+        num_beacons = NUM_BEACONS(rctx);
+        memcpy(beacons, rctx->beacon, sizeof(beacons));
+        memcpy(order, rctx->order, sizeof(order));
+
+        ASSERT(sky_new_request(rctx, sky_sizeof_request_ctx(), rctx->session, NULL, 0,
+                   &sky_errno) == rctx);
+        rctx->header.time = now; /* beacon ages are relative to the time of the request */
+        ASSERT(sky_add_ap_beacons(rctx, &sky_errno, aps, (uint32_t)num_aps) == SKY_SUCCESS);
+        ASSERT(NUM_BEACONS(rctx) == num_beacons && NUM_APS(rctx) == MAX_AP_BEACONS);
+        ASSERT(memcmp(beacons, rctx->beacon, sizeof(beacons)) == 0);
+        ASSERT(memcmp(order, rctx->order, (size_t)num_beacons) == 0);
+        ASSERT(sky_add_ap_beacons(rctx, &sky_errno, NULL, 1) == SKY_ERROR);
+        ASSERT(sky_errno == SKY_ERROR_BAD_PARAMETERS);
+    });
 }
 
 TEST_FUNC(test_sky_option)
@@ -264,7 +334,7 @@ TEST_FUNC(test_sky_gnss)
             .cell.freq = 5901,
             .cell.ta = 2 };
 
-        rctx->beacon[0] = c;
+        RCTX_BEACON(rctx, 0) = c;
         rctx->num_beacons = 1;
         rctx->num_ap = 0;
         rctx->gnss.lat = 35.511315;
@@ -293,7 +363,7 @@ TEST_FUNC(test_sky_gnss)
             .cell.freq = 5901,
             .cell.ta = 2 };
 
-        rctx->beacon[0] = c;
+        RCTX_BEACON(rctx, 0) = c;
         rctx->num_beacons = 1;
         rctx->num_ap = 0;
         rctx->gnss.lat = NAN;
@@ -321,7 +391,7 @@ TEST_FUNC(test_sky_gnss)
             .cell.ta = 2 };
         uint32_t buf_size;
 
-        rctx->beacon[0] = c;
+        RCTX_BEACON(rctx, 0) = c;
         rctx->num_beacons = 1;
         rctx->num_ap = 0;
         rctx->gnss.lat = NAN; /* gnss empty in request rctx */
@@ -363,7 +433,7 @@ TEST_FUNC(test_sky_gnss)
             .cell.freq = 5901,
             .cell.ta = 2 };
 
-        rctx->beacon[0] = c;
+        RCTX_BEACON(rctx, 0) = c;
         rctx->num_beacons = 1;
         rctx->num_ap = 0;
         rctx->gnss.lat = NAN;
@@ -393,18 +463,18 @@ TEST_FUNC(test_sky_gnss)
             .cell.freq = 5901,
             .cell.ta = 2 };
 
-        rctx->beacon[0] = c;
+        RCTX_BEACON(rctx, 0) = c;
         rctx->num_beacons = 1;
         rctx->num_ap = 0;
-        rctx->gnss.lat = 35.51131;
-        rctx->gnss.lon = 139.6189;
-        rctx->gnss.hpe = 90;
+        rctx->gnss.lat = 35.51132;
+        rctx->gnss.lon = 139.618;
+        rctx->gnss.hpe = 123;
         loc.time = rctx->header.time;
 
         sky_plugin_add_to_cache(rctx, &sky_errno, &loc);
-        rctx->session->cacheline[0].gnss.lat = 35.51132;
-        rctx->session->cacheline[0].gnss.lon = 139.618;
-        rctx->session->cacheline[0].gnss.hpe = 123;
+        rctx->gnss.lat = 35.51131;
+        rctx->gnss.lon = 139.6189;
+        rctx->gnss.hpe = 90;
         ASSERT(IS_CACHE_HIT(rctx) == false);
         sky_search_cache(rctx, &sky_errno, NULL, &loc);
         ASSERT(IS_CACHE_HIT(rctx) == false);
@@ -425,18 +495,18 @@ TEST_FUNC(test_sky_gnss)
             .cell.freq = 5901,
             .cell.ta = 2 };
 
-        rctx->beacon[0] = c;
+        RCTX_BEACON(rctx, 0) = c;
         rctx->num_beacons = 1;
         rctx->num_ap = 0;
-        rctx->gnss.lat = 35.511315;
-        rctx->gnss.lon = 139.618906;
-        rctx->gnss.hpe = 57;
+        rctx->gnss.lat = 35; /* far away */
+        rctx->gnss.lon = 139;
+        rctx->gnss.hpe = 46; /* better accuracy */
         loc.time = rctx->header.time;
 
         sky_plugin_add_to_cache(rctx, &sky_errno, &loc);
-        rctx->session->cacheline[0].gnss.lat = 35; /* far away */
-        rctx->session->cacheline[0].gnss.lon = 139;
-        rctx->session->cacheline[0].gnss.hpe = 46; /* better accuracy */
+        rctx->gnss.lat = 35.511315;
+        rctx->gnss.lon = 139.618906;
+        rctx->gnss.hpe = 57;
         ASSERT(IS_CACHE_HIT(rctx) == false);
         sky_search_cache(rctx, &sky_errno, NULL, &loc);
         ASSERT(IS_CACHE_HIT(rctx) == false);
@@ -457,18 +527,18 @@ TEST_FUNC(test_sky_gnss)
             .cell.freq = 5901,
             .cell.ta = 2 };
 
-        rctx->beacon[0] = c;
+        RCTX_BEACON(rctx, 0) = c;
         rctx->num_beacons = 1;
         rctx->num_ap = 0;
-        rctx->gnss.lat = 35.51131;
-        rctx->gnss.lon = 139.6189;
-        rctx->gnss.hpe = 30;
+        rctx->gnss.lat = 35.51132; /* position different but close (82m) */
+        rctx->gnss.lon = 139.618;
+        rctx->gnss.hpe = 47; /* hpe worse in cache */
         loc.time = rctx->header.time;
 
         sky_plugin_add_to_cache(rctx, &sky_errno, &loc);
-        rctx->session->cacheline[0].gnss.lat = 35.51132; /* position different but close (82m) */
-        rctx->session->cacheline[0].gnss.lon = 139.618;
-        rctx->session->cacheline[0].gnss.hpe = 47; /* hpe worse in cache */
+        rctx->gnss.lat = 35.51131;
+        rctx->gnss.lon = 139.6189;
+        rctx->gnss.hpe = 30;
         ASSERT(IS_CACHE_HIT(rctx) == false);
         sky_search_cache(rctx, &sky_errno, NULL, &loc);
         ASSERT(IS_CACHE_HIT(rctx) == false);
@@ -489,18 +559,18 @@ TEST_FUNC(test_sky_gnss)
             .cell.freq = 5901,
             .cell.ta = 2 };
 
-        rctx->beacon[0] = c;
+        RCTX_BEACON(rctx, 0) = c;
         rctx->num_beacons = 1;
         rctx->num_ap = 0;
-        rctx->gnss.lat = 35.51131;
-        rctx->gnss.lon = 139.6189;
-        rctx->gnss.hpe = 90;
+        rctx->gnss.lat = 35.51132; /* position different but close (82m) */
+        rctx->gnss.lon = 139.618;
+        rctx->gnss.hpe = 47; /* hpe better in cache */
         loc.time = rctx->header.time;
 
         sky_plugin_add_to_cache(rctx, &sky_errno, &loc);
-        rctx->session->cacheline[0].gnss.lat = 35.51132; /* position different but close (82m) */
-        rctx->session->cacheline[0].gnss.lon = 139.618;
-        rctx->session->cacheline[0].gnss.hpe = 47; /* hpe better in cache */
+        rctx->gnss.lat = 35.51131;
+        rctx->gnss.lon = 139.6189;
+        rctx->gnss.hpe = 90;
         ASSERT(IS_CACHE_HIT(rctx) == false);
         sky_search_cache(rctx, &sky_errno, NULL, &loc);
         ASSERT(IS_CACHE_HIT(rctx) == true);
@@ -522,7 +592,7 @@ TEST_FUNC(test_cache_match)
             .ap.property = { 0 },
             .ap.vg_len = 0 };
 
-        rctx->beacon[0] = b;
+        RCTX_BEACON(rctx, 0) = b;
         rctx->num_beacons = 1;
         rctx->num_ap = 1;
         loc.time = rctx->header.time;
@@ -545,13 +615,13 @@ TEST_FUNC(test_cache_match)
             .ap.vg_len = 0 };
 
         /* four different APs */
-        rctx->beacon[0] = b;
+        RCTX_BEACON(rctx, 0) = b;
         b.ap.mac[3] = 0xaa;
-        rctx->beacon[1] = b;
+        RCTX_BEACON(rctx, 1) = b;
         b.ap.mac[3] = 0x99;
-        rctx->beacon[2] = b;
+        RCTX_BEACON(rctx, 2) = b;
         b.ap.mac[3] = 0x88;
-        rctx->beacon[3] = b;
+        RCTX_BEACON(rctx, 3) = b;
         rctx->num_beacons = 4;
         rctx->num_ap = 4;
         loc.time = rctx->header.time;
@@ -574,22 +644,22 @@ TEST_FUNC(test_cache_match)
             .ap.vg_len = 0 };
 
         /* four different APs */
-        rctx->beacon[0] = b;
+        RCTX_BEACON(rctx, 0) = b;
         b.ap.mac[3] = 0xAA;
-        rctx->beacon[1] = b;
+        RCTX_BEACON(rctx, 1) = b;
         b.ap.mac[3] = 0x99;
-        rctx->beacon[2] = b;
+        RCTX_BEACON(rctx, 2) = b;
         b.ap.mac[3] = 0x88;
-        rctx->beacon[3] = b;
+        RCTX_BEACON(rctx, 3) = b;
         rctx->num_beacons = 4;
         rctx->num_ap = 4;
         loc.time = rctx->header.time;
 
         sky_plugin_add_to_cache(rctx, &sky_errno, &loc);
-        rctx->beacon[0].ap.mac[3] = 0xB1; /* 0xB0 */
-        rctx->beacon[1].ap.mac[3] = 0xA8; /* 0xAA */
-        rctx->beacon[2].ap.mac[3] = 0x98; /* 0x99 */
-        rctx->beacon[3].ap.mac[3] = 0x89; /* 0x88 */
+        RCTX_BEACON(rctx, 0).ap.mac[3] = 0xB1; /* 0xB0 */
+        RCTX_BEACON(rctx, 1).ap.mac[3] = 0xA8; /* 0xAA */
+        RCTX_BEACON(rctx, 2).ap.mac[3] = 0x98; /* 0x99 */
+        RCTX_BEACON(rctx, 3).ap.mac[3] = 0x89; /* 0x88 */
         sky_search_cache(rctx, &sky_errno, NULL, &loc);
         ASSERT(IS_CACHE_HIT(rctx) == true);
     });
@@ -607,20 +677,23 @@ TEST_FUNC(test_cache_match)
             .ap.vg_len = 0 };
 
         /* four different APs */
-        rctx->beacon[0] = b;
+        RCTX_BEACON(rctx, 0) = b;
         b.ap.mac[3] = 0xaa;
-        rctx->beacon[1] = b;
+        RCTX_BEACON(rctx, 1) = b;
         b.ap.mac[3] = 0x99;
-        rctx->beacon[2] = b;
+        RCTX_BEACON(rctx, 2) = b;
         b.ap.mac[3] = 0x88;
-        rctx->beacon[3] = b;
+        RCTX_BEACON(rctx, 3) = b;
         rctx->num_beacons = 4;
         rctx->num_ap = 4;
         loc.time = rctx->header.time;
 
+        /* cache holds two of the APs with different MACs */
+        RCTX_BEACON(rctx, 0).ap.mac[3] = 0x77;
+        RCTX_BEACON(rctx, 1).ap.mac[3] = 0x66;
         sky_plugin_add_to_cache(rctx, &sky_errno, &loc);
-        rctx->session->cacheline[0].beacon[0].ap.mac[3] = 0x77;
-        rctx->session->cacheline[0].beacon[1].ap.mac[3] = 0x66;
+        RCTX_BEACON(rctx, 0).ap.mac[3] = 0xB0;
+        RCTX_BEACON(rctx, 1).ap.mac[3] = 0xaa;
         sky_search_cache(rctx, &sky_errno, NULL, &loc);
         ASSERT(IS_CACHE_HIT(rctx) == false);
     });
@@ -638,20 +711,21 @@ TEST_FUNC(test_cache_match)
             .ap.vg_len = 0 };
 
         /* 3 different APs */
-        rctx->beacon[0] = b;
+        RCTX_BEACON(rctx, 0) = b;
         b.ap.mac[3] = 0xaa;
-        rctx->beacon[1] = b;
+        RCTX_BEACON(rctx, 1) = b;
         b.ap.mac[3] = 0x99;
-        rctx->beacon[2] = b;
-        rctx->num_beacons = 3;
-        rctx->num_ap = 3;
+        RCTX_BEACON(rctx, 2) = b;
+        b.ap.mac[3] = 0x88;
+        RCTX_BEACON(rctx, 3) = b;
+        rctx->num_beacons = 4;
+        rctx->num_ap = 4;
         loc.time = rctx->header.time;
 
+        /* cache holds an extra AP */
         sky_plugin_add_to_cache(rctx, &sky_errno, &loc);
-        b.ap.mac[3] = 0x88;
-        rctx->session->cacheline[0].beacon[3] = b;
-        rctx->session->cacheline[0].num_beacons = 4;
-        rctx->session->cacheline[0].num_ap = 4;
+        rctx->num_beacons = 3;
+        rctx->num_ap = 3;
         sky_search_cache(rctx, &sky_errno, NULL, &loc);
         ASSERT(IS_CACHE_HIT(rctx) == false);
     });
@@ -669,18 +743,19 @@ TEST_FUNC(test_cache_match)
             .ap.vg_len = 0 };
 
         /* 2 different APs */
-        rctx->beacon[0] = b;
+        RCTX_BEACON(rctx, 0) = b;
         b.ap.mac[3] = 0xaa;
-        rctx->beacon[1] = b;
-        rctx->num_beacons = 2;
-        rctx->num_ap = 2;
+        RCTX_BEACON(rctx, 1) = b;
+        b.ap.mac[3] = 0x88;
+        RCTX_BEACON(rctx, 2) = b;
+        rctx->num_beacons = 3;
+        rctx->num_ap = 3;
         loc.time = rctx->header.time;
 
+        /* cache holds an extra AP */
         sky_plugin_add_to_cache(rctx, &sky_errno, &loc);
-        b.ap.mac[3] = 0x88;
-        rctx->session->cacheline[0].beacon[2] = b;
-        rctx->session->cacheline[0].num_beacons = 3;
-        rctx->session->cacheline[0].num_ap = 3;
+        rctx->num_beacons = 2;
+        rctx->num_ap = 2;
         sky_search_cache(rctx, &sky_errno, NULL, &loc);
         ASSERT(IS_CACHE_HIT(rctx) == false);
     });
@@ -706,17 +781,18 @@ TEST_FUNC(test_cache_match)
             .cell.ta = 2 };
 
         /* 2 different APs */
-        rctx->beacon[0] = b;
+        RCTX_BEACON(rctx, 0) = b;
         b.ap.mac[3] = 0xaa;
-        rctx->beacon[1] = b;
-        rctx->beacon[2] = c;
+        RCTX_BEACON(rctx, 1) = b;
+        RCTX_BEACON(rctx, 2) = c;
         rctx->num_beacons = 3;
         rctx->num_ap = 2;
         loc.time = rctx->header.time;
 
+        /* cache holds a different cell */
+        RCTX_BEACON(rctx, 2).cell.id2 = 47;
         sky_plugin_add_to_cache(rctx, &sky_errno, &loc);
-        c.cell.id2 = 47;
-        rctx->session->cacheline[0].beacon[2] = c;
+        RCTX_BEACON(rctx, 2) = c;
         sky_search_cache(rctx, &sky_errno, NULL, &loc);
         ASSERT(IS_CACHE_HIT(rctx) == false);
     });
@@ -742,17 +818,18 @@ TEST_FUNC(test_cache_match)
             .cell.ta = 2 };
 
         /* 2 different APs */
-        rctx->beacon[0] = b;
+        RCTX_BEACON(rctx, 0) = b;
         b.ap.mac[3] = 0xaa;
-        rctx->beacon[1] = b;
-        rctx->beacon[2] = c;
+        RCTX_BEACON(rctx, 1) = b;
+        RCTX_BEACON(rctx, 2) = c;
         rctx->num_beacons = 3;
         rctx->num_ap = 2;
         loc.time = rctx->header.time;
 
+        /* cache holds a different cell */
+        RCTX_BEACON(rctx, 2).cell.id2 = 47;
         sky_plugin_add_to_cache(rctx, &sky_errno, &loc);
-        c.cell.id2 = 47;
-        rctx->session->cacheline[0].beacon[2] = c;
+        RCTX_BEACON(rctx, 2) = c;
         sky_search_cache(rctx, &sky_errno, NULL, &loc);
         ASSERT(IS_CACHE_HIT(rctx) == false);
     });
@@ -772,7 +849,7 @@ TEST_FUNC(test_cache_match)
             .cell.freq = 5901,
             .cell.ta = 2 };
 
-        rctx->beacon[0] = c;
+        RCTX_BEACON(rctx, 0) = c;
         rctx->num_beacons = 1;
         rctx->num_ap = 0;
         loc.time = rctx->header.time;
@@ -797,16 +874,360 @@ TEST_FUNC(test_cache_match)
             .cell.freq = 5901,
             .cell.ta = 2 };
 
-        rctx->beacon[0] = c;
+        RCTX_BEACON(rctx, 0) = c;
+        rctx->num_beacons = 1;
+        rctx->num_ap = 0;
+        loc.time = rctx->header.time;
+
+        /* cache holds a different cell */
+        RCTX_BEACON(rctx, 0).cell.id2 = 47;
+        sky_plugin_add_to_cache(rctx, &sky_errno, &loc);
+        RCTX_BEACON(rctx, 0) = c;
+        sky_search_cache(rctx, &sky_errno, NULL, &loc);
+        ASSERT(IS_CACHE_HIT(rctx) == false);
+    });
+}
+
+TEST_FUNC(test_cache_stats)
+{
+    TEST("sky_get_cache_stats counts lookups, hits and misses by reason", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_cache_stats_t stats;
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+        Beacon_t b = { .ap.h = { BEACON_MAGIC, SKY_BEACON_AP, 1, -30, 1, false },
+            .ap.mac = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x4B },
+            .ap.freq = 3660 };
+
+        RCTX_BEACON(rctx, 0) = b;
+        rctx->num_beacons = rctx->num_ap = 1;
+        loc.time = rctx->header.time;
+        sky_search_cache(rctx, &sky_errno, NULL, &loc);
+        loc.location_status = SKY_LOCATION_STATUS_SUCCESS;
+        sky_plugin_add_to_cache(rctx, &sky_errno, &loc);
+        sky_search_cache(rctx, &sky_errno, NULL, &loc);
+        b.ap.mac[0] = 0x10;
+        ASSERT(sky_add_ap_beacon(rctx, &sky_errno, b.ap.mac, rctx->header.time, -30, 3660, 1) ==
+               SKY_SUCCESS);
+        sky_search_cache(rctx, &sky_errno, NULL, &loc);
+        ASSERT(sky_get_cache_stats(rctx->session, &sky_errno, &stats, true) == SKY_SUCCESS);
+        ASSERT(stats.lookups == 3 && stats.hits == 1 && stats.misses == 2);
+        ASSERT(stats.miss_empty == 1 && stats.miss_score == 1);
+        ASSERT(stats.miss_cell_changed == 0 && stats.miss_gnss_worse == 0);
+        ASSERT(stats.evictions == 0 && stats.expirations == 0);
+        ASSERT(sky_get_cache_stats(rctx->session, &sky_errno, &stats, false) == SKY_SUCCESS);
+        ASSERT(stats.lookups == 0 && stats.hits == 0 && stats.misses == 0);
+    });
+    TEST("sky_get_cache_stats counts a miss for a changed serving cell", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_cache_stats_t stats;
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_CELL,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+        Beacon_t c = { .cell.h = { BEACON_MAGIC, SKY_BEACON_LTE, 1, -30, 0, 1 },
+            .cell.id1 = 441,
+            .cell.id2 = 53,
+            .cell.id3 = 24674,
+            .cell.id4 = 202274050,
+            .cell.id5 = 21,
+            .cell.freq = 5901,
+            .cell.ta = 2 };
+
+        RCTX_BEACON(rctx, 0) = c;
         rctx->num_beacons = 1;
         rctx->num_ap = 0;
         loc.time = rctx->header.time;
 
+        /* cache holds a different serving cell, which is never a candidate */
+        RCTX_BEACON(rctx, 0).cell.id2 = 47;
+        sky_plugin_add_to_cache(rctx, &sky_errno, &loc);
+        RCTX_BEACON(rctx, 0) = c;
+        sky_search_cache(rctx, &sky_errno, NULL, &loc);
+        ASSERT(IS_CACHE_HIT(rctx) == false);
+        ASSERT(sky_get_cache_stats(rctx->session, &sky_errno, &stats, false) == SKY_SUCCESS);
+        ASSERT(stats.lookups == 1 && stats.misses == 1);
+        ASSERT(stats.miss_cell_changed == 1);
+        ASSERT(stats.miss_gnss_worse == 0 && stats.miss_score == 0 && stats.miss_empty == 0);
+    });
+    TEST("sky_get_cache_stats counts a miss for a distant GNSS fix", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_cache_stats_t stats;
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+        Beacon_t b = { .ap.h = { BEACON_MAGIC, SKY_BEACON_AP, 1, -30, 1, false },
+            .ap.mac = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x4B },
+            .ap.freq = 3660 };
+
+        RCTX_BEACON(rctx, 0) = b;
+        rctx->num_beacons = rctx->num_ap = 1;
+        rctx->gnss.lat = 35; /* far away */
+        rctx->gnss.lon = 139;
+        rctx->gnss.hpe = 46;
+        loc.time = rctx->header.time;
+
+        /* cached fix is outside the grid cells reached by the request hpe */
         sky_plugin_add_to_cache(rctx, &sky_errno, &loc);
-        c.cell.id2 = 47;
-        rctx->session->cacheline[0].beacon[0] = c;
+        rctx->gnss.lat = 35.511315;
+        rctx->gnss.lon = 139.618906;
+        rctx->gnss.hpe = 57;
         sky_search_cache(rctx, &sky_errno, NULL, &loc);
         ASSERT(IS_CACHE_HIT(rctx) == false);
+        ASSERT(sky_get_cache_stats(rctx->session, &sky_errno, &stats, false) == SKY_SUCCESS);
+        ASSERT(stats.lookups == 1 && stats.misses == 1);
+        ASSERT(stats.miss_gnss_worse == 1);
+        ASSERT(stats.miss_cell_changed == 0 && stats.miss_score == 0 && stats.miss_empty == 0);
+    });
+    TEST("sky_get_cache_stats rejects a NULL result", rctx, {
+        Sky_errno_t sky_errno;
+
+        ASSERT(sky_get_cache_stats(rctx->session, &sky_errno, NULL, false) == SKY_ERROR);
+        ASSERT(sky_errno == SKY_ERROR_BAD_PARAMETERS);
+    });
+}
+
+TEST_FUNC(test_locate_offline)
+{
+    /* cacheline 0 holds APs 0x10-0x13, cacheline 1 holds APs 0x20-0x23 */
+#define OFFLINE_CACHE(rctx, sky_errno, b)                                                          \
+    do {                                                                                           \
+        Sky_location_t l0 = { .lat = 35.5, .lon = 139.6, .hpe = 20, .time = rctx->header.time,     \
+            .location_source = SKY_LOCATION_SOURCE_WIFI,                                           \
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };                                      \
+        Sky_location_t l1 = l0;                                                                    \
+                                                                                                   \
+        l1.lat = 35.502;                                                                           \
+        for (int j = 0; j < 4; j++) {                                                              \
+            b.ap.mac[5] = (uint8_t)(0x10 + j);                                                     \
+            RCTX_BEACON(rctx, j) = b;                                                              \
+        }                                                                                          \
+        rctx->num_beacons = rctx->num_ap = 4;                                                      \
+        rctx->save_to = 0;                                                                         \
+        sky_plugin_add_to_cache(rctx, &sky_errno, &l0);                                            \
+        for (int j = 0; j < 4; j++)                                                                \
+            RCTX_BEACON(rctx, j).ap.mac[5] = (uint8_t)(0x20 + j);                                  \
+        rctx->save_to = 1;                                                                         \
+        sky_plugin_add_to_cache(rctx, &sky_errno, &l1);                                            \
+    } while (0)
+
+    TEST("sky_locate_offline returns location of the one similar cached scan", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_location_t loc;
+        Beacon_t b = { .ap.h = { BEACON_MAGIC, SKY_BEACON_AP, 1, -30, 1, false },
+            .ap.mac = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x00 },
+            .ap.freq = 3660 };
+
+        OFFLINE_CACHE(rctx, sky_errno, b);
+        /* three APs of cacheline 0 and one of cacheline 1 */
+        RCTX_BEACON(rctx, 0).ap.mac[5] = 0x10;
+        RCTX_BEACON(rctx, 1).ap.mac[5] = 0x11;
+        RCTX_BEACON(rctx, 2).ap.mac[5] = 0x12;
+        ASSERT(sky_locate_offline(rctx, &sky_errno, &loc) == SKY_SUCCESS);
+        ASSERT(loc.lat == 35.5f && loc.lon == 139.6f && loc.hpe == 20);
+        ASSERT(loc.location_source == SKY_LOCATION_SOURCE_WIFI);
+        ASSERT(loc.location_status == SKY_LOCATION_STATUS_SUCCESS);
+    });
+    TEST("sky_locate_offline combines equally similar cached scans", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_location_t loc;
+        Beacon_t b = { .ap.h = { BEACON_MAGIC, SKY_BEACON_AP, 1, -30, 1, false },
+            .ap.mac = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x00 },
+            .ap.freq = 3660 };
+
+        OFFLINE_CACHE(rctx, sky_errno, b);
+        /* two APs of each cacheline */
+        RCTX_BEACON(rctx, 0).ap.mac[5] = 0x10;
+        RCTX_BEACON(rctx, 1).ap.mac[5] = 0x11;
+        ASSERT(sky_locate_offline(rctx, &sky_errno, &loc) == SKY_SUCCESS);
+        ASSERT(fabs(loc.lat - 35.501) < 0.00001 && loc.lon == 139.6f);
+        /* hpe grows by the spread of the two locations, about 111m */
+        ASSERT(loc.hpe > 120 && loc.hpe < 140);
+    });
+    TEST("sky_locate_offline reports location unknown with no similar cached scan", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_location_t loc;
+        Beacon_t b = { .ap.h = { BEACON_MAGIC, SKY_BEACON_AP, 1, -30, 1, false },
+            .ap.mac = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x00 },
+            .ap.freq = 3660 };
+
+        OFFLINE_CACHE(rctx, sky_errno, b);
+        for (int j = 0; j < 4; j++)
+            RCTX_BEACON(rctx, j).ap.mac[5] = (uint8_t)(0x30 + j);
+        RCTX_BEACON(rctx, 0).ap.mac[5] = 0x10;
+        ASSERT(sky_locate_offline(rctx, &sky_errno, &loc) == SKY_ERROR);
+        ASSERT(sky_errno == SKY_ERROR_LOCATION_UNKNOWN);
+        ASSERT(sky_locate_offline(rctx, &sky_errno, NULL) == SKY_ERROR);
+        ASSERT(sky_errno == SKY_ERROR_BAD_PARAMETERS);
+    });
+#undef OFFLINE_CACHE
+}
+
+/* write a little-endian integer to an AP database */
+static void ap_db_put(uint8_t *p, uint32_t v, int size)
+{
+    while (size--) {
+        *p++ = (uint8_t)v;
+        v >>= 8;
+    }
+}
+
+/* AP database holding 4C:5E:0C:B0:17:10-12 at 35.5 and 35.501 and 35.502 N, 139.6 E */
+static uint32_t ap_db_build(uint8_t *db)
+{
+    memcpy(db, SKY_AP_DB_MAGIC, 8);
+    ap_db_put(db + 8, 3, 4);
+    ap_db_put(db + 12, 0, 4);
+    for (int i = 0; i < 3; i++) {
+        uint8_t *r = db + SKY_AP_DB_HEADER_SIZE + i * SKY_AP_DB_RECORD_SIZE;
+
+        memcpy(r, "\x4C\x5E\x0C\xB0\x17", 5);
+        r[5] = (uint8_t)(0x10 + i);
+        ap_db_put(r + 6, 10, 2);
+        ap_db_put(r + 8, (uint32_t)(355000000 + i * 10000), 4);
+        ap_db_put(r + 12, 1396000000, 4);
+    }
+    return SKY_AP_DB_HEADER_SIZE + 3 * SKY_AP_DB_RECORD_SIZE;
+}
+
+TEST_FUNC(test_locate_ap_database)
+{
+    TEST("sky_locate_ap_database combines APs found in the database", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_location_t loc;
+        uint8_t db[SKY_AP_DB_HEADER_SIZE + 3 * SKY_AP_DB_RECORD_SIZE];
+        uint32_t len = ap_db_build(db);
+        Beacon_t b = { .ap.h = { BEACON_MAGIC, SKY_BEACON_AP, 1, -30, 1, false },
+            .ap.mac = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x10 },
+            .ap.freq = 3660 };
+
+        /* first and last APs of the database, and one not in it */
+        RCTX_BEACON(rctx, 0) = b;
+        b.ap.mac[5] = 0x12;
+        RCTX_BEACON(rctx, 1) = b;
+        b.ap.mac[5] = 0x20;
+        RCTX_BEACON(rctx, 2) = b;
+        rctx->num_beacons = rctx->num_ap = 3;
+        ASSERT(sky_locate_ap_database(rctx, &sky_errno, db, len, &loc) == SKY_SUCCESS);
+        ASSERT(fabs(loc.lat - 35.501) < 0.00001 && fabs(loc.lon - 139.6) < 0.00001);
+        /* hpe grows by the spread of the two APs, about 111m */
+        ASSERT(loc.hpe > 110 && loc.hpe < 130);
+        ASSERT(loc.location_source == SKY_LOCATION_SOURCE_WIFI);
+    });
+    TEST("sky_locate_ap_database reports location unknown with too few APs found", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_location_t loc;
+        uint8_t db[SKY_AP_DB_HEADER_SIZE + 3 * SKY_AP_DB_RECORD_SIZE];
+        uint32_t len = ap_db_build(db);
+        Beacon_t b = { .ap.h = { BEACON_MAGIC, SKY_BEACON_AP, 1, -30, 1, false },
+            .ap.mac = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x11 },
+            .ap.freq = 3660 };
+
+        RCTX_BEACON(rctx, 0) = b;
+        b.ap.mac[5] = 0x20;
+        RCTX_BEACON(rctx, 1) = b;
+        rctx->num_beacons = rctx->num_ap = 2;
+        ASSERT(sky_locate_ap_database(rctx, &sky_errno, db, len, &loc) == SKY_ERROR);
+        ASSERT(sky_errno == SKY_ERROR_LOCATION_UNKNOWN);
+    });
+    TEST("sky_locate_ap_database reports bad parameters with a bad database", rctx, {
+        Sky_errno_t sky_errno;
+        Sky_location_t loc;
+        uint8_t db[SKY_AP_DB_HEADER_SIZE + 3 * SKY_AP_DB_RECORD_SIZE];
+        uint32_t len = ap_db_build(db);
+
+        ASSERT(sky_locate_ap_database(rctx, &sky_errno, db, len - 1, &loc) == SKY_ERROR);
+        ASSERT(sky_errno == SKY_ERROR_BAD_PARAMETERS);
+        db[0] = 'X';
+        ASSERT(sky_locate_ap_database(rctx, &sky_errno, db, len, &loc) == SKY_ERROR);
+        ASSERT(sky_errno == SKY_ERROR_BAD_PARAMETERS);
+    });
+}
+
+/* send the scan of 6 APs to the server, which responds with loc */
+static bool adapt_scan(Sky_rctx_t *rctx, bool ignore_hit, Sky_location_t *loc)
+{
+    Sky_errno_t sky_errno;
+    uint8_t mac[] = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x00 };
+    uint8_t response[256];
+    Sky_location_t rsp;
+    uint32_t size;
+    int32_t len;
+
+    if (sky_new_request(rctx, sky_sizeof_request_ctx(), rctx->session, NULL, 0, &sky_errno) !=
+        rctx)
+        return false;
+    for (int j = 0; j < 6; j++) {
+        mac[5] = (uint8_t)j;
+        if (sky_add_ap_beacon(rctx, &sky_errno, mac, rctx->header.time, -30 - j, 3660, false) !=
+            SKY_SUCCESS)
+            return false;
+    }
+    if (sky_search_cache(rctx, &sky_errno, NULL, &rsp) != SKY_SUCCESS)
+        return false;
+    if (ignore_hit && sky_ignore_cache_hit(rctx, &sky_errno) != SKY_SUCCESS)
+        return false;
+    if (sky_sizeof_request_buf(rctx, &size, &sky_errno) != SKY_SUCCESS)
+        return false;
+    if ((len = serialize_response(rctx, response, sizeof(response), loc)) < 0)
+        return false;
+    return sky_decode_response(rctx, &sky_errno, response, (uint32_t)len, &rsp) == SKY_SUCCESS;
+}
+
+TEST_FUNC(test_adaptive_threshold)
+{
+    TEST("ignored cache hits with a wrong cached location raise the threshold", rctx, {
+        Sky_sctx_t *sctx = rctx->session;
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+        uint32_t server = CONFIG(sctx, cache_match_all_threshold);
+
+        sctx->token_id = 1234; /* registered, so responses are locations */
+        ASSERT(adapt_scan(rctx, false, &loc));
+        ASSERT(IS_CACHE_MISS(rctx) && sctx->threshold_checks == 0);
+        /* each time the server locates the scan about 111m from where it was cached */
+        for (int j = 0; j < ADAPTIVE_THRESHOLD_WINDOW && match_all_threshold(sctx) == server;
+             j++) {
+            loc.lat += 0.001f;
+            ASSERT(adapt_scan(rctx, true, &loc));
+        }
+        ASSERT(match_all_threshold(sctx) == server + ADAPTIVE_THRESHOLD_STEP);
+    });
+    TEST("only cache hits sent with the scan are checked", rctx, {
+        Sky_sctx_t *sctx = rctx->session;
+        Sky_location_t loc = { .lat = 35.511315,
+            .lon = 139.618906,
+            .hpe = 16,
+            .location_source = SKY_LOCATION_SOURCE_WIFI,
+            .location_status = SKY_LOCATION_STATUS_SUCCESS };
+
+        sctx->token_id = 1234;
+        ASSERT(adapt_scan(rctx, false, &loc));
+
+        /* a hit sent as the cached beacons is located by the server where it was cached */
+        loc.lat += 0.001f;
+        ASSERT(adapt_scan(rctx, false, &loc));
+        ASSERT(IS_CACHE_HIT(rctx) && sctx->threshold_checks == 0);
+
+        /* a hit forced to a miss sends the scan, so the wrong cached location is checked */
+        sctx->cache_hits = 127;
+        loc.lat += 0.001f;
+        ASSERT(adapt_scan(rctx, false, &loc));
+        ASSERT(rctx->get_from == -1);
+        ASSERT(sctx->threshold_checks == 1 && sctx->threshold_errors == 1);
+
+        /* an ignored hit located by the server within hpe is confirmed */
+        ASSERT(adapt_scan(rctx, true, &loc));
+        ASSERT(sctx->threshold_checks == 2 && sctx->threshold_errors == 1);
     });
 }
 
@@ -818,5 +1239,9 @@ GROUP_CALL("sky add tests", test_sky_add);
 GROUP_CALL("sky option tests", test_sky_option);
 GROUP_CALL("sky match tests", test_cache_match);
 GROUP_CALL("sky gnss tests", test_sky_gnss);
+GROUP_CALL("sky cache stats tests", test_cache_stats);
+GROUP_CALL("sky offline locate tests", test_locate_offline);
+GROUP_CALL("sky AP database tests", test_locate_ap_database);
+GROUP_CALL("sky adaptive threshold tests", test_adaptive_threshold);
 
 END_TESTS();